@@ -28,10 +28,9 @@
 #define HPGUPPI_DAQ_CONTROL "/tmp/hpguppi_daq_control"
 #define MAX_CMD_LEN 1024
 
-#define PKTSOCK_BYTES_PER_FRAME (16384)
-#define PKTSOCK_FRAMES_PER_BLOCK (8)
-#define PKTSOCK_NBLOCKS (800)
-#define PKTSOCK_NFRAMES (PKTSOCK_FRAMES_PER_BLOCK * PKTSOCK_NBLOCKS)
+// TPACKET_V3 ring of 50 2 MiB blocks (same 100 MiB as the former TPACKET_V1
+// ring of 6400 16 KiB frames)
+#define PKTSOCK_NBLOCKS (50)
 
 #define ELAPSED_NS(start,stop) \
   (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
@@ -443,7 +442,8 @@ enum run_states status_from_start_stop(hashpipe_status_t *st, uint64_t pktidx,
   }
 }
 
-int ata_snap_obs_info_read(hashpipe_status_t *st, struct ata_snap_obs_info *obs_info)
+int ata_snap_obs_info_read(hashpipe_status_t *st, struct ata_snap_obs_info *obs_info,
+    size_t block_data_size)
 {
   int rc = 1;//obsinfo valid
 
@@ -465,9 +465,9 @@ int ata_snap_obs_info_read(hashpipe_status_t *st, struct ata_snap_obs_info *obs_
       // int pkt_seq_step = obs_info.pkt_ntime;
 
       obs_info->pkt_data_size = ata_snap_pkt_bytes(*obs_info);
-      obs_info->pkt_per_block = ata_snap_eff_pkt_per_block(BLOCK_DATA_SIZE, *obs_info);
-      obs_info->pktidx_per_block = ata_snap_pktidx_per_block(BLOCK_DATA_SIZE, *obs_info);//inherently effective 
-      // eff_block_size = ata_snap_block_size(BLOCK_DATA_SIZE, obs_info);
+      obs_info->pkt_per_block = ata_snap_eff_pkt_per_block(block_data_size, *obs_info);
+      obs_info->pktidx_per_block = ata_snap_pktidx_per_block(block_data_size, *obs_info);//inherently effective 
+      // eff_block_size = ata_snap_block_size(block_data_size, obs_info);
 
       hputs(st->buf, "OBSINFO", "VALID");
     } else {
@@ -521,9 +521,10 @@ int ata_snap_obs_info_write(hashpipe_status_t *st, struct ata_snap_obs_info *obs
 static int init(hashpipe_thread_args_t *args)
 {
   	const char * thread_name = args->thread_desc->name;
+    hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->obuf;
 
     /* Non-network essential paramaters */
-    int blocsize=BLOCK_DATA_SIZE;
+    int blocsize=hpguppi_databuf_block_data_size(db);
     int directio=1;
     int nbits=4;
     int npol=2;
@@ -580,17 +581,14 @@ static int init(hashpipe_thread_args_t *args)
     hputi4(st->buf, "CHANMAJ", 0);
     hashpipe_status_unlock_safe(st);
 
-    // Set up pktsock.  Make frame_size be a divisor of block size so that
-    // frames will be contiguous in mapped mempory.  block_size must also be a
-    // multiple of page_size.  Easiest way is to oversize the frames to be
-    // 16384 bytes, which is bigger than we need, but keeps things easy.
-    p_psp->ps.frame_size = PKTSOCK_BYTES_PER_FRAME;
-    // total number of frames
-    p_psp->ps.nframes = PKTSOCK_NFRAMES;
-    // number of blocks
-    p_psp->ps.nblocks = PKTSOCK_NBLOCKS;
-
-    if (hashpipe_pktsock_open(&p_psp->ps, p_psp->ifname, PACKET_RX_RING) != HASHPIPE_OK) {
+    // Set up pktsock.  The TPACKET_V3 ring packs variable length frames into
+    // blocks, so frame_size is just an upper bound on the packet size.
+    p_psp->psv3.block_size = HPGUPPI_PKTSOCK_V3_BLOCK_SIZE;
+    p_psp->psv3.frame_size = HPGUPPI_PKTSOCK_V3_FRAME_SIZE;
+    p_psp->psv3.nblocks = PKTSOCK_NBLOCKS;
+    p_psp->psv3.retire_ms = HPGUPPI_PKTSOCK_V3_RETIRE_MS;
+
+    if (hpguppi_pktsock_v3_open(&p_psp->psv3, p_psp->ifname) != HASHPIPE_OK) {
         hashpipe_error(thread_name, "Error opening pktsock.");
         pthread_exit(NULL);
     }
@@ -632,15 +630,16 @@ static void *run(hashpipe_thread_args_t * args)
     ata_snap_obs_info_init(&obs_info);
 
 
-    int block_size = BLOCK_DATA_SIZE;
+    const int block_data_size = hpguppi_databuf_block_data_size(db);
+    int block_size = block_data_size;
 
     if (hgeti4(status_buf, "BLOCSIZE", &block_size)==0) {
-            block_size = BLOCK_DATA_SIZE;
+            block_size = block_data_size;
             hputi4(status_buf, "BLOCSIZE", block_size);
     } else {
-        if (block_size > BLOCK_DATA_SIZE) {
-            hashpipe_error(thread_name, "BLOCSIZE > databuf block_size (%d > %d)", block_size, BLOCK_DATA_SIZE);
-            block_size = BLOCK_DATA_SIZE;
+        if (block_size > block_data_size) {
+            hashpipe_error(thread_name, "BLOCSIZE > databuf block_size (%d > %d)", block_size, block_data_size);
+            block_size = block_data_size;
             hputi4(status_buf, "BLOCSIZE", block_size);
         }
     }
@@ -650,7 +649,7 @@ static void *run(hashpipe_thread_args_t * args)
      * recommended, so observational flexibility is only possible 
      * when hashpipe is idling.
      */
-    ata_snap_obs_info_read(st, &obs_info);
+    ata_snap_obs_info_read(st, &obs_info, block_data_size);
     ata_snap_obs_info_write(st, &obs_info);
     
     fprintf(stderr, "Packets per block %d, Packet timestamps per block %d\n", obs_info.pkt_per_block, obs_info.pktidx_per_block);
@@ -720,9 +719,7 @@ static void *run(hashpipe_thread_args_t * args)
 
     // Drop all packets to date
     unsigned char *p_frame;
-    while((p_frame=hashpipe_pktsock_recv_frame_nonblock(&p_ps_params->ps))) {
-        hashpipe_pktsock_release_frame(p_frame);
-    }
+    hpguppi_pktsock_v3_flush(&p_ps_params->psv3);
     struct ata_snap_pkt *ata_snap_pkt;
 
     fprintf(stderr, "Receiving at interface %s, port %d\n",
@@ -737,7 +734,7 @@ static void *run(hashpipe_thread_args_t * args)
             time(&curtime);//time stores seconds since epoch
             if(flag_state_update || curtime > lasttime) {// once per second
                 if (state == IDLE){
-                  ata_snap_obs_info_read(st, &obs_info);
+                  ata_snap_obs_info_read(st, &obs_info, block_data_size);
                 }
                 ata_snap_obs_info_write(st, &obs_info);
                 flag_state_update = 0;
@@ -774,8 +771,8 @@ static void *run(hashpipe_thread_args_t * args)
                 hashpipe_status_unlock_safe(st);
             }
 
-            p_frame = hashpipe_pktsock_recv_udp_frame(
-                &p_ps_params->ps, p_ps_params->port, 500); // 0.5 second timeout
+            p_frame = hpguppi_pktsock_v3_recv_udp_frame(
+                &p_ps_params->psv3, p_ps_params->port, 500); // 0.5 second timeout
 
             /* Set "waiting" flag */
             if (!p_frame && run_threads() && waiting!=1) {
@@ -789,7 +786,6 @@ static void *run(hashpipe_thread_args_t * args)
 
         if(!run_threads()) {
             // We're outta here!
-            hashpipe_pktsock_release_frame(p_frame);
             break;
         }
 
@@ -799,14 +795,12 @@ static void *run(hashpipe_thread_args_t * args)
         //     p_ps_params->packet_size = PKT_UDP_SIZE(p_frame) - 8;
         // } else 
         // if(p_ps_params->packet_size != PKT_UDP_SIZE(p_frame) - 8) {
-        if(obs_info.pkt_data_size != PKT_UDP_SIZE(p_frame) - 8) {
+        if(obs_info.pkt_data_size != PKTV3_UDP_SIZE(p_frame) - 8) {
             /* Unexpected packet size, ignore */
             hashpipe_status_lock_safe(st);
               hputi4(st->buf, "NBOGUS", ++nbogus_total);
-              hputi4(st->buf, "BOGUSIZE", PKT_UDP_SIZE(p_frame)-8);
+              hputi4(st->buf, "BOGUSIZE", PKTV3_UDP_SIZE(p_frame)-8);
             hashpipe_status_unlock_safe(st);
-            // Release frame!
-            hashpipe_pktsock_release_frame(p_frame);
             continue;
         }
         
@@ -819,7 +813,9 @@ static void *run(hashpipe_thread_args_t * args)
         }
         packets_per_second++;
 
-        ata_snap_pkt = (struct ata_snap_pkt*) p_frame;
+        // Line up the SNAP header fields of ata_snap_pkt with the UDP payload
+        ata_snap_pkt = (struct ata_snap_pkt*)(PKTV3_UDP_DATA(p_frame)
+            - offsetof(struct ata_snap_pkt, version));
         // Get packet's sequence number
         pkt_seq_num =  ATA_SNAP_PKT_NUMBER(ata_snap_pkt);
         pkt_blk_num = pkt_seq_num / obs_info.pktidx_per_block;
@@ -874,7 +870,6 @@ static void *run(hashpipe_thread_args_t * args)
         }
 
         if (state != RECORD && flag_obs_end != 1){ //causes a block to be missed
-          hashpipe_pktsock_release_frame(p_frame);
           continue;
         }
 
@@ -955,7 +950,6 @@ static void *run(hashpipe_thread_args_t * args)
 
         // Check observation state
         if(state == IDLE){// Only possible if transitioning RECORD->IDLE
-          hashpipe_pktsock_release_frame(p_frame);
           continue;
         }
 
@@ -984,8 +978,6 @@ static void *run(hashpipe_thread_args_t * args)
         }
 
         last_pkt_seq_num = pkt_seq_num;
-        // Release frame back to ring buffer
-        hashpipe_pktsock_release_frame(p_frame);
 
         /* Will exit if thread has been cancelled */
         pthread_testcancel();
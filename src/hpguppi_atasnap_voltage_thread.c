@@ -14,6 +14,7 @@
 //#include <stdio.h>
 //#include <sys/types.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sched.h>
 #include <math.h>
 #include <unistd.h>
@@ -35,10 +36,16 @@
 #include "hashpipe.h"
 #include "hpguppi_databuf.h"
 #include "hpguppi_time.h"
+#include "hpguppi_numa.h"
 #include "hpguppi_util.h"
+#include "hpguppi_lossstat.h"
 #include "hpguppi_atasnap.h"
 #include "hpguppi_ibverbs_pkt_thread.h"
 
+#if HAVE_AVX2_INSTRUCTIONS
+#include <immintrin.h>
+#endif
+
 // Change to 1 to use temporal memset() rather than non-temporal bzero_nt()
 #if 0
 #define bzero_nt(d,l) memset(d,0,l)
@@ -111,8 +118,10 @@ struct block_info {
   // Set at start of block
   int block_idx_out;                // Block index number in output databuf
   int64_t block_num;                // Absolute block number
+  // Latched when block's header is copied (see latch_block_info())
   uint64_t pktidx_per_block;
   uint64_t pkts_per_block;
+  int expand;                       // Expand 4+4 bit samples to 8+8 bits
   // Incremented throughout duration of block
   uint32_t npacket;                 // Number of packets recevied so far
   // Fields set during block finalization
@@ -142,10 +151,8 @@ static void reset_block_info_stats(struct block_info *bi)
 // bi->dbout is set if dbout is non-NULL.
 // bi->block_idx_out is set if block_idx_out >= 0.
 // bi->block_num is always set and the stats are always reset.
-// bi->pkts_per_block is set of pkt_size > 0.
 static void init_block_info(struct block_info *bi,
-    struct hpguppi_input_databuf *dbout, int block_idx_out, int64_t block_num,
-    uint64_t pkts_per_block)
+    struct hpguppi_input_databuf *dbout, int block_idx_out, int64_t block_num)
 {
   if(dbout) {
     bi->dbout = dbout;
@@ -154,12 +161,31 @@ static void init_block_info(struct block_info *bi,
     bi->block_idx_out = block_idx_out;
   }
   bi->block_num = block_num;
-  if(pkts_per_block > 0) {
-    bi->pkts_per_block = pkts_per_block;
-  }
   reset_block_info_stats(bi);
 }
 
+// Latch the block layout that packets will be copied into bi's block with.
+// This must agree with the PIPERBLK, BLOCSIZE, and NBITS values in the block's
+// header, so it is called just before wait_for_block_free() copies the status
+// buffer to the header and the values are not changed again until the block
+// is advanced or re-initialized.
+static void latch_block_info(struct block_info *bi,
+    uint64_t pktidx_per_block, uint64_t pkts_per_block, int expand)
+{
+  bi->pktidx_per_block = pktidx_per_block;
+  bi->pkts_per_block = pkts_per_block;
+  bi->expand = expand;
+}
+
+// Returns non-zero if bi was latched with the given block layout.
+static int block_info_latched(const struct block_info *bi,
+    uint64_t pktidx_per_block, uint64_t pkts_per_block, int expand)
+{
+  return bi->pktidx_per_block == pktidx_per_block
+      && bi->pkts_per_block == pkts_per_block
+      && bi->expand == expand;
+}
+
 // Update block's header info and set filled status (i.e. hand-off to downstream)
 static void finalize_block(struct block_info *bi)
 {
@@ -261,8 +287,8 @@ static void wait_for_block_free(const struct block_info * bi,
 #if 0
   // TODO Move this out of net thread (takes too long)
   // TODO Just clear effective block size?
-  //memset(block_info_data(bi), 0, BLOCK_DATA_SIZE);
-  bzero_nt(block_info_data(bi), BLOCK_DATA_SIZE);
+  //memset(block_info_data(bi), 0, hpguppi_databuf_block_data_size(bi->dbout));
+  bzero_nt(block_info_data(bi), hpguppi_databuf_block_data_size(bi->dbout));
 #else
   //nanosleep(&ts_sleep, NULL);
 #endif
@@ -321,15 +347,202 @@ static void wait_for_block_free(const struct block_info * bi,
 //     [FID=f, STREAM=s, TIME=0:PKT_NTIME-1, CHAN=0:PKT_NCHAN-1] ...
 //
 
+//
+// The packet payload is [time][chan] (with both pols of a sample in a
+// uint16_t) whereas each packet's 2D rectangle in the block is [chan][time],
+// so the copy is a transpose.  When the packet has ATA_SNAP_TILE_NTIME time
+// samples, it is transposed in ATA_SNAP_TILE_NTIME x ATA_SNAP_TILE_NTIME tiles
+// of uint16_t values using AVX2 or AVX-512 registers (see transpose_tiles()).
+// This writes one 32 byte run per channel row per tile rather than one
+// uint16_t per channel row per time sample.
+//
+// When the EXPAND8 status buffer keyword is non-zero, the 4+4 bit complex
+// values are expanded to signed 8+8 bit complex values as part of the copy, so
+// each sample (i.e. both pols) occupies 4 bytes rather than 2 in the block.
+// The block layout is otherwise unchanged (i.e. sample offsets stay the same),
+// so the number of samples per block is halved and NBITS becomes 8.  The real
+// part of each 4+4 bit value is in the high nibble.  The expansion setting is
+// latched in each working block along with the block layout when its header
+// is copied from the status buffer (see latch_block_info()).  Changing EXPAND8
+// changes the layout, so the working blocks are re-initialized rather than
+// having the output format change partway through a block.
+
+// Returns the signed 8+8 bit expansions of the two 4+4 bit values in sample
+// (one per pol) as a little endian uint32_t (i.e. P0 real, P0 imag, P1 real,
+// P1 imag).
+static inline uint32_t expand_4bit_sample(uint16_t sample)
+{
+  int8_t p0 = sample & 0xff;
+  int8_t p1 = sample >> 8;
+  uint8_t p0re = p0 >> 4;
+  uint8_t p0im = (int8_t)(p0 << 4) >> 4;
+  uint8_t p1re = p1 >> 4;
+  uint8_t p1im = (int8_t)(p1 << 4) >> 4;
+
+  return p0re | (p0im << 8) | (p1re << 16) | ((uint32_t)p1im << 24);
+}
+
+#if HAVE_AVX2_INSTRUCTIONS
+// Number of time samples (and channels) per tile
+#define ATA_SNAP_TILE_NTIME (16)
+
+// Transposes 8x8 uint16_t sub-matrices within each 128 bit lane of the 8
+// registers r[0] to r[7].  On entry, lane L of r[t] holds channels 8L to 8L+7
+// of time t.  On return, lane L of r[k] holds times 0 to 7 of channel 8L+k.
+// This is done using three rounds of unpacks that interleave 16, 32, then 64
+// bit elements.  AVX2 version.
+static inline void transpose_8x8_lanes_epi16_256(__m256i r[8])
+{
+  __m256i a[8], b[8];
+  int i;
+
+  for(i=0; i<4; i++) {
+    a[2*i  ] = _mm256_unpacklo_epi16(r[2*i], r[2*i+1]);
+    a[2*i+1] = _mm256_unpackhi_epi16(r[2*i], r[2*i+1]);
+  }
+  // a[0]: c0-3 t0-1, a[1]: c4-7 t0-1, a[2]: c0-3 t2-3, a[3]: c4-7 t2-3, ...
+  for(i=0; i<2; i++) {
+    b[4*i  ] = _mm256_unpacklo_epi32(a[4*i  ], a[4*i+2]); // c0-1 t4i-4i+3
+    b[4*i+1] = _mm256_unpackhi_epi32(a[4*i  ], a[4*i+2]); // c2-3
+    b[4*i+2] = _mm256_unpacklo_epi32(a[4*i+1], a[4*i+3]); // c4-5
+    b[4*i+3] = _mm256_unpackhi_epi32(a[4*i+1], a[4*i+3]); // c6-7
+  }
+  for(i=0; i<4; i++) {
+    r[2*i  ] = _mm256_unpacklo_epi64(b[i], b[4+i]); // c2i   t0-7
+    r[2*i+1] = _mm256_unpackhi_epi64(b[i], b[4+i]); // c2i+1 t0-7
+  }
+}
+
+#if HAVE_AVX512BW_INSTRUCTIONS
+// AVX-512 version of transpose_8x8_lanes_epi16_256().
+static inline void transpose_8x8_lanes_epi16_512(__m512i r[8])
+{
+  __m512i a[8], b[8];
+  int i;
+
+  for(i=0; i<4; i++) {
+    a[2*i  ] = _mm512_unpacklo_epi16(r[2*i], r[2*i+1]);
+    a[2*i+1] = _mm512_unpackhi_epi16(r[2*i], r[2*i+1]);
+  }
+  for(i=0; i<2; i++) {
+    b[4*i  ] = _mm512_unpacklo_epi32(a[4*i  ], a[4*i+2]);
+    b[4*i+1] = _mm512_unpackhi_epi32(a[4*i  ], a[4*i+2]);
+    b[4*i+2] = _mm512_unpacklo_epi32(a[4*i+1], a[4*i+3]);
+    b[4*i+3] = _mm512_unpackhi_epi32(a[4*i+1], a[4*i+3]);
+  }
+  for(i=0; i<4; i++) {
+    r[2*i  ] = _mm512_unpacklo_epi64(b[i], b[4+i]);
+    r[2*i+1] = _mm512_unpackhi_epi64(b[i], b[4+i]);
+  }
+}
+#endif // HAVE_AVX512BW_INSTRUCTIONS
+
+// Stores the 16 samples of v at dst.  If expand is non-zero, the 4+4 bit
+// values are expanded to 8+8 bits (see expand_4bit_sample()) and 64 bytes are
+// stored, otherwise v is stored as is.
+static inline void store_tile_row(uint8_t * dst, __m256i v, int expand)
+{
+  // Sign extended values of 4 bit two's complement nibbles
+  const __m256i nibble_lut = _mm256_setr_epi8(
+      0, 1, 2, 3, 4, 5, 6, 7, -8, -7, -6, -5, -4, -3, -2, -1,
+      0, 1, 2, 3, 4, 5, 6, 7, -8, -7, -6, -5, -4, -3, -2, -1);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  __m256i re, im, lo, hi;
+
+  if(!expand) {
+    _mm256_storeu_si256((__m256i *)dst, v);
+    return;
+  }
+
+  re = _mm256_shuffle_epi8(nibble_lut,
+      _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles));
+  im = _mm256_shuffle_epi8(nibble_lut, _mm256_and_si256(v, low_nibbles));
+  // Interleave real/imag (unpacks work within 128 bit lanes)
+  lo = _mm256_unpacklo_epi8(re, im); // bytes 0-7 | bytes 16-23
+  hi = _mm256_unpackhi_epi8(re, im); // bytes 8-15 | bytes 24-31
+  _mm256_storeu_si256((__m256i *)dst,
+      _mm256_permute2x128_si256(lo, hi, 0x20));
+  _mm256_storeu_si256((__m256i *)(dst + 32),
+      _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+// Transposes a packet with ATA_SNAP_TILE_NTIME time samples of nchan channels
+// from src ([time][chan]) to nchan rows of ATA_SNAP_TILE_NTIME samples starting
+// at dst and ostride samples apart.  Samples are expanded to 8+8 bits if
+// expand is non-zero (see store_tile_row()).  nchan must be a multiple of 16.
+// With AVX-512, 32 channels are transposed per iteration (two tiles in 512 bit
+// registers), otherwise 16.
+static void transpose_tiles(uint8_t * dst, const uint16_t * src,
+    int nchan, size_t ostride, int expand)
+{
+  int c = 0;
+  int t, k;
+
+  // Convert ostride to bytes
+  ostride *= expand ? sizeof(uint32_t) : sizeof(uint16_t);
+
+#if HAVE_AVX512BW_INSTRUCTIONS
+  __m512i z[2][8];
+  __m512i lo, hi;
+
+  for(; c+32 <= nchan; c+=32) {
+    for(t=0; t<ATA_SNAP_TILE_NTIME; t++) {
+      z[t/8][t%8] = _mm512_loadu_si512((const void *)(src + t*nchan + c));
+    }
+    transpose_8x8_lanes_epi16_512(z[0]);
+    transpose_8x8_lanes_epi16_512(z[1]);
+    // Lane L of z[R][k] now holds times 8R to 8R+7 of channel c+8L+k.
+    // Rearrange lanes so each 256 bit half holds all times of a channel.
+    for(k=0; k<8; k++) {
+      lo = _mm512_shuffle_i64x2(z[0][k], z[1][k], _MM_SHUFFLE(1,0,1,0));
+      hi = _mm512_shuffle_i64x2(z[0][k], z[1][k], _MM_SHUFFLE(3,2,3,2));
+      lo = _mm512_shuffle_i64x2(lo, lo, _MM_SHUFFLE(3,1,2,0));
+      hi = _mm512_shuffle_i64x2(hi, hi, _MM_SHUFFLE(3,1,2,0));
+      store_tile_row(dst + (c+k   )*ostride,
+          _mm512_castsi512_si256(lo), expand);
+      store_tile_row(dst + (c+k+ 8)*ostride,
+          _mm512_extracti64x4_epi64(lo, 1), expand);
+      store_tile_row(dst + (c+k+16)*ostride,
+          _mm512_castsi512_si256(hi), expand);
+      store_tile_row(dst + (c+k+24)*ostride,
+          _mm512_extracti64x4_epi64(hi, 1), expand);
+    }
+  }
+#endif // HAVE_AVX512BW_INSTRUCTIONS
+
+  __m256i y[2][8];
+
+  for(; c+16 <= nchan; c+=16) {
+    for(t=0; t<ATA_SNAP_TILE_NTIME; t++) {
+      y[t/8][t%8] = _mm256_loadu_si256((const __m256i *)(src + t*nchan + c));
+    }
+    transpose_8x8_lanes_epi16_256(y[0]);
+    transpose_8x8_lanes_epi16_256(y[1]);
+    // Lane L of y[R][k] now holds times 8R to 8R+7 of channel c+8L+k
+    for(k=0; k<8; k++) {
+      store_tile_row(dst + (c+k  )*ostride,
+          _mm256_permute2x128_si256(y[0][k], y[1][k], 0x20), expand);
+      store_tile_row(dst + (c+k+8)*ostride,
+          _mm256_permute2x128_si256(y[0][k], y[1][k], 0x31), expand);
+    }
+  }
+}
+#endif // HAVE_AVX2_INSTRUCTIONS
+
 static void copy_packet_data_to_databuf(const struct block_info *bi,
     const struct ata_snap_obs_info * p_oi,
     const struct ata_snap_feng_info * p_fei,
-    const uint8_t * p_payload)
+    const uint8_t * p_payload,
+    int expand)
 {
-  // We copy the two pols together as a uint16_t type
+  // We copy the two pols together as a uint16_t type (or uint32_t type when
+  // expanding to 8+8 bits)
   const uint16_t * src = (uint16_t *)p_payload;
   uint16_t * dst_base = (uint16_t *)block_info_data(bi);
   uint16_t * dst;
+  uint32_t * dst32_base = (uint32_t *)block_info_data(bi);
+  uint32_t * dst32;
+  size_t offset;
   int t, c;
 
   // ostride is the spacing, in units of sizeof(uint16_t), from one channel to
@@ -351,10 +564,12 @@ static void copy_packet_data_to_databuf(const struct block_info *bi,
   // Stream is the "channel chunk" for this FID
   const int stream = (p_fei->feng_chan - p_oi->schan) / p_oi->pkt_nchan;
 
-  // Advance dst_base to...
-  dst_base += p_fei->feng_id * fid_stride // first location of this FID, then
-           +  stream * stream_stride // first location of this stream, then
-           +  (p_fei->pktidx - bi->pktidx_per_block) * pktidx_stride; // to this pktidx
+  // Offset of first sample from start of block is...
+  offset = p_fei->feng_id * fid_stride // first location of this FID, then
+         + stream * stream_stride // first location of this stream, then
+         + (p_fei->pktidx - bi->pktidx_per_block) * pktidx_stride; // to this pktidx
+  dst_base += offset;
+  dst32_base += offset;
 
 #if 0
 printf("feng_id       = %lu\n", p_fei->feng_id);
@@ -370,6 +585,29 @@ printf("stream        = %d\n", stream);
 printf("dst           = 0x%p\n", dst);
 #endif
 
+#if HAVE_AVX2_INSTRUCTIONS
+  // Transpose in registers if packet geometry allows
+  if(p_oi->pkt_ntime == ATA_SNAP_TILE_NTIME && p_oi->pkt_nchan % 16 == 0) {
+    transpose_tiles(expand ? (uint8_t *)dst32_base : (uint8_t *)dst_base,
+        src, p_oi->pkt_nchan, ostride, expand);
+    return;
+  }
+#endif
+
+  if(expand) {
+    // Expand samples linearly from packet, strided to dst32
+    for(t=0; t < p_oi->pkt_ntime; t++) {
+      dst32 = dst32_base;
+      for(c=0; c < p_oi->pkt_nchan; c++) {
+        *dst32 = expand_4bit_sample(*src);
+        dst32 += ostride;
+        src++;
+      }
+      dst32_base++;
+    }
+    return;
+  }
+
   // Copy samples linearly from packet, strided to dst
   for(t=0; t < p_oi->pkt_ntime; t++) {
     dst = dst_base;
@@ -460,6 +698,23 @@ enum run_states check_start_stop(hashpipe_status_t *st, uint64_t pktidx)
   return retval;
 }
 
+// Applies the ANTMASK/CHANRANGE selection in *p_sub (see struct
+// hpguppi_subset) to *p_oi and stores the compacted obs_info, which describes
+// the RAW block layout, in *p_sel.  *p_sel will be invalid if *p_oi is invalid
+// or nothing is selected.
+static void select_obs_info(struct ata_snap_obs_info *p_sel,
+    const struct ata_snap_obs_info *p_oi, struct hpguppi_subset *p_sub)
+{
+  *p_sel = *p_oi;
+  if(ata_snap_obs_info_valid(*p_oi)) {
+    hpguppi_subset_compact(p_sub,
+        p_oi->nants, p_oi->nstrm, p_oi->pkt_nchan, p_oi->schan);
+    p_sel->nants = p_sub->nants;
+    p_sel->nstrm = p_sub->nstrm;
+    p_sel->schan = p_sub->schan;
+  }
+}
+
 // This thread's init() function, if provided, is called by the Hashpipe
 // framework at startup to allow the thread to perform initialization tasks
 // such as setting up network connections or GPU devices.
@@ -473,7 +728,8 @@ static int init(hashpipe_thread_args_t *args)
   hashpipe_status_t *st = &args->st;
 
   // Non-network essential paramaters
-  int blocsize=BLOCK_DATA_SIZE;
+  int blocsize=hpguppi_databuf_block_data_size(
+      (hpguppi_input_databuf_t *)args->obuf);
   int directio=1;
   int nbits=4;
   int npol=4;
@@ -493,7 +749,10 @@ static int init(hashpipe_thread_args_t *args)
   if(hpguppi_pktbuf_slot_offset(dbin, ATA_SNAP_PKT_OFFSET_HEADER) %
       PKT_ALIGNMENT_SIZE != 0
   || hpguppi_pktbuf_slot_offset(dbin, ATA_SNAP_PKT_OFFSET_PAYLOAD) %
-      PKT_ALIGNMENT_SIZE != 0) {
+      PKT_ALIGNMENT_SIZE != 0
+  || hpguppi_pktbuf_slot_offset(dbin, ATA_SNAP_PKT_OFFSET_PAYLOAD) -
+     hpguppi_pktbuf_slot_offset(dbin, ATA_SNAP_PKT_OFFSET_HEADER) !=
+      offsetof(struct ata_snap_ibv_pkt, payload) - offsetof(struct ata_snap_ibv_pkt, header)) {
     errno = EINVAL;
     hashpipe_error(thread_name, "IBVPKTSZ!=%d,%d,[...]",
         ATA_SNAP_PKT_OFFSET_HEADER, ATA_SNAP_PKT_SIZE_HEADER);
@@ -585,6 +844,9 @@ int debug_i=0, debug_j=0;
   const char * thread_name = args->thread_desc->name;
   const char * status_key = args->thread_desc->skey;
 
+  // Size of data area of the output databuf's blocks
+  const size_t block_data_size = hpguppi_databuf_block_data_size(dbout);
+
   // String version of destination address
   char dest_ip_stream_str[80] = {};
   char dest_ip_stream_str_new[80] = {};
@@ -603,6 +865,9 @@ int debug_i=0, debug_j=0;
   // Current run state
   //enum run_states state = LISTEN;
   unsigned waiting = 0;
+  // Report NUMA node of this thread
+  hpguppi_numa_report_thread(args);
+
   // Update status_key with idle state and get max_flows, port
   hashpipe_status_lock_safe(st);
   {
@@ -629,7 +894,7 @@ int debug_i=0, debug_j=0;
   uint8_t u8 = 0;
   uint8_t *pu8in = (uint8_t *)dbin;
   uint8_t *pu8out = (uint8_t *)dbout;
-  for(u64=0; u64<sizeof(hpguppi_input_databuf_t); u64+=4096) {
+  for(u64=0; u64<hpguppi_databuf_total_size(dbin); u64+=4096) {
     if(u8 || !u8) {
       u8 += pu8in[u64];
       u8 += pu8out[u64];
@@ -637,44 +902,54 @@ int debug_i=0, debug_j=0;
   }
   hashpipe_info(thread_name, "db pagein sum is %u", u8);
 #endif
-  memset(dbout->block, 0, sizeof(dbout->block));
+  memset(hpguppi_databuf_blocks(dbout), 0, hpguppi_databuf_blocks_size(dbout));
   hashpipe_info(thread_name,
-      "set %lu bytes in dbout to 0", sizeof(dbout->block));
+      "set %lu bytes in dbout to 0", hpguppi_databuf_blocks_size(dbout));
 
-  for(i=0; i<N_INPUT_BLOCKS; i++) {
+  for(i=0; i<dbin->header.n_block; i++) {
     hashpipe_info(thread_name, "db_in  block %2d : %p %p", i,
         hpguppi_databuf_data(dbin, i),
-        hpguppi_databuf_data(dbin, i) + BLOCK_DATA_SIZE - 1);
+        hpguppi_databuf_data(dbin, i) +
+          hpguppi_databuf_block_data_size(dbin) - 1);
   }
 
-  for(i=0; i<N_INPUT_BLOCKS; i++) {
+  for(i=0; i<dbout->header.n_block; i++) {
     hashpipe_info(thread_name, "db_out block %2d : %p %p", i,
         hpguppi_databuf_data(dbout, i),
-        hpguppi_databuf_data(dbout, i) + BLOCK_DATA_SIZE - 1);
+        hpguppi_databuf_data(dbout, i) + block_data_size - 1);
   }
 
   // The incoming packets are taken from blocks of the input databuf and then
   // converted to GUPPI RAW format in blocks of the output databuf to pass to
-  // the downstream thread.  We currently support two active output blocks (aka
-  // "working blocks").  Working blocks are associated with absolute output
-  // block numbers, which are simply PKTIDX values divided by the number of
-  // packets per block (discarding any remainder).  Let the block numbers for
-  // the first working block (wblk[0]) be W.  The block number for the second
-  // working block (wblk[1]) will be W+1.  Incoming packets corresponding to
-  // block W or W+1 are placed in the corresponding data buffer block.
-  // Incoming packets for block W+2 cause block W to be "finalized" and handed
-  // off to the downstream thread, working block 1 moves to working block 0 and
-  // working block 1 is incremented to be W+2.  Things get "interesting" when a
-  // packet is recevied for block < W or block > W+2.  Packets for block W-1
-  // are ignored.  Packets with PKTIDX P corresponding block < W-1 or block >
-  // W+2 cause the current working blocks' block numbers to be reset such that
-  // W will refer to the block containing P and W+1 will refer to the block
-  // after that.
+  // the downstream thread.  We currently support NWBLK (default 2) active
+  // output blocks (aka "working blocks").  Working blocks are associated with
+  // absolute output block numbers, which are simply PKTIDX values divided by
+  // the number of packets per block (discarding any remainder).  Let the block
+  // numbers for the first working block (wblk[0]) be W.  The block number for
+  // the last working block (wblk[NWBLK-1]) will be L = W+NWBLK-1.  Incoming
+  // packets corresponding to blocks W through L are placed in the
+  // corresponding data buffer block.  Incoming packets for block L+1 cause
+  // block W to be "finalized" and handed off to the downstream thread, the
+  // remaining working blocks move down one position and the last working block
+  // is incremented to be L+1.  Things get "interesting" when a packet is
+  // recevied for block < W or block > L+1.  Packets for blocks W-NWBLK through
+  // W-1 are late and are ignored (but counted in NLATE).  Packets with PKTIDX P
+  // corresponding block < W-NWBLK or block > L+1 cause the current working
+  // blocks' block numbers to be reset such that W will refer to the block
+  // after the block containing P.  Larger NWBLK values tolerate more skew
+  // between packet streams.  To help choose NWBLK, LATEHIST is a histogram of
+  // how many blocks before the newest working block (i.e. L) packets arrived
+  // since the previous status buffer update.
   //
-  // wblk is a two element array of block_info structures (i.e. the working
-  // blocks)
-  struct block_info wblk[2];
+  // wblk is an array of block_info structures (i.e. the working blocks), nwblk
+  // of which are used.
+  struct block_info wblk[HPGUPPI_MAX_WBLKS];
   int wblk_idx;
+  int nwblk;
+  int wblk_last;
+  // Late packet histogram (see HPGUPPI_LATEHIST_BINS)
+  uint64_t latehist[HPGUPPI_LATEHIST_BINS] = {0};
+  char latehist_str[80];
 
   // Packet block variables
   uint64_t pkt_seq_num = 0;
@@ -699,6 +974,11 @@ int debug_i=0, debug_j=0;
   int block_idx_in = 0;
   const int npkts_per_block_in = pktbuf_info->slots_per_block;
   const int slot_size = pktbuf_info->slot_size;
+  // Offset from the start of a slot to where the packet's struct ata_snap_ibv_pkt
+  // starts.  This is negative if the Ethernet/IP/UDP headers are skipped
+  // (see IBVSKIP), but only the header and payload fields get accessed.
+  const off_t pkt_offset = hpguppi_pktbuf_slot_offset(dbin, ATA_SNAP_PKT_OFFSET_HEADER)
+    - offsetof(struct ata_snap_ibv_pkt, header);
   struct timespec timeout_in = {0, 50 * 1000 * 1000}; // 50 ms
 
   // Variables for counting packets and bytes.
@@ -716,6 +996,23 @@ int debug_i=0, debug_j=0;
   // Structure to hold observation info, init all fields to invalid values
   struct ata_snap_obs_info obs_info;
   ata_snap_obs_info_init(&obs_info);
+  // Structure to hold selected subset of obs_info (see ANTMASK/CHANRANGE),
+  // which determines the RAW block layout.
+  struct hpguppi_subset subset = {0};
+  struct ata_snap_obs_info sel_info = obs_info;
+
+  // Expansion of 4+4 bit samples to 8+8 bits (see EXPAND8 above
+  // copy_packet_data_to_databuf()).  out_scale is the size of an expanded
+  // sample relative to a packet sample.
+  uint32_t expand8 = 0;
+  int expand = 0;
+  int out_scale = 1;
+
+  // Per-input loss statistics (see hpguppi_lossstat.h) and the original
+  // (i.e. uncompacted) F engine ID and stream number of the current packet
+  struct hpguppi_lossstat * lossstat = NULL;
+  uint64_t ls_ant = 0;
+  uint64_t ls_strm = 0;
 
   // OBSNCHAN is total number of channels handled by this instance.
   // For arrays like ATA, it is NANTS*NSTRM*PKTNCHAN.
@@ -724,10 +1021,14 @@ int debug_i=0, debug_j=0;
   // cause div-by-zero error if using it unintialized (crash early, crash
   // hard!).
   uint32_t pktidx_per_block = 0;
-  // Effective block size (will be less than BLOCK_DATA_SIZE when
-  // BLOCK_DATA_SIZE is not divisible by NANTS, PKTNCHAN and/or PKTNTIME.
+  // Packets per block for the current block layout, and whether the current
+  // layout differs from the one the working blocks were latched with
+  uint64_t pkts_per_block;
+  int layout_changed;
+  // Effective block size (will be less than block_data_size when
+  // block_data_size is not divisible by NANTS, PKTNCHAN and/or PKTNTIME.
   // Historically, BLOCSIZE gets stored as a signed 4 byte integer
-  int32_t eff_block_size;
+  int32_t eff_block_size = 0;
 
   // Structure to hold feng info from packet
   struct ata_snap_feng_info feng_info = {0};
@@ -758,7 +1059,8 @@ int debug_i=0, debug_j=0;
   // Used to calculate moving average of fill-to-free times for input blocks
   uint64_t fill_to_free_elapsed_ns;
   uint64_t fill_to_free_moving_sum_ns = 0;
-  uint64_t fill_to_free_block_ns[N_INPUT_BLOCKS] = {0};
+  uint64_t fill_to_free_block_ns[dbin->header.n_block];
+  memset(fill_to_free_block_ns, 0, sizeof(fill_to_free_block_ns));
 
   //struct timespec ts_sleep = {0, 10 * 1000 * 1000}; // 10 ms
 
@@ -773,11 +1075,16 @@ int debug_i=0, debug_j=0;
   }
 #endif
 
-  // Initialize working blocks
-  for(wblk_idx=0; wblk_idx<2; wblk_idx++) {
-    init_block_info(wblk+wblk_idx, dbout, wblk_idx, wblk_idx, 0);
-    wait_for_block_free(wblk+wblk_idx, st, status_key);
+  // Create loss statistics table
+  if(!(lossstat = hpguppi_lossstat_create(st->instance_id))) {
+    hashpipe_error(thread_name, "cannot allocate loss statistics");
+    return NULL;
+  }
+  hashpipe_status_lock_safe(st);
+  {
+    hputs(st->buf, "LOSSSHM", lossstat->table ? lossstat->name : "none");
   }
+  hashpipe_status_unlock_safe(st);
 
   // Get any obs info from status buffer, store values
   hashpipe_status_lock_safe(st);
@@ -789,13 +1096,24 @@ int debug_i=0, debug_j=0;
     hgetu4(st->buf, "PKTNTIME", &obs_info.pkt_ntime);
     hgetu4(st->buf, "PKTNCHAN", &obs_info.pkt_nchan);
     hgeti4(st->buf, "SCHAN",    &obs_info.schan);
-
-    // If obs_info is valid
-    if(ata_snap_obs_info_valid(obs_info)) {
+    hgetu4(st->buf, "EXPAND8",  &expand8);
+    hpguppi_subset_read(st->buf, &subset);
+    select_obs_info(&sel_info, &obs_info, &subset);
+
+    // Only 4 bit samples get expanded
+    expand = expand8 && sel_info.time_nbits == 4;
+    out_scale = expand ? 2 : 1;
+    hputu4(st->buf, "EXPAND8",  expand8);
+    hputu4(st->buf, "NBITS",    expand ? 8 : sel_info.time_nbits);
+
+    // If (selected) obs_info is valid
+    if(ata_snap_obs_info_valid(sel_info)) {
       // Update obsnchan, pktidx_per_block, and eff_block_size
-      obsnchan = ata_snap_obsnchan(obs_info);
-      pktidx_per_block = ata_snap_pktidx_per_block(BLOCK_DATA_SIZE, obs_info);
-      eff_block_size = ata_snap_block_size(BLOCK_DATA_SIZE, obs_info);
+      obsnchan = ata_snap_obsnchan(sel_info);
+      pktidx_per_block = ata_snap_pktidx_per_block(
+          block_data_size / out_scale, sel_info);
+      eff_block_size = out_scale * ata_snap_block_size(
+          block_data_size / out_scale, sel_info);
 
       hputs(st->buf, "OBSINFO", "VALID");
     } else {
@@ -816,6 +1134,17 @@ int debug_i=0, debug_j=0;
   }
   hashpipe_status_unlock_safe(st);
 
+  // Initialize working blocks (after NBITS has been set from EXPAND8 above so
+  // that it matches each block's latched expansion setting)
+  nwblk = hpguppi_status_get_nwblk(st, dbout->header.n_block);
+  wblk_last = nwblk - 1;
+  for(wblk_idx=0; wblk_idx<nwblk; wblk_idx++) {
+    init_block_info(wblk+wblk_idx, dbout, wblk_idx, wblk_idx);
+    latch_block_info(wblk+wblk_idx, pktidx_per_block,
+        eff_block_size / (out_scale * ATA_SNAP_PKT_SIZE_PAYLOAD), expand);
+    wait_for_block_free(wblk+wblk_idx, st, status_key);
+  }
+
   // Wait for ibvpkt thread to be running, then it's OK to add/remove flows.
   hpguppi_ibvpkt_wait_running(st);
 
@@ -863,6 +1192,9 @@ int debug_i=0, debug_j=0;
         }
         ts_prev_phys = ts_curr_phys;
 
+        // Publish loss statistics
+        hpguppi_lossstat_publish(lossstat, obs_info.nants, obs_info.nstrm);
+
         hashpipe_status_lock_safe(st);
         {
           hputs(st->buf, "DAQPULSE", timestr);
@@ -883,13 +1215,24 @@ int debug_i=0, debug_j=0;
           hgetu4(st->buf, "PKTNTIME", &obs_info.pkt_ntime);
           hgetu4(st->buf, "PKTNCHAN", &obs_info.pkt_nchan);
           hgeti4(st->buf, "SCHAN",    &obs_info.schan);
-
-          // If obs_info is valid
-          if(ata_snap_obs_info_valid(obs_info)) {
+          hgetu4(st->buf, "EXPAND8",  &expand8);
+          hpguppi_subset_read(st->buf, &subset);
+          select_obs_info(&sel_info, &obs_info, &subset);
+
+          // Only 4 bit samples get expanded
+          expand = expand8 && sel_info.time_nbits == 4;
+          out_scale = expand ? 2 : 1;
+          hputu4(st->buf, "EXPAND8",  expand8);
+          hputu4(st->buf, "NBITS",    expand ? 8 : sel_info.time_nbits);
+
+          // If (selected) obs_info is valid
+          if(ata_snap_obs_info_valid(sel_info)) {
             // Update obsnchan, pktidx_per_block, and eff_block_size
-            obsnchan = ata_snap_obsnchan(obs_info);
-            pktidx_per_block = ata_snap_pktidx_per_block(BLOCK_DATA_SIZE, obs_info);
-            eff_block_size = ata_snap_block_size(BLOCK_DATA_SIZE, obs_info);
+            obsnchan = ata_snap_obsnchan(sel_info);
+            pktidx_per_block = ata_snap_pktidx_per_block(
+                block_data_size / out_scale, sel_info);
+            eff_block_size = out_scale * ata_snap_block_size(
+                block_data_size / out_scale, sel_info);
 
             hputu4(st->buf, "OBSNCHAN", obsnchan);
             hputu4(st->buf, "PIPERBLK", pktidx_per_block);
@@ -1016,8 +1359,8 @@ int debug_i=0, debug_j=0;
       break;
     }
 
-    // If obs_info is invalid
-    if(!ata_snap_obs_info_valid(obs_info)) {
+    // If (selected) obs_info is invalid
+    if(!ata_snap_obs_info_valid(sel_info)) {
       hashpipe_status_lock_safe(st);
       {
         hputs(st->buf, status_key, "obsinfo");
@@ -1056,7 +1399,7 @@ int debug_i=0, debug_j=0;
       // Non-temporally copy packet into cached buffer
       memcpy_nt(p_spdpkt, p_u8pkt, MAX_PKT_SIZE);
 #else
-      p_pkt = (struct ata_snap_ibv_pkt *)p_u8pkt;
+      p_pkt = (struct ata_snap_ibv_pkt *)(p_u8pkt + pkt_offset);
 #endif
 
       // TODO Validate that this is a valid packet for us!
@@ -1096,6 +1439,16 @@ fflush(stdout);
         continue;
       }
 
+      // Remember input for loss statistics
+      ls_ant = feng_info.feng_id;
+      ls_strm = (feng_info.feng_chan - obs_info.schan) / obs_info.pkt_nchan;
+
+      // Ignore packets not selected by ANTMASK/CHANRANGE, renumber FID
+      if(!hpguppi_subset_select(&subset,
+            &feng_info.feng_id, feng_info.feng_chan)) {
+        continue;
+      }
+
       // Count packet and the payload bits
       packet_count++;
       pkts_processed_net++;
@@ -1163,7 +1516,7 @@ fprintf(stderr, "feng_chan    = 0x%016lx\n", feng_info.feng_chan);
           //     tbin * ntime/block
           //
           // To get an integer number of blocks, simply truncate
-          dwell_blocks = trunc(dwell_seconds / (tbin * ata_snap_pkt_per_block(BLOCK_DATA_SIZE, obs_info)));
+          dwell_blocks = trunc(dwell_seconds / (tbin * ata_snap_pkt_per_block(block_data_size / out_scale, sel_info)));
 
           stop_seq_num = start_seq_num + pktidx_per_block * dwell_blocks;
           hputi8(st->buf, "PKTSTOP", stop_seq_num);
@@ -1175,50 +1528,81 @@ fprintf(stderr, "feng_chan    = 0x%016lx\n", feng_info.feng_chan);
           hgetu8(st->buf, "NLATE", &u64tmp);
           u64tmp += nlate; nlate = 0;
           hputu8(st->buf, "NLATE", u64tmp);
+
+          hpguppi_latehist_str(latehist_str, sizeof(latehist_str), latehist);
+          hputs(st->buf, "LATEHIST", latehist_str);
+          memset(latehist, 0, sizeof(latehist));
         }
         hashpipe_status_unlock_safe(st);
       } // End status buffer block update
 
+      // The working blocks must be re-initialized if the block layout has
+      // changed since they were latched (e.g. due to EXPAND8 or obs_info
+      // changes), even if pkt_blk_num happens to fall within them.
+      pkts_per_block = eff_block_size / (out_scale * ATA_SNAP_PKT_SIZE_PAYLOAD);
+      layout_changed = !block_info_latched(wblk,
+          pktidx_per_block, pkts_per_block, expand);
+
       // Manage blocks based on pkt_blk_num
-      if(pkt_blk_num == wblk[1].block_num + 1) {
+      if(!layout_changed && pkt_blk_num == wblk[wblk_last].block_num + 1) {
         // Time to advance the blocks!!!
 #if 0
-printf("next block (%ld == %ld + 1)\n", pkt_blk_num, wblk[1].block_num);
+printf("next block (%ld == %ld + 1)\n", pkt_blk_num, wblk[wblk_last].block_num);
 #endif
 
-        // Finalize first working block
+        // Finalize first working block (with compacted layout in header)
+        hpguppi_subset_update_header(block_info_header(wblk), &subset);
         finalize_block(wblk);
         // Update ndrop counter
         ndrop_total += wblk->ndrop;
+        // Count expected packets of selected inputs
+        if(subset.nants && subset.nstrm) {
+          hpguppi_lossstat_expect(lossstat,
+              subset.antmask & (obs_info.nants < 64 ?
+                (1ULL << obs_info.nants) - 1 : ~0ULL),
+              (subset.schan - obs_info.schan) / subset.strm_nchan,
+              subset.nstrm,
+              wblk->pkts_per_block / (subset.nants * subset.nstrm),
+              wblk->block_num * wblk->pktidx_per_block);
+        }
         // Shift working blocks
-        wblk[0] = wblk[1];
+        memmove(wblk, wblk+1, wblk_last * sizeof(struct block_info));
         // Check start/stop using wblk[0]'s first PKTIDX
         check_start_stop(st, wblk[0].block_num * pktidx_per_block);
         // Increment last working block
-        increment_block(&wblk[1], pkt_blk_num);
+        increment_block(&wblk[wblk_last], pkt_blk_num);
+        // Latch layout of new block to match its header
+        latch_block_info(&wblk[wblk_last],
+            pktidx_per_block, pkts_per_block, expand);
         // Wait for new databuf data block to be free
-        wait_for_block_free(&wblk[1], st, status_key);
+        wait_for_block_free(&wblk[wblk_last], st, status_key);
       }
-      // Check for PKTIDX discontinuity
-      else if(pkt_blk_num < wblk[0].block_num - 1
-      || pkt_blk_num > wblk[1].block_num + 1) {
+      // Check for block layout change or PKTIDX discontinuity
+      else if(layout_changed
+      || pkt_blk_num < wblk[0].block_num - nwblk
+      || pkt_blk_num > wblk[wblk_last].block_num + 1) {
 #if 0
-printf("reset blocks (%ld <> [%ld - 1, %ld + 1])\n", pkt_blk_num, wblk[0].block_num, wblk[1].block_num);
+printf("reset blocks (%ld <> [%ld - %d, %ld + 1])\n", pkt_blk_num, wblk[0].block_num, nwblk, wblk[wblk_last].block_num);
 #endif
-        // Should only happen when transitioning into LISTEN, so warn about it
+        // Should only happen when transitioning into LISTEN or when the block
+        // layout changes, so warn about it
         hashpipe_warn(thread_name,
-            "working blocks reinit due to packet discontinuity (PKTIDX %lu)",
+            "working blocks reinit due to %s (PKTIDX %lu)",
+            layout_changed ? "block layout change" : "packet discontinuity",
             pkt_seq_num);
 
 #ifdef USE_WORKER_THREADS
         wait_for_job_completion(pjq);
 #endif // USE_WORKER_THREADS
 
-        // Re-init working blocks for block number *after* current packet's block
-        // and clear their data buffers
-        for(wblk_idx=0; wblk_idx<2; wblk_idx++) {
-          init_block_info(wblk+wblk_idx, NULL, -1, pkt_blk_num+wblk_idx+1,
-              eff_block_size / ATA_SNAP_PKT_SIZE_PAYLOAD);
+        // Re-init working blocks for block number *after* current packet's
+        // block, re-latch their layout, and re-copy their headers (the blocks
+        // are already ours, so wait_for_block_free() will not block)
+        for(wblk_idx=0; wblk_idx<nwblk; wblk_idx++) {
+          init_block_info(wblk+wblk_idx, NULL, -1, pkt_blk_num+wblk_idx+1);
+          latch_block_info(wblk+wblk_idx,
+              pktidx_per_block, pkts_per_block, expand);
+          wait_for_block_free(wblk+wblk_idx, st, status_key);
 #if 0
           // Clear data buffer
           // TODO Move this out of net thread (takes too long)
@@ -1233,12 +1617,14 @@ printf("reset blocks (%ld <> [%ld - 1, %ld + 1])\n", pkt_blk_num, wblk[0].block_
         check_start_stop(st, wblk[0].block_num * pktidx_per_block);
 // This happens after discontinuities (e.g. on startup), so don't warn about
 // it.
-      } else if(pkt_blk_num == wblk[0].block_num - 1) {
+      } else if(pkt_blk_num < wblk[0].block_num) {
         // Ignore late packet, continue on to next one
         // TODO Move this check above the "once per block" status buffer
         // update (so we don't accidentally update status buffer based on a
         // late packet)?
         nlate++;
+        hpguppi_latehist_add(latehist,
+            wblk[wblk_last].block_num - pkt_blk_num);
 #if 0
         // Should "never" happen, so warn about it
         hashpipe_warn(thread_name,
@@ -1248,7 +1634,7 @@ printf("reset blocks (%ld <> [%ld - 1, %ld + 1])\n", pkt_blk_num, wblk[0].block_
       }
 
 #if 0
-printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].block_num, wblk[1].block_num);
+printf("packet block: %ld   working blocks: %ld - %ld\n", pkt_blk_num, wblk[0].block_num, wblk[wblk_last].block_num);
 #endif
 
       // TODO Check START/STOP status???
@@ -1259,16 +1645,16 @@ printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].blo
       wblk_idx = pkt_blk_num - wblk[0].block_num;
 
       // Only copy packet data and count packet if its wblk_idx is valid
-      if(0 <= wblk_idx && wblk_idx < 2) {
-        // Update block's packets per block.  Not needed for each packet, but
-        // probably just as fast to do it for each packet rather than
-        // check-and-update-only-if-needed for each packet.
-        wblk[wblk_idx].pkts_per_block = eff_block_size / ATA_SNAP_PKT_SIZE_PAYLOAD;
-        wblk[wblk_idx].pktidx_per_block = pktidx_per_block;
+      if(0 <= wblk_idx && wblk_idx < nwblk) {
+        // Count packet's lag behind the newest working block
+        hpguppi_latehist_add(latehist, wblk_last - wblk_idx);
+
+        // Count packet for its input's loss statistics
+        hpguppi_lossstat_count(lossstat, ls_ant, ls_strm);
 
         // Copy packet data to data buffer of working block
         copy_packet_data_to_databuf(wblk+wblk_idx,
-            &obs_info, &feng_info, p_payload);
+            &sel_info, &feng_info, p_payload, wblk[wblk_idx].expand);
 
         // Count packet for block and for processing stats
         wblk[wblk_idx].npacket++;
@@ -1288,11 +1674,11 @@ printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].blo
     // Store new value
     fill_to_free_block_ns[block_idx_in] = fill_to_free_elapsed_ns;
 
-    if(block_idx_in == N_INPUT_BLOCKS - 1) {
+    if(block_idx_in == dbin->header.n_block - 1) {
       hashpipe_status_lock_safe(st);
       {
         hputr8(st->buf, "NETBLKMS",
-            round((double)fill_to_free_moving_sum_ns / N_INPUT_BLOCKS) / 1e6);
+            round((double)fill_to_free_moving_sum_ns / dbin->header.n_block) / 1e6);
       }
       hashpipe_status_unlock_safe(st);
     }
@@ -1311,6 +1697,8 @@ printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].blo
     pthread_testcancel();
   } // end main loop
 
+  hpguppi_lossstat_destroy(lossstat);
+
   hashpipe_info(thread_name, "exiting!");
   pthread_exit(NULL);
 
@@ -6,39 +6,447 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 
 #include <hashpipe.h>
 
 #include "hpguppi_databuf.h"
+#include "hpguppi_numa.h"
 //#include "fitshead.h"
 
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT (26)
+#endif
+#ifndef SHM_HUGE_2MB
+#define SHM_HUGE_2MB (21 << SHM_HUGE_SHIFT)
+#endif
+#ifndef SHM_HUGE_1GB
+#define SHM_HUGE_1GB (30 << SHM_HUGE_SHIFT)
+#endif
+
+// Timeout used by the futex based wait functions when no timeout is given.
+// This matches the timeout that hashpipe uses for its semaphore based wait
+// functions so that callers get to check run_threads() just as often.
+#define DEFAULT_FUTEX_WAIT_TIMEOUT_NS (250*1000*1000)
+
+// Used with semctl() SETVAL
+union hpguppi_semun {
+    int val;
+    struct semid_ds *buf;
+    unsigned short *array;
+};
+
+// Parses a huge page size string.  The string can be a plain number of bytes
+// or a number followed by a "K", "M", or "G" suffix (case insensitive).  The
+// string "0" (or an empty string) means "do not use huge pages".  Only 2 MiB
+// and 1 GiB huge pages are supported.  Returns the huge page size in bytes, 0
+// for no huge pages, or -1 on error.
+static ssize_t parse_hugepage_size(const char * s)
+{
+    char * endptr;
+    size_t size = strtoul(s, &endptr, 0);
+
+    switch(*endptr) {
+      case 'k': case 'K': size <<= 10; break;
+      case 'm': case 'M': size <<= 20; break;
+      case 'g': case 'G': size <<= 30; break;
+      case '\0':
+      case ' ': break;
+      default: return -1;
+    }
+
+    if(size != 0 && size != (1<<21) && size != (1<<30)) {
+      return -1;
+    }
+
+    return size;
+}
+
+// Returns the size in bytes of the huge pages backing the mapping that
+// contains addr, as reported by the KernelPageSize field of /proc/self/smaps,
+// 0 if the mapping uses normal pages, or -1 if it cannot be determined.
+static ssize_t databuf_page_size(const void * addr)
+{
+    FILE * f;
+    char line[256];
+    unsigned long start, end;
+    unsigned long kb;
+    int in_mapping = 0;
+    ssize_t size = -1;
+
+    if(!(f = fopen("/proc/self/smaps", "r"))) {
+        errno = 0;
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_mapping = (unsigned long)addr >= start
+                      && (unsigned long)addr < end;
+        } else if(in_mapping
+        && sscanf(line, "KernelPageSize: %lu kB", &kb) == 1) {
+            size = (kb << 10) == sysconf(_SC_PAGESIZE) ? 0 : kb << 10;
+            break;
+        }
+    }
+    fclose(f);
+
+    return size;
+}
+
+// Creates the shared memory segment for a databuf ahead of
+// hashpipe_databuf_create().  This is used when the segment needs properties
+// that hashpipe_databuf_create() does not provide, namely huge pages (if
+// hugepage_size is non-zero) and/or a NUMA memory policy (if numa_node is
+// non-negative).  The segment is created with the same key that
+// hashpipe_databuf_create() will use.  The sizing fields of the
+// hashpipe_databuf_t header are initialized so that hashpipe_databuf_create()
+// will find a pre-existing segment with the expected geometry and then adopt
+// it as its own.  The NUMA policy is attached to the shared memory object
+// itself, so all pages faulted in later (by any process) are allocated on
+// numa_node.  If a segment with the same key already exists, it is left as-is
+// (i.e. hugepage_size and numa_node are NOT applied to it) and
+// hashpipe_databuf_create() will verify its sizing.  Returns 0 if the segment
+// was created, 1 if it already existed, or -1 on error (in which case the
+// caller should fall back to normal pages with no NUMA policy).
+static int databuf_segment_precreate(int instance_id, int databuf_id,
+    size_t header_size, size_t block_size, int n_block,
+    size_t hugepage_size, int numa_node)
+{
+    hashpipe_databuf_t * d;
+    size_t total_size = header_size + block_size*n_block;
+    int shmflg = 0666 | IPC_CREAT | IPC_EXCL;
+    int shmid;
+    key_t key = hashpipe_databuf_key(instance_id);
+
+    if(key == (key_t)-1) {
+        hashpipe_error(__FUNCTION__, "hashpipe_databuf_key error");
+        return -1;
+    }
+
+    if(hugepage_size == (1<<30)) {
+        shmflg |= SHM_HUGETLB | SHM_HUGE_1GB;
+    } else if(hugepage_size > 0) {
+        shmflg |= SHM_HUGETLB | SHM_HUGE_2MB;
+    }
+
+    shmid = shmget(key + databuf_id - 1, total_size, shmflg);
+    if(shmid == -1) {
+        if(errno == EEXIST) {
+            // Already exists, let hashpipe_databuf_create() verify it
+            errno = 0;
+            return 1;
+        }
+        hashpipe_error(__FUNCTION__, hugepage_size > 0
+            ? "shmget error (are huge pages reserved?)" : "shmget error");
+        return -1;
+    }
+
+    d = shmat(shmid, NULL, 0);
+    if(d == (void *)-1) {
+        hashpipe_error(__FUNCTION__, "shmat error");
+        shmctl(shmid, IPC_RMID, NULL);
+        return -1;
+    }
+
+    // Bind before anything touches the segment
+    if(numa_node >= 0 && hpguppi_numa_bind(d, total_size, numa_node)) {
+        hashpipe_error(__FUNCTION__, "mbind error for NUMA node %d", numa_node);
+        shmdt(d);
+        shmctl(shmid, IPC_RMID, NULL);
+        return -1;
+    }
+
+    d->header_size = header_size;
+    d->block_size = block_size;
+    d->n_block = n_block;
+
+    shmdt(d);
+
+    return 0;
+}
+
+// Determines which NUMA node (if any) the databuf should be bound to based on
+// the DBNUMA setting.  DBNUMA can be "auto" to use the NUMA node of the
+// network interface given by IBVIFACE (or BINDHOST if IBVIFACE is not given),
+// "none" (or "-1") to not bind to any NUMA node, or a NUMA node number.
+// Returns the NUMA node to bind to, -1 for no binding, or -2 for an invalid
+// DBNUMA value.
+static int databuf_numa_node(const char * dbnuma,
+    const char * ibviface, const char * bindhost)
+{
+    char * endptr;
+    long node;
+
+    if(!strcasecmp(dbnuma, "auto")) {
+        node = hpguppi_numa_node_of_interface(ibviface);
+        if(node < 0) {
+            node = hpguppi_numa_node_of_interface(bindhost);
+        }
+        return node;
+    }
+
+    if(!strcasecmp(dbnuma, "none")) {
+        return -1;
+    }
+
+    node = strtol(dbnuma, &endptr, 0);
+    if(endptr == dbnuma || (*endptr != '\0' && *endptr != ' ') || node < -1) {
+        return -2;
+    }
+
+    return node;
+}
+
+// Formats the NUMA nodes of the blocks of databuf d as a comma separated list
+// of run-length encoded "node*count" values (e.g. "0*24" or "0*20,1*4") into
+// buf, which has room for buflen characters (including the terminating NUL).
+// Blocks whose pages are not resident (or on non-NUMA systems) are reported as
+// node -1.
+static void databuf_format_block_nodes(hpguppi_input_databuf_t * d,
+    char * buf, size_t buflen)
+{
+    int i;
+    int node;
+    int run_node = -1;
+    int run_len = 0;
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for(i=0; i<=d->header.n_block; i++) {
+      node = i < d->header.n_block
+        ? hpguppi_numa_node_of_addr(hpguppi_databuf_block(d, i)) : -2;
+      if(run_len > 0 && node != run_node) {
+        len += snprintf(buf+len, len < buflen ? buflen-len : 0,
+            "%s%d*%d", len ? "," : "", run_node, run_len);
+        run_len = 0;
+      }
+      run_node = node;
+      run_len++;
+    }
+}
+
+// Creates the hpguppi_input_databuf.  The geometry of the databuf is taken
+// from these status buffer keywords, if present:
+//
+//   DBNBLKS   Number of blocks (default DEFAULT_N_INPUT_BLOCKS)
+//   DBBLKSZ   Size of each block's data area in bytes (default
+//             DEFAULT_BLOCK_DATA_SIZE).  This gets rounded up to a multiple
+//             of ALIGNMENT_SIZE and must be less than 2 GiB.
+//   DBHUGEPG  Huge page size to use for the databuf, "2M" or "1G" (default
+//             "0" for normal pages).  If the huge page allocation fails, the
+//             databuf will fall back to normal pages.  If the databuf's
+//             segment already exists, it is used as-is.  Either way, the page
+//             size actually backing the databuf is stored back in DBHUGEPG.
+//   DBNUMA    NUMA node to bind the databuf memory to, "auto" (default) to
+//             use the NUMA node of the IBVIFACE/BINDHOST network interface,
+//             or "none" to not bind the memory (i.e. use first touch).  As
+//             with DBHUGEPG, this is not applied to a databuf segment that
+//             already exists, and the NUMA node that the databuf is actually
+//             bound to (or "none") is stored back in DBNUMA.
+//
+//   DBSTATE   Block state mechanism, "sem" (default) to use SysV semaphores
+//             or "futex" to use atomics and futexes (see hpguppi_databuf.h).
+//   DBSPIN    Number of times to poll a block's state before sleeping when
+//             DBSTATE is "futex" (default DEFAULT_DATABUF_SPIN).  Readers
+//             that register with hpguppi_input_databuf_add_reader_spin() can
+//             override this with their own keyword (e.g. DISKSPIN).
+//   FANOUTDB  Databuf ID of a databuf to be shared by multiple readers
+//             (default 0 for none).  Requests to create a databuf with an ID
+//             from FANOUTDB+1 to FANOUTDB+FANOUTN will instead return the
+//             existing FANOUTDB databuf.  Since Hashpipe gives each thread
+//             the databuf whose ID is its position in the pipeline, this
+//             allows the FANOUTN+1 threads that follow the thread whose
+//             output databuf is FANOUTDB to all read the same databuf (see
+//             hpguppi_input_databuf_add_reader()).  Databufs with other IDs
+//             are unaffected, so the last of those threads may have its own
+//             output databuf.
+//   FANOUTN   Number of databuf IDs after FANOUTDB that share it (default 1).
+//
+// For example, with FANOUTDB=2 and FANOUTN=2, the pipeline
+//
+//   hpguppi_ibvpkt_thread -> hpguppi_meerkat_spead_thread
+//     -> hpguppi_rawdisk_only_thread -> hpguppi_fildisk_only_thread
+//     -> hpguppi_dbmon_thread
+//
+// has the last three threads all reading databuf 2.  If more than one thread
+// sharing a databuf frees its blocks, they must all be registered readers.
+// Threads that never free blocks (e.g. hpguppi_pkttap_thread) do not count.
+//
+// These keywords are typically given via "-o KEY=VALUE" on the hashpipe
+// command line.  The values used are stored back into the status buffer.
+// Note that these settings apply to all hpguppi_input_databufs of an instance.
+//
+// The NUMA node of each block is reported in the status buffer as DBNODE<N>,
+// where <N> is databuf_id, in the format described for
+// databuf_format_block_nodes().
 hashpipe_databuf_t *hpguppi_input_databuf_create(int instance_id, int databuf_id)
 {
     int i;
+    hashpipe_status_t st;
+    int have_st = 0;
+    uint32_t n_block = DEFAULT_N_INPUT_BLOCKS;
+    uint64_t block_data_size = DEFAULT_BLOCK_DATA_SIZE;
+    char hugepg[80];
+    ssize_t hugepage_size;
+    ssize_t page_size;
+    char dbnuma[80];
+    char ibviface[80];
+    char bindhost[80];
+    int numa_node;
+    int bound_node;
+    uint32_t fanout_db = 0;
+    uint32_t fanout_n = 1;
+    char dbstate[80];
+    uint32_t spin = DEFAULT_DATABUF_SPIN;
+    char nodes_key[9];
+    char nodes[81];
+
+    strcpy(hugepg, "0");
+    strcpy(dbnuma, "auto");
+    strcpy(dbstate, "sem");
+    ibviface[0] = '\0';
+    bindhost[0] = '\0';
+
+    /* Get databuf geometry from status buffer */
+    if(hashpipe_status_attach(instance_id, &st) == HASHPIPE_OK) {
+        have_st = 1;
+        hashpipe_status_lock_safe(&st);
+        {
+            hgetu4(st.buf, "DBNBLKS", &n_block);
+            hgetu8(st.buf, "DBBLKSZ", &block_data_size);
+            hgets(st.buf, "DBHUGEPG", sizeof(hugepg), hugepg);
+            hgets(st.buf, "DBNUMA", sizeof(dbnuma), dbnuma);
+            hgets(st.buf, "IBVIFACE", sizeof(ibviface), ibviface);
+            hgets(st.buf, "BINDHOST", sizeof(bindhost), bindhost);
+            hgetu4(st.buf, "FANOUTDB", &fanout_db);
+            hgetu4(st.buf, "FANOUTN", &fanout_n);
+            hgets(st.buf, "DBSTATE", sizeof(dbstate), dbstate);
+            hgetu4(st.buf, "DBSPIN", &spin);
+        }
+        hashpipe_status_unlock_safe(&st);
+    } else {
+        hashpipe_warn(__FUNCTION__,
+            "could not attach to status buffer, using default sizing");
+    }
+
+    /* Share the fan-out databuf rather than creating a new one */
+    if(fanout_db > 0 && databuf_id > fanout_db
+    && databuf_id - fanout_db <= fanout_n) {
+        if(have_st) {
+            hashpipe_status_detach(&st);
+        }
+        hashpipe_info(__FUNCTION__,
+            "using databuf %u in place of databuf %d", fanout_db, databuf_id);
+        return (hashpipe_databuf_t *)
+            hpguppi_input_databuf_attach(instance_id, fanout_db);
+    }
+
+    if(n_block < MIN_N_INPUT_BLOCKS) {
+        if(have_st) {
+            hashpipe_status_detach(&st);
+        }
+        hashpipe_error(__FUNCTION__,
+            "DBNBLKS must be at least %d", MIN_N_INPUT_BLOCKS);
+        return NULL;
+    }
+
+    if(block_data_size == 0) {
+        if(have_st) {
+            hashpipe_status_detach(&st);
+        }
+        hashpipe_error(__FUNCTION__, "DBBLKSZ must be non-zero");
+        return NULL;
+    }
+    // Round up to multiple of ALIGNMENT_SIZE
+    block_data_size += (-block_data_size) % ALIGNMENT_SIZE;
+    // BLOCSIZE is historically a signed 32 bit value
+    if(block_data_size > INT_MAX) {
+        if(have_st) {
+            hashpipe_status_detach(&st);
+        }
+        hashpipe_error(__FUNCTION__, "DBBLKSZ must be less than 2 GiB");
+        return NULL;
+    }
+
+    if(strcasecmp(dbstate, "sem") && strcasecmp(dbstate, "futex")) {
+        if(have_st) {
+            hashpipe_status_detach(&st);
+        }
+        hashpipe_error(__FUNCTION__,
+            "invalid DBSTATE \"%s\" (must be sem or futex)", dbstate);
+        return NULL;
+    }
+
+    hugepage_size = parse_hugepage_size(hugepg);
+    if(hugepage_size < 0) {
+        if(have_st) {
+            hashpipe_status_detach(&st);
+        }
+        hashpipe_error(__FUNCTION__,
+            "invalid DBHUGEPG \"%s\" (must be 0, 2M, or 1G)", hugepg);
+        return NULL;
+    }
+
+    numa_node = databuf_numa_node(dbnuma, ibviface, bindhost);
+    if(numa_node < -1) {
+        if(have_st) {
+            hashpipe_status_detach(&st);
+        }
+        hashpipe_error(__FUNCTION__,
+            "invalid DBNUMA \"%s\" (must be auto, none, or node number)",
+            dbnuma);
+        return NULL;
+    }
 
     /* Calc databuf sizes */
     size_t header_size = sizeof(hashpipe_databuf_t)
-                       + sizeof(hashpipe_databuf_alignment);
-    size_t block_size  = sizeof(hpguppi_input_block_t);
-    int    n_block = N_INPUT_BLOCKS;
+                       + sizeof(hashpipe_databuf_alignment)
+                       + hpguppi_databuf_ctl_size(n_block);
+    size_t block_size  = sizeof(hpguppi_input_block_t) + block_data_size;
+
+    if(hugepage_size > 0 || numa_node >= 0) {
+        if(databuf_segment_precreate(instance_id, databuf_id,
+              header_size, block_size, n_block, hugepage_size, numa_node) < 0) {
+            hashpipe_warn(__FUNCTION__,
+                "unable to use %s huge pages on NUMA node %d, "
+                "using normal pages with no NUMA binding", hugepg, numa_node);
+            errno = 0;
+            strcpy(hugepg, "0");
+            hugepage_size = 0;
+            numa_node = -1;
+        }
+    }
 
     hpguppi_input_databuf_t * d = (hpguppi_input_databuf_t *)
         hashpipe_databuf_create(
             instance_id, databuf_id, header_size, block_size, n_block);
 
     if(!d) {
+      if(have_st) {
+        hashpipe_status_detach(&st);
+      }
       return NULL;
     }
 
+    /* Reset reader bookkeeping (readers register after creation) */
+    memset(&d->ctl, 0, hpguppi_databuf_ctl_size(n_block));
+    d->ctl.use_futex = !strcasecmp(dbstate, "futex");
+    d->ctl.spin = spin;
+
     /* Zero out blocks */
     for(i=0; i<n_block; i++) {
-      memset(&(d->block[i]), 0, sizeof(hpguppi_input_block_t));
+      memset(hpguppi_databuf_block(d, i), 0, block_size);
     }
 
     /* Init headers of each databuf block */
@@ -50,9 +458,316 @@ hashpipe_databuf_t *hpguppi_input_databuf_create(int instance_id, int databuf_id
         memcpy(hpguppi_databuf_header(d,i), end_key, 80); 
     }
 
+    /* Report the actual page size, which is not the requested one if the
+     * segment already existed (e.g. from a previous run) */
+    page_size = databuf_page_size(d);
+    if(page_size >= 0 && page_size != hugepage_size) {
+        hashpipe_warn(__FUNCTION__, "databuf %d already existed, "
+            "DBHUGEPG %s not applied", databuf_id, hugepg);
+    }
+    switch(page_size) {
+      case 0:       strcpy(hugepg, "0");  break;
+      case (1<<21): strcpy(hugepg, "2M"); break;
+      case (1<<30): strcpy(hugepg, "1G"); break;
+      case -1:      break;
+      default:
+        snprintf(hugepg, sizeof(hugepg), "%zdK", page_size >> 10);
+        break;
+    }
+
+    /* Likewise for the NUMA binding, which is not applied to a segment that
+     * already existed */
+    bound_node = hpguppi_numa_bound_node_of_addr(d);
+    if(bound_node != numa_node) {
+        hashpipe_warn(__FUNCTION__, "databuf %d already existed, "
+            "DBNUMA %s not applied", databuf_id, dbnuma);
+        numa_node = bound_node;
+    }
+
+    /* Store geometry and placement in status buffer */
+    if(have_st) {
+        // Blocks are resident now that they have been zeroed
+        databuf_format_block_nodes(d, nodes, sizeof(nodes));
+        snprintf(nodes_key, sizeof(nodes_key), "DBNODE%d", databuf_id);
+
+        hashpipe_status_lock_safe(&st);
+        {
+            hputu4(st.buf, "DBNBLKS", n_block);
+            hputu8(st.buf, "DBBLKSZ", block_data_size);
+            hputs(st.buf, "DBHUGEPG", hugepg);
+            if(numa_node >= 0) {
+              hputi4(st.buf, "DBNUMA", numa_node);
+            } else {
+              hputs(st.buf, "DBNUMA", "none");
+            }
+            hputs(st.buf, nodes_key, nodes);
+            hputs(st.buf, "DBSTATE", d->ctl.use_futex ? "futex" : "sem");
+            hputu4(st.buf, "DBSPIN", spin);
+        }
+        hashpipe_status_unlock_safe(&st);
+        hashpipe_status_detach(&st);
+    }
+
     return (hashpipe_databuf_t *)d;
 }
 
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Sets the state of a futex based block and wakes any threads sleeping on it.
+static void futex_block_set_state(hpguppi_databuf_block_ctl_t * block_ctl,
+    uint32_t state)
+{
+    // The sequentially consistent store/load pair here and the
+    // increment/load pair in futex_block_wait() ensure that either the waiter
+    // sees the new state or we see the waiter.
+    __atomic_store_n(&block_ctl->state, state, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&block_ctl->waiters, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &block_ctl->state, FUTEX_WAKE, INT_MAX,
+            NULL, NULL, 0);
+    }
+}
+
+// Waits for a futex based block to become filled (if want_filled is
+// non-zero) or free (if want_filled is zero).  Polls the state up to spin
+// times before sleeping on the futex for up to timeout (relative).
+static int futex_block_wait(hpguppi_databuf_block_ctl_t * block_ctl,
+    int want_filled, uint32_t spin, struct timespec *timeout)
+{
+    int rv = HASHPIPE_OK;
+    uint32_t i;
+    uint32_t state;
+    struct timespec default_timeout = {0, DEFAULT_FUTEX_WAIT_TIMEOUT_NS};
+
+    for(i=0; ; i++) {
+        state = __atomic_load_n(&block_ctl->state, __ATOMIC_ACQUIRE);
+        if((state != 0) == (want_filled != 0)) {
+            return HASHPIPE_OK;
+        }
+        if(i >= spin) {
+            break;
+        }
+        cpu_relax();
+    }
+
+    if(!timeout) {
+        timeout = &default_timeout;
+    }
+
+    __atomic_add_fetch(&block_ctl->waiters, 1, __ATOMIC_SEQ_CST);
+    for(;;) {
+        state = __atomic_load_n(&block_ctl->state, __ATOMIC_SEQ_CST);
+        if((state != 0) == (want_filled != 0)) {
+            break;
+        }
+        if(syscall(SYS_futex, &block_ctl->state, FUTEX_WAIT, state,
+              timeout, NULL, 0) == -1) {
+            if(errno == ETIMEDOUT) {
+                errno = 0;
+                rv = HASHPIPE_TIMEOUT;
+                break;
+            } else if(errno != EAGAIN && errno != EINTR) {
+                hashpipe_error(__FUNCTION__, "futex wait error");
+                rv = HASHPIPE_ERR_SYS;
+                break;
+            }
+            errno = 0;
+        }
+    }
+    __atomic_sub_fetch(&block_ctl->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return rv;
+}
+
+int hpguppi_futex_databuf_block_status(hpguppi_input_databuf_t *d, int block_id)
+{
+    return __atomic_load_n(&d->ctl.block_ctl[block_id].state, __ATOMIC_ACQUIRE);
+}
+
+int hpguppi_futex_databuf_total_status(hpguppi_input_databuf_t *d)
+{
+    int i;
+    int total = 0;
+
+    for(i=0; i<d->header.n_block; i++) {
+        if(hpguppi_futex_databuf_block_status(d, i)) {
+            total++;
+        }
+    }
+
+    return total;
+}
+
+int hpguppi_futex_databuf_wait_free(hpguppi_input_databuf_t *d, int block_id,
+    uint32_t spin, struct timespec *timeout)
+{
+    return futex_block_wait(&d->ctl.block_ctl[block_id], 0, spin, timeout);
+}
+
+int hpguppi_futex_databuf_wait_filled(hpguppi_input_databuf_t *d, int block_id,
+    uint32_t spin, struct timespec *timeout)
+{
+    return futex_block_wait(&d->ctl.block_ctl[block_id], 1, spin, timeout);
+}
+
+int hpguppi_futex_databuf_set_free(hpguppi_input_databuf_t *d, int block_id)
+{
+    futex_block_set_state(&d->ctl.block_ctl[block_id], 0);
+    return HASHPIPE_OK;
+}
+
+int hpguppi_input_databuf_set_filled(hpguppi_input_databuf_t *d, int block_id)
+{
+    union hpguppi_semun arg;
+    uint32_t n_reader = __atomic_load_n(&d->ctl.n_reader, __ATOMIC_ACQUIRE);
+
+    // Bump fill_seq before the block becomes visible as filled
+    __atomic_add_fetch(&d->ctl.block_ctl[block_id].fill_seq, 1,
+        __ATOMIC_RELEASE);
+
+    if(hpguppi_databuf_uses_futex(d)) {
+        futex_block_set_state(&d->ctl.block_ctl[block_id],
+            n_reader ? n_reader : 1);
+        return HASHPIPE_OK;
+    }
+
+    if(n_reader == 0) {
+        return hashpipe_databuf_set_filled((hashpipe_databuf_t *)d, block_id);
+    }
+
+    arg.val = n_reader;
+    if(semctl(d->header.semid, block_id, SETVAL, arg) == -1) {
+        hashpipe_error(__FUNCTION__, "semctl error");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    return HASHPIPE_OK;
+}
+
+int hpguppi_input_databuf_add_reader(hpguppi_input_databuf_t *d)
+{
+    int i;
+    uint32_t reader = __atomic_fetch_add(&d->ctl.n_reader, 1, __ATOMIC_ACQ_REL);
+
+    if(reader >= MAX_DATABUF_READERS) {
+        __atomic_fetch_sub(&d->ctl.n_reader, 1, __ATOMIC_ACQ_REL);
+        hashpipe_error(__FUNCTION__,
+            "too many readers (max %d)", MAX_DATABUF_READERS);
+        return -1;
+    }
+
+    // A new reader has not seen any of the blocks filled so far
+    for(i=0; i<d->header.n_block; i++) {
+        d->ctl.block_ctl[i].read_seq[reader] = 0;
+    }
+    d->ctl.reader_spin[reader] = d->ctl.spin;
+
+    return reader;
+}
+
+int hpguppi_input_databuf_add_reader_spin(hpguppi_input_databuf_t *d,
+    hashpipe_status_t *st, const char *spin_key)
+{
+    uint32_t spin;
+    int reader = hpguppi_input_databuf_add_reader(d);
+
+    if(reader < 0) {
+        return reader;
+    }
+
+    spin = d->ctl.reader_spin[reader];
+    hashpipe_status_lock_safe(st);
+    {
+        hgetu4(st->buf, spin_key, &spin);
+        hputu4(st->buf, spin_key, spin);
+    }
+    hashpipe_status_unlock_safe(st);
+
+    hpguppi_input_databuf_reader_set_spin(d, reader, spin);
+
+    return reader;
+}
+
+int hpguppi_input_databuf_reader_wait_filled(hpguppi_input_databuf_t *d,
+    int block_id, int reader)
+{
+    int rv;
+    int use_futex = hpguppi_databuf_uses_futex(d);
+    uint32_t spin = d->ctl.reader_spin[reader];
+    hpguppi_databuf_block_ctl_t * block_ctl = &d->ctl.block_ctl[block_id];
+
+    for(;;) {
+        rv = use_futex
+          ? hpguppi_futex_databuf_wait_filled(d, block_id, spin, NULL)
+          : hpguppi_input_databuf_wait_filled(d, block_id);
+        if(rv != HASHPIPE_OK) {
+            break;
+        }
+        if(__atomic_load_n(&block_ctl->fill_seq, __ATOMIC_ACQUIRE)
+            != block_ctl->read_seq[reader]) {
+            break;
+        }
+        // This reader has already released this filling of the block, but
+        // other readers have not.  Wait for it to be freed (and refilled).
+        rv = use_futex
+          ? hpguppi_futex_databuf_wait_free(d, block_id, spin, NULL)
+          : hpguppi_input_databuf_wait_free(d, block_id);
+        if(rv != HASHPIPE_OK) {
+            break;
+        }
+    }
+
+    return rv;
+}
+
+int hpguppi_input_databuf_reader_set_free(hpguppi_input_databuf_t *d,
+    int block_id, int reader)
+{
+    struct sembuf op;
+    uint32_t state;
+    hpguppi_databuf_block_ctl_t * block_ctl = &d->ctl.block_ctl[block_id];
+
+    block_ctl->read_seq[reader] =
+        __atomic_load_n(&block_ctl->fill_seq, __ATOMIC_ACQUIRE);
+
+    if(hpguppi_databuf_uses_futex(d)) {
+        state = __atomic_load_n(&block_ctl->state, __ATOMIC_ACQUIRE);
+        do {
+            if(state == 0) {
+                // Already free
+                return HASHPIPE_OK;
+            }
+        } while(!__atomic_compare_exchange_n(&block_ctl->state, &state,
+              state-1, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+
+        // Wake waiters if we were the last reader to release the block
+        if(state == 1 && __atomic_load_n(&block_ctl->waiters, __ATOMIC_SEQ_CST)) {
+            syscall(SYS_futex, &block_ctl->state, FUTEX_WAKE, INT_MAX,
+                NULL, NULL, 0);
+        }
+        return HASHPIPE_OK;
+    }
+
+    op.sem_num = block_id;
+    op.sem_op = -1;
+    op.sem_flg = IPC_NOWAIT;
+    if(semop(d->header.semid, &op, 1) == -1) {
+        if(errno == EAGAIN) {
+            // Already free
+            errno = 0;
+            return HASHPIPE_OK;
+        }
+        hashpipe_error(__FUNCTION__, "semop error");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    return HASHPIPE_OK;
+}
+
 #if 0 // OLD STUFF
 
 int hpguppi_databuf_detach(struct guppi_databuf *d) {
@@ -7,19 +7,34 @@
 
 #include <stdint.h>
 #include "hashpipe_databuf.h"
+#include "hashpipe_status.h"
 #include "config.h"
 
 // Technically we only need to align to 512 bytes,
 // but this keeps things 4K (i.e. page) aligned.
 #define ALIGNMENT_SIZE (4096)
 
-#define N_INPUT_BLOCKS 24
+// The number of blocks and the size of each block's data area are determined
+// at runtime when the databuf is created (see hpguppi_input_databuf_create()
+// for the status buffer keywords that control this).  These are the defaults
+// used when those keywords are not present.  Code that uses an existing
+// databuf must not use these values, but rather use the geometry stored in the
+// databuf's header via the hpguppi_databuf_*() accessor functions below.
+#define DEFAULT_N_INPUT_BLOCKS 24
+#define DEFAULT_BLOCK_DATA_SIZE (128*1024*1024) // in bytes, from guppi_daq_server
+
+// Minimum number of blocks.  Some of the packet capture threads keep up to
+// three blocks "in use" at once.
+#define MIN_N_INPUT_BLOCKS 3
+
+// The block header size is still fixed at compile time.
 #define BLOCK_HDR_SIZE  (5*80*512)      // in bytes, from guppi_daq_server
-#define BLOCK_DATA_SIZE (128*1024*1024) // in bytes, from guppi_daq_server
 
+// Each block consists of a fixed size header followed by a data area whose
+// size is determined at runtime.
 typedef struct hpguppi_input_block {
   char hdr[BLOCK_HDR_SIZE];
-  char data[BLOCK_DATA_SIZE];
+  char data[];
 } hpguppi_input_block_t;
 
 // Used to pad after hashpipe_databuf_t to maintain data alignment
@@ -27,12 +42,64 @@ typedef uint8_t hashpipe_databuf_alignment[
   ALIGNMENT_SIZE - (sizeof(hashpipe_databuf_t)%ALIGNMENT_SIZE)
 ];
 
+// Maximum number of readers that can share a databuf (see
+// hpguppi_input_databuf_add_reader()).
+#define MAX_DATABUF_READERS (8)
+
+// Default number of times a waiter polls a block's state before sleeping when
+// using futex based block state (see DBSTATE and DBSPIN).
+#define DEFAULT_DATABUF_SPIN (1000)
+
+// Per-block bookkeeping used to support multiple readers of a databuf.
+// fill_seq is incremented every time the block is marked filled.
+// read_seq[i] is the fill_seq that reader i last released.  A reader must not
+// process a block whose fill_seq equals its read_seq entry because it has
+// already processed (and released) that filling of the block.
+//
+// When the databuf uses futex based block state, state holds the block's
+// state in place of the block's SysV semaphore: 0 means free and non-zero is
+// the number of readers that have yet to release the block.  waiters counts
+// the threads sleeping on state so that wakeups can skip the futex system
+// call when nobody is sleeping.  Each block_ctl gets its own cache line.
+typedef struct hpguppi_databuf_block_ctl {
+  uint32_t state;
+  uint32_t waiters;
+  uint64_t fill_seq;
+  uint64_t read_seq[MAX_DATABUF_READERS];
+} __attribute__((aligned(64))) hpguppi_databuf_block_ctl_t;
+
+// Reader bookkeeping for the whole databuf.  n_reader is the number of
+// registered readers.  use_futex is non-zero if block state is managed with
+// atomics and futexes rather than SysV semaphores.  spin is the number of
+// times to poll before sleeping when waiting for a block; reader_spin[i] is
+// the same for reader i.  There is one block_ctl entry per block.
+typedef struct hpguppi_databuf_ctl {
+  uint32_t n_reader;
+  uint32_t use_futex;
+  uint32_t spin;
+  uint32_t reader_spin[MAX_DATABUF_READERS];
+  uint32_t reserved[5]; // Keep block_ctl cache line aligned
+  hpguppi_databuf_block_ctl_t block_ctl[];
+} hpguppi_databuf_ctl_t;
+
+// The databuf control structure follows the padding.  The blocks follow the
+// control structure at header.header_size bytes from the start of the databuf.
+// There are header.n_block blocks, each of which is header.block_size bytes in
+// size.  Use hpguppi_databuf_block() to get a pointer to a specific block.
 typedef struct hpguppi_input_databuf {
   hashpipe_databuf_t header;
   hashpipe_databuf_alignment padding; // Maintain data alignment
-  hpguppi_input_block_t block[N_INPUT_BLOCKS];
+  hpguppi_databuf_ctl_t ctl;
 } hpguppi_input_databuf_t;
 
+// Returns the size of the control structure for n_block blocks rounded up to
+// a multiple of ALIGNMENT_SIZE.
+static inline size_t hpguppi_databuf_ctl_size(int n_block) {
+    size_t size = sizeof(hpguppi_databuf_ctl_t)
+                + n_block * sizeof(hpguppi_databuf_block_ctl_t);
+    return (size + ALIGNMENT_SIZE - 1) & ~(ALIGNMENT_SIZE - 1);
+}
+
 /*
  * INPUT BUFFER FUNCTIONS
  */
@@ -54,79 +121,241 @@ static inline void hpguppi_input_databuf_clear(hpguppi_input_databuf_t *d)
     hashpipe_databuf_clear((hashpipe_databuf_t *)d);
 }
 
+/*
+ * BLOCK STATE FUNCTIONS
+ *
+ * By default block state is kept in the databuf's SysV semaphores (via the
+ * hashpipe_databuf_*() functions).  If DBSTATE is "futex" when the databuf is
+ * created, block state is instead kept in the per-block state words of the
+ * databuf control structure.  These are updated with atomic operations and
+ * waiters spin for a while (see DBSPIN) before sleeping on a futex, so block
+ * handoffs normally involve no system calls at all.  This keeps the handoff
+ * cost low when using many small blocks.  The functions below dispatch to the
+ * appropriate implementation, so threads need not care which is in use.
+ * Note that external tools that inspect the semaphores will not see the block
+ * state of futex based databufs.
+ */
+
+int hpguppi_futex_databuf_block_status(hpguppi_input_databuf_t *d, int block_id);
+int hpguppi_futex_databuf_total_status(hpguppi_input_databuf_t *d);
+int hpguppi_futex_databuf_wait_free(hpguppi_input_databuf_t *d, int block_id,
+    uint32_t spin, struct timespec *timeout);
+int hpguppi_futex_databuf_wait_filled(hpguppi_input_databuf_t *d, int block_id,
+    uint32_t spin, struct timespec *timeout);
+int hpguppi_futex_databuf_set_free(hpguppi_input_databuf_t *d, int block_id);
+
+// Returns non-zero if d uses futex based block state.
+static inline int hpguppi_databuf_uses_futex(hpguppi_input_databuf_t *d)
+{
+    return d->ctl.use_futex;
+}
+
 static inline int hpguppi_input_databuf_block_status(hpguppi_input_databuf_t *d, int block_id)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_block_status(d, block_id);
+    }
     return hashpipe_databuf_block_status((hashpipe_databuf_t *)d, block_id);
 }
 
 static inline int hpguppi_input_databuf_total_status(hpguppi_input_databuf_t *d)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_total_status(d);
+    }
     return hashpipe_databuf_total_status((hashpipe_databuf_t *)d);
 }
 
 static inline int hpguppi_input_databuf_wait_free_timeout(
     hpguppi_input_databuf_t *d, int block_id, struct timespec *timeout)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_wait_free(d, block_id,
+            d->ctl.spin, timeout);
+    }
     return hashpipe_databuf_wait_free_timeout((hashpipe_databuf_t *)d,
         block_id, timeout);
 }
 
 static inline int hpguppi_input_databuf_wait_free(hpguppi_input_databuf_t *d, int block_id)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_wait_free(d, block_id,
+            d->ctl.spin, NULL);
+    }
     return hashpipe_databuf_wait_free((hashpipe_databuf_t *)d, block_id);
 }
 
 static inline int hpguppi_input_databuf_busywait_free(hpguppi_input_databuf_t *d, int block_id)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_wait_free(d, block_id, UINT32_MAX, NULL);
+    }
     return hashpipe_databuf_busywait_free((hashpipe_databuf_t *)d, block_id);
 }
 
 static inline int hpguppi_input_databuf_wait_filled_timeout(
     hpguppi_input_databuf_t *d, int block_id, struct timespec *timeout)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_wait_filled(d, block_id,
+            d->ctl.spin, timeout);
+    }
     return hashpipe_databuf_wait_filled_timeout((hashpipe_databuf_t *)d,
         block_id, timeout);
 }
 
 static inline int hpguppi_input_databuf_wait_filled(hpguppi_input_databuf_t *d, int block_id)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_wait_filled(d, block_id,
+            d->ctl.spin, NULL);
+    }
     return hashpipe_databuf_wait_filled((hashpipe_databuf_t *)d, block_id);
 }
 
 static inline int hpguppi_input_databuf_busywait_filled(hpguppi_input_databuf_t *d, int block_id)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_wait_filled(d, block_id, UINT32_MAX, NULL);
+    }
     return hashpipe_databuf_busywait_filled((hashpipe_databuf_t *)d, block_id);
 }
 
+// Marks block block_id as free regardless of how many readers have yet to
+// release it.  Registered readers should use
+// hpguppi_input_databuf_reader_set_free() instead.
 static inline int hpguppi_input_databuf_set_free(hpguppi_input_databuf_t *d, int block_id)
 {
+    if(hpguppi_databuf_uses_futex(d)) {
+        return hpguppi_futex_databuf_set_free(d, block_id);
+    }
     return hashpipe_databuf_set_free((hashpipe_databuf_t *)d, block_id);
 }
 
-static inline int hpguppi_input_databuf_set_filled(hpguppi_input_databuf_t *d, int block_id)
+// Marks block block_id as filled for all registered readers (or for the one
+// unregistered reader if no readers have registered).
+int hpguppi_input_databuf_set_filled(hpguppi_input_databuf_t *d, int block_id);
+
+/*
+ * MULTIPLE READER FUNCTIONS
+ *
+ * A databuf can be shared by up to MAX_DATABUF_READERS readers (e.g. a raw
+ * recording thread, a filterbank thread, and a monitoring thread).  Each
+ * reader calls hpguppi_input_databuf_add_reader() from its init() function to
+ * get a reader ID.  The reader then uses the reader_wait_filled() and
+ * reader_set_free() functions below (instead of wait_filled() and set_free())
+ * with that reader ID.  When set filled, a block's semaphore is set to the
+ * number of registered readers.  Each reader decrements the semaphore when it
+ * releases the block, so the block becomes free (and available to the writer)
+ * only after all readers have released it.  No data are copied.
+ *
+ * Readers must register before the writer starts filling blocks (i.e. in
+ * init() rather than run()).  A databuf with no registered readers behaves as
+ * a traditional single reader databuf.
+ *
+ * Because all readers of a shared databuf access the same block concurrently,
+ * readers must treat a filled block (header and data) as read only.  Any
+ * reader that needs a modified header (e.g. to insert a BACKEND record) must
+ * make a private copy (see hpguppi_raw_header_copy()).
+ */
+
+// Registers a new reader of databuf d.  Returns the reader ID or -1 if
+// MAX_DATABUF_READERS readers are already registered.
+int hpguppi_input_databuf_add_reader(hpguppi_input_databuf_t *d);
+
+// Registers a new reader of databuf d like hpguppi_input_databuf_add_reader()
+// and sets the reader's spin count (see
+// hpguppi_input_databuf_reader_set_spin()) from status buffer keyword
+// spin_key, if present.  The spin count used is stored back in spin_key.
+// This lets each consumer thread's wait policy be given on the hashpipe
+// command line (e.g. "-o DISKSPIN=0").
+int hpguppi_input_databuf_add_reader_spin(hpguppi_input_databuf_t *d,
+    hashpipe_status_t *st, const char *spin_key);
+
+// Waits for block block_id to be filled with data that reader has not yet
+// processed.  Returns HASHPIPE_OK when the block is ready to be read,
+// HASHPIPE_TIMEOUT on timeout (in which case the caller should try again), or
+// an error code.
+int hpguppi_input_databuf_reader_wait_filled(hpguppi_input_databuf_t *d,
+    int block_id, int reader);
+
+// Releases block block_id on behalf of reader.  The block becomes free when
+// all registered readers have released it.
+int hpguppi_input_databuf_reader_set_free(hpguppi_input_databuf_t *d,
+    int block_id, int reader);
+
+// Returns the number of times block block_id has been marked filled.  This
+// lets unregistered observers (e.g. hpguppi_pkttap_thread) peek at filled
+// blocks without holding them up: an observer checks that the block is filled
+// and notes its fill_seq, reads the block, then checks that the block is still
+// filled and that its fill_seq is unchanged (in that order).  If either check
+// fails, the block was freed (and possibly refilled) while being read and the
+// data read should be discarded.
+static inline uint64_t hpguppi_input_databuf_fill_seq(
+    hpguppi_input_databuf_t *d, int block_id)
+{
+    return __atomic_load_n(&d->ctl.block_ctl[block_id].fill_seq,
+        __ATOMIC_ACQUIRE);
+}
+
+// Sets the number of times reader polls a block's state before sleeping when
+// waiting for a block of a futex based databuf.  Latency sensitive readers
+// running on dedicated cores can use a large value (UINT32_MAX to never
+// sleep), while readers sharing cores should use a small value (0 to sleep
+// immediately).  The default is the databuf's DBSPIN value.
+static inline void hpguppi_input_databuf_reader_set_spin(
+    hpguppi_input_databuf_t *d, int reader, uint32_t spin)
 {
-    return hashpipe_databuf_set_filled((hashpipe_databuf_t *)d, block_id);
+    d->ctl.reader_spin[reader] = spin;
+}
+
+// Returns the size, in bytes, of the data area of each block.
+static inline size_t hpguppi_databuf_block_data_size(struct hpguppi_input_databuf *d) {
+    return d->header.block_size - BLOCK_HDR_SIZE;
+}
+
+// Returns a pointer to the start of the blocks.
+static inline char *hpguppi_databuf_blocks(struct hpguppi_input_databuf *d) {
+    return (char *)d + d->header.header_size;
+}
+
+// Returns the total size, in bytes, of all blocks (headers and data).  This is
+// the size of the memory region starting at hpguppi_databuf_blocks(d).
+static inline size_t hpguppi_databuf_blocks_size(struct hpguppi_input_databuf *d) {
+    return d->header.n_block * d->header.block_size;
+}
+
+// Returns the total size, in bytes, of the databuf (including its header).
+static inline size_t hpguppi_databuf_total_size(struct hpguppi_input_databuf *d) {
+    return d->header.header_size + hpguppi_databuf_blocks_size(d);
+}
+
+// Returns a pointer to block block_id.  No range checking is performed.
+static inline hpguppi_input_block_t *hpguppi_databuf_block(struct hpguppi_input_databuf *d, int block_id) {
+    return (hpguppi_input_block_t *)(hpguppi_databuf_blocks(d)
+        + block_id * d->header.block_size);
 }
 
 static inline char *hpguppi_databuf_header(struct hpguppi_input_databuf *d, int block_id) {
-    if(block_id < 0 || d->header.n_block < block_id) {
+    if(block_id < 0 || d->header.n_block <= block_id) {
         hashpipe_error(__FUNCTION__,
-            "block_id %s out of range [0, %d)",
+            "block_id %d out of range [0, %d)",
             block_id, d->header.n_block);
         return NULL;
     } else {
-        return d->block[block_id].hdr;
+        return hpguppi_databuf_block(d, block_id)->hdr;
     }
 }
 
 static inline char *hpguppi_databuf_data(struct hpguppi_input_databuf *d, int block_id) {
-    if(block_id < 0 || d->header.n_block < block_id) {
+    if(block_id < 0 || d->header.n_block <= block_id) {
         hashpipe_error(__FUNCTION__,
-            "block_id %s out of range [0, %d)",
+            "block_id %d out of range [0, %d)",
             block_id, d->header.n_block);
         return NULL;
     } else {
-        return d->block[block_id].data;
+        return hpguppi_databuf_block(d, block_id)->data;
     }
 }
 
@@ -0,0 +1,124 @@
+// hpguppi_dbmon_thread.c
+//
+// A Hashpipe thread that monitors the blocks of an hpguppi_input_databuf.  It
+// registers as one of the databuf's readers so it can run alongside other
+// readers of the same databuf (e.g. hpguppi_rawdisk_only_thread and/or
+// hpguppi_fildisk_only_thread, see FANOUTDB in hpguppi_databuf.c).  For each
+// block it reports a few block header values and the databuf fill level in the
+// status buffer.  It does not touch the block data so it should never be the
+// reader that holds up the release of a block.
+//
+// Status buffer keywords:
+//
+//   DBMONSTA  Thread status
+//   DBMONBLK  Number of blocks seen
+//   DBMONPKT  PKTIDX of most recent block
+//   DBMONDRP  NDROP of most recent block
+//   DBMONBUF  Databuf fill level as "filled/n_block"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hashpipe.h"
+#include "hpguppi_databuf.h"
+
+// Our reader ID for the input databuf
+static int reader_id = -1;
+
+static int init(hashpipe_thread_args_t * args)
+{
+  hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->ibuf;
+
+  // Register as a reader of the input databuf
+  if((reader_id = hpguppi_input_databuf_add_reader_spin(db,
+        &args->st, "DBMSPIN")) < 0) {
+    hashpipe_error(args->thread_desc->name,
+        "unable to register as databuf reader");
+    return HASHPIPE_ERR_SYS;
+  }
+
+  return HASHPIPE_OK;
+}
+
+static void * run(hashpipe_thread_args_t * args)
+{
+  // Local aliases to shorten access to args fields
+  hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->ibuf;
+  hashpipe_status_t *st = &args->st;
+  const char * thread_name = args->thread_desc->name;
+  const char * status_key = args->thread_desc->skey;
+
+  int rv;
+  int curblock = 0;
+  uint64_t block_count = 0;
+  int64_t pktidx = 0;
+  int32_t ndrop = 0;
+  char * hdr;
+  char dbbuf_status[80];
+
+  hashpipe_status_lock_safe(st);
+  {
+    hputs(st->buf, status_key, "running");
+    hputu8(st->buf, "DBMONBLK", 0);
+  }
+  hashpipe_status_unlock_safe(st);
+
+  while(run_threads()) {
+    // Wait for block to have data that we have not yet seen
+    rv = hpguppi_input_databuf_reader_wait_filled(db, curblock, reader_id);
+    if(rv == HASHPIPE_TIMEOUT) {
+      continue;
+    } else if(rv != HASHPIPE_OK) {
+      hashpipe_error(thread_name, "error waiting for filled databuf block");
+      break;
+    }
+
+    hdr = hpguppi_databuf_header(db, curblock);
+    pktidx = -1;
+    ndrop = -1;
+    hgeti8(hdr, "PKTIDX", &pktidx);
+    hgeti4(hdr, "NDROP", &ndrop);
+    block_count++;
+
+    sprintf(dbbuf_status, "%d/%d",
+        hpguppi_input_databuf_total_status(db), db->header.n_block);
+
+    // Release block before updating status buffer
+    hpguppi_input_databuf_reader_set_free(db, curblock, reader_id);
+
+    hashpipe_status_lock_safe(st);
+    {
+      hputu8(st->buf, "DBMONBLK", block_count);
+      hputi8(st->buf, "DBMONPKT", pktidx);
+      hputi4(st->buf, "DBMONDRP", ndrop);
+      hputs(st->buf, "DBMONBUF", dbbuf_status);
+    }
+    hashpipe_status_unlock_safe(st);
+
+    curblock = (curblock + 1) % db->header.n_block;
+
+    // Will exit if thread has been cancelled
+    pthread_testcancel();
+  }
+
+  hashpipe_info(thread_name, "exiting!");
+
+  return NULL;
+}
+
+static hashpipe_thread_desc_t thread_desc = {
+    name: "hpguppi_dbmon_thread",
+    skey: "DBMONSTA",
+    init: init,
+    run:  run,
+    ibuf_desc: {hpguppi_input_databuf_create},
+    obuf_desc: {NULL}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&thread_desc);
+}
+
+// vi: set ts=2 sw=2 et :
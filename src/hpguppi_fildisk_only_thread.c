@@ -18,6 +18,7 @@
 #include "hashpipe.h"
 
 #include "hpguppi_databuf.h"
+#include "hpguppi_numa.h"
 #include "hpguppi_params.h"
 #include "hpguppi_pksuwl.h"
 #include "hpguppi_rawspec.h"
@@ -33,6 +34,9 @@ static const char BACKEND_RECORD[] =
   "                                        ";
 #endif
 
+// Our reader ID for the input databuf
+static int reader_id = -1;
+
 static int init(hashpipe_thread_args_t * args)
 {
     int i;
@@ -77,7 +81,7 @@ static int init(hashpipe_thread_args_t * args)
 
     if(Nbps == 8) {
       // Assume pre-PKSUWL (multibeam, other single pixel) data parameters.
-      ctx->Ntpb = calc_ntime_per_block(BLOCK_DATA_SIZE, Nc);
+      ctx->Ntpb = calc_ntime_per_block(hpguppi_databuf_block_data_size(db), Nc);
       // Number of fine channels per coarse channel (i.e. FFT size).
       ctx->Nts[0] = (1<<20);
       ctx->Nts[1] = (1<<3);
@@ -135,7 +139,7 @@ static int init(hashpipe_thread_args_t * args)
       return HASHPIPE_ERR_SYS;
     }
     for(i=0; i < ctx->Nb_host; i++) {
-      ctx->h_blkbufs[i] = (char *)&db->block[i].data;
+      ctx->h_blkbufs[i] = hpguppi_databuf_data(db, i);
     }
 
     // Initialize rawspec
@@ -154,6 +158,14 @@ static int init(hashpipe_thread_args_t * args)
       }
     }
 
+    // Register as a reader of the input databuf
+    if((reader_id = hpguppi_input_databuf_add_reader_spin(db,
+        &args->st, "FILSPIN")) < 0) {
+      hashpipe_error(thread_name,
+	  "unable to register as databuf reader");
+      return HASHPIPE_ERR_SYS;
+    }
+
     // Save context
     args->user_data = ctx;
 
@@ -188,6 +200,9 @@ static void *run(hashpipe_thread_args_t * args)
       hashpipe_error(thread_name, "ioprio_set IOPRIO_CLASS_RT");
     }
 
+    /* Report NUMA node of this thread */
+    hpguppi_numa_report_thread(args);
+
     /* Loop */
     int64_t pktidx=0, pktstart=0, pktstop=0;
     int64_t piperblk=0, last_pktidx=0;
@@ -195,20 +210,18 @@ static void *run(hashpipe_thread_args_t * args)
     int got_packet_0=0, first=1;
     char *ptr;
     int rv = 0;
+    const char * disk_state = NULL;
     int i;
 
     while (run_threads()) {
 
-        /* Note waiting status */
-        hashpipe_status_lock_safe(st);
-	{
-	  hputs(st->buf, status_key, "waiting");
-	}
-        hashpipe_status_unlock_safe(st);
-
         /* Wait for buf to have data */
-        rv = hpguppi_input_databuf_wait_filled(db, curblock);
-        if (rv!=0) continue;
+        rv = hpguppi_input_databuf_reader_wait_filled(db, curblock, reader_id);
+        if (rv!=0) {
+            /* Note waiting status */
+            hpguppi_status_update_state(st, status_key, &disk_state, "waiting");
+            continue;
+        }
 
         /* Read param struct for this block */
         ptr = hpguppi_databuf_header(db, curblock);
@@ -248,7 +261,10 @@ static void *run(hashpipe_thread_args_t * args)
 	    }
 
 	    /* Mark as free */
-	    hpguppi_input_databuf_set_free(db, curblock);
+	    hpguppi_input_databuf_reader_set_free(db, curblock, reader_id);
+
+	    /* Note waiting status */
+	    hpguppi_status_update_state(st, status_key, &disk_state, "waiting");
 
 	    /* Go to next block */
 	    curblock = (curblock + 1) % db->header.n_block;
@@ -335,10 +351,8 @@ static void *run(hashpipe_thread_args_t * args)
         /* If we got packet 0, write data to disk */
         if (got_packet_0) {
 
-            /* Note waiting status */
-            hashpipe_status_lock_safe(st);
-            hputs(st->buf, status_key, "writing");
-            hashpipe_status_unlock_safe(st);
+            /* Note writing status */
+            hpguppi_status_update_state(st, status_key, &disk_state, "writing");
 
 	    // Update piperblk if piperblk is zero
 	    // or pktidx is smaller than last_pktidx + piperblk
@@ -402,7 +416,7 @@ static void *run(hashpipe_thread_args_t * args)
         }
 
         /* Mark as free */
-        hpguppi_input_databuf_set_free(db, curblock);
+        hpguppi_input_databuf_reader_set_free(db, curblock, reader_id);
 
         /* Go to next block */
         curblock = (curblock + 1) % db->header.n_block;
@@ -76,11 +76,58 @@
 // would be used if IBVPKTSZ were given as 1162 assuming each packet is aligned
 // on a 64 byte boundary, but the extra padding bytes are redistributed to
 // afford more optimal alignment ofthe SEPAD header and SPEAD data sections.
-
+//
+// The Ethernet/IP/UDP header chunk still takes a full 64 bytes of each slot
+// (and the corresponding memory bandwidth) even though downstream threads
+// generally don't need it.  Setting IBVSKIP=1 makes the first chunk get
+// scattered into a small scratch area at the end of each block instead of
+// into the slot, so with IBVPKTSZ=42,96,1024 each packet uses only 128+1024
+// == 1152 bytes of the block and the SPEAD header is at the start of the slot.
+// The scratch area has PKTBUF_SCRATCH_LINES lines that are shared round robin
+// by the work requests and overwritten by subsequent packets.  In general,
+// IBVSKIP specifies the number of leading chunks to skip.  Downstream threads
+// should use hpguppi_pktbuf_slot_offset() to locate the parts of the packet
+// that they need.
+//
+// By default the thread (or, for IBVNQP=1, hashpipe_ibv_recv_pkts()) sleeps
+// while waiting for packets and handles whatever work completions are ready
+// when it wakes up.  With small packets the per-wakeup overhead adds up, so
+// setting IBVPOLL=busy makes each queue spin on its completion queue instead,
+// taking up to IBVBATCH (default 64) work completions at a time.  In busy poll
+// mode the time check for the periodic status buffer update is only done every
+// few polls and work requests are reposted in bulk once enough have been
+// handled.  The distribution of the number of packets handled per batch is
+// reported as IBVBHIST, a comma separated list of batch counts for batch sizes
+// of 1, 2-3, 4-7, and so on, for the latest status buffer update interval.
+//
+// A single core polling for work completions tops out well below 100 Gbps, so
+// the capture can be spread over multiple queue pairs (QPs) by setting IBVNQP
+// (default 1).  Each QP gets its own capture thread (the first one being this
+// hashpipe thread itself) and its own contiguous range of slots within every
+// block, so queue q of N fills slots q*S/N through (q+1)*S/N-1 of each block
+// (where S is slots_per_block).  Each queue advances through the blocks on its
+// own, but a block is only marked as filled once every queue has advanced past
+// it.  hashpipe_ibv_flow() distributes flows across the QPs by flow index, so
+// every QP should be given at least one flow carrying traffic.  A queue that
+// receives no packets (or falls far behind) would otherwise hold up the
+// others, so a queue that has waited IBVQWAIT milliseconds (default
+// DEFAULT_QUEUE_WAIT_MS, 0 to wait forever) for slower queues marks the blocks
+// it needs as filled anyway and leaves the slower queues behind.  The slots of
+// a left behind queue in those blocks hold whatever they held before (e.g.
+// packets from an earlier pass through the databuf or nothing at all), which
+// downstream threads will see as late or empty.  When a left behind queue gets
+// packets again it rejoins the others at the oldest block not yet marked
+// filled.  Packets that it received into already filled blocks are lost.  The
+// number of blocks marked filled early is reported in IBVQSKIP.  The extra
+// capture threads inherit this thread's CPU affinity unless IBVCPUS is given
+// as a comma separated list of CPUs for queues 1 through IBVNQP-1.
+
+#define _GNU_SOURCE 1
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include <infiniband/verbs.h>
 
 #include "hashpipe.h"
@@ -88,12 +135,37 @@
 #include "hpguppi_time.h"
 #include "hpguppi_mkfeng.h"
 #include "hpguppi_ibverbs_pkt_thread.h"
+#include "hpguppi_numa.h"
 
 // Milliseconds between periodic status buffer updates
 #define PERIODIC_STATUS_BUFFER_UPDATE_MS (200)
 
 #define DEFAULT_MAX_FLOWS (16)
 
+// Maximum number of queue pairs (and capture threads) supported
+#define MAX_IBV_QUEUES (16)
+
+// Default and max number of work completions to poll for at once when polling
+// a single queue (i.e. when IBVNQP > 1 or IBVPOLL=busy)
+#define DEFAULT_POLL_BATCH (64)
+#define MAX_POLL_BATCH (256)
+
+// Number of polls between time checks for the periodic status buffer update
+// when busy polling
+#define BUSY_POLLS_PER_TIME_CHECK (256)
+
+// Number of (power of 2 sized) batch size histogram bins.  The last bin holds
+// batches of MAX_POLL_BATCH.
+#define BATCH_HIST_BINS (9)
+
+// Default number of milliseconds that a queue waits for slower queues before
+// leaving them behind (see IBVQWAIT)
+#define DEFAULT_QUEUE_WAIT_MS (500)
+
+// Nanoseconds to sleep when polling a single queue finds no work completions
+// (unless busy polling)
+#define QUEUE_IDLE_NS (20*1000)
+
 // A bit of a hack...
 #ifndef IBV_FLOW_ATTR_SNIFFER
 #define IBV_FLOW_ATTR_SNIFFER (0x3)
@@ -115,14 +187,30 @@
 // threads).  Any status buffer fields that need to be updated for correct
 // downstream processing of this block must be updated BEFORE calling this
 // function.  Note that some of the block's header fields will be set when the
-// block is finalized (see finalize_block() for details).
+// block is finalized (see finalize_block() for details).  If status_key is
+// NULL, the status buffer is not updated (used by all but one queue when
+// capturing with multiple queues).
 static void wait_for_block_free(hpguppi_input_databuf_t *db, int block_idx,
     hashpipe_status_t * st, const char * status_key)
 {
   int rv;
   char ibvstat[80] = {0};
   char ibvbuf_status[80];
-  int ibvbuf_full = hpguppi_input_databuf_total_status(db);
+  int ibvbuf_full;
+
+  if(!status_key) {
+    while ((rv=hpguppi_input_databuf_wait_free(db, block_idx))
+        != HASHPIPE_OK) {
+      if (rv!=HASHPIPE_TIMEOUT) {
+        hashpipe_error(__FUNCTION__,
+            "error waiting for free databuf (%s)", __FILE__);
+        pthread_exit(NULL);
+      }
+    }
+    return;
+  }
+
+  ibvbuf_full = hpguppi_input_databuf_total_status(db);
   sprintf(ibvbuf_status, "%d/%d", ibvbuf_full, db->header.n_block);
 
   hashpipe_status_lock_safe(st);
@@ -185,17 +273,18 @@ hpguppi_query_max_wr(const char * interface_name)
   return ibv_dev_attr.max_qp_wr;
 }
 
-// Parses the ibvpktsz string for chunk sizes and initializes db's pktbuf_info
-// accordingly.  Returns 0 on success or -1 on error.
-static
+// See comments in hpguppi_ibverbs_pkt_thread.h.
 int
-parse_ibvpktsz(struct hpguppi_pktbuf_info *pktbuf_info, char * ibvpktsz)
+hpguppi_parse_ibvpktsz(struct hpguppi_pktbuf_info *pktbuf_info, char * ibvpktsz,
+    uint32_t num_skip_chunks, size_t block_data_size)
 {
   int i;
   char * p;
   uint32_t nchunks = 0;
   size_t pkt_size = 0;
   size_t slot_size = 0;
+  size_t skip_size = 0;
+  size_t scratch_size;
 
   if(!ibvpktsz) {
     return -1;
@@ -237,21 +326,45 @@ parse_ibvpktsz(struct hpguppi_pktbuf_info *pktbuf_info, char * ibvpktsz)
     return -1;
   }
 
-  // Calculate remaining fields
+  // At least one chunk must be stored in the slots
+  if(num_skip_chunks >= nchunks) {
+    hashpipe_error("IBVSKIP", "must skip fewer than %u chunks", nchunks);
+    return -1;
+  }
+
+  // Calculate remaining fields.  Skipped chunks are laid out in a scratch line
+  // rather than in the slot.
   for(i=0; i<nchunks; i++) {
     pktbuf_info->chunks[i].chunk_aligned_size = pktbuf_info->chunks[i].chunk_size +
       ((-pktbuf_info->chunks[i].chunk_size) % PKT_ALIGNMENT_SIZE);
-    pktbuf_info->chunks[i].chunk_offset = slot_size;
-    // Accumulate pkt_size and slot_size
+    // Accumulate pkt_size
     pkt_size += pktbuf_info->chunks[i].chunk_size;
-    slot_size += pktbuf_info->chunks[i].chunk_aligned_size;
+    if(i < num_skip_chunks) {
+      // Accumulate skip_size
+      pktbuf_info->chunks[i].chunk_offset = skip_size;
+      skip_size += pktbuf_info->chunks[i].chunk_aligned_size;
+    } else {
+      // Accumulate slot_size
+      pktbuf_info->chunks[i].chunk_offset = slot_size;
+      slot_size += pktbuf_info->chunks[i].chunk_aligned_size;
+    }
+  }
+
+  // Scratch lines go after the slots at the end of each block
+  scratch_size = PKTBUF_SCRATCH_LINES * skip_size;
+  if(scratch_size + slot_size > block_data_size) {
+    hashpipe_error("IBVPKTSZ", "packets too large for block size");
+    return -1;
   }
 
   // Store final values
   pktbuf_info->num_chunks = nchunks;
+  pktbuf_info->num_skip_chunks = num_skip_chunks;
   pktbuf_info->pkt_size = pkt_size;
   pktbuf_info->slot_size = slot_size;
-  pktbuf_info->slots_per_block = BLOCK_DATA_SIZE / slot_size;
+  pktbuf_info->slots_per_block = (block_data_size - scratch_size) / slot_size;
+  pktbuf_info->skip_size = skip_size;
+  pktbuf_info->scratch_offset = pktbuf_info->slots_per_block * slot_size;
 
   return 0;
 }
@@ -280,6 +393,9 @@ hpguppi_pktbuf_slot_offset(hpguppi_input_databuf_t *db, off_t pkt_offset)
   // pkt_offset that doesn't exceed the sum of chuck sizes.
   if(i == pktbuf_info->num_chunks) {
     slot_offset = hpguppi_pktbuf_slot_offset(db, pkt_offset);
+  } else if(i < pktbuf_info->num_skip_chunks) {
+    // Skipped chunks are not stored in the slot
+    slot_offset = -1;
   } else {
     slot_offset = pktbuf_info->chunks[i].chunk_offset + pkt_offset;
   }
@@ -301,6 +417,17 @@ hashpipe_ibv_context_ptr(hpguppi_input_databuf_t *db)
       db->padding + sizeof(struct hpguppi_pktbuf_info));
 }
 
+// Non-zero when packets come from a source other than this thread's
+// hashpipe_ibv_context, in which case there are no NIC flows to manage.
+static int ibvpkt_flows_disabled = 0;
+
+// See comments in hpguppi_ibverbs_pkt_thread.h.
+void
+hpguppi_ibvpkt_disable_flows()
+{
+  ibvpkt_flows_disabled = 1;
+}
+
 // See comments in hpguppi_ibverbs_pkt_thread.h.
 // This is essentially a passthrough to hashpipe_ibv_flow().
 int
@@ -314,6 +441,10 @@ hpguppi_ibvpkt_flow(
 {
   struct hashpipe_ibv_context * hibv_ctx = hashpipe_ibv_context_ptr(db);
 
+  if(ibvpkt_flows_disabled) {
+    return 0;
+  }
+
   return hashpipe_ibv_flow(hibv_ctx,
     flow_idx,   flow_type,
     dst_mac,    src_mac,
@@ -326,7 +457,11 @@ hpguppi_ibvpkt_flow(
 // ibverbs setup.  After this funtion returns, the underlying
 // hashpipe_ibv_context structure used by hpguppi_ibvpkt_thread will be fully
 // initialized and flows can be created/destroyed by calling
-// hpguppi_ibvpkt_flow().
+// hpguppi_ibvpkt_flow().  Any IBVSTAT value that is only set once setup is
+// complete ("running", "blocked", or "done") ends the wait.  Checking for
+// "running" only would miss a packet source that blocks (or, like
+// hpguppi_pcap_replay_thread, finishes) within one polling interval, leaving
+// the caller waiting forever.
 void
 hpguppi_ibvpkt_wait_running(hashpipe_status_t * st)
 {
@@ -336,7 +471,7 @@ hpguppi_ibvpkt_wait_running(hashpipe_status_t * st)
     .tv_nsec = 100*1000*1000 // 100 ms
   };
 
-  // Loop until break when IBVSTAT is "running"
+  // Loop until break when IBVSTAT shows that setup is complete
   for(;;) {
     hashpipe_status_lock_safe(st);
     {
@@ -344,7 +479,9 @@ hpguppi_ibvpkt_wait_running(hashpipe_status_t * st)
     }
     hashpipe_status_unlock_safe(st);
 
-    if(!strcmp(ibvstat, "running")) {
+    if(!strcmp(ibvstat, "running")
+    || !strcmp(ibvstat, "blocked")
+    || !strcmp(ibvstat, "done")) {
       break;
     }
 
@@ -352,6 +489,16 @@ hpguppi_ibvpkt_wait_running(hashpipe_status_t * st)
   }
 }
 
+// Returns the first slot of queue q's slot range when using nqp queues.  The
+// slot range of queue q ends just before the first slot of queue q+1.
+static inline
+uint32_t
+queue_first_slot(struct hpguppi_pktbuf_info * pktbuf_info, uint32_t nqp,
+    uint32_t q)
+{
+  return (uint32_t)(pktbuf_info->slots_per_block * q / nqp);
+}
+
 // The hpguppi_ibverbs_init() function sets up the hashpipe_ibv_context
 // structure and then call hashpipe_ibv_init().  This uses the "user-managed
 // buffers" feature of hashpipe_ibverbs so that packets will be stored directly
@@ -361,19 +508,22 @@ hpguppi_ibvpkt_wait_running(hashpipe_status_t * st)
 // address mappings for the shared memory datbuf change between ini() and
 // run(), so this function must be called from run() only.  It initializes
 // receive scatter/gather lists to point to slots in the first data block of
-// the shared memory databuf.  Returns HASHPIPE_OK on success, other values on
-// error.
+// the shared memory databuf.  When using multiple QPs, the receive WRs of each
+// QP point to the slots of that QP's slot range (see queue_first_slot()).
+// Returns HASHPIPE_OK on success, other values on error.
 static
 int
 hpguppi_ibverbs_init(struct hashpipe_ibv_context * hibv_ctx,
                      hashpipe_status_t * st,
                      hpguppi_input_databuf_t * db)
 {
-  int i, j;
+  int i, j, q;
   struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
   uint32_t num_chunks = pktbuf_info->num_chunks;
   struct hpguppi_pktbuf_chunk * chunks = pktbuf_info->chunks;
   uint64_t base_addr;
+  uint64_t scratch_addr;
+  uint32_t nqp = 1;
 
   memset(hibv_ctx, 0, sizeof(struct hashpipe_ibv_context));
 
@@ -401,19 +551,23 @@ hpguppi_ibverbs_init(struct hashpipe_ibv_context * hibv_ctx,
       hibv_ctx->max_flows = 1;
     }
     hputu4(st->buf, "MAXFLOWS", hibv_ctx->max_flows);
+
+    // IBVNQP got validated by init()
+    hgetu4(st->buf, "IBVNQP", &nqp);
   }
   hashpipe_status_unlock_safe(st);
 
   // General fields
-  hibv_ctx->nqp = 1;
+  hibv_ctx->nqp = nqp;
   hibv_ctx->pkt_size_max = 9*1024; // Not really used with user managed buffers
   hibv_ctx->user_managed_flag = 1;
 
-  // Number of send/recv packets (i.e. number of send/recv WRs)
+  // Number of send/recv packets (i.e. number of send/recv WRs).  The
+  // recv_pkt_num field is per QP so it is limited by the smallest slot range.
   hibv_ctx->send_pkt_num = 1;
   int num_recv_wr = hpguppi_query_max_wr(hibv_ctx->interface_name);
-  if(num_recv_wr > pktbuf_info->slots_per_block) {
-    num_recv_wr = pktbuf_info->slots_per_block;
+  if(num_recv_wr < 0 || num_recv_wr > pktbuf_info->slots_per_block / nqp) {
+    num_recv_wr = pktbuf_info->slots_per_block / nqp;
   }
   hibv_ctx->recv_pkt_num = num_recv_wr;
 
@@ -423,7 +577,7 @@ hpguppi_ibverbs_init(struct hashpipe_ibv_context * hibv_ctx,
     return HASHPIPE_ERR_SYS;
   }
   if(!(hibv_ctx->recv_pkt_buf = (struct hashpipe_ibv_recv_pkt *)calloc(
-      hibv_ctx->recv_pkt_num, sizeof(struct hashpipe_ibv_recv_pkt)))) {
+      hibv_ctx->recv_pkt_num * nqp, sizeof(struct hashpipe_ibv_recv_pkt)))) {
     return HASHPIPE_ERR_SYS;
   }
 
@@ -433,14 +587,14 @@ hpguppi_ibverbs_init(struct hashpipe_ibv_context * hibv_ctx,
     return HASHPIPE_ERR_SYS;
   }
   if(!(hibv_ctx->recv_sge_buf = (struct ibv_sge *)calloc(
-      hibv_ctx->recv_pkt_num * num_chunks, sizeof(struct ibv_sge)))) {
+      hibv_ctx->recv_pkt_num * nqp * num_chunks, sizeof(struct ibv_sge)))) {
     return HASHPIPE_ERR_SYS;
   }
 
   // Specify size of send and recv memory regions.
   // Send memory region is just one packet.  Recv memory region spans all data blocks.
   hibv_ctx->send_mr_size = (size_t)hibv_ctx->send_pkt_num * hibv_ctx->pkt_size_max;
-  hibv_ctx->recv_mr_size = sizeof(db->block);
+  hibv_ctx->recv_mr_size = hpguppi_databuf_blocks_size(db);
 
   // Allocate memory for send_mr_buf
   if(!(hibv_ctx->send_mr_buf = (uint8_t *)calloc(
@@ -448,21 +602,29 @@ hpguppi_ibverbs_init(struct hashpipe_ibv_context * hibv_ctx,
     return HASHPIPE_ERR_SYS;
   }
   // Point recv_mr_buf to starts of block 0
-  hibv_ctx->recv_mr_buf = (uint8_t *)db->block;
+  hibv_ctx->recv_mr_buf = (uint8_t *)hpguppi_databuf_blocks(db);
 
   // Setup send WR's num_sge and SGEs' addr/length fields
   hibv_ctx->send_pkt_buf[0].wr.num_sge = 1;
   hibv_ctx->send_sge_buf[0].addr = (uint64_t)hibv_ctx->send_mr_buf;
   hibv_ctx->send_sge_buf[0].length = hibv_ctx->pkt_size_max;
 
-  // Setup recv WRs' num_sge and SGEs' addr/length fields
-  for(i=0; i<hibv_ctx->recv_pkt_num; i++) {
-    hibv_ctx->recv_pkt_buf[i].wr.num_sge = num_chunks;
-
-    base_addr = (uint64_t)hpguppi_pktbuf_block_slot_ptr(db, 0, i);
-    for(j=0; j<num_chunks; j++) {
-      hibv_ctx->recv_sge_buf[num_chunks*i+j].addr = base_addr + chunks[j].chunk_offset;
-      hibv_ctx->recv_sge_buf[num_chunks*i+j].length = chunks[j].chunk_size;
+  // Setup recv WRs' num_sge and SGEs' addr/length fields.  The WRs of QP q
+  // are recv_pkt_buf[q*recv_pkt_num] through recv_pkt_buf[(q+1)*recv_pkt_num-1]
+  // and initially point to the start of QP q's slot range in block 0.
+  for(q=0; q<nqp; q++) {
+    for(i=q*hibv_ctx->recv_pkt_num; i<(q+1)*hibv_ctx->recv_pkt_num; i++) {
+      hibv_ctx->recv_pkt_buf[i].wr.num_sge = num_chunks;
+
+      // Skipped chunks go to scratch line i
+      scratch_addr = (uint64_t)hpguppi_pktbuf_block_scratch_ptr(db, 0, i);
+      base_addr = (uint64_t)hpguppi_pktbuf_block_slot_ptr(db, 0,
+          queue_first_slot(pktbuf_info, nqp, q) + i - q*hibv_ctx->recv_pkt_num);
+      for(j=0; j<num_chunks; j++) {
+        hibv_ctx->recv_sge_buf[num_chunks*i+j].addr = chunks[j].chunk_offset +
+          (j < pktbuf_info->num_skip_chunks ? scratch_addr : base_addr);
+        hibv_ctx->recv_sge_buf[num_chunks*i+j].length = chunks[j].chunk_size;
+      }
     }
   }
 
@@ -503,7 +665,7 @@ static
 void
 update_status_buffer(hashpipe_status_t *st, int nfull, int nblocks,
     uint64_t nbytes, uint64_t npkts, uint64_t ns_elapsed,
-    int32_t * sniffer_flag)
+    const char * batch_hist, int32_t * sniffer_flag)
 {
   char ibvbufst[80];
   double gbps;
@@ -522,6 +684,7 @@ update_status_buffer(hashpipe_status_t *st, int nfull, int nblocks,
     hputs(st->buf, "IBVBUFST", ibvbufst);
     hputnr8(st->buf, "IBVGBPS", 6, gbps);
     hputnr8(st->buf, "IBVPPS", 3, pps);
+    hputs(st->buf, "IBVBHIST", batch_hist);
     if(*sniffer_flag > -1) {
       hgeti4(st->buf, "IBVSNIFF", sniffer_flag);
     }
@@ -557,6 +720,12 @@ static int init(hashpipe_thread_args_t *args)
 
   // Variables to get/set status buffer fields
   uint32_t max_flows = DEFAULT_MAX_FLOWS;
+  uint32_t nqp = 1;
+  uint32_t num_skip_chunks = 0;
+  uint32_t batch = DEFAULT_POLL_BATCH;
+  uint32_t qwait = DEFAULT_QUEUE_WAIT_MS;
+  char ibvpoll[80];
+  strcpy(ibvpoll, "event");
   char ifname[80] = {0};
   char ibvpktsz[80];
   strcpy(ibvpktsz, "9216"); // 9216 == 9*1024
@@ -575,14 +744,45 @@ static int init(hashpipe_thread_args_t *args)
 
     hgets(st->buf,  "IBVPKTSZ", sizeof(ibvpktsz), ibvpktsz);
     hgetu4(st->buf, "MAXFLOWS", &max_flows);
+    hgetu4(st->buf, "IBVNQP", &nqp);
+    hgetu4(st->buf, "IBVSKIP", &num_skip_chunks);
+    hgets(st->buf,  "IBVPOLL", sizeof(ibvpoll), ibvpoll);
+    hgetu4(st->buf, "IBVBATCH", &batch);
+    hgetu4(st->buf, "IBVQWAIT", &qwait);
 
     if(max_flows == 0) {
       max_flows = 1;
     }
 
+    if(nqp == 0) {
+      nqp = 1;
+    } else if(nqp > MAX_IBV_QUEUES) {
+      hashpipe_warn(args->thread_desc->name,
+          "IBVNQP %u exceeds max, using %u", nqp, MAX_IBV_QUEUES);
+      nqp = MAX_IBV_QUEUES;
+    }
+
+    if(strcmp(ibvpoll, "event") && strcmp(ibvpoll, "busy")) {
+      hashpipe_warn(args->thread_desc->name,
+          "unsupported IBVPOLL '%s', using 'event'", ibvpoll);
+      strcpy(ibvpoll, "event");
+    }
+
+    if(batch == 0) {
+      batch = 1;
+    } else if(batch > MAX_POLL_BATCH) {
+      batch = MAX_POLL_BATCH;
+    }
+
     // Store ibvpktsz in status buffer (in case it was not there before).
     hputs(st->buf, "IBVPKTSZ", ibvpktsz);
+    hputu4(st->buf, "IBVSKIP", num_skip_chunks);
     hputu4(st->buf, "MAXFLOWS", max_flows);
+    hputu4(st->buf, "IBVNQP", nqp);
+    hputs(st->buf, "IBVPOLL", ibvpoll);
+    hputu4(st->buf, "IBVBATCH", batch);
+    hputu4(st->buf, "IBVQWAIT", qwait);
+    hputu8(st->buf, "IBVQSKIP", 0);
 
     // Set status_key to init
     hputs(st->buf, status_key, "init");
@@ -590,7 +790,16 @@ static int init(hashpipe_thread_args_t *args)
   hashpipe_status_unlock_safe(st);
 
   // Parse ibvpktsz
-  if(parse_ibvpktsz(pktbuf_info, ibvpktsz)) {
+  if(hpguppi_parse_ibvpktsz(pktbuf_info, ibvpktsz, num_skip_chunks,
+        hpguppi_databuf_block_data_size(db))) {
+    return HASHPIPE_ERR_PARAM;
+  }
+
+  // Each queue needs at least one slot per block
+  if(pktbuf_info->slots_per_block < nqp) {
+    hashpipe_error(args->thread_desc->name,
+        "IBVNQP %u exceeds slots per block %lu",
+        nqp, pktbuf_info->slots_per_block);
     return HASHPIPE_ERR_PARAM;
   }
 
@@ -598,233 +807,751 @@ static int init(hashpipe_thread_args_t *args)
   return HASHPIPE_OK;
 }
 
+// Structures for sharing the capture across multiple queues.  Each queue has
+// its own hpguppi_ibvpkt_queue structure.  All queues share one
+// hpguppi_ibvpkt_capture structure.
+struct hpguppi_ibvpkt_capture;
+
+struct hpguppi_ibvpkt_queue {
+  struct hpguppi_ibvpkt_capture * cap;
+  // Queue (i.e. QP) number
+  uint32_t q;
+  // This queue's slot range is first_slot to end_slot-1
+  uint32_t first_slot;
+  uint32_t end_slot;
+  // Older of this queue's two active blocks (see capture_queue()).  Protected
+  // by cap->lock.
+  uint64_t curblk;
+  // Running totals of packets/bytes received.  Only written by the queue's
+  // capture thread.
+  uint64_t pkts_received;
+  uint64_t bytes_received;
+  // Running histogram of batch sizes.  Only written by the queue's capture
+  // thread.
+  uint64_t batch_hist[BATCH_HIST_BINS];
+  // CPU for the queue's capture thread (-1 means inherit)
+  int cpu;
+  pthread_t thread;
+};
+
+struct hpguppi_ibvpkt_capture {
+  hpguppi_input_databuf_t * db;
+  hashpipe_status_t * st;
+  struct hashpipe_ibv_context * hibv_ctx;
+  const char * thread_name;
+  const char * status_key;
+  uint32_t nqp;
+  // Non-zero to busy poll each queue's completion queue
+  int busy_poll;
+  // Max number of work completions to handle per poll
+  uint32_t batch;
+  // Min number of handled WRs to repost at once when busy polling
+  uint32_t repost_batch;
+  // Milliseconds to wait for slower queues before leaving them behind (0
+  // means wait forever)
+  uint32_t wait_ms;
+  // Number of blocks marked filled so far.  Protected by lock, but may be
+  // read atomically without it.
+  uint64_t nfilled;
+  // Number of blocks marked filled before all queues were done with them.
+  // Protected by lock.
+  uint64_t nskipped;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Non-zero when all queues should stop capturing
+  int stop;
+  // Periodic status buffer update state (only used by queue 0)
+  struct timespec ts_start;
+  uint64_t last_pkts;
+  uint64_t last_bytes;
+  uint64_t last_batch_hist[BATCH_HIST_BINS];
+  // See run() for details
+  struct ibv_flow * sniffer_flow;
+  int32_t sniffer_flag;
+  struct hpguppi_ibvpkt_queue queues[MAX_IBV_QUEUES];
+};
+
+// Tells all queues to stop capturing and wakes any that are waiting on the
+// other queues.
 static
-void *
-run(hashpipe_thread_args_t * args)
+void
+stop_capture(struct hpguppi_ibvpkt_capture * cap)
 {
-#if 0
-int debug_i=0, debug_j=0;
-#endif
-  // Local aliases to shorten access to args fields
-  // Our output buffer happens to be a hpguppi_input_databuf
-  hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->obuf;
-  hashpipe_status_t * st = &args->st;
-  const char * thread_name = args->thread_desc->name;
-  const char * status_key = args->thread_desc->skey;
+  pthread_mutex_lock(&cap->lock);
+  __atomic_store_n(&cap->stop, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&cap->cond);
+  pthread_mutex_unlock(&cap->lock);
+}
 
-  // pktbuf_info related variables
-  struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
-  uint32_t num_chunks = pktbuf_info->num_chunks;
-  struct hpguppi_pktbuf_chunk * chunks = pktbuf_info->chunks;
-  size_t slots_per_block = pktbuf_info->slots_per_block;
+// Called with cap->lock held by a queue that may have been left behind by the
+// other queues (i.e. whose curblk is less than cap->nfilled, see
+// advance_queue()).  If so, moves the queue to the oldest block not yet marked
+// filled by setting its curblk, *next_block, and *next_slot accordingly.  That
+// block and the one after it are already in use by the other queues, so there
+// is no need to wait for them to be free.  Returns non-zero if the queue was
+// moved.
+static
+int
+rejoin_queue_locked(struct hpguppi_ibvpkt_queue * queue,
+    uint64_t * next_block, uint32_t * next_slot)
+{
+  struct hpguppi_ibvpkt_capture * cap = queue->cap;
 
-  // The all important hashpipe_ibv_context
-  struct hashpipe_ibv_context * hibv_ctx = hashpipe_ibv_context_ptr(db);
+  if(queue->curblk >= cap->nfilled) {
+    return 0;
+  }
 
-  // Variables for handing received packets
-  struct hashpipe_ibv_recv_pkt * hibv_rpkt = NULL;
-  struct hashpipe_ibv_recv_pkt * curr_rpkt;
+  hashpipe_warn(cap->thread_name,
+      "queue %u rejoining at block %lu after being left behind at block %lu",
+      queue->q, cap->nfilled, queue->curblk);
 
-  // Misc counters, etc
-  int i;
-  uint64_t base_addr;
-  int got_wc_error = 0;
-
-  // We maintain two active blocks at all times.  curblk is the number of the
-  // older of the two blocks with block number curblk+1 being the other of the
-  // two active blocks.  Work requests are first posted with slot locations in
-  // curblk as the destination.  Enough WRs are posted to cover up to the
-  // entire first block or as many WRs as the NIC can have outstanding at ones,
-  // whichever is less.  When packets are received, their WRs' SGEs are updated
-  // to point to the next free slot, which could be in the same block or the
-  // next block higher (with wrapping).  If any of these new SGEs point to a
-  // block that is greater than curblk+1, then block curblk is marked filled
-  // and curblk is incremented.  This continues indefinitely.
-  uint64_t curblk = 0;
+  queue->curblk = cap->nfilled;
+  *next_block = cap->nfilled;
+  *next_slot = queue->first_slot;
 
-  // Used to track next block/slot to be assigned to a work request.
-  // next_slot is always within the range 0 to slots_per_block-1, but
-  // next_block is allowed to grow "forever".
-  uint64_t next_block = 0;
-  uint32_t next_slot = 0;
+  return 1;
+}
 
-  // This ibv_flow pointer is used to support a diagnostic "sniffer" mode.
-  // This is enabled by setting IBVSNIFF=1 in the status buffer.
-  // Use with caution!!!
-  struct ibv_flow * sniffer_flow = NULL;
-  // sniffer_flag <0 disabled completely, 0 enabled but off, >0 enabled and on
-  // The disabled completely state is to completely avoid the sniffer if an
-  // error in encountered with it.  We also disable it completely unless
-  // IBVSNIFF>-1 in the status buffer at startup.
-  int32_t sniffer_flag = -1;
+// Called by a queue when it is about to post a WR for a block beyond its
+// curblk+1.  Increments the queue's curblk and marks as filled all blocks that
+// every queue has now advanced past.  Then waits for the databuf block to be
+// used for the queue's new curblk+1 to be released by the queue(s) still using
+// it for an earlier block, marked filled, and freed by downstream threads.
+// With only one queue this is the same as marking curblk filled and waiting
+// for curblk+1 to be free.  If the slower queue(s) still hold up the queue
+// after cap->wait_ms milliseconds, the blocks it needs are marked filled
+// anyway and the slower queues are left behind (and ignored from then on until
+// they rejoin).  If the queue itself has been left behind, it rejoins the
+// others via rejoin_queue_locked() instead of advancing, which updates
+// *next_block and *next_slot.  Returns 0 on success or -1 if the capture is
+// stopping.
+static
+int
+advance_queue(struct hpguppi_ibvpkt_queue * queue,
+    uint64_t * next_block, uint32_t * next_slot)
+{
+  struct hpguppi_ibvpkt_capture * cap = queue->cap;
+  hpguppi_input_databuf_t * db = cap->db;
+  uint64_t n_block = db->header.n_block;
+  uint64_t minblk;
+  uint64_t nskip = 0;
+  uint64_t nskipped = 0;
+  struct timespec ts_abs;
+  struct timespec ts_wait;
+  struct timespec ts_now;
+  int waiting = 0;
+  uint32_t q;
+  int rv = 0;
 
-  // Wait until the first two blocks are marked as free
-  // (should already be free)
-  for(i=0; i<2; i++) {
-    wait_for_block_free(db, (curblk+i) % N_INPUT_BLOCKS, st, status_key);
+  pthread_mutex_lock(&cap->lock);
+  {
+    if(rejoin_queue_locked(queue, next_block, next_slot)) {
+      pthread_mutex_unlock(&cap->lock);
+      return 0;
+    }
+
+    queue->curblk++;
+
+    // Find the block that the slowest queue is still using, ignoring queues
+    // that have been left behind
+    minblk = queue->curblk;
+    for(q=0; q<cap->nqp; q++) {
+      if(cap->queues[q].curblk >= cap->nfilled
+      && cap->queues[q].curblk < minblk) {
+        minblk = cap->queues[q].curblk;
+      }
+    }
+
+    // Mark filled all blocks before minblk
+    if(cap->nfilled < minblk) {
+      while(cap->nfilled < minblk) {
+        hpguppi_input_databuf_set_filled(db, cap->nfilled % n_block);
+        __atomic_store_n(&cap->nfilled, cap->nfilled + 1, __ATOMIC_RELEASE);
+      }
+      pthread_cond_broadcast(&cap->cond);
+    }
+
+    // Block curblk+1 uses the same databuf block as block curblk+1-n_block,
+    // which must be marked filled before we can wait for it to be free.
+    while(queue->curblk + 1 >= cap->nfilled + n_block) {
+      if(!run_threads() || __atomic_load_n(&cap->stop, __ATOMIC_RELAXED)) {
+        rv = -1;
+        break;
+      }
+
+      // Leave the slower queue(s) behind if they have held us up too long
+      if(cap->wait_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ts_now);
+        if(!waiting) {
+          ts_wait = ts_now;
+          waiting = 1;
+        } else if(ELAPSED_NS(ts_wait, ts_now)
+            >= (int64_t)cap->wait_ms*1000*1000) {
+          while(queue->curblk + 1 >= cap->nfilled + n_block) {
+            hpguppi_input_databuf_set_filled(db, cap->nfilled % n_block);
+            __atomic_store_n(&cap->nfilled, cap->nfilled + 1,
+                __ATOMIC_RELEASE);
+            nskip++;
+          }
+          cap->nskipped += nskip;
+          nskipped = cap->nskipped;
+          pthread_cond_broadcast(&cap->cond);
+          break;
+        }
+      }
+
+      clock_gettime(CLOCK_REALTIME, &ts_abs);
+      ts_abs.tv_nsec += 50*1000*1000; // 50 ms
+      if(ts_abs.tv_nsec >= 1000*1000*1000) {
+        ts_abs.tv_sec++;
+        ts_abs.tv_nsec -= 1000*1000*1000;
+      }
+      pthread_cond_timedwait(&cap->cond, &cap->lock, &ts_abs);
+    }
   }
+  pthread_mutex_unlock(&cap->lock);
 
-  // Initialize IBV
-  if(hpguppi_ibverbs_init(hibv_ctx, st, db)) {
-    hashpipe_error(thread_name, "hpguppi_ibverbs_init failed");
-    return NULL;
+  if(nskip > 0) {
+    hashpipe_warn(cap->thread_name,
+        "queue %u left slower queue(s) behind after %u ms "
+        "(%lu blocks marked filled early)", queue->q, cap->wait_ms, nskip);
+    hashpipe_status_lock_safe(cap->st);
+    {
+      hputu8(cap->st->buf, "IBVQSKIP", nskipped);
+    }
+    hashpipe_status_unlock_safe(cap->st);
   }
 
-  // Initialize next slot
-  next_slot = hibv_ctx->recv_pkt_num + 1;
-  if(next_slot > pktbuf_info->slots_per_block) {
-    next_slot = 0;
-    next_block++;
+  if(rv == 0) {
+    // Only queue 0 reports waiting in the status buffer
+    wait_for_block_free(db, (queue->curblk+1) % n_block,
+        cap->st, queue->q == 0 ? cap->status_key : NULL);
   }
 
-  // Variables for counting packets and bytes as well as elapsed time
-  uint64_t bytes_received = 0;
-  uint64_t pkts_received = 0;
-  struct timespec ts_start;
+  return rv;
+}
+
+// Polls queue q's completion queue for up to num_wc work completions and
+// returns them as a linked list of hashpipe_ibv_recv_pkt structures just like
+// hashpipe_ibv_recv_pkts() does for all queues.  Returns NULL if there are no
+// work completions or on error.
+static
+struct hashpipe_ibv_recv_pkt *
+poll_queue(struct hashpipe_ibv_context * hibv_ctx, uint32_t q,
+    struct ibv_wc * wc, int num_wc)
+{
+  int i, n;
+  struct hashpipe_ibv_recv_pkt * recv_pkt;
+  struct hashpipe_ibv_recv_pkt * next_pkt = NULL;
+
+  n = ibv_poll_cq(hibv_ctx->recv_cq[q], num_wc, wc);
+  if(n < 0) {
+    hashpipe_error(__FUNCTION__, "ibv_poll_cq error on queue %u", q);
+    errno = 0;
+  }
+
+  // Link WRs in completion order (i.e. build list from the end)
+  for(i=n-1; i>=0; i--) {
+    recv_pkt = &hibv_ctx->recv_pkt_buf[wc[i].wr_id];
+    recv_pkt->length = wc[i].status == IBV_WC_SUCCESS ? wc[i].byte_len : 0;
+    recv_pkt->wr.next = (struct ibv_recv_wr *)next_pkt;
+    next_pkt = recv_pkt;
+  }
+
+  return next_pkt;
+}
+
+// Performs the periodic status buffer update (and sniffer flow management)
+// if PERIODIC_STATUS_BUFFER_UPDATE_MS have elapsed since the previous one.
+// Packet and byte rates are summed over all queues.  This is only called by
+// queue 0.
+static
+void
+periodic_update(struct hpguppi_ibvpkt_capture * cap)
+{
   struct timespec ts_now;
   uint64_t ns_elapsed;
+  uint64_t pkts = 0;
+  uint64_t bytes = 0;
+  uint64_t nbatch;
+  char batch_hist[80];
+  int len = 0;
+  uint32_t q;
+  int i;
 
-  // Update status_key with running state
-  hashpipe_status_lock_safe(st);
-  {
-    hgeti4(st->buf, "IBVSNIFF", &sniffer_flag);
-    hputs(st->buf, status_key, "running");
+  // Check for periodic status buffer update interval
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts_now);
+  ns_elapsed = ELAPSED_NS(cap->ts_start, ts_now);
+  if(ns_elapsed < PERIODIC_STATUS_BUFFER_UPDATE_MS*1000*1000) {
+    return;
   }
-  hashpipe_status_unlock_safe(st);
 
-  if(sniffer_flag > 0) {
-    if(!(sniffer_flow = create_sniffer_flow(hibv_ctx))) {
-      hashpipe_error(thread_name, "create_sniffer_flow failed");
-      errno = 0;
-      sniffer_flag = -1;
-    } else {
-      hashpipe_info(thread_name, "create_sniffer_flow succeeded");
+  // Save now as the new start
+  cap->ts_start = ts_now;
+
+  for(q=0; q<cap->nqp; q++) {
+    pkts += __atomic_load_n(&cap->queues[q].pkts_received, __ATOMIC_RELAXED);
+    bytes += __atomic_load_n(&cap->queues[q].bytes_received, __ATOMIC_RELAXED);
+  }
+
+  // Make IBVBHIST string
+  for(i=0; i<BATCH_HIST_BINS; i++) {
+    nbatch = 0;
+    for(q=0; q<cap->nqp; q++) {
+      nbatch += __atomic_load_n(&cap->queues[q].batch_hist[i], __ATOMIC_RELAXED);
     }
-  } else {
-    hashpipe_info(thread_name, "sniffer_flow disabled");
+    len += snprintf(batch_hist+len, sizeof(batch_hist)-len, "%s%lu",
+        i ? "," : "", nbatch - cap->last_batch_hist[i]);
+    if(len >= sizeof(batch_hist)) {
+      break;
+    }
+    cap->last_batch_hist[i] = nbatch;
   }
 
-  // Initialize ts_start with current time
-  clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+  // Timeout, update status buffer
+  update_status_buffer(cap->st, hpguppi_input_databuf_total_status(cap->db),
+      cap->db->header.n_block, bytes - cap->last_bytes, pkts - cap->last_pkts,
+      ns_elapsed, batch_hist, &cap->sniffer_flag);
 
-  // Main loop
-  while (run_threads()) {
-    hibv_rpkt = hashpipe_ibv_recv_pkts(hibv_ctx, 50); // 50 ms timeout
+  // Save totals for next time
+  cap->last_pkts = pkts;
+  cap->last_bytes = bytes;
 
-    // If no packets and errno is non-zero
-    if(!hibv_rpkt && errno) {
-      // Print error, reset errno, and continue receiving
-      hashpipe_error(thread_name, "hashpipe_ibv_recv_pkts");
+  // Manage sniffer_flow as needed
+  if(cap->sniffer_flag > 0 && !cap->sniffer_flow) {
+    if(!(cap->sniffer_flow = create_sniffer_flow(cap->hibv_ctx))) {
+      hashpipe_error(cap->thread_name, "create_sniffer_flow failed");
       errno = 0;
-      continue;
+      cap->sniffer_flag = -1;
+    } else {
+      hashpipe_info(cap->thread_name, "create_sniffer_flow succeeded");
     }
+  } else if (cap->sniffer_flag < 1 && cap->sniffer_flow) {
+    if(destroy_sniffer_flow(cap->sniffer_flow)) {
+      hashpipe_error(cap->thread_name, "destroy_sniffer_flow failed");
+      errno = 0;
+      cap->sniffer_flag = -1;
+    } else {
+      hashpipe_info(cap->thread_name, "destroy_sniffer_flow succeeded");
+    }
+    cap->sniffer_flow = NULL;
+  }
+}
+
+// Capture loop for one queue.  Queue 0 runs in the hashpipe thread itself and
+// also handles the periodic status buffer updates.  The other queues run in
+// their own threads.
+//
+// Each queue maintains two active blocks at all times.  curblk is the number
+// of the older of the two blocks with block number curblk+1 being the other of
+// the two active blocks.  Work requests are first posted with slot locations
+// in the queue's slot range of block 0 as the destination.  Enough WRs are
+// posted to cover up to the entire slot range or as many WRs as the NIC can
+// have outstanding at once, whichever is less.  When packets are received,
+// their WRs' SGEs are updated to point to the next free slot in the queue's
+// slot range, which could be in the same block or the next block higher (with
+// wrapping).  If any of these new SGEs point to a block that is greater than
+// curblk+1, then the queue advances (see advance_queue()).  This continues
+// indefinitely.
+static
+void *
+capture_queue(void * arg)
+{
+  struct hpguppi_ibvpkt_queue * queue = (struct hpguppi_ibvpkt_queue *)arg;
+  struct hpguppi_ibvpkt_capture * cap = queue->cap;
+  hpguppi_input_databuf_t * db = cap->db;
+  struct hashpipe_ibv_context * hibv_ctx = cap->hibv_ctx;
+
+  // pktbuf_info related variables
+  struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
+  uint32_t num_chunks = pktbuf_info->num_chunks;
+  uint32_t num_skip_chunks = pktbuf_info->num_skip_chunks;
+  struct hpguppi_pktbuf_chunk * chunks = pktbuf_info->chunks;
 
-    // Check for periodic status buffer update interval
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_now);
-    ns_elapsed = ELAPSED_NS(ts_start, ts_now);
-    if(ns_elapsed >= PERIODIC_STATUS_BUFFER_UPDATE_MS*1000*1000) {
-      // Save now as the new start
-      ts_start = ts_now;
+  // Variables for handing received packets
+  struct hashpipe_ibv_recv_pkt * hibv_rpkt = NULL;
+  struct hashpipe_ibv_recv_pkt * curr_rpkt;
+  struct hashpipe_ibv_recv_pkt * last_rpkt = NULL;
+  struct ibv_recv_wr * bad_wr;
+  struct ibv_wc wc[MAX_POLL_BATCH];
+
+  // Handled WRs waiting to be reposted
+  struct hashpipe_ibv_recv_pkt * repost_head = NULL;
+  struct hashpipe_ibv_recv_pkt * repost_tail = NULL;
+  uint32_t nrepost = 0;
+  struct timespec ts_idle = {
+    .tv_sec  = 0,
+    .tv_nsec = QUEUE_IDLE_NS
+  };
 
-      // Timeout, update status buffer
-      update_status_buffer(st, hpguppi_input_databuf_total_status(db),
-          db->header.n_block, bytes_received, pkts_received, ns_elapsed,
-          &sniffer_flag);
+  // Misc counters, etc
+  int i;
+  uint64_t base_addr;
+  uint64_t npkts;
+  uint64_t nbytes;
+  uint32_t npolls = 0;
+  int stopping = 0;
 
-      // Reset counters
-      bytes_received = 0;
-      pkts_received = 0;
+  // Use hashpipe_ibv_recv_pkts() and hashpipe_ibv_release_pkts() for a
+  // single event driven queue, otherwise poll/post just our own queue.
+  int own_queue = cap->nqp > 1 || cap->busy_poll;
 
-      // Manage sniffer_flow as needed
-      if(sniffer_flag > 0 && !sniffer_flow) {
-        if(!(sniffer_flow = create_sniffer_flow(hibv_ctx))) {
-          hashpipe_error(thread_name, "create_sniffer_flow failed");
-          errno = 0;
-          sniffer_flag = -1;
-        } else {
-          hashpipe_info(thread_name, "create_sniffer_flow succeeded");
-        }
-      } else if (sniffer_flag < 1 && sniffer_flow) {
-        if(destroy_sniffer_flow(sniffer_flow)) {
-          hashpipe_error(thread_name, "destroy_sniffer_flow failed");
-          errno = 0;
-          sniffer_flag = -1;
-        } else {
-          hashpipe_info(thread_name, "destroy_sniffer_flow succeeded");
-        }
-        sniffer_flow = NULL;
+  // Used to track next block/slot to be assigned to a work request.
+  // next_slot is always within the queue's slot range, but next_block is
+  // allowed to grow "forever".  The first recv_pkt_num slots of the range
+  // were assigned by hpguppi_ibverbs_init().
+  uint64_t next_block = 0;
+  uint32_t next_slot = queue->first_slot + hibv_ctx->recv_pkt_num;
+  if(next_slot >= queue->end_slot) {
+    next_slot = queue->first_slot;
+    next_block++;
+  }
+
+  // Main loop
+  while (run_threads() && !__atomic_load_n(&cap->stop, __ATOMIC_RELAXED)) {
+    if(!own_queue) {
+      hibv_rpkt = hashpipe_ibv_recv_pkts(hibv_ctx, 50); // 50 ms timeout
+
+      // If no packets and errno is non-zero
+      if(!hibv_rpkt && errno) {
+        // Print error, reset errno, and continue receiving
+        hashpipe_error(cap->thread_name, "hashpipe_ibv_recv_pkts");
+        errno = 0;
+        continue;
       }
-    } // end periodic status buffer update
+    } else {
+      // hashpipe_ibv_recv_pkts() polls all queues so poll just our own
+      hibv_rpkt = poll_queue(hibv_ctx, queue->q, wc, cap->batch);
+    }
+
+    // When busy polling, only check the time every so often
+    if(queue->q == 0
+    && (!cap->busy_poll || ++npolls % BUSY_POLLS_PER_TIME_CHECK == 0)) {
+      periodic_update(cap);
+    }
 
     // If no packets
     if(!hibv_rpkt) {
+      // Repost any pending WRs now that we have time
+      if(nrepost > 0) {
+        if(ibv_post_recv(hibv_ctx->qp[queue->q], &repost_head->wr, &bad_wr)) {
+          hashpipe_error(cap->thread_name, "ibv_post_recv error on queue %u",
+              queue->q);
+          errno = 0;
+        }
+        repost_head = NULL;
+        repost_tail = NULL;
+        nrepost = 0;
+      }
       // Wait for more packets
+      if(own_queue && !cap->busy_poll) {
+        nanosleep(&ts_idle, NULL);
+      }
       continue;
     }
 
     // Got packets!
+    npkts = 0;
+    nbytes = 0;
+
+    // If the other queues have left this queue behind, rejoin them before
+    // storing packets into blocks that they have already marked filled
+    if(queue->curblk < __atomic_load_n(&cap->nfilled, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&cap->lock);
+      rejoin_queue_locked(queue, &next_block, &next_slot);
+      pthread_mutex_unlock(&cap->lock);
+    }
 
     // For each packet: update SGE addr
     for(curr_rpkt = hibv_rpkt; curr_rpkt;
         curr_rpkt = (struct hashpipe_ibv_recv_pkt *)curr_rpkt->wr.next) {
 
       if(curr_rpkt->length == 0) {
-        hashpipe_error(thread_name,
+        hashpipe_error(cap->thread_name,
             "WR %d got error when using address: %p (databuf %p +%lu)",
             curr_rpkt->wr.wr_id,
             curr_rpkt->wr.sg_list->addr,
-            db->block, sizeof(db->block));
+            hpguppi_databuf_blocks(db), hpguppi_databuf_blocks_size(db));
         // Set flag to break out of main loop and then break out of for loop
-        got_wc_error = 1;
+        stopping = 1;
         break;
       }
 
       // If time to advance the ring buffer block
-      if(next_block > curblk+1) {
-        // Mark curblk as filled
-        hpguppi_input_databuf_set_filled(db, curblk % N_INPUT_BLOCKS);
-
-        // Increment curblk
-        curblk++;
-
-        // Wait for curblk+1 to be free
-        wait_for_block_free(db, (curblk+1) % N_INPUT_BLOCKS, st, status_key);
+      if(next_block > queue->curblk+1) {
+        if(advance_queue(queue, &next_block, &next_slot)) {
+          stopping = 1;
+          break;
+        }
       } // end block advance
 
       // Count packet and bytes
-      pkts_received++;
-      bytes_received += curr_rpkt->length;
-
-      // Update current WR with new destination addresses for all SGEs
+      npkts++;
+      nbytes += curr_rpkt->length;
+      last_rpkt = curr_rpkt;
+
+      // Update current WR with new destination addresses for all SGEs.
+      // Skipped chunks go to the WR's scratch line in the same block.
+      if(num_skip_chunks > 0) {
+        base_addr = (uint64_t)hpguppi_pktbuf_block_scratch_ptr(db, next_block,
+            curr_rpkt->wr.wr_id);
+        for(i=0; i<num_skip_chunks; i++) {
+          curr_rpkt->wr.sg_list[i].addr = base_addr + chunks[i].chunk_offset;
+        }
+      }
       base_addr = (uint64_t)hpguppi_pktbuf_block_slot_ptr(db, next_block, next_slot);
-      for(i=0; i<num_chunks; i++) {
+      for(i=num_skip_chunks; i<num_chunks; i++) {
         curr_rpkt->wr.sg_list[i].addr = base_addr + chunks[i].chunk_offset;
       }
 
       // Advance slot
       next_slot++;
-      if(next_slot >= slots_per_block) {
-        next_slot = 0;
+      if(next_slot >= queue->end_slot) {
+        next_slot = queue->first_slot;
         next_block++;
       }
     } // end for each packet
 
-    // Break out of main loop if we got a work completion error
-    if(got_wc_error) {
+    // Publish counts for periodic_update()
+    __atomic_store_n(&queue->pkts_received,
+        queue->pkts_received + npkts, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->bytes_received,
+        queue->bytes_received + nbytes, __ATOMIC_RELAXED);
+    if(npkts > 0) {
+      i = 31 - __builtin_clz((uint32_t)npkts);
+      if(i >= BATCH_HIST_BINS) {
+        i = BATCH_HIST_BINS - 1;
+      }
+      __atomic_store_n(&queue->batch_hist[i],
+          queue->batch_hist[i] + 1, __ATOMIC_RELAXED);
+    }
+
+    // Break out of main loop if we got a work completion error or the capture
+    // is stopping
+    if(stopping) {
       break;
     }
 
-    // Release packets (i.e. repost work requests)
-    if(hashpipe_ibv_release_pkts(hibv_ctx,
-          (struct hashpipe_ibv_recv_pkt *)hibv_rpkt)) {
-      hashpipe_error(thread_name, "hashpipe_ibv_release_pkts");
-      errno = 0;
+    // Release packets (i.e. repost work requests).  When polling our own
+    // queue, handled WRs are appended to the repost list and reposted in bulk
+    // once repost_batch of them have accumulated (or when idle).
+    if(!own_queue) {
+      if(hashpipe_ibv_release_pkts(hibv_ctx,
+            (struct hashpipe_ibv_recv_pkt *)hibv_rpkt)) {
+        hashpipe_error(cap->thread_name, "hashpipe_ibv_release_pkts");
+        errno = 0;
+      }
+    } else {
+      if(repost_tail) {
+        repost_tail->wr.next = &hibv_rpkt->wr;
+      } else {
+        repost_head = hibv_rpkt;
+      }
+      repost_tail = last_rpkt;
+      nrepost += npkts;
+
+      if(nrepost >= cap->repost_batch) {
+        if(ibv_post_recv(hibv_ctx->qp[queue->q], &repost_head->wr, &bad_wr)) {
+          hashpipe_error(cap->thread_name, "ibv_post_recv error on queue %u",
+              queue->q);
+          errno = 0;
+        }
+        repost_head = NULL;
+        repost_tail = NULL;
+        nrepost = 0;
+      }
     }
 
     // Will exit if thread has been cancelled
     pthread_testcancel();
   } // end main loop
 
+  // Make sure the other queues stop too
+  stop_capture(cap);
+
+  return NULL;
+}
+
+// Parses the IBVCPUS string (i.e. the value of the IBVCPUS status buffer
+// keyword) into the cpu fields of queues 1 through nqp-1.  Queues for which
+// no CPU is given keep a cpu value of -1.
+static
+void
+parse_ibvcpus(struct hpguppi_ibvpkt_capture * cap, const char * ibvcpus)
+{
+  uint32_t q;
+  char * p = (char *)ibvcpus;
+
+  for(q=1; q<cap->nqp && *p; q++) {
+    cap->queues[q].cpu = strtol(p, &p, 0);
+    if(*p == ',') {
+      p++;
+    } else {
+      break;
+    }
+  }
+}
+
+static
+void *
+run(hashpipe_thread_args_t * args)
+{
+  // Local aliases to shorten access to args fields
+  // Our output buffer happens to be a hpguppi_input_databuf
+  hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->obuf;
+  hashpipe_status_t * st = &args->st;
+  const char * thread_name = args->thread_desc->name;
+  const char * status_key = args->thread_desc->skey;
+
+  // pktbuf_info related variables
+  struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
+
+  // The all important hashpipe_ibv_context
+  struct hashpipe_ibv_context * hibv_ctx = hashpipe_ibv_context_ptr(db);
+
+  // State shared by all queues
+  struct hpguppi_ibvpkt_capture cap;
+
+  // Misc variables
+  uint32_t q;
+  uint32_t nthreads;
+  int rv;
+  char ibvcpus[80] = {0};
+  char ibvpoll[80] = {0};
+  cpu_set_t cpuset;
+  pthread_attr_t attr;
+
+  // Wait until the first two blocks are marked as free
+  // (should already be free)
+  for(q=0; q<2; q++) {
+    wait_for_block_free(db, q % db->header.n_block, st, status_key);
+  }
+
+  // Initialize IBV
+  if(hpguppi_ibverbs_init(hibv_ctx, st, db)) {
+    hashpipe_error(thread_name, "hpguppi_ibverbs_init failed");
+    return NULL;
+  }
+
+  // Initialize capture state
+  memset(&cap, 0, sizeof(cap));
+  cap.db = db;
+  cap.st = st;
+  cap.hibv_ctx = hibv_ctx;
+  cap.thread_name = thread_name;
+  cap.status_key = status_key;
+  cap.nqp = hibv_ctx->nqp;
+  cap.batch = DEFAULT_POLL_BATCH;
+  cap.wait_ms = DEFAULT_QUEUE_WAIT_MS;
+  pthread_mutex_init(&cap.lock, NULL);
+  pthread_cond_init(&cap.cond, NULL);
+  for(q=0; q<cap.nqp; q++) {
+    cap.queues[q].cap = &cap;
+    cap.queues[q].q = q;
+    cap.queues[q].first_slot = queue_first_slot(pktbuf_info, cap.nqp, q);
+    cap.queues[q].end_slot = queue_first_slot(pktbuf_info, cap.nqp, q+1);
+    cap.queues[q].cpu = -1;
+  }
+
+  // This ibv_flow pointer is used to support a diagnostic "sniffer" mode.
+  // This is enabled by setting IBVSNIFF=1 in the status buffer.
+  // Use with caution!!!
+  cap.sniffer_flow = NULL;
+  // sniffer_flag <0 disabled completely, 0 enabled but off, >0 enabled and on
+  // The disabled completely state is to completely avoid the sniffer if an
+  // error in encountered with it.  We also disable it completely unless
+  // IBVSNIFF>-1 in the status buffer at startup.
+  cap.sniffer_flag = -1;
+
+  // Report NUMA placement and warn if this thread is not local to the NIC
+  int nic_node = hpguppi_numa_node_of_interface(hibv_ctx->interface_name);
+  int thread_node = hpguppi_numa_node_of_thread();
+  if(nic_node >= 0 && thread_node >= 0 && nic_node != thread_node) {
+    hashpipe_warn(thread_name,
+        "running on NUMA node %d but %s is on NUMA node %d",
+        thread_node, hibv_ctx->interface_name, nic_node);
+  }
+
+  // Update status_key with running state
+  hashpipe_status_lock_safe(st);
+  {
+    hgeti4(st->buf, "IBVSNIFF", &cap.sniffer_flag);
+    hgets(st->buf, "IBVCPUS", sizeof(ibvcpus), ibvcpus);
+    hgets(st->buf, "IBVPOLL", sizeof(ibvpoll), ibvpoll);
+    hgetu4(st->buf, "IBVBATCH", &cap.batch);
+    hgetu4(st->buf, "IBVQWAIT", &cap.wait_ms);
+    hputi4(st->buf, "IBVNUMA", thread_node);
+    hputi4(st->buf, "NICNUMA", nic_node);
+    hputs(st->buf, status_key, "running");
+  }
+  hashpipe_status_unlock_safe(st);
+
+  // Setup polling mode (IBVPOLL and IBVBATCH got validated by init()).  Don't
+  // let unposted WRs pile up to more than a quarter of each queue's WRs.
+  cap.busy_poll = !strcmp(ibvpoll, "busy");
+  if(cap.batch == 0 || cap.batch > MAX_POLL_BATCH) {
+    cap.batch = DEFAULT_POLL_BATCH;
+  }
+  cap.repost_batch = cap.batch;
+  if(cap.repost_batch > hibv_ctx->recv_pkt_num / 4) {
+    cap.repost_batch = hibv_ctx->recv_pkt_num / 4;
+  }
+  if(cap.repost_batch == 0) {
+    cap.repost_batch = 1;
+  }
+
+  if(cap.sniffer_flag > 0) {
+    if(!(cap.sniffer_flow = create_sniffer_flow(hibv_ctx))) {
+      hashpipe_error(thread_name, "create_sniffer_flow failed");
+      errno = 0;
+      cap.sniffer_flag = -1;
+    } else {
+      hashpipe_info(thread_name, "create_sniffer_flow succeeded");
+    }
+  } else {
+    hashpipe_info(thread_name, "sniffer_flow disabled");
+  }
+
+  // Initialize ts_start with current time
+  clock_gettime(CLOCK_MONOTONIC_RAW, &cap.ts_start);
+
+  // Start capture threads for queues 1 through nqp-1
+  parse_ibvcpus(&cap, ibvcpus);
+  for(nthreads=1; nthreads<cap.nqp; nthreads++) {
+    q = nthreads;
+    pthread_attr_init(&attr);
+    if(cap.queues[q].cpu >= 0) {
+      CPU_ZERO(&cpuset);
+      CPU_SET(cap.queues[q].cpu, &cpuset);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+    rv = pthread_create(&cap.queues[q].thread, &attr,
+        capture_queue, &cap.queues[q]);
+    pthread_attr_destroy(&attr);
+    if(rv) {
+      hashpipe_error(thread_name,
+          "error creating capture thread for queue %u", q);
+      errno = 0;
+      // Stop the queues that were started
+      stop_capture(&cap);
+      break;
+    }
+  }
+
+  if(cap.nqp > 1 || cap.busy_poll) {
+    hashpipe_info(thread_name, "capturing using %u %s queue%s (batch %u)",
+        cap.nqp, cap.busy_poll ? "busy polled" : "polled",
+        cap.nqp > 1 ? "s" : "", cap.batch);
+  }
+
+  // Run queue 0 in this thread
+  capture_queue(&cap.queues[0]);
+
+  // Wait for other queues to finish
+  for(q=1; q<nthreads; q++) {
+    pthread_join(cap.queues[q].thread, NULL);
+  }
+
   // Update status_key with exiting state
   hashpipe_status_lock_safe(st);
   {
@@ -16,6 +16,9 @@
 // Maximum number of chunks supported
 #define MAX_CHUNKS (8)
 
+// Number of scratch lines per block for skipped chunks (see below)
+#define PKTBUF_SCRATCH_LINES (64)
+
 // Structure that holds info about a "chunk".  A chunk is part of a packet that
 // is stored at a PKT_ALIGNMENT_SIZE aligned address.  The chunk_size is the
 // number of bytes from the packet that are stored in the chunk.  The
@@ -37,11 +40,25 @@ struct hpguppi_pktbuf_chunk {
 // equals the sum of the chunk_aligned_sizes.  slots_per_block is the number of
 // slots in a data block.  Note that slot_size * slots_per_block may be less
 // than the size of data block by up PKT_ALIGNMENT_SIZE-1 bytes.
+//
+// The first num_skip_chunks chunks (e.g. the Ethernet/IP/UDP headers) can be
+// skipped, in which case they are not stored in the slots.  The slot_size and
+// the chunk_offsets of the remaining chunks then only account for the
+// remaining chunks, so the first non-skipped chunk is at the start of the slot.
+// The skipped chunks are instead written to one of PKTBUF_SCRATCH_LINES scratch
+// lines at scratch_offset in each block's data area where they get overwritten
+// by subsequent packets.  Each scratch line is skip_size bytes (the sum of the
+// skipped chunks' chunk_aligned_sizes) and the chunk_offsets of skipped chunks
+// are relative to the start of the scratch line.  The pkt_size still includes
+// the skipped chunks.
 struct hpguppi_pktbuf_info {
   uint32_t num_chunks;
+  uint32_t num_skip_chunks;
   size_t pkt_size;
   size_t slot_size;
   size_t slots_per_block;
+  size_t skip_size;
+  off_t scratch_offset;
   struct hpguppi_pktbuf_chunk chunks[MAX_CHUNKS];
 };
 
@@ -56,11 +73,23 @@ hpguppi_pktbuf_info_ptr(hpguppi_input_databuf_t *db)
   return (struct hpguppi_pktbuf_info *)(db->padding);
 }
 
+// Parses the ibvpktsz string (i.e. the value of the IBVPKTSZ status buffer
+// keyword) for chunk sizes and initializes pktbuf_info accordingly.  The first
+// num_skip_chunks chunks (i.e. the value of the IBVSKIP status buffer keyword)
+// will be skipped.  block_data_size is the size of the data area of each
+// databuf block.  Other packet sources that feed the same downstream threads
+// as hpguppi_ibvpkt_thread should use this to get the same slot layout.  Note
+// that ibvpktsz is temporarily modified while parsing.  Returns 0 on success
+// or -1 on error.
+int hpguppi_parse_ibvpktsz(struct hpguppi_pktbuf_info *pktbuf_info,
+    char * ibvpktsz, uint32_t num_skip_chunks, size_t block_data_size);
+
 // Function to get the offset within a slot to an (unaligned) offset within a
 // packet.  This accounts for the padding between chunks.  For example, if the
 // chuck sizes are 14,20,1500 (e.g. MAC,IP,PAYLOAD) and the chunks are aligned
 // on 64 byte boundaries, then (unaligned) packet offset 34 (e.g. start of
-// PAYLOAD) would have (aligned) slot offset 64.
+// PAYLOAD) would have (aligned) slot offset 64.  Returns -1 if pkt_offset is
+// within a skipped chunk.
 off_t
 hpguppi_pktbuf_slot_offset(hpguppi_input_databuf_t *db, off_t pkt_offset);
 
@@ -138,11 +167,18 @@ int hpguppi_ibvpkt_flow(
     uint32_t  src_ip,     uint32_t  dst_ip,
     uint16_t  src_port,   uint16_t  dst_port);
 
+// Makes hpguppi_ibvpkt_flow() a no-op that returns success.  This is for
+// packet sources that stand in for hpguppi_ibvpkt_thread without a NIC (e.g.
+// hpguppi_pcap_replay_thread) so that downstream threads can manage flows as
+// usual.
+void hpguppi_ibvpkt_disable_flows();
+
 // Function that threads can call to wait for hpguppi_ibvpkt_thread to finalize
 // ibverbs setup.  After this funtion returns, the underlying
 // hashpipe_ibv_context structure used by hpguppi_ibvpkt_thread will be fully
 // initialized and flows can be created/destroyed by calling
-// hpguppi_ibvpkt_flow().
+// hpguppi_ibvpkt_flow().  This also returns if IBVSTAT is "blocked" or "done"
+// (e.g. after hpguppi_pcap_replay_thread has finished replaying).
 void hpguppi_ibvpkt_wait_running(hashpipe_status_t * st);
 
 // Function to get a pointer to slot "slot_id" in block "block_id" of databuf
@@ -154,7 +190,22 @@ hpguppi_pktbuf_block_slot_ptr(hpguppi_input_databuf_t *db,
 {
   struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
   block_id %= db->header.n_block;
-  return (uint8_t *)db->block[block_id].data + slot_id * pktbuf_info->slot_size;
+  return (uint8_t *)hpguppi_databuf_block(db, block_id)->data
+    + slot_id * pktbuf_info->slot_size;
+}
+
+// Function to get a pointer to scratch line "line_id" (modulo
+// PKTBUF_SCRATCH_LINES) in block "block_id" of databuf "db".
+static inline
+uint8_t *
+hpguppi_pktbuf_block_scratch_ptr(hpguppi_input_databuf_t *db,
+    uint64_t block_id, uint32_t line_id)
+{
+  struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
+  block_id %= db->header.n_block;
+  line_id %= PKTBUF_SCRATCH_LINES;
+  return (uint8_t *)hpguppi_databuf_block(db, block_id)->data
+    + pktbuf_info->scratch_offset + line_id * pktbuf_info->skip_size;
 }
 
 #endif // _HPGUPPI_IBVERBS_PKT_THREAD_H_
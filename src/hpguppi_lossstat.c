@@ -0,0 +1,132 @@
+// hpguppi_lossstat.c
+//
+// Per-input packet loss statistics for hpguppi_daq (see hpguppi_lossstat.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashpipe.h"
+#include "hpguppi_lossstat.h"
+
+struct hpguppi_lossstat *
+hpguppi_lossstat_create(int instance_id)
+{
+  struct hpguppi_lossstat * ls;
+  int fd;
+  void * p;
+
+  if(!(ls = calloc(1, sizeof(struct hpguppi_lossstat)))) {
+    return NULL;
+  }
+
+  snprintf(ls->name, sizeof(ls->name), "/hpguppi_lossstat_%d", instance_id);
+
+  fd = shm_open(ls->name, O_RDWR | O_CREAT, 0644);
+  if(fd == -1) {
+    hashpipe_warn(__FUNCTION__, "shm_open %s", ls->name);
+    errno = 0;
+    return ls;
+  }
+
+  if(ftruncate(fd, sizeof(struct hpguppi_lossstat_table))) {
+    hashpipe_warn(__FUNCTION__, "ftruncate %s", ls->name);
+    errno = 0;
+    close(fd);
+    return ls;
+  }
+
+  p = mmap(NULL, sizeof(struct hpguppi_lossstat_table),
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) {
+    hashpipe_warn(__FUNCTION__, "mmap %s", ls->name);
+    errno = 0;
+    return ls;
+  }
+
+  ls->table = (struct hpguppi_lossstat_table *)p;
+
+  // Reset table (bump seq so readers notice)
+  __atomic_add_fetch(&ls->table->seq, 1, __ATOMIC_ACQ_REL);
+  memset(ls->table->entries, 0, sizeof(ls->table->entries));
+  ls->table->magic = HPGUPPI_LOSSSTAT_MAGIC;
+  ls->table->max_ants = HPGUPPI_LOSSSTAT_MAX_ANTS;
+  ls->table->max_strm = HPGUPPI_LOSSSTAT_MAX_STRM;
+  ls->table->nants = 0;
+  ls->table->nstrm = 0;
+  ls->table->pktidx = 0;
+  ls->table->update_time = time(NULL);
+  __atomic_add_fetch(&ls->table->seq, 1, __ATOMIC_ACQ_REL);
+
+  return ls;
+}
+
+void
+hpguppi_lossstat_destroy(struct hpguppi_lossstat * ls)
+{
+  if(!ls) {
+    return;
+  }
+  if(ls->table) {
+    munmap(ls->table, sizeof(struct hpguppi_lossstat_table));
+  }
+  free(ls);
+}
+
+void
+hpguppi_lossstat_expect(struct hpguppi_lossstat * ls, uint64_t antmask,
+    uint32_t strm0, uint32_t nstrm, uint64_t npkts, uint64_t pktidx)
+{
+  uint32_t a, s;
+
+  for(a=0; a<HPGUPPI_LOSSSTAT_MAX_ANTS; a++) {
+    if(!(antmask & (1ULL << a))) {
+      continue;
+    }
+    for(s=strm0; s<strm0+nstrm && s<HPGUPPI_LOSSSTAT_MAX_STRM; s++) {
+      ls->counts[a][s].expected += npkts;
+    }
+  }
+  ls->pktidx = pktidx;
+}
+
+void
+hpguppi_lossstat_publish(struct hpguppi_lossstat * ls,
+    uint32_t nants, uint32_t nstrm)
+{
+  struct hpguppi_lossstat_table * t = ls->table;
+  uint32_t a;
+
+  if(!t) {
+    return;
+  }
+  if(nants > HPGUPPI_LOSSSTAT_MAX_ANTS) {
+    nants = HPGUPPI_LOSSSTAT_MAX_ANTS;
+  }
+  if(nstrm > HPGUPPI_LOSSSTAT_MAX_STRM) {
+    nstrm = HPGUPPI_LOSSSTAT_MAX_STRM;
+  }
+
+  // Odd seq means update in progress
+  __atomic_add_fetch(&t->seq, 1, __ATOMIC_ACQ_REL);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  t->nants = nants;
+  t->nstrm = nstrm;
+  t->pktidx = ls->pktidx;
+  t->update_time = time(NULL);
+  for(a=0; a<nants; a++) {
+    memcpy(t->entries[a], ls->counts[a],
+        nstrm * sizeof(struct hpguppi_lossstat_entry));
+  }
+
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_add_fetch(&t->seq, 1, __ATOMIC_ACQ_REL);
+}
@@ -0,0 +1,87 @@
+// hpguppi_lossstat.h
+//
+// Per-input (i.e. per F engine and stream) packet loss statistics for the
+// packet-to-RAW assemblers.  Assemblers count received packets per input in
+// thread private memory (no atomics or locking on the per-packet path) and
+// count expected packets per input whenever a block is finalized.  The
+// counters are periodically published to a POSIX shared memory table named
+// "/hpguppi_lossstat_N" (N is the Hashpipe instance ID, see LOSSSHM in the
+// status buffer), which external tools can read alongside the status buffer.
+//
+// The table is updated using a sequence lock.  Readers should read seq, copy
+// the parts of the table they need, then read seq again.  The copy is
+// consistent if both seq values are equal and even.  The counters are
+// cumulative from the start of the assembler thread.  Entries are indexed by
+// F engine ID and by stream number relative to the stream of SCHAN.
+
+#ifndef _HPGUPPI_LOSSSTAT_H_
+#define _HPGUPPI_LOSSSTAT_H_
+
+#include <stdint.h>
+
+#define HPGUPPI_LOSSSTAT_MAX_ANTS (64)
+#define HPGUPPI_LOSSSTAT_MAX_STRM (64)
+#define HPGUPPI_LOSSSTAT_MAGIC    (0x53534f4c) // "LOSS" (little endian)
+
+struct hpguppi_lossstat_entry {
+  uint64_t received;
+  uint64_t expected;
+};
+
+// Layout of the shared memory table.  Only the first nants antennas and nstrm
+// streams of entries are meaningful.
+struct hpguppi_lossstat_table {
+  uint32_t magic;
+  uint32_t max_ants;
+  uint32_t max_strm;
+  uint32_t nants;
+  uint32_t nstrm;
+  uint32_t reserved;
+  uint64_t seq;
+  uint64_t pktidx;        // PKTIDX of most recently finalized block
+  uint64_t update_time;   // Time of last update (seconds since Unix epoch)
+  struct hpguppi_lossstat_entry
+    entries[HPGUPPI_LOSSSTAT_MAX_ANTS][HPGUPPI_LOSSSTAT_MAX_STRM];
+};
+
+// Thread private counters and the shared memory table they get published to.
+struct hpguppi_lossstat {
+  struct hpguppi_lossstat_table * table; // NULL if shared memory unavailable
+  char name[64];                         // Name of shared memory table
+  uint64_t pktidx;
+  struct hpguppi_lossstat_entry
+    counts[HPGUPPI_LOSSSTAT_MAX_ANTS][HPGUPPI_LOSSSTAT_MAX_STRM];
+};
+
+// Allocates a zeroed hpguppi_lossstat structure and creates (or re-uses) the
+// shared memory table for Hashpipe instance instance_id.  If the shared memory
+// table cannot be created, a warning is logged and counting still works but
+// nothing gets published.  Returns NULL if allocation fails.
+struct hpguppi_lossstat * hpguppi_lossstat_create(int instance_id);
+
+// Unmaps the shared memory table and frees ls.  The shared memory table is
+// left in place so that tools can still read the final counts.
+void hpguppi_lossstat_destroy(struct hpguppi_lossstat * ls);
+
+// Counts a received packet from F engine ant, stream strm.  This is meant to
+// be called for every packet.
+static inline void
+hpguppi_lossstat_count(struct hpguppi_lossstat * ls, uint64_t ant, uint64_t strm)
+{
+  if(ant < HPGUPPI_LOSSSTAT_MAX_ANTS && strm < HPGUPPI_LOSSSTAT_MAX_STRM) {
+    ls->counts[ant][strm].received++;
+  }
+}
+
+// Adds npkts expected packets to every input of the antennas in antmask and
+// streams strm0 to strm0+nstrm-1, and records pktidx as the current PKTIDX.
+// This is meant to be called whenever a block is finalized.
+void hpguppi_lossstat_expect(struct hpguppi_lossstat * ls, uint64_t antmask,
+    uint32_t strm0, uint32_t nstrm, uint64_t npkts, uint64_t pktidx);
+
+// Publishes the counters of the first nants antennas and nstrm streams to the
+// shared memory table.
+void hpguppi_lossstat_publish(struct hpguppi_lossstat * ls,
+    uint32_t nants, uint32_t nstrm);
+
+#endif // _HPGUPPI_LOSSSTAT_H_
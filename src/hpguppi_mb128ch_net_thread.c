@@ -278,7 +278,8 @@ static void write_baseband_packet_to_block_from_pktsock_frame(
 static int init(hashpipe_thread_args_t *args)
 {
     /* Non-network essential paramaters */
-    int blocsize=BLOCK_DATA_SIZE;
+    int blocsize=hpguppi_databuf_block_data_size(
+        (hpguppi_input_databuf_t *)args->obuf);
     int directio=1;
     int nbits=8;
     int npol=4;
@@ -393,6 +394,9 @@ static void *run(hashpipe_thread_args_t * args)
     struct hpguppi_pktsock_params *p_ps_params =
         (struct hpguppi_pktsock_params *)args->user_data;
 
+    // Size of data area of the databuf's blocks
+    const int block_data_size = hpguppi_databuf_block_data_size(db);
+
     /* Open command FIFO for read */
     char fifo_name[PATH_MAX];
     char fifo_cmd[MAX_CMD_LEN];
@@ -440,7 +444,7 @@ static void *run(hashpipe_thread_args_t * args)
     /* Figure out number of packets per block, etc.  Changing number of
      * channels during an obs is not supported.
      */
-    int block_size = BLOCK_DATA_SIZE;
+    int block_size = block_data_size;
     int ntime_per_block = calc_ntime_per_block(block_size,
                                                p_ps_params->obsnchan);
 
@@ -453,10 +457,10 @@ static void *run(hashpipe_thread_args_t * args)
 
     block_size = 4 * p_ps_params->obsnchan * ntime_per_block;
 
-    if (block_size > BLOCK_DATA_SIZE) {
+    if (block_size > block_data_size) {
         hashpipe_error("hpguppi_mb128ch_net_thread", "BLOCSIZE > databuf block_size");
-        block_size = BLOCK_DATA_SIZE;
-        ntime_per_block = BLOCK_DATA_SIZE / (4 * p_ps_params->obsnchan);
+        block_size = block_data_size;
+        ntime_per_block = block_data_size / (4 * p_ps_params->obsnchan);
     }
 
     // Update BLOCSIZE in status buffer
@@ -27,11 +27,9 @@
 #define HPGUPPI_DAQ_CONTROL "/tmp/hpguppi_daq_control"
 #define MAX_CMD_LEN 1024
 
-#define PKTSOCK_BYTES_PER_FRAME (16384)
-#define PKTSOCK_FRAMES_PER_BLOCK (8)
-//#define PKTSOCK_NBLOCKS (800)
-#define PKTSOCK_NBLOCKS (800*12)
-#define PKTSOCK_NFRAMES (PKTSOCK_FRAMES_PER_BLOCK * PKTSOCK_NBLOCKS)
+// TPACKET_V3 ring of 600 2 MiB blocks (same 1200 MiB as the former
+// TPACKET_V1 ring of 76800 16 KiB frames)
+#define PKTSOCK_NBLOCKS (600)
 
 #define ELAPSED_NS(start,stop) \
   (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
@@ -211,7 +209,7 @@ static int block_packet_check(struct datablock_stats *d,
  */
 static uint64_t hpguppi_pktsock_seq_num(const unsigned char *p_frame)
 {
-    uint64_t tmp = be64toh(*(uint64_t *)PKT_UDP_DATA(p_frame));
+    uint64_t tmp = be64toh(*(uint64_t *)PKTV3_UDP_DATA(p_frame));
     tmp >>= 16;
     return tmp ;
 }
@@ -221,7 +219,7 @@ static uint64_t hpguppi_pktsock_seq_num(const unsigned char *p_frame)
  */
 static uint64_t hpguppi_pktsock_hdr_chan(const unsigned char *p_frame)
 {
-    uint64_t tmp = be64toh(*(uint64_t *)PKT_UDP_DATA(p_frame));
+    uint64_t tmp = be64toh(*(uint64_t *)PKTV3_UDP_DATA(p_frame));
     tmp >>= 4;
     return tmp & 0xfff;
 }
@@ -271,14 +269,14 @@ static void write_baseband_packet_to_block_from_pktsock_frame(
     hpguppi_s6_packet_data_copy_transpose_from_payload(
             hpguppi_databuf_data(d->db, d->block_idx),
             block_chan, block_time, ntime_per_block,
-            (char *)PKT_UDP_DATA(p_frame),
-            (size_t)PKT_UDP_SIZE(p_frame)-8); // -8 for UDP header bytes
+            (char *)PKTV3_UDP_DATA(p_frame),
+            (size_t)PKTV3_UDP_SIZE(p_frame)-8); // -8 for UDP header bytes
 #else
     hpguppi_s6_packet_data_copy_from_payload(
             hpguppi_databuf_data(d->db, d->block_idx),
             block_chan, block_time, obsnchan,
-            (char *)PKT_UDP_DATA(p_frame),
-            (size_t)PKT_UDP_SIZE(p_frame)-8); // -8 for UDP header bytes
+            (char *)PKTV3_UDP_DATA(p_frame),
+            (size_t)PKTV3_UDP_SIZE(p_frame)-8); // -8 for UDP header bytes
 #endif
 
     d->npacket++;
@@ -287,7 +285,8 @@ static void write_baseband_packet_to_block_from_pktsock_frame(
 static int init(hashpipe_thread_args_t *args)
 {
     /* Non-network essential paramaters */
-    int blocsize=BLOCK_DATA_SIZE;
+    int blocsize=hpguppi_databuf_block_data_size(
+        (hpguppi_input_databuf_t *)args->obuf);
     int directio=1;
     int nbits=8;
     int npol=4;
@@ -372,17 +371,14 @@ static int init(hashpipe_thread_args_t *args)
     // Calculate packet size from CHPERPKT
     p_psp->packet_size = p_psp->chperpkt * 4 + 16;
 
-    // Set up pktsock.  Make frame_size be a divisor of block size so that
-    // frames will be contiguous in mapped mempory.  block_size must also be a
-    // multiple of page_size.  Easiest way is to oversize the frames to be
-    // 16384 bytes, which is bigger than we need, but keeps things easy.
-    p_psp->ps.frame_size = PKTSOCK_BYTES_PER_FRAME;
-    // total number of frames
-    p_psp->ps.nframes = PKTSOCK_NFRAMES;
-    // number of blocks
-    p_psp->ps.nblocks = PKTSOCK_NBLOCKS;
-
-    rv = hashpipe_pktsock_open(&p_psp->ps, p_psp->ifname, PACKET_RX_RING);
+    // Set up pktsock.  The TPACKET_V3 ring packs variable length frames into
+    // blocks, so frame_size is just an upper bound on the packet size.
+    p_psp->psv3.block_size = HPGUPPI_PKTSOCK_V3_BLOCK_SIZE;
+    p_psp->psv3.frame_size = HPGUPPI_PKTSOCK_V3_FRAME_SIZE;
+    p_psp->psv3.nblocks = PKTSOCK_NBLOCKS;
+    p_psp->psv3.retire_ms = HPGUPPI_PKTSOCK_V3_RETIRE_MS;
+
+    rv = hpguppi_pktsock_v3_open(&p_psp->psv3, p_psp->ifname);
     if (rv!=HASHPIPE_OK) {
         hashpipe_error("hpguppi_mb1_net_thread", "Error opening pktsock.");
         pthread_exit(NULL);
@@ -405,6 +401,9 @@ static void *run(hashpipe_thread_args_t * args)
     struct hpguppi_pktsock_params *p_ps_params =
         (struct hpguppi_pktsock_params *)args->user_data;
 
+    // Size of data area of the databuf's blocks
+    const int block_data_size = hpguppi_databuf_block_data_size(db);
+
     /* Open command FIFO for read */
     char fifo_name[PATH_MAX];
     char fifo_cmd[MAX_CMD_LEN];
@@ -453,8 +452,8 @@ static void *run(hashpipe_thread_args_t * args)
      * per block, etc.  Changing packet size during an obs is not
      * supported.
      */
-    int block_size = BLOCK_DATA_SIZE;
-    int ntime_per_block = BLOCK_DATA_SIZE / (4 * p_ps_params->obsnchan);
+    int block_size = block_data_size;
+    int ntime_per_block = block_data_size / (4 * p_ps_params->obsnchan);
 
     // Set ntime_per_block to closest power of 2 less than or equal to
     // ntime_per_block.
@@ -467,10 +466,10 @@ static void *run(hashpipe_thread_args_t * args)
 
     block_size = 4 * p_ps_params->obsnchan * ntime_per_block;
 
-    if (block_size > BLOCK_DATA_SIZE) {
+    if (block_size > block_data_size) {
         hashpipe_error("hpguppi_mb1_net_thread", "BLOCSIZE > databuf block_size");
-        block_size = BLOCK_DATA_SIZE;
-        ntime_per_block = BLOCK_DATA_SIZE / (4 * p_ps_params->obsnchan);
+        block_size = block_data_size;
+        ntime_per_block = block_data_size / (4 * p_ps_params->obsnchan);
     }
 
     // Update BLOCSIZE in status buffer
@@ -551,17 +550,15 @@ static void *run(hashpipe_thread_args_t * args)
 
     // Drop all packets to date
     unsigned char *p_frame;
-    while((p_frame=hashpipe_pktsock_recv_frame_nonblock(&p_ps_params->ps))) {
-        hashpipe_pktsock_release_frame(p_frame);
-    }
+    hpguppi_pktsock_v3_flush(&p_ps_params->psv3);
 
     /* Main loop */
     while (run_threads()) {
 
         /* Wait for data */
         do {
-            p_frame = hashpipe_pktsock_recv_udp_frame(
-                &p_ps_params->ps, p_ps_params->port, 1000); // 1 second timeout
+            p_frame = hpguppi_pktsock_v3_recv_udp_frame(
+                &p_ps_params->psv3, p_ps_params->port, 1000); // 1 second timeout
 
             // Get start-of-processing time if we got a packet
             if(p_frame) {
@@ -636,24 +633,21 @@ static void *run(hashpipe_thread_args_t * args)
 
         if(!run_threads()) {
             // We're outta here!
-            hashpipe_pktsock_release_frame(p_frame);
             break;
         }
 
         /* Check packet size */
         if(p_ps_params->packet_size == 0) {
-            p_ps_params->packet_size = PKT_UDP_SIZE(p_frame) - 8;
-        } else if(p_ps_params->packet_size != PKT_UDP_SIZE(p_frame) - 8) {
+            p_ps_params->packet_size = PKTV3_UDP_SIZE(p_frame) - 8;
+        } else if(p_ps_params->packet_size != PKTV3_UDP_SIZE(p_frame) - 8) {
             /* Unexpected packet size, ignore? */
             nbogus_total++;
             if(nbogus_total % 1000000 == 0) {
                 hashpipe_status_lock_safe(st);
                 hputi4(st->buf, "NBOGUS", nbogus_total);
-                hputi4(st->buf, "PKTSIZE", PKT_UDP_SIZE(p_frame)-8);
+                hputi4(st->buf, "PKTSIZE", PKTV3_UDP_SIZE(p_frame)-8);
                 hashpipe_status_unlock_safe(st);
             }
-            // Release frame!
-            hashpipe_pktsock_release_frame(p_frame);
             continue;
         }
 
@@ -666,7 +660,7 @@ static void *run(hashpipe_thread_args_t * args)
         if(seq_num % seqnums_per_block == 0
         && hpguppi_pktsock_hdr_chan(p_frame) == p_ps_params->obsschan) {
             // Get packet stats
-            hashpipe_pktsock_stats(&p_ps_params->ps, &ps_pkts, &ps_drops);
+            hpguppi_pktsock_v3_stats(&p_ps_params->psv3, &ps_pkts, &ps_drops);
             hashpipe_status_lock_safe(st);
             hputi8(st->buf, "PKTIDX", seq_num);
             hgetu8(st->buf, "PKTSTART", &start_seq_num);
@@ -709,17 +703,15 @@ static void *run(hashpipe_thread_args_t * args)
             waiting=0;
         }
 
-        // If IDLE, release frame and continue main loop
+        // If IDLE, skip frame and continue main loop
         if(state == IDLE) {
-            // Release frame!
-            hashpipe_pktsock_release_frame(p_frame);
             continue;
         }
 
         /* Convert packet format if needed */
         if (use_parkes_packets) {
             parkes_to_guppi_from_payload(
-                (char *)PKT_UDP_DATA(p_frame), acclen, npol, nchan);
+                (char *)PKTV3_UDP_DATA(p_frame), acclen, npol, nchan);
         }
 
         /* Check seq num diff */
@@ -733,8 +725,6 @@ static void *run(hashpipe_thread_args_t * args)
                         seq_num);
             }
             else {
-              // Release frame!
-              hashpipe_pktsock_release_frame(p_frame);
               /* No going backwards */
               continue;
             }
@@ -883,9 +873,6 @@ static void *run(hashpipe_thread_args_t * args)
             }
         }
 
-        // Release frame back to ring buffer
-        hashpipe_pktsock_release_frame(p_frame);
-
         clock_gettime(CLOCK_MONOTONIC, &ts_stop);
 
         // -16 for S6 header and footer
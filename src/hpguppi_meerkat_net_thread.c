@@ -289,8 +289,8 @@ static void wait_for_block_free(const struct block_info * bi,
 #if 0
   // TODO Move this out of net thread (takes too long)
   // TODO Just clear effective block size?
-  //memset(block_info_data(bi), 0, BLOCK_DATA_SIZE);
-  bzero_nt(block_info_data(bi), BLOCK_DATA_SIZE);
+  //memset(block_info_data(bi), 0, hpguppi_databuf_block_data_size(bi->db));
+  bzero_nt(block_info_data(bi), hpguppi_databuf_block_data_size(bi->db));
 #else
           nanosleep(&ts_sleep, NULL);
 #endif
@@ -355,7 +355,8 @@ static void copy_packet_data_to_databuf(struct block_info *bi,
   size_t istride = 4 * p_oi->hntime;
 
   // ostride is the size of a "row" in bytes
-  size_t ostride = 4 * mk_ntime(BLOCK_DATA_SIZE, *p_oi);
+  size_t ostride = 4 * mk_ntime(
+      hpguppi_databuf_block_data_size(bi->db), *p_oi);
 
   // slot_idx is the index of the slot in the block where the packet's heap goes
   int slot_idx = mk_pktidx(*p_oi, *p_fesi) % bi->pktidx_per_block;
@@ -518,7 +519,8 @@ struct net_params {
 static int init(hashpipe_thread_args_t *args)
 {
   // Non-network essential paramaters
-  int blocsize=BLOCK_DATA_SIZE;
+  int blocsize=hpguppi_databuf_block_data_size(
+      (hpguppi_input_databuf_t *)args->obuf);
   int directio=1;
   int nbits=8;
   int npol=4;
@@ -644,6 +646,9 @@ int debug_i=0, debug_j=0;
   const char * thread_name = args->thread_desc->name;
   const char * status_key = args->thread_desc->skey;
 
+  // Size of data area of the output databuf's blocks
+  const size_t block_data_size = hpguppi_databuf_block_data_size(db);
+
   // Get a pointer to the net_params structure allocated and initialized in
   // init() as well as its hashpipe_ibv_context structure.
   struct net_params *net_params = (struct net_params *)args->user_data;
@@ -745,8 +750,8 @@ int debug_i=0, debug_j=0;
   // PKTIDX per block (depends on obs_info).  Init to 0 to cause div-by-zero
   // error if using it unintialized (crash early, crash hard!).
   uint32_t pktidx_per_block = 0;
-  // Effective block size (will be less than BLOCK_DATA_SIZE when
-  // BLOCK_DATA_SIZE is not divisible by NCHAN and/or HNTIME.
+  // Effective block size (will be less than block_data_size when
+  // block_data_size is not divisible by NCHAN and/or HNTIME.
   // Historically, BLOCSIZE gets stored as a signed 4 byte integer
   int32_t eff_block_size;
 
@@ -798,8 +803,8 @@ int debug_i=0, debug_j=0;
     if(mk_obs_info_valid(obs_info)) {
       // Update obsnchan, pktidx_per_block, and eff_block_size
       obsnchan = mk_obsnchan(obs_info);
-      pktidx_per_block = mk_pktidx_per_block(BLOCK_DATA_SIZE, obs_info);
-      eff_block_size = mk_block_size(BLOCK_DATA_SIZE, obs_info);
+      pktidx_per_block = mk_pktidx_per_block(block_data_size, obs_info);
+      eff_block_size = mk_block_size(block_data_size, obs_info);
     }
 
     // Write (store default/invlid values if not present)
@@ -894,8 +899,8 @@ int debug_i=0, debug_j=0;
         if(mk_obs_info_valid(obs_info)) {
           // Update obsnchan, pktidx_per_block, and eff_block_size
           obsnchan = mk_obsnchan(obs_info);
-          pktidx_per_block = mk_pktidx_per_block(BLOCK_DATA_SIZE, obs_info);
-          eff_block_size = mk_block_size(BLOCK_DATA_SIZE, obs_info);
+          pktidx_per_block = mk_pktidx_per_block(block_data_size, obs_info);
+          eff_block_size = mk_block_size(block_data_size, obs_info);
 
           hputu4(st->buf, "OBSNCHAN", obsnchan);
           hputu4(st->buf, "PIPERBLK", pktidx_per_block);
@@ -1209,7 +1214,7 @@ printf("\n");
           //     tbin * ntime/block
           //
           // To get an integer number of blocks, simply truncate
-          dwell_blocks = trunc(dwell_seconds / (tbin * mk_ntime(BLOCK_DATA_SIZE, obs_info)));
+          dwell_blocks = trunc(dwell_seconds / (tbin * mk_ntime(block_data_size, obs_info)));
 
           stop_seq_num = start_seq_num + pktidx_per_block * dwell_blocks;
           hputi8(st->buf, "PKTSTOP", stop_seq_num);
@@ -203,8 +203,8 @@ static void wait_for_block_free(hpguppi_input_databuf_t *db, int block_idx,
 #if 0
   // TODO Move this out of net thread (takes too long)
   // TODO Just clear effective block size?
-  //memset(block_info_data(bi), 0, BLOCK_DATA_SIZE);
-  clear_memory(block_info_data(bi), BLOCK_DATA_SIZE);
+  //memset(block_info_data(bi), 0, hpguppi_databuf_block_data_size(bi->db));
+  clear_memory(block_info_data(bi), hpguppi_databuf_block_data_size(bi->db));
 #else
   //TODO nanosleep(&ts_sleep, NULL);
 #endif
@@ -295,7 +295,7 @@ static int init(hashpipe_thread_args_t *args)
 
   // Calculate total number of receive packets per block.  This is the number
   // of hashpipe_recv_pkt and ibv_sge elements that we need to allocate.
-  //uint32_t total_recv_pkts = BLOCK_DATA_SIZE / hibv_ctx->pkt_size_max;
+  //uint32_t total_recv_pkts = hpguppi_databuf_block_data_size(db) / hibv_ctx->pkt_size_max;
   uint32_t total_recv_pkts = 32768;
 
   // hashpipe_ibv_init() needs to know the number of recv_pkts per WQ.  It is
@@ -304,8 +304,8 @@ static int init(hashpipe_thread_args_t *args)
   if(total_recv_pkts % hibv_ctx->nqp != 0) {
     // Log error and return error code
     hashpipe_error(thread_name,
-        "BLOCK_DATA_SIZE / pkt_size %% nqp != 0 (%lu / %u %% %u != 0)",
-        BLOCK_DATA_SIZE, hibv_ctx->pkt_size_max, hibv_ctx->nqp);
+        "total_recv_pkts %% nqp != 0 (%u %% %u != 0)",
+        total_recv_pkts, hibv_ctx->nqp);
     return HASHPIPE_ERR_PARAM;
   }
   hibv_ctx->recv_pkt_num = total_recv_pkts / hibv_ctx->nqp;
@@ -439,7 +439,17 @@ int debug_i=0, debug_j=0;
 
   // databuf_end is used to test when a pointer has advanced beyond the end of
   // the databuf blocks'
-  uintptr_t databuf_end = ((uintptr_t)db->block) + sizeof(db->block);
+  uintptr_t databuf_end = ((uintptr_t)hpguppi_databuf_blocks(db)) + hpguppi_databuf_blocks_size(db);
+
+  // Each block holds two sub-blocks of packets (see below), so make sure that
+  // the databuf's blocks are big enough.
+  if(2 * hibv_ctx->recv_pkt_num * hibv_ctx->nqp * hibv_ctx->pkt_size_max
+      > hpguppi_databuf_block_data_size(db)) {
+    hashpipe_error(thread_name,
+        "databuf block size too small for %u packets of %u bytes",
+        2 * hibv_ctx->recv_pkt_num * hibv_ctx->nqp, hibv_ctx->pkt_size_max);
+    return (void *)HASHPIPE_ERR_PARAM;
+  }
 
   // We maintain three active blocks at all times.  curblk is the number of the
   // oldest of the three blocks with block numbers curblk+1 and curblk+2 being
@@ -473,14 +483,14 @@ int debug_i=0, debug_j=0;
   // Wait until the first three blocks are marked as free
   // (should already be free)
   for(i=0; i<3; i++) {
-    wait_for_block_free(db, (curblk+i) % N_INPUT_BLOCKS, st, status_key);
+    wait_for_block_free(db, (curblk+i) % db->header.n_block, st, status_key);
   }
 
   // send_mr_size and send_mr_buf are set in init().
   // recv_mr_size and recv_mr_buf are set here.  NB: This is necessary because
   // shared memory mappings change between init() and run()!
-  hibv_ctx->recv_mr_size = sizeof(db->block);
-  hibv_ctx->recv_mr_buf = (uint8_t *)db->block;
+  hibv_ctx->recv_mr_size = hpguppi_databuf_blocks_size(db);
+  hibv_ctx->recv_mr_buf = (uint8_t *)hpguppi_databuf_blocks(db);
 
   hashpipe_info(thread_name, "Setting up recv_mr start %p length %lu",
       hibv_ctx->recv_mr_buf, hibv_ctx->recv_mr_size);
@@ -505,7 +515,7 @@ int debug_i=0, debug_j=0;
       pkt_blocks[ii+j] = curblk;
       hibv_ctx->recv_pkt_buf[ii+j].wr.num_sge = 3;
 
-      base_addr = (uint64_t)(db->block[curblk].data +
+      base_addr = (uint64_t)(hpguppi_databuf_block(db, curblk)->data +
           hibv_ctx->pkt_size_max * (ii+j));
       hibv_ctx->recv_sge_buf[3*(ii+j)  ].addr = base_addr;
       hibv_ctx->recv_sge_buf[3*(ii+j)+1].addr = base_addr + 0x40;
@@ -514,12 +524,12 @@ int debug_i=0, debug_j=0;
       hibv_ctx->recv_sge_buf[3*(ii+j)+1].length = 96;
       hibv_ctx->recv_sge_buf[3*(ii+j)+2].length = hibv_ctx->pkt_size_max - 0xc0;
 
-      if(hibv_ctx->recv_sge_buf[ii+j].addr < (uintptr_t)db->block
+      if(hibv_ctx->recv_sge_buf[ii+j].addr < (uintptr_t)hpguppi_databuf_blocks(db)
       || hibv_ctx->recv_sge_buf[ii+j].addr > databuf_end) {
         hashpipe_error(thread_name,
           "bad pointer math i=%d j=%d ii=%d addr=%p db_start=%p db_end=%p",
           i, j, ii, hibv_ctx->recv_sge_buf[ii+j].addr,
-          db->block[curblk].data, databuf_end);
+          hpguppi_databuf_block(db, curblk)->data, databuf_end);
       }
     }
   }
@@ -533,13 +543,13 @@ int debug_i=0, debug_j=0;
     hashpipe_info(thread_name,
       "i=%d j=%d ii=%d addr=%p db_start=%p db_end=%p pktblk %d curblk %d",
       i, j, ii, hibv_ctx->recv_sge_buf[ii+j].addr,
-      db->block, databuf_end, pkt_blocks[ii+j], curblk);
+      hpguppi_databuf_blocks(db), databuf_end, pkt_blocks[ii+j], curblk);
 
     j = hibv_ctx->recv_pkt_num-1;
     hashpipe_info(thread_name,
       "i=%d j=%d ii=%d addr=%p db_start=%p db_end=%p",
       i, j, ii, hibv_ctx->recv_sge_buf[ii+j].addr,
-      db->block, databuf_end, pkt_blocks[ii+j], curblk);
+      hpguppi_databuf_blocks(db), databuf_end, pkt_blocks[ii+j], curblk);
   }
 
   // Initialize ibverbs
@@ -749,7 +759,7 @@ int debug_i=0, debug_j=0;
             "WR %d got error for block %d when using address: %p (databuf %p %p)",
             curr_rpkt->wr.wr_id, pkt_blocks[curr_rpkt->wr.wr_id],
             curr_rpkt->wr.sg_list->addr,
-            db->block, databuf_end);
+            hpguppi_databuf_blocks(db), databuf_end);
         pthread_exit(NULL);
       }
 #if 0
@@ -759,7 +769,7 @@ int debug_i=0, debug_j=0;
             packet_count, curblk,
             curr_rpkt->wr.wr_id, pkt_blocks[curr_rpkt->wr.wr_id],
             curr_rpkt->wr.sg_list->addr,
-            db->block, databuf_end);
+            hpguppi_databuf_blocks(db), databuf_end);
       }
 #endif
 
@@ -774,35 +784,36 @@ int debug_i=0, debug_j=0;
 
       // Set current pkt's new destination addresses for all SGEs
       base_addr = (uint64_t)(
-        ((uint8_t *)db->block[(pkt_blocks[wr_id]/2) % N_INPUT_BLOCKS].data) +
+        ((uint8_t *)hpguppi_databuf_block(db,
+            (pkt_blocks[wr_id]/2) % db->header.n_block)->data) +
         wr_id * hibv_ctx->pkt_size_max +
-        (BLOCK_DATA_SIZE/2)*(pkt_blocks[wr_id]%2));
+        (hpguppi_databuf_block_data_size(db)/2)*(pkt_blocks[wr_id]%2));
       curr_rpkt->wr.sg_list[0].addr = base_addr;
       curr_rpkt->wr.sg_list[1].addr = base_addr + 0x40;
       curr_rpkt->wr.sg_list[2].addr = base_addr + 0xc0;
 
       // Sanity check
-      if(curr_rpkt->wr.sg_list->addr < (uintptr_t)db->block
+      if(curr_rpkt->wr.sg_list->addr < (uintptr_t)hpguppi_databuf_blocks(db)
       || curr_rpkt->wr.sg_list->addr > databuf_end) {
         hashpipe_error(thread_name,
           "bad pointer math blk=%d (%d) wr_id=%d size=%d addr=%p db_start=%p db_end=%p",
           pkt_blocks[wr_id],
-          pkt_blocks[wr_id] % N_INPUT_BLOCKS,
+          pkt_blocks[wr_id] % db->header.n_block,
           wr_id, curr_rpkt->wr.sg_list->addr,
-          db->block[curblk].data, databuf_end);
+          hpguppi_databuf_block(db, curblk)->data, databuf_end);
         pthread_exit(NULL);
       }
 
       // If time to advance the ring buffer blocks
       if(pkt_blocks[wr_id] > 2*(curblk+2)) {
         // Mark curblk as filled
-        hpguppi_input_databuf_set_filled(db, curblk % N_INPUT_BLOCKS);
+        hpguppi_input_databuf_set_filled(db, curblk % db->header.n_block);
         
         // Increment curblk
         curblk++;
 
         // Wait for curblk+2 to be free
-        wait_for_block_free(db, (curblk+2) % N_INPUT_BLOCKS, st, status_key);
+        wait_for_block_free(db, (curblk+2) % db->header.n_block, st, status_key);
 
         // Update PKTBLKIN/PKTPKTS in status buffer
         hashpipe_status_lock_safe(st);
@@ -14,6 +14,7 @@
 //#include <stdio.h>
 //#include <sys/types.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sched.h>
 #include <math.h>
 #include <unistd.h>
@@ -35,7 +36,9 @@
 #include "hashpipe.h"
 #include "hpguppi_databuf.h"
 #include "hpguppi_time.h"
+#include "hpguppi_numa.h"
 #include "hpguppi_util.h"
+#include "hpguppi_lossstat.h"
 #include "hpguppi_mkfeng.h"
 #include "hpguppi_ibverbs_pkt_thread.h"
 
@@ -117,8 +120,24 @@ struct block_info {
   uint32_t npacket;                 // Number of packets recevied so far
   // Fields set during block finalization
   uint32_t ndrop;                   // Count of expected packets not recevied
+  // Received packet bitmap (see block_info_mark_packet)
+  uint64_t *rxmap;                  // One bit per packet of the block
+  uint32_t rxmap_nbits;             // Capacity of rxmap in bits
+  uint32_t rxmap_hiwat;             // Number of rxmap words possibly non-zero
+  size_t istride;                   // Bytes per row per PKTIDX
+  size_t ostride;                   // Bytes per row of block
+  size_t row_len;                   // Bytes per row per packet
+  uint32_t rows_per_pkt;            // Rows (channels) per packet
+  uint32_t pkts_per_row;            // Packets per row per PKTIDX
 };
 
+// Smallest packet payload size for which the received packet bitmap has room
+// for every packet of a block.
+#define RXMAP_MIN_PAYLOAD (64)
+
+// Alignment (and length granularity) required by memcpy_nt() and bzero_nt()
+#define NT_ALIGNMENT_SIZE (64)
+
 // Returns pointer to block_info's output data block
 static char * block_info_data(const struct block_info *bi)
 {
@@ -131,11 +150,153 @@ static char * block_info_header(const struct block_info *bi)
   return hpguppi_databuf_header(bi->dbout, bi->block_idx_out);
 }
 
-// Reset counter(s) in block_info
+// Reset counter(s) and received packet bitmap in block_info
 static void reset_block_info_stats(struct block_info *bi)
 {
   bi->npacket=0;
   bi->ndrop=0;
+  if(bi->rxmap) {
+    memset(bi->rxmap, 0, bi->rxmap_hiwat * sizeof(uint64_t));
+  }
+  bi->rxmap_hiwat=0;
+}
+
+// Allocate block_info's received packet bitmap with room for all the packets
+// of a block_data_size byte block.  Calling thread will exit on error.
+static void alloc_block_info_rxmap(struct block_info *bi, size_t block_data_size)
+{
+  bi->rxmap_nbits = block_data_size / RXMAP_MIN_PAYLOAD;
+  bi->rxmap = calloc((bi->rxmap_nbits + 63) / 64, sizeof(uint64_t));
+  bi->rxmap_hiwat = 0;
+  if(!bi->rxmap) {
+    hashpipe_error(__FUNCTION__, "cannot allocate received packet bitmap");
+    pthread_exit(NULL);
+  }
+}
+
+// Marks the packet described by p_oi and p_fesi as received in bi's bitmap and
+// updates bi's packet geometry (which is needed to zero-fill missing packets
+// when the block is finalized).  A packet holds either one or more whole rows
+// (i.e. HNTIME samples of rows_per_pkt channels) or, when the payload is
+// smaller than a row, 1/pkts_per_row of a row.  The bitmap is ordered by
+// packet "row group" (i.e. block_chan / rows_per_pkt, with pkts_per_row
+// entries per row group) then by PKTIDX within the block, so a run of set/unset
+// bits is a contiguous time range of a group of channels.  The payload size is
+// assumed to be supported (see select_copy_kernel()).  Returns 1 if the packet
+// was already marked (i.e. a duplicate), otherwise 0.
+static int block_info_mark_packet(struct block_info *bi,
+    const struct mk_obs_info * p_oi,
+    const struct mk_feng_spead_info * p_fesi)
+{
+  uint32_t bit, word;
+  uint64_t mask;
+
+  bi->istride = mk_sample_size(*p_oi) * p_oi->hntime;
+  bi->ostride = mk_sample_size(*p_oi) * mk_ntime(
+      hpguppi_databuf_block_data_size(bi->dbout), *p_oi);
+  if(p_fesi->payload_size < bi->istride) {
+    bi->row_len = p_fesi->payload_size;
+    bi->rows_per_pkt = 1;
+    bi->pkts_per_row = bi->istride / bi->row_len;
+  } else {
+    bi->row_len = bi->istride;
+    bi->rows_per_pkt = p_fesi->payload_size / bi->istride;
+    bi->pkts_per_row = 1;
+  }
+
+  bit = (((mk_block_chan(*p_oi, *p_fesi) + p_fesi->heap_offset / bi->istride)
+          / bi->rows_per_pkt) * bi->pkts_per_row
+        + (p_fesi->heap_offset % bi->istride) / bi->row_len)
+      * bi->pktidx_per_block
+      + mk_pktidx(*p_oi, *p_fesi) % bi->pktidx_per_block;
+  if(bit >= bi->rxmap_nbits) {
+    return 0;
+  }
+
+  word = bit / 64;
+  mask = 1ULL << (bit % 64);
+  if(word >= bi->rxmap_hiwat) {
+    bi->rxmap_hiwat = word + 1;
+  }
+  if(bi->rxmap[word] & mask) {
+    return 1;
+  }
+  bi->rxmap[word] |= mask;
+  return 0;
+}
+
+// Zeros the data of all packets of bi that are not marked in its received
+// packet bitmap and summarizes the missing packets in the block's header.
+// Without this, missing packets' regions would contain stale data from the
+// block's previous use.  The summary consists of NMISSRUN, the number of runs
+// of missing packets (in bitmap order), and MISSRUNS, a list of the first of
+// those runs as "START+LEN" bit ranges (with a trailing "..." if truncated).
+// Returns the number of missing packets.
+static uint32_t zero_fill_missing_packets(const struct block_info *bi)
+{
+  char *header = block_info_header(bi);
+  uint8_t *data = (uint8_t *)block_info_data(bi);
+  uint32_t nbits = bi->pkts_per_block;
+  uint32_t bit, run_start = 0, r, unit;
+  uint32_t nmissing = 0;
+  uint32_t nruns = 0;
+  int in_run = 0;
+  int is_missing;
+  char missruns[69] = {0};
+  size_t len = 0;
+  uint8_t *dst;
+
+  if(nbits > bi->rxmap_nbits) {
+    nbits = bi->rxmap_nbits;
+  }
+  if(bi->pktidx_per_block == 0) {
+    nbits = 0;
+  }
+
+  // Loop one past the end to close out a trailing run
+  for(bit=0; bit<=nbits; bit++) {
+    is_missing = bit < nbits && !(bi->rxmap[bit/64] & (1ULL << (bit % 64)));
+
+    if(is_missing) {
+      nmissing++;
+      unit = bit / bi->pktidx_per_block;
+      dst = data
+        + (bit % bi->pktidx_per_block) * bi->istride
+        + (unit % bi->pkts_per_row) * bi->row_len
+        + (unit / bi->pkts_per_row) * bi->rows_per_pkt * bi->ostride;
+      for(r=0; r<bi->rows_per_pkt; r++, dst += bi->ostride) {
+        if(((uintptr_t)dst | bi->row_len) % NT_ALIGNMENT_SIZE == 0) {
+          bzero_nt(dst, bi->row_len);
+        } else {
+          memset(dst, 0, bi->row_len);
+        }
+      }
+      if(!in_run) {
+        run_start = bit;
+        in_run = 1;
+      }
+    } else if(in_run) {
+      in_run = 0;
+      if(len < sizeof(missruns) - 1) {
+        len += snprintf(missruns + len, sizeof(missruns) - len, "%s%u+%u",
+            nruns ? "," : "", run_start, bit - run_start);
+        if(len >= sizeof(missruns) - 1) {
+          strcpy(missruns + sizeof(missruns) - 4, "...");
+          len = sizeof(missruns) - 1;
+        }
+      }
+      nruns++;
+    } else if(bit % 64 == 0 && bit + 64 <= nbits
+        && bi->rxmap[bit/64] == ~0ULL) {
+      // Skip whole words of received packets quickly
+      bit += 63;
+    }
+  }
+
+  hputu4(header, "NMISSRUN", nruns);
+  hputs(header, "MISSRUNS", missruns);
+
+  return nmissing;
 }
 
 // (Re-)initialize some or all fields of block_info bi.
@@ -169,7 +330,11 @@ static void finalize_block(struct block_info *bi)
   }
   char *header = block_info_header(bi);
   char dropstat[128];
-  if(bi->pkts_per_block > bi->npacket) {
+  // Zero the regions of missing packets and count them (packet geometry is
+  // unknown if no packets have been marked yet)
+  if(bi->istride) {
+    bi->ndrop = zero_fill_missing_packets(bi);
+  } else if(bi->pkts_per_block > bi->npacket) {
     bi->ndrop = bi->pkts_per_block - bi->npacket;
   }
 #if 0
@@ -261,13 +426,135 @@ static void wait_for_block_free(const struct block_info * bi,
 #if 0
   // TODO Move this out of net thread (takes too long)
   // TODO Just clear effective block size?
-  //memset(block_info_data(bi), 0, BLOCK_DATA_SIZE);
-  bzero_nt(block_info_data(bi), BLOCK_DATA_SIZE);
+  //memset(block_info_data(bi), 0, hpguppi_databuf_block_data_size(bi->dbout));
+  bzero_nt(block_info_data(bi), hpguppi_databuf_block_data_size(bi->dbout));
 #else
   //nanosleep(&ts_sleep, NULL);
 #endif
 }
 
+// Packet copy kernels copy a packet's payload into a RAW block.  Each row_len
+// bytes of the nbytes byte payload at src go to a row of the RAW block, with
+// rows being ostride bytes apart starting at dst.  A packet holds either whole
+// rows, in which case row_len is istride (i.e. HNTIME samples), or a fraction
+// of a row, in which case row_len is the payload size (see
+// block_info_mark_packet()).  Kernels are specialized for the (payload size,
+// row_len) combinations used by the F engines so that the loop trip count and
+// copy length are compile time constants.  Any other supported combination
+// uses copy_packet_generic().
+typedef void (*mk_copy_fn)(uint8_t * dst, const uint8_t * src,
+    size_t row_len, size_t ostride, size_t nbytes);
+
+#define DEFINE_COPY_PACKET_KERNEL(PAYLOAD, ROWLEN)                            \
+static void copy_packet_##PAYLOAD##_##ROWLEN(uint8_t * dst,                   \
+    const uint8_t * src, size_t row_len, size_t ostride, size_t nbytes)       \
+{                                                                             \
+  int r;                                                                      \
+  (void)row_len;                                                              \
+  (void)nbytes;                                                               \
+  for(r=0; r<(PAYLOAD)/(ROWLEN); r++) {                                       \
+    memcpy_nt(dst, src, (ROWLEN));                                            \
+    src += (ROWLEN);                                                          \
+    dst += ostride;                                                           \
+  }                                                                           \
+}
+
+// 1024 byte payloads (8 bit samples with HNTIME 256 are the usual case, 16 bit
+// samples with HNTIME 128 also use the 1024,1024 kernel)
+DEFINE_COPY_PACKET_KERNEL(1024, 1024)
+DEFINE_COPY_PACKET_KERNEL(1024, 512)
+DEFINE_COPY_PACKET_KERNEL(1024, 256)
+// Larger payloads with one row per packet (e.g. 16 bit samples with HNTIME
+// 256 in 2048 byte payloads)
+DEFINE_COPY_PACKET_KERNEL(2048, 2048)
+DEFINE_COPY_PACKET_KERNEL(4096, 4096)
+DEFINE_COPY_PACKET_KERNEL(8192, 8192)
+
+// Copies any supported payload size/row_len combination.  Uses non-temporal
+// copies if dst, src, and row_len are suitably aligned.
+static void copy_packet_generic(uint8_t * dst, const uint8_t * src,
+    size_t row_len, size_t ostride, size_t nbytes)
+{
+  int nt = ((uintptr_t)dst | (uintptr_t)src | row_len | ostride)
+    % NT_ALIGNMENT_SIZE == 0;
+
+  while(nbytes >= row_len) {
+    if(nt) {
+      memcpy_nt(dst, src, row_len);
+    } else {
+      memcpy(dst, src, row_len);
+    }
+    src += row_len;
+    dst += ostride;
+    nbytes -= row_len;
+  }
+}
+
+static const struct {
+  uint64_t payload_size;
+  size_t row_len;
+  mk_copy_fn copy;
+} copy_packet_kernels[] = {
+  {1024, 1024, copy_packet_1024_1024},
+  {1024,  512, copy_packet_1024_512},
+  {1024,  256, copy_packet_1024_256},
+  {2048, 2048, copy_packet_2048_2048},
+  {4096, 4096, copy_packet_4096_4096},
+  {8192, 8192, copy_packet_8192_8192}
+};
+
+// The copy kernel selected for the most recent payload size and istride.
+struct copy_kernel_sel {
+  uint64_t payload_size;
+  size_t istride;
+  size_t row_len;
+  mk_copy_fn copy;           // NULL if payload size is not supported
+};
+
+// Selects the copy kernel for packets with payload_size bytes of payload in an
+// observation with istride bytes per row per PKTIDX.  The payload size must be
+// a multiple or an integer fraction of istride and must not exceed
+// max_payload_size (i.e. the payload bytes that fit in an input packet slot).
+// The selection is cached, so this is cheap to call for each packet.  Returns
+// the selected kernel or NULL if the payload size is not supported.
+static mk_copy_fn select_copy_kernel(struct copy_kernel_sel *sel,
+    uint64_t payload_size, size_t istride, size_t max_payload_size)
+{
+  size_t k;
+
+  if(payload_size == sel->payload_size && istride == sel->istride) {
+    return sel->copy;
+  }
+
+  sel->payload_size = payload_size;
+  sel->istride = istride;
+  sel->row_len = payload_size < istride ? payload_size : istride;
+  sel->copy = NULL;
+
+  if(payload_size == 0 || istride == 0 || payload_size > max_payload_size
+  || (payload_size % istride != 0 && istride % payload_size != 0)) {
+    hashpipe_warn(__FUNCTION__,
+        "unsupported payload size %lu (istride %lu, max %lu)",
+        payload_size, istride, max_payload_size);
+    return NULL;
+  }
+
+  sel->copy = copy_packet_generic;
+  for(k=0; k<sizeof(copy_packet_kernels)/sizeof(copy_packet_kernels[0]); k++) {
+    if(copy_packet_kernels[k].payload_size == payload_size
+    && copy_packet_kernels[k].row_len == sel->row_len) {
+      sel->copy = copy_packet_kernels[k].copy;
+      break;
+    }
+  }
+
+  hashpipe_info(__FUNCTION__,
+      "payload size %lu, row length %lu, %s copy kernel", payload_size,
+      sel->row_len, sel->copy == copy_packet_generic ? "generic" : "specialized");
+
+  return sel->copy;
+}
+
 #if 0 // debug(1) vs real(0) copy
 struct ts_mk_feng_spead_info {
   struct timespec ts;
@@ -284,7 +571,8 @@ struct debug_data_block {
 static void copy_packet_data_to_databuf(const struct block_info *bi,
     const struct mk_obs_info * p_oi,
     const struct mk_feng_spead_info * p_fesi,
-    const uint8_t * p_spead_payload)
+    const uint8_t * p_spead_payload,
+    mk_copy_fn copy)
 {
   // Get pointer to data block (cast as a debug_data_block)
   struct debug_data_block * ddb =
@@ -318,20 +606,27 @@ static void copy_packet_data_to_databuf(const struct block_info *bi,
 // packet's spead metadata.
 //
 // The p_spead_payload parameter points to the spead payload of the packet.
+//
+// The copy parameter is the packet copy kernel for the packet's payload size
+// (see select_copy_kernel()).
 static void copy_packet_data_to_databuf(const struct block_info *bi,
     const struct mk_obs_info * p_oi,
     const struct mk_feng_spead_info * p_fesi,
-    const uint8_t * p_spead_payload)
+    const uint8_t * p_spead_payload,
+    mk_copy_fn copy)
 {
-  const uint8_t * src = p_spead_payload;
   uint8_t * dst = (uint8_t *)block_info_data(bi);
-  int bytes_to_copy = p_fesi->payload_size;
 
   // istride is the size of a HNTIME samples in bytes
-  size_t istride = 4 * p_oi->hntime;
+  size_t istride = mk_sample_size(*p_oi) * p_oi->hntime;
+
+  // row_len is the number of bytes per row in the packet
+  size_t row_len = p_fesi->payload_size < istride ?
+    p_fesi->payload_size : istride;
 
   // ostride is the size of a "row" in bytes
-  size_t ostride = 4 * mk_ntime(BLOCK_DATA_SIZE, *p_oi);
+  size_t ostride = mk_sample_size(*p_oi) * mk_ntime(
+      hpguppi_databuf_block_data_size(bi->dbout), *p_oi);
 
   // slot_idx is the index of the slot in the block where the packet's heap goes
   int slot_idx = mk_pktidx(*p_oi, *p_fesi) % bi->pktidx_per_block;
@@ -345,7 +640,7 @@ printf("nstrm      = %d\n", p_oi->nstrm);
 printf("hnchan     = %d\n", p_oi->hnchan);
 printf("feng_chan  = %lu\n", p_fesi->feng_chan);
 printf("schan      = %d\n", p_oi->schan);
-printf("b_to_copy  = %d\n", bytes_to_copy);
+printf("b_to_copy  = %lu\n", p_fesi->payload_size);
 printf("istride    = 0x%08lx\n", istride);
 printf("ostride    = 0x%08lx\n", ostride);
 printf("slot_idx   = %d\n", slot_idx);
@@ -365,26 +660,208 @@ printf("dst        = 0x%p\n", dst);
 printf("dst        = 0x%p\n", dst);
 #endif
 
-  // Advance dst to heap offset.
-  // For now assume that packets are hntime aligned within heap.
-  dst += (p_fesi->heap_offset / istride) * ostride;
+  // Advance dst to heap offset (packets smaller than a row start part way
+  // into the row)
+  dst += (p_fesi->heap_offset / istride) * ostride
+    + p_fesi->heap_offset % istride;
 #if 0
 printf("dst        = 0x%p\n", dst);
 printf("\n");
 #endif
 
   // Copy samples
-  // TODO Ensure that bytes_to_copy is a multiple of istride.
-  while(bytes_to_copy > 0) {
-    memcpy_nt(dst, src, istride);
-    src += istride;
-    dst += ostride;
-    bytes_to_copy -= istride;
-  }
+  copy(dst, p_spead_payload, row_len, ostride, p_fesi->payload_size);
 }
 #endif
 #endif // debug vs real copy
 
+// When the SPDTILE status buffer keyword is non-zero (and SPDNWRK is zero),
+// packet data is not copied directly into the RAW block.  Doing that writes
+// every istride bytes of a packet ostride bytes apart, so each packet touches
+// several distant DRAM pages.  Instead, the packets of each antenna/stream
+// ("heapset") are gathered into a cache resident staging tile that spans
+// SPDTILE consecutive PKTIDX values (i.e. heaps).  When a packet for a later
+// tile of the same heapset arrives, the tile is "flushed", which writes each
+// of its HNCHAN rows to the RAW block as one contiguous run of SPDTILE*istride
+// bytes using non-temporal stores.  Tiles still being filled are flushed
+// before their block is finalized.  SPDTILE must be a power of two and is
+// limited to the number of PKTIDX values per block.
+//
+// Each tile is identified by a monotonic "key" (absolute PKTIDX / SPDTILE).
+// Packets for keys older than a heapset's current tile (e.g. reordered
+// packets) are copied directly into the RAW block.  Regions of the tile that
+// received no packet hold stale data when flushed, but those are zeroed when
+// the block is finalized (see zero_fill_missing_packets()).
+struct heap_tile {
+  int64_t key;         // Key of tile being filled (or last flushed)
+  int active;          // Non-zero if tile holds unflushed packets
+  int64_t block_num;   // Absolute block number of tile
+  uint8_t * dst;       // RAW block address of tile's first row
+};
+
+struct heap_tiler {
+  uint32_t tile_slots;       // Number of PKTIDX values per tile (SPDTILE)
+  struct mk_obs_info oi;     // obs_info that the tiles were sized for
+  uint32_t ntiles;           // Number of heapsets (NANTS*NSTRM)
+  size_t istride;            // Bytes per row per PKTIDX (HNTIME samples)
+  size_t ostride;            // Bytes per row of RAW block
+  size_t tile_size;          // Bytes per tile (HNCHAN*SPDTILE*istride)
+  uint8_t * mem;             // Memory for all tiles
+  struct heap_tile * tiles;
+};
+
+// Writes tile t's rows to the RAW block and marks it inactive.
+static void flush_heap_tile(struct heap_tiler *ht, uint32_t t)
+{
+  struct heap_tile *tile = &ht->tiles[t];
+  const uint8_t *src = ht->mem + t * ht->tile_size;
+  uint8_t *dst = tile->dst;
+  size_t row_len = ht->tile_slots * ht->istride;
+  uint32_t r;
+
+  for(r=0; r<ht->oi.hnchan; r++) {
+    memcpy_nt(dst, src, row_len);
+    src += row_len;
+    dst += ht->ostride;
+  }
+  tile->active = 0;
+}
+
+// Flushes all active tiles of block block_num (or earlier blocks).  Must be
+// called before the block is finalized.
+static void flush_heap_tiles(struct heap_tiler *ht, int64_t block_num)
+{
+  uint32_t t;
+
+  for(t=0; t<ht->ntiles; t++) {
+    if(ht->tiles[t].active && ht->tiles[t].block_num <= block_num) {
+      flush_heap_tile(ht, t);
+    }
+  }
+}
+
+// Discards all tiles (e.g. when working blocks are reset).
+static void reset_heap_tiles(struct heap_tiler *ht)
+{
+  uint32_t t;
+
+  for(t=0; t<ht->ntiles; t++) {
+    ht->tiles[t].active = 0;
+    ht->tiles[t].key = -1;
+  }
+}
+
+// Returns non-zero if ht's tiles were sized for obs_info *p_oi.
+static int heap_tiler_matches(const struct heap_tiler *ht,
+    const struct mk_obs_info *p_oi)
+{
+  return ht->tiles
+    && ht->oi.nants   == p_oi->nants
+    && ht->oi.nstrm   == p_oi->nstrm
+    && ht->oi.hntime  == p_oi->hntime
+    && ht->oi.hnchan  == p_oi->hnchan
+    && ht->oi.hclocks == p_oi->hclocks
+    && ht->oi.schan   == p_oi->schan
+    && ht->oi.nbits   == p_oi->nbits;
+}
+
+// (Re-)sizes ht's tiles for obs_info *p_oi.  Any active tiles are flushed
+// first.  Returns 0 on success, -1 on error (in which case tiling is disabled
+// by setting tile_slots to 0).
+static int resize_heap_tiler(struct heap_tiler *ht,
+    const struct mk_obs_info *p_oi, size_t block_data_size)
+{
+  uint32_t pktidx_per_block = mk_pktidx_per_block(block_data_size, *p_oi);
+
+  if(ht->tiles) {
+    flush_heap_tiles(ht, INT64_MAX);
+  }
+  free(ht->mem);
+  free(ht->tiles);
+  ht->mem = NULL;
+  ht->tiles = NULL;
+
+  ht->oi = *p_oi;
+  while(ht->tile_slots > pktidx_per_block) {
+    ht->tile_slots >>= 1;
+  }
+  ht->ntiles = p_oi->nants * p_oi->nstrm;
+  ht->istride = mk_sample_size(*p_oi) * p_oi->hntime;
+  ht->ostride = mk_sample_size(*p_oi) * mk_ntime(block_data_size, *p_oi);
+  ht->tile_size = p_oi->hnchan * ht->tile_slots * ht->istride;
+
+  if(posix_memalign((void **)&ht->mem, 4096, ht->ntiles * ht->tile_size)
+      || !(ht->tiles = calloc(ht->ntiles, sizeof(struct heap_tile)))) {
+    free(ht->mem);
+    ht->mem = NULL;
+    ht->tile_slots = 0;
+    return -1;
+  }
+  reset_heap_tiles(ht);
+  return 0;
+}
+
+// Copies the packet described by p_fesi (with payload p_spead_payload) into
+// its heapset's staging tile, flushing the tile's previous contents if the
+// packet starts a new tile.  Packets for earlier tiles are copied directly
+// into the RAW block of working block bi using copy kernel copy.
+static void copy_packet_data_to_tile(struct heap_tiler *ht,
+    const struct block_info *bi,
+    const struct mk_feng_spead_info * p_fesi,
+    const uint8_t * p_spead_payload,
+    mk_copy_fn copy)
+{
+  uint64_t pktidx = mk_pktidx(ht->oi, *p_fesi);
+  uint32_t block_chan = mk_block_chan(ht->oi, *p_fesi);
+  uint32_t t = block_chan / ht->oi.hnchan;
+  int64_t key = pktidx / ht->tile_slots;
+  struct heap_tile *tile = &ht->tiles[t];
+  uint32_t row = block_chan % ht->oi.hnchan + p_fesi->heap_offset / ht->istride;
+  size_t row_len = ht->tile_slots * ht->istride;
+  int bytes_to_copy = p_fesi->payload_size;
+  size_t pkt_row_len = p_fesi->payload_size < ht->istride ?
+    p_fesi->payload_size : ht->istride;
+  const uint8_t *src = p_spead_payload;
+  uint8_t *dst;
+
+  if(t >= ht->ntiles
+  || row + (p_fesi->payload_size + ht->istride - 1) / ht->istride
+       > ht->oi.hnchan
+  || key < tile->key) {
+    // Packet is outside of the tiles or its tile has moved on, copy directly
+    copy_packet_data_to_databuf(bi, &ht->oi, p_fesi, p_spead_payload, copy);
+    return;
+  }
+
+  if(key > tile->key) {
+    // Start new tile
+    if(tile->active) {
+      flush_heap_tile(ht, t);
+    }
+    tile->key = key;
+    tile->block_num = bi->block_num;
+    tile->dst = (uint8_t *)block_info_data(bi)
+      + (pktidx % bi->pktidx_per_block) / ht->tile_slots * row_len
+      + (block_chan - block_chan % ht->oi.hnchan) * ht->ostride;
+  } else if(!tile->active) {
+    // Tile was already flushed (e.g. its block was finalized)
+    copy_packet_data_to_databuf(bi, &ht->oi, p_fesi, p_spead_payload, copy);
+    return;
+  }
+  tile->active = 1;
+
+  // Copy rows into tile (temporal stores keep the tile in cache)
+  dst = ht->mem + t * ht->tile_size + row * row_len
+    + (pktidx % ht->tile_slots) * ht->istride
+    + p_fesi->heap_offset % ht->istride;
+  while(bytes_to_copy > 0) {
+    memcpy(dst, src, pkt_row_len);
+    src += pkt_row_len;
+    dst += row_len;
+    bytes_to_copy -= pkt_row_len;
+  }
+}
+
 // Check the given pktidx value against the status buffer's PKTSTART/PKTSTOP
 // values. Logic goes something like this:
 //   if PKTSTART <= pktidx < PKTSTOPs
@@ -492,183 +969,270 @@ struct net_params {
 };
 #endif
 
-//#define USE_WORKER_THREADS
-
-#ifdef USE_WORKER_THREADS
-
-// Define number of worker threads
-#define N_WORKER_THREADS (2)
-
-// Define size of packet_job_queue
-#define PJQ_NUM_ENTRIES (65536)
-
-// We use a thread pool to copy the data from packet blocks to the RAW blocks.
-// This allows multiple copies to occurr in parallel.  When processing a block
-// of packets, we first queue up a list of "packet_jobs", set num_queued and
-// num_pending to the number of jobs, and signal the worker threads that jobs
-// have been queued.  We then wait for a worker to signal when num_pending is
-// zero.  The worker threads take jobs off the queue (decrementing num_queued
-// as they do), do the jobs, then decrement num_pending and signal the "boss"
-// thread if num_pending is zero. The locking and signaling for these two
-// fields are done using a mutex and condition variable for each field.
+// Maximum number of packet copy worker threads (see SPDNWRK below)
+#define MAX_PACKET_WORKERS (16)
+
+// Number of consecutive empty polls of its job ring before a worker naps for
+// WORKER_IDLE_NS nanoseconds.
+#define WORKER_SPINS_BEFORE_NAP (4096)
+#define WORKER_IDLE_NS (10 * 1000)
+
+// When the SPDNWRK status buffer keyword is non-zero, a pool of SPDNWRK worker
+// threads is used to copy the data from packet blocks to the RAW blocks.  This
+// allows multiple copies to occur in parallel.  Each packet's copy is described
+// by a "packet_job" that gets pushed onto the job ring of the worker that is
+// responsible for the packet's antenna/stream (i.e. block_chan/HNCHAN modulo
+// SPDNWRK), so all writes to a given set of RAW block rows are done by the
+// same worker.  Each worker has its own single-producer/single-consumer ring,
+// so pushing and popping jobs needs no locks, just atomic accesses of the
+// ring's head and tail indices.  After all packets of an input block have been
+// pushed, the "boss" thread waits once for all of the rings to drain before
+// marking the input block free.  The boss thread also waits for the rings to
+// drain before finalizing or resetting working blocks.  The optional SPDWCPUS
+// status buffer keyword is a comma separated list of CPUs to pin the workers
+// to.  When SPDNWRK is zero (the default), the boss thread copies the packet
+// data itself.
 //
 // A packet_job is a 2D copy operation specified by the fields of this
-// structure:
+// structure (see mk_copy_fn):
 struct packet_job {
-  uint8_t * src;
+  mk_copy_fn copy;
+  const uint8_t * src;
   uint8_t * dst;
   size_t row_len;
   size_t ostride;
   size_t nbytes;
 };
 
-// A packet_job_queue holds the num_queued/ num_pending variables, the
-// cond_queued/cond_pending condition variables, the mutex for synchronization
-// control, and an array of packet_jobs. The idxnew field is the index into
-// jobs where the next element will be added.  The idxold field is the index of
-// the oldest element in the queue.  If (idxnew+1) % num_entries == idxold, the
-// queue is full.  If idxnew == idxold, the queue is empty.
-struct packet_job_queue {
-  uint32_t idxnew;
-  uint32_t idxold;
-  uint32_t num_queued;
-  uint32_t num_pending;
-  pthread_cond_t cond_queued;
-  pthread_cond_t cond_pending;
-  pthread_mutex_t mutex;
-  struct packet_job jobs[65536]; // TODO un-hard-code the magic number
+// A packet_job_ring holds the jobs for one worker.  The head index is only
+// written by the boss thread and the tail index is only written by the worker
+// thread, so they live on separate cache lines.  Both indices are free running
+// and num_entries is a power of two, so the ring is empty when head == tail
+// and full when head - tail == num_entries.
+struct packet_job_pool;
+struct packet_job_ring {
+  uint32_t head __attribute__((aligned(64)));
+  uint32_t tail __attribute__((aligned(64)));
+  uint32_t num_entries __attribute__((aligned(64)));
+  struct packet_job * jobs;
+  struct packet_job_pool * pool;
+  pthread_t thread;
+  int cpu;
 };
 
-// Pushes a job onto the queue and signals a worker. Returns 1 and sets errno
-// to ENOMEM if queue is full.
+// A packet_job_pool holds the job rings of all the workers.
+struct packet_job_pool {
+  uint32_t nworkers;
+  int stop;
+  struct packet_job_ring rings[MAX_PACKET_WORKERS];
+};
+
+// Pushes a job onto the ring.  If the ring is full, waits for the worker to
+// make room.  This only happens if a worker falls an entire input block behind.
+// Returns 0 on success or -1 (without pushing the job) if the pipeline is
+// shutting down while waiting.
 static int
-push_job(struct packet_job_queue *pjq, uint8_t *dst, uint8_t *src,
-    size_t row_len, size_t ostride, size_t nbytes)
+push_job(struct packet_job_ring *ring, const struct packet_job *job)
 {
-  pthread_mutex_lock(&pjq->mutex);
+  uint32_t head = ring->head;
 
-  // Check for overflow
-  uint32_t idx_nextnew = (pjq->idxnew + 1) % PJQ_NUM_ENTRIES;
-  if(idx_nextnew == pjq->idxold) {
-    pthread_mutex_unlock(&pjq->mutex);
-    errno = ENOMEM;
-    return 1;
+  while(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+      == ring->num_entries) {
+    if(!run_threads()) {
+      return -1;
+    }
+    pthread_testcancel();
+    sched_yield();
   }
 
-  // Copy jobs fields
-  struct packet_job *p_job = &pjq->jobs[pjq->idxnew];
-  p_job->src = src;
-  p_job->dst = dst;
-  p_job->row_len = row_len;
-  p_job->ostride = ostride;
-  p_job->nbytes = nbytes;
-
-  // Update queue state
-  pjq->idxnew = idx_nextnew;
-  pjq->num_queued++;
-  pjq->num_pending++;
-
-  // Signal a worker that there is another entry
-  //pthread_cond_signal(&pjq->cond_queued);
-  pthread_cond_broadcast(&pjq->cond_queued);
-  pthread_mutex_unlock(&pjq->mutex);
+  ring->jobs[head & (ring->num_entries - 1)] = *job;
+
+  // Publish job to worker
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
   return 0;
 }
 
-// Pops a job from the queue.  If no job is available, wait for one.
-static void
-pop_job(struct packet_job_queue *pjq, uint8_t **dst, uint8_t **src,
-    size_t *row_len, size_t *ostride, size_t *nbytes)
+// Waits for all pending jobs of all workers to complete (called by "boss"
+// thread).  Returns 0 on success or -1 if the pipeline is shutting down while
+// waiting.
+static int
+wait_for_job_completion(struct packet_job_pool *pool)
 {
-  pthread_mutex_lock(&pjq->mutex);
-
-  // Wait until non-empty
-  while(pjq->num_queued == 0) {
-    pthread_cond_wait(&pjq->cond_queued, &pjq->mutex);
+  uint32_t w;
+  uint32_t spins = 0;
+  struct packet_job_ring *ring;
+
+  for(w=0; w<pool->nworkers; w++) {
+    ring = &pool->rings[w];
+    while(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+      // Check for shutdown every so often
+      if(++spins % WORKER_SPINS_BEFORE_NAP == 0) {
+        if(!run_threads()) {
+          return -1;
+        }
+        pthread_testcancel();
+      }
+      __builtin_ia32_pause();
+    }
   }
 
-  // Copy jobs fields
-  struct packet_job *p_job = &pjq->jobs[pjq->idxold];
-  *src = p_job->src;
-  *dst = p_job->dst;
-  *row_len = p_job->row_len;
-  *ostride = p_job->ostride;
-  *nbytes = p_job->nbytes;
+  return 0;
+}
+
+// This is the function for packet jobs workers.  The void * argument will be
+// interpreted as a pointer to the worker's packet_job_ring structure.  Workers
+// only exit once the pool is stopping and their ring is empty, so the boss
+// thread never waits for jobs that no worker will do.
+static
+void *
+packet_job_function(void * arg)
+{
+  struct packet_job_ring * ring = (struct packet_job_ring *)arg;
+  struct packet_job my_job;
+  uint32_t tail = ring->tail;
+  uint32_t head;
+  int spins = 0;
+  struct timespec ts_nap = {0, WORKER_IDLE_NS};
+
+  for(;;) {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(head == tail) {
+      if(__atomic_load_n(&ring->pool->stop, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      if(++spins < WORKER_SPINS_BEFORE_NAP) {
+        __builtin_ia32_pause();
+      } else {
+        nanosleep(&ts_nap, NULL);
+        spins = 0;
+      }
+      continue;
+    }
+    spins = 0;
+
+    // Do all the jobs that have been queued so far
+    while(tail != head) {
+      my_job = ring->jobs[tail & (ring->num_entries - 1)];
+      my_job.copy(my_job.dst, my_job.src,
+          my_job.row_len, my_job.ostride, my_job.nbytes);
+      tail++;
+    }
 
-  // Update queue state
-  pjq->idxold = (pjq->idxold + 1) % PJQ_NUM_ENTRIES;
-  pjq->num_queued--;
+    // Make sure the non-temporal stores are globally visible before marking
+    // the jobs done.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
 
-  pthread_mutex_unlock(&pjq->mutex);
+  return NULL;
 }
 
-// Marks the completion of a job by decrementing the num_pending counter.
-// If it goes to zero, signal everyone waiting on cond_pending.
+// Stops and joins the first nworkers worker threads of pool and frees their
+// job rings.
 static void
-complete_job(struct packet_job_queue *pjq)
+stop_packet_workers(struct packet_job_pool *pool, uint32_t nworkers)
 {
-  pthread_mutex_lock(&pjq->mutex);
+  uint32_t w;
 
-  // Mark job done
-  if(pjq->num_pending != 0) {
-    pjq->num_pending--;
-  } else {
-    fprintf(stderr, "completing job, but num_pending is already zero");
+  __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+  for(w=0; w<nworkers; w++) {
+    pthread_join(pool->rings[w].thread, NULL);
   }
-  if(pjq->num_pending == 0) {
-    // Signal that all jobs are done
-    pthread_cond_signal(&pjq->cond_pending);
+  for(w=0; w<pool->nworkers; w++) {
+    free(pool->rings[w].jobs);
+    pool->rings[w].jobs = NULL;
   }
-
-  pthread_mutex_unlock(&pjq->mutex);
+  pool->nworkers = 0;
 }
 
-// Waits for all pending jobs to complete (called by "boss" thread)
+// Cleanup handler that stops all worker threads of the packet_job_pool pointed
+// to by arg (if they are still running) when the boss thread exits or is
+// cancelled.
 static void
-wait_for_job_completion(struct packet_job_queue *pjq)
+cleanup_packet_workers(void *arg)
 {
-  pthread_mutex_lock(&pjq->mutex);
+  struct packet_job_pool *pool = (struct packet_job_pool *)arg;
 
-  // Wait until num_pending == 0
-  while(pjq->num_pending != 0) {
-    pthread_cond_wait(&pjq->cond_pending, &pjq->mutex);
-  }
-
-  pthread_mutex_unlock(&pjq->mutex);
+  stop_packet_workers(pool, pool->nworkers);
 }
 
-// This is the function for packet jobs workers.  The void * argument will be
-// interpreted as a pointer to a packet_job_queue structure.
-static
-void *
-packet_job_function(void * arg)
+// Starts pool->nworkers worker threads, each with a job ring that can hold at
+// least min_entries jobs.  The cpus string is a comma separated list of CPUs
+// for the workers (workers without a CPU are not pinned).  Returns 0 on success
+// or -1 on error (in which case no workers are running).
+static int
+start_packet_workers(struct packet_job_pool *pool, uint32_t min_entries,
+    const char * cpus)
 {
-  struct packet_job_queue * pjq = (struct packet_job_queue *)arg;
-  struct packet_job my_job;
+  uint32_t w;
+  uint32_t num_entries = 1;
+  char * p = (char *)cpus;
+  pthread_attr_t attr;
+  cpu_set_t cpuset;
+  int rv;
 
-  while(run_threads()) {
-    // Pop a job (waits until there is a job)
-    pop_job(pjq, &my_job.dst, &my_job.src,
-        &my_job.row_len, &my_job.ostride, &my_job.nbytes);
+  while(num_entries < min_entries) {
+    num_entries <<= 1;
+  }
 
-#if 0
-    // Do job
-    while(my_job.nbytes > 0) {
-      memcpy_nt(my_job.dst, my_job.src, my_job.row_len);
-      my_job.src += my_job.row_len;
-      my_job.dst += my_job.ostride;
-      my_job.nbytes -= my_job.row_len;
+  pool->stop = 0;
+  for(w=0; w<pool->nworkers; w++) {
+    struct packet_job_ring * ring = &pool->rings[w];
+    ring->head = 0;
+    ring->tail = 0;
+    ring->num_entries = num_entries;
+    ring->pool = pool;
+    ring->cpu = -1;
+    if(*p) {
+      ring->cpu = strtol(p, &p, 0);
+      if(*p == ',') {
+        p++;
+      }
     }
-#endif
+    ring->jobs = calloc(num_entries, sizeof(struct packet_job));
+    if(!ring->jobs) {
+      stop_packet_workers(pool, w);
+      return -1;
+    }
+  }
 
-    // Mark job done
-    complete_job(pjq);
+  for(w=0; w<pool->nworkers; w++) {
+    struct packet_job_ring * ring = &pool->rings[w];
+    pthread_attr_init(&attr);
+    if(ring->cpu >= 0) {
+      CPU_ZERO(&cpuset);
+      CPU_SET(ring->cpu, &cpuset);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+    rv = pthread_create(&ring->thread, &attr, packet_job_function, ring);
+    pthread_attr_destroy(&attr);
+    if(rv) {
+      errno = rv;
+      stop_packet_workers(pool, w);
+      return -1;
+    }
   }
 
-  return NULL;
+  return 0;
 }
 
-#endif // USE_WORKER_THREADS
+// Applies the ANTMASK/CHANRANGE selection in *p_sub (see struct
+// hpguppi_subset) to *p_oi and stores the compacted obs_info, which describes
+// the RAW block layout, in *p_sel.  *p_sel will be invalid if *p_oi is invalid
+// or nothing is selected.
+static void select_obs_info(struct mk_obs_info *p_sel,
+    const struct mk_obs_info *p_oi, struct hpguppi_subset *p_sub)
+{
+  *p_sel = *p_oi;
+  if(mk_obs_info_valid(*p_oi)) {
+    hpguppi_subset_compact(p_sub,
+        p_oi->nants, p_oi->nstrm, p_oi->hnchan, p_oi->schan);
+    p_sel->nants = p_sub->nants;
+    p_sel->nstrm = p_sub->nstrm;
+    p_sel->schan = p_sub->schan;
+  }
+}
 
 // This thread's init() function, if provided, is called by the Hashpipe
 // framework at startup to allow the thread to perform initialization tasks
@@ -683,7 +1247,8 @@ static int init(hashpipe_thread_args_t *args)
   hashpipe_status_t *st = &args->st;
 
   // Non-network essential paramaters
-  int blocsize=BLOCK_DATA_SIZE;
+  int blocsize=hpguppi_databuf_block_data_size(
+      (hpguppi_input_databuf_t *)args->obuf);
   int directio=1;
   int nbits=8;
   int npol=4;
@@ -703,7 +1268,10 @@ static int init(hashpipe_thread_args_t *args)
   if(hpguppi_pktbuf_slot_offset(dbin, PKT_OFFSET_MEERKAT_SPEAD_HEADER) %
       PKT_ALIGNMENT_SIZE != 0
   || hpguppi_pktbuf_slot_offset(dbin, PKT_OFFSET_MEERKAT_SPEAD_PAYLOAD) %
-      PKT_ALIGNMENT_SIZE != 0) {
+      PKT_ALIGNMENT_SIZE != 0
+  || hpguppi_pktbuf_slot_offset(dbin, PKT_OFFSET_MEERKAT_SPEAD_PAYLOAD) -
+     hpguppi_pktbuf_slot_offset(dbin, PKT_OFFSET_MEERKAT_SPEAD_HEADER) !=
+      offsetof(struct mk_ibv_spead_pkt, payload) - offsetof(struct mk_ibv_spead_pkt, spdhdr)) {
     errno = EINVAL;
     hashpipe_error(thread_name, "IBVPKTSZ!=%d,%d,[...]",
         PKT_OFFSET_MEERKAT_SPEAD_HEADER, PKT_OFFSET_MEERKAT_SPEAD_PAYLOAD -
@@ -792,6 +1360,9 @@ int debug_i=0, debug_j=0;
   const char * thread_name = args->thread_desc->name;
   const char * status_key = args->thread_desc->skey;
 
+  // Size of data area of the output databuf's blocks
+  const size_t block_data_size = hpguppi_databuf_block_data_size(dbout);
+
   // String version of destination address
   char dest_ip_stream_str[80] = {};
   char dest_ip_stream_str_new[80] = {};
@@ -805,10 +1376,18 @@ int debug_i=0, debug_j=0;
   uint32_t max_flows = 0;
   // Port to listen on
   uint32_t port = 7148;
+  // Packet job pool for worker threads (see SPDNWRK)
+  struct packet_job_pool pool = {0};
+  char spdwcpus[80] = {0};
+  // Staging tiles for heapsets (see SPDTILE)
+  struct heap_tiler tiler = {0};
 
   // Current run state
   //enum run_states state = LISTEN;
   unsigned waiting = 0;
+  // Report NUMA node of this thread
+  hpguppi_numa_report_thread(args);
+
   // Update status_key with idle state and get max_flows, port
   hashpipe_status_lock_safe(st);
   {
@@ -817,6 +1396,19 @@ int debug_i=0, debug_j=0;
     hgetu4(st->buf, "BINDPORT", &port);
     // Store bind port in status buffer (in case it was not there before).
     hputu4(st->buf, "BINDPORT", port);
+    hgetu4(st->buf, "SPDNWRK", &pool.nworkers);
+    hgets(st->buf, "SPDWCPUS", sizeof(spdwcpus), spdwcpus);
+    if(pool.nworkers > MAX_PACKET_WORKERS) {
+      pool.nworkers = MAX_PACKET_WORKERS;
+    }
+    hputu4(st->buf, "SPDNWRK", pool.nworkers);
+    hgetu4(st->buf, "SPDTILE", &tiler.tile_slots);
+    // Must be power of 2 and is not supported with worker threads
+    tiler.tile_slots = prevpow2(tiler.tile_slots);
+    if(pool.nworkers > 0) {
+      tiler.tile_slots = 0;
+    }
+    hputu4(st->buf, "SPDTILE", tiler.tile_slots);
   }
   hashpipe_status_unlock_safe(st);
 
@@ -835,7 +1427,7 @@ int debug_i=0, debug_j=0;
   uint8_t u8 = 0;
   uint8_t *pu8in = (uint8_t *)dbin;
   uint8_t *pu8out = (uint8_t *)dbout;
-  for(u64=0; u64<sizeof(hpguppi_input_databuf_t); u64+=4096) {
+  for(u64=0; u64<hpguppi_databuf_total_size(dbin); u64+=4096) {
     if(u8 || !u8) {
       u8 += pu8in[u64];
       u8 += pu8out[u64];
@@ -843,95 +1435,61 @@ int debug_i=0, debug_j=0;
   }
   hashpipe_info(thread_name, "db pagein sum is %u", u8);
 #endif
-  memset(dbout->block, 0, sizeof(dbout->block));
+  memset(hpguppi_databuf_blocks(dbout), 0, hpguppi_databuf_blocks_size(dbout));
   hashpipe_info(thread_name,
-      "set %lu bytes in dbout to 0", sizeof(dbout->block));
+      "set %lu bytes in dbout to 0", hpguppi_databuf_blocks_size(dbout));
 
-  for(i=0; i<N_INPUT_BLOCKS; i++) {
+  for(i=0; i<dbin->header.n_block; i++) {
     hashpipe_info(thread_name, "db_in  block %2d : %p %p", i,
         hpguppi_databuf_data(dbin, i),
-        hpguppi_databuf_data(dbin, i) + BLOCK_DATA_SIZE - 1);
+        hpguppi_databuf_data(dbin, i) +
+          hpguppi_databuf_block_data_size(dbin) - 1);
   }
 
-  for(i=0; i<N_INPUT_BLOCKS; i++) {
+  for(i=0; i<dbout->header.n_block; i++) {
     hashpipe_info(thread_name, "db_out block %2d : %p %p", i,
         hpguppi_databuf_data(dbout, i),
-        hpguppi_databuf_data(dbout, i) + BLOCK_DATA_SIZE - 1);
+        hpguppi_databuf_data(dbout, i) + block_data_size - 1);
   }
 
   int njobs = 0;
-#ifdef USE_WORKER_THREADS
-  // Packet job queue for worker threads and worker threads
-#if 0
-  struct packet_job_queue pjq = {
-    .num_queued = 0,
-    .num_pending = 0,
-    .cond_queued = PTHREAD_COND_INITIALIZER,
-    .cond_pending = PTHREAD_COND_INITIALIZER,
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
-    .jobs = {{0}}
-  };
-#else
-  struct packet_job_queue *pjq = calloc(1, sizeof(struct packet_job_queue));
-  pthread_cond_init(&pjq->cond_queued, NULL);
-  pthread_cond_init(&pjq->cond_pending, NULL);
-  pthread_mutex_init(&pjq->mutex, NULL);
-#endif
-
   // Used when pushing a packet_job
   struct packet_job pktjob;
-
-  // These will be the worker threads
-  pthread_t worker_threads[N_WORKER_THREADS];
-  pthread_attr_t pthread_attr;
-  //struct sched_param sched_param = {1};
-	cpu_set_t cpuset;
-
-  // Create worker threads
-  pthread_attr_init(&pthread_attr);
-  //pthread_attr_setschedpolicy(&pthread_attr, SCHED_RR);
-  //pthread_attr_setschedparam(&pthread_attr, &sched_param);
-  //pthread_attr_setinheritsched(&pthread_attr, PTHREAD_EXPLICIT_SCHED);
-  //pthread_attr_set_schedparam();
-  for(i=0; i<N_WORKER_THREADS; i++) {
-    // Set cpu affinity
-    CPU_ZERO(&cpuset);
-    CPU_SET(12+i, &cpuset);
-    rv = pthread_attr_setaffinity_np(&pthread_attr, sizeof(cpu_set_t), &cpuset);
-    if (rv) {
-      hashpipe_warn(thread_name,
-          "Error setting cpu affinity for thread %d to %d [%s]",
-          i, 12+i, strerror(errno));
-    }
-    if(pthread_create(&worker_threads[i], &pthread_attr, packet_job_function, pjq)) {
-      hashpipe_error(thread_name, "error creating worker thread %d", i);
-      return NULL;
-    }
-  }
-#endif // USE_WORKER_THREADS
+  int block_chan;
 
   // The incoming packets are taken from blocks of the input databuf and then
   // converted to GUPPI RAW format in blocks of the output databuf to pass to
-  // the downstream thread.  We currently support two active output blocks (aka
-  // "working blocks").  Working blocks are associated with absolute output
-  // block numbers, which are simply PKTIDX values divided by the number of
-  // packets per block (discarding any remainder).  Let the block numbers for
-  // the first working block (wblk[0]) be W.  The block number for the second
-  // working block (wblk[1]) will be W+1.  Incoming packets corresponding to
-  // block W or W+1 are placed in the corresponding data buffer block.
-  // Incoming packets for block W+2 cause block W to be "finalized" and handed
-  // off to the downstream thread, working block 1 moves to working block 0 and
-  // working block 1 is incremented to be W+2.  Things get "interesting" when a
-  // packet is recevied for block < W or block > W+2.  Packets for block W-1
-  // are ignored.  Packets with PKTIDX P corresponding block < W-1 or block >
-  // W+2 cause the current working blocks' block numbers to be reset such that
-  // W will refer to the block containing P and W+1 will refer to the block
-  // after that.
+  // the downstream thread.  We currently support NWBLK (default 2) active
+  // output blocks (aka "working blocks").  Working blocks are associated with
+  // absolute output block numbers, which are simply PKTIDX values divided by
+  // the number of packets per block (discarding any remainder).  Let the block
+  // numbers for the first working block (wblk[0]) be W.  The block number for
+  // the last working block (wblk[NWBLK-1]) will be L = W+NWBLK-1.  Incoming
+  // packets corresponding to blocks W through L are placed in the
+  // corresponding data buffer block.  Incoming packets for block L+1 cause
+  // block W to be "finalized" and handed off to the downstream thread, the
+  // remaining working blocks move down one position and the last working block
+  // is incremented to be L+1.  Things get "interesting" when a packet is
+  // recevied for block < W or block > L+1.  Packets for blocks W-NWBLK through
+  // W-1 are late and are ignored (but counted in NLATE).  Packets with PKTIDX P
+  // corresponding block < W-NWBLK or block > L+1 cause the current working
+  // blocks' block numbers to be reset such that W will refer to the block
+  // after the block containing P.  Larger NWBLK values tolerate more skew
+  // between packet streams.  To help choose NWBLK, LATEHIST is a histogram of
+  // how many blocks before the newest working block (i.e. L) packets arrived
+  // since the previous status buffer update.
   //
-  // wblk is a two element array of block_info structures (i.e. the working
-  // blocks)
-  struct block_info wblk[2];
+  // wblk is an array of block_info structures (i.e. the working blocks), nwblk
+  // of which are used.
+  struct block_info wblk[HPGUPPI_MAX_WBLKS] = {0};
   int wblk_idx;
+  int nwblk;
+  int wblk_last;
+  // Used to rotate working blocks (and their received packet bitmaps)
+  struct block_info wblk_tmp;
+  // Late packet histogram (see HPGUPPI_LATEHIST_BINS)
+  uint64_t latehist[HPGUPPI_LATEHIST_BINS] = {0};
+  char latehist_str[80];
 
   // Packet block variables
   uint64_t pkt_seq_num = 0;
@@ -956,6 +1514,11 @@ int debug_i=0, debug_j=0;
   int block_idx_in = 0;
   const int npkts_per_block_in = pktbuf_info->slots_per_block;
   const int slot_size = pktbuf_info->slot_size;
+  // Offset from the start of a slot to where the packet's struct mk_ibv_spead_pkt
+  // starts.  This is negative if the Ethernet/IP/UDP headers are skipped
+  // (see IBVSKIP), but only the spdhdr and payload fields get accessed.
+  const off_t pkt_offset = hpguppi_pktbuf_slot_offset(dbin, PKT_OFFSET_MEERKAT_SPEAD_HEADER)
+    - offsetof(struct mk_ibv_spead_pkt, spdhdr);
   struct timespec timeout_in = {0, 50 * 1000 * 1000}; // 50 ms
 
   // Variables for counting packets and bytes.
@@ -973,6 +1536,16 @@ int debug_i=0, debug_j=0;
   // Structure to hold observation info, init all fields to invalid values
   struct mk_obs_info obs_info;
   mk_obs_info_init(&obs_info);
+  // Structure to hold selected subset of obs_info (see ANTMASK/CHANRANGE),
+  // which determines the RAW block layout.
+  struct hpguppi_subset subset = {0};
+  struct mk_obs_info sel_info = obs_info;
+
+  // Per-input loss statistics (see hpguppi_lossstat.h) and the original
+  // (i.e. uncompacted) F engine ID and stream number of the current packet
+  struct hpguppi_lossstat * lossstat = NULL;
+  uint64_t ls_ant = 0;
+  uint64_t ls_strm = 0;
 
   // OBSNCHAN is total number of channels handled by this instance.
   // For arrays like MeerKAT, it is NANTS*NSTRM*HNCHAN.
@@ -980,14 +1553,22 @@ int debug_i=0, debug_j=0;
   // PKTIDX per block (depends on obs_info).  Init to 0 to cause div-by-zero
   // error if using it unintialized (crash early, crash hard!).
   uint32_t pktidx_per_block = 0;
-  // Effective block size (will be less than BLOCK_DATA_SIZE when
-  // BLOCK_DATA_SIZE is not divisible by NCHAN and/or HNTIME.
+  // Effective block size (will be less than block_data_size when
+  // block_data_size is not divisible by NCHAN and/or HNTIME.
   // Historically, BLOCSIZE gets stored as a signed 4 byte integer
   int32_t eff_block_size;
 
   // Structure to hold feng spead info from packet
   struct mk_feng_spead_info feng_spead_info = {0};
 
+  // Packet copy kernel for the current payload size (see
+  // select_copy_kernel()).  Payloads larger than the payload bytes of an input
+  // slot are not supported.
+  struct copy_kernel_sel kernel_sel = {0};
+  mk_copy_fn copy_kernel = NULL;
+  const size_t max_payload_size =
+    pktbuf_info->pkt_size - PKT_OFFSET_MEERKAT_SPEAD_PAYLOAD;
+
   // Variables for tracking timing stats
   //
   // ts_start_recv(N) to ts_stop_recv(N) is the time spent in the "receive" call.
@@ -1014,7 +1595,8 @@ int debug_i=0, debug_j=0;
   // Used to calculate moving average of fill-to-free times for input blocks
   uint64_t fill_to_free_elapsed_ns;
   uint64_t fill_to_free_moving_sum_ns = 0;
-  uint64_t fill_to_free_block_ns[N_INPUT_BLOCKS] = {0};
+  uint64_t fill_to_free_block_ns[dbin->header.n_block];
+  memset(fill_to_free_block_ns, 0, sizeof(fill_to_free_block_ns));
 
   //struct timespec ts_sleep = {0, 10 * 1000 * 1000}; // 10 ms
 
@@ -1029,8 +1611,34 @@ int debug_i=0, debug_j=0;
   }
 #endif
 
+  // Start packet copy worker threads, if requested.  Each ring can hold all
+  // the packets of an input block.
+  if(pool.nworkers > 0) {
+    if(start_packet_workers(&pool, npkts_per_block_in, spdwcpus)) {
+      hashpipe_error(thread_name, "error starting packet copy workers");
+      return NULL;
+    }
+    hashpipe_info(thread_name, "started %u packet copy workers",
+        pool.nworkers);
+  }
+
+  // Create loss statistics table
+  if(!(lossstat = hpguppi_lossstat_create(st->instance_id))) {
+    hashpipe_error(thread_name, "cannot allocate loss statistics");
+    stop_packet_workers(&pool, pool.nworkers);
+    return NULL;
+  }
+  hashpipe_status_lock_safe(st);
+  {
+    hputs(st->buf, "LOSSSHM", lossstat->table ? lossstat->name : "none");
+  }
+  hashpipe_status_unlock_safe(st);
+
   // Initialize working blocks
-  for(wblk_idx=0; wblk_idx<2; wblk_idx++) {
+  nwblk = hpguppi_status_get_nwblk(st, dbout->header.n_block);
+  wblk_last = nwblk - 1;
+  for(wblk_idx=0; wblk_idx<nwblk; wblk_idx++) {
+    alloc_block_info_rxmap(wblk+wblk_idx, block_data_size);
     init_block_info(wblk+wblk_idx, dbout, wblk_idx, wblk_idx, 0);
     wait_for_block_free(wblk+wblk_idx, st, status_key);
   }
@@ -1043,16 +1651,19 @@ int debug_i=0, debug_j=0;
     hgetu4(st->buf, "NANTS",   &obs_info.nants);
     hgetu4(st->buf, "NSTRM",   &obs_info.nstrm);
     hgetu4(st->buf, "HNTIME",  &obs_info.hntime);
+    hgetu4(st->buf, "NBITS",   &obs_info.nbits);
     hgetu4(st->buf, "HNCHAN",  &obs_info.hnchan);
     hgetu8(st->buf, "HCLOCKS", &obs_info.hclocks);
     hgeti4(st->buf, "SCHAN",   &obs_info.schan);
+    hpguppi_subset_read(st->buf, &subset);
+    select_obs_info(&sel_info, &obs_info, &subset);
 
-    // If obs_info is valid
-    if(mk_obs_info_valid(obs_info)) {
+    // If (selected) obs_info is valid
+    if(mk_obs_info_valid(sel_info)) {
       // Update obsnchan, pktidx_per_block, and eff_block_size
-      obsnchan = mk_obsnchan(obs_info);
-      pktidx_per_block = mk_pktidx_per_block(BLOCK_DATA_SIZE, obs_info);
-      eff_block_size = mk_block_size(BLOCK_DATA_SIZE, obs_info);
+      obsnchan = mk_obsnchan(sel_info);
+      pktidx_per_block = mk_pktidx_per_block(block_data_size, sel_info);
+      eff_block_size = mk_block_size(block_data_size, sel_info);
 
       hputs(st->buf, "OBSINFO", "VALID");
     } else {
@@ -1064,6 +1675,7 @@ int debug_i=0, debug_j=0;
     hputu4(st->buf, "NANTS",   obs_info.nants);
     hputu4(st->buf, "NSTRM",   obs_info.nstrm);
     hputu4(st->buf, "HNTIME",  obs_info.hntime);
+    hputu4(st->buf, "NBITS",   obs_info.nbits);
     hputu4(st->buf, "HNCHAN",  obs_info.hnchan);
     hputu8(st->buf, "HCLOCKS", obs_info.hclocks);
     hputi4(st->buf, "SCHAN",   obs_info.schan);
@@ -1074,6 +1686,9 @@ int debug_i=0, debug_j=0;
   }
   hashpipe_status_unlock_safe(st);
 
+  // Stop the workers however this thread exits
+  pthread_cleanup_push(cleanup_packet_workers, &pool);
+
   // Wait for ibvpkt thread to be running, then it's OK to add/remove flows.
   hpguppi_ibvpkt_wait_running(st);
 
@@ -1121,6 +1736,9 @@ int debug_i=0, debug_j=0;
         }
         ts_prev_phys = ts_curr_phys;
 
+        // Publish loss statistics
+        hpguppi_lossstat_publish(lossstat, obs_info.nants, obs_info.nstrm);
+
         hashpipe_status_lock_safe(st);
         {
           hputs(st->buf, "DAQPULSE", timestr);
@@ -1139,16 +1757,19 @@ int debug_i=0, debug_j=0;
           hgetu4(st->buf, "NANTS",   &obs_info.nants);
           hgetu4(st->buf, "NSTRM",   &obs_info.nstrm);
           hgetu4(st->buf, "HNTIME",  &obs_info.hntime);
+          hgetu4(st->buf, "NBITS",   &obs_info.nbits);
           hgetu4(st->buf, "HNCHAN",  &obs_info.hnchan);
           hgetu8(st->buf, "HCLOCKS", &obs_info.hclocks);
           hgeti4(st->buf, "SCHAN",   &obs_info.schan);
+          hpguppi_subset_read(st->buf, &subset);
+          select_obs_info(&sel_info, &obs_info, &subset);
 
-          // If obs_info is valid
-          if(mk_obs_info_valid(obs_info)) {
+          // If (selected) obs_info is valid
+          if(mk_obs_info_valid(sel_info)) {
             // Update obsnchan, pktidx_per_block, and eff_block_size
-            obsnchan = mk_obsnchan(obs_info);
-            pktidx_per_block = mk_pktidx_per_block(BLOCK_DATA_SIZE, obs_info);
-            eff_block_size = mk_block_size(BLOCK_DATA_SIZE, obs_info);
+            obsnchan = mk_obsnchan(sel_info);
+            pktidx_per_block = mk_pktidx_per_block(block_data_size, sel_info);
+            eff_block_size = mk_block_size(block_data_size, sel_info);
 
             hputu4(st->buf, "OBSNCHAN", obsnchan);
             hputu4(st->buf, "PIPERBLK", pktidx_per_block);
@@ -1202,6 +1823,7 @@ int debug_i=0, debug_j=0;
             hputu4(st->buf, "NANTS",   obs_info.nants);
             hputu4(st->buf, "NSTRM",   obs_info.nstrm);
             hputu4(st->buf, "HNTIME",  obs_info.hntime);
+            hputu4(st->buf, "NBITS",   obs_info.nbits);
             hputu4(st->buf, "HNCHAN",  obs_info.hnchan);
             hputu8(st->buf, "HCLOCKS", obs_info.hclocks);
             hputi4(st->buf, "SCHAN",   obs_info.schan);
@@ -1317,8 +1939,8 @@ int debug_i=0, debug_j=0;
       break;
     }
 
-    // If obs_info is invalid
-    if(!mk_obs_info_valid(obs_info)) {
+    // If (selected) obs_info is invalid
+    if(!mk_obs_info_valid(sel_info)) {
       hashpipe_status_lock_safe(st);
       {
         hputs(st->buf, status_key, "obsinfo");
@@ -1357,7 +1979,7 @@ int debug_i=0, debug_j=0;
       // Non-temporally copy packet into cached buffer
       memcpy_nt(p_spdpkt, p_u8pkt, MAX_PKT_SIZE);
 #else
-      p_spdpkt = (struct mk_ibv_spead_pkt *)p_u8pkt;
+      p_spdpkt = (struct mk_ibv_spead_pkt *)(p_u8pkt + pkt_offset);
 #endif
 
       // TODO Validate that this is a valid packet for us!
@@ -1377,10 +1999,12 @@ fflush(stdout);
       p_spead_payload = mk_parse_mkfeng_ibv_spead_packet(
           p_spdpkt, &feng_spead_info);
 
-      // Warn about unexpected payload sizes, and ignore
-      if(feng_spead_info.payload_size != 1024) {
-        hashpipe_warn(thread_name, "unexpected payload size %u",
-            feng_spead_info.payload_size);
+      // Select copy kernel for payload size, ignore unsupported payload
+      // sizes (select_copy_kernel() warns about them)
+      if(!(copy_kernel = select_copy_kernel(&kernel_sel,
+              feng_spead_info.payload_size,
+              mk_sample_size(sel_info) * sel_info.hntime,
+              max_payload_size))) {
 #if 0
         for(i=0; i<144; i++) {
           if(i%16 == 0) fprintf(stderr, "%04x:", i);
@@ -1396,6 +2020,16 @@ fflush(stdout);
         continue;
       }
 
+      // Remember input for loss statistics
+      ls_ant = feng_spead_info.feng_id;
+      ls_strm = (feng_spead_info.feng_chan - obs_info.schan) / obs_info.hnchan;
+
+      // Ignore packets not selected by ANTMASK/CHANRANGE, renumber FID
+      if(!hpguppi_subset_select(&subset,
+            &feng_spead_info.feng_id, feng_spead_info.feng_chan)) {
+        continue;
+      }
+
       // Count packet and the payload bits
       packet_count++;
       pkts_processed_net++;
@@ -1404,7 +2038,7 @@ fflush(stdout);
       bits_processed_phys += 8 * feng_spead_info.payload_size;
 
       // Get packet index and absolute block number for packet
-      pkt_seq_num = mk_pktidx(obs_info, feng_spead_info);
+      pkt_seq_num = mk_pktidx(sel_info, feng_spead_info);
       pkt_blk_num = pkt_seq_num / pktidx_per_block;
 
 #if 0
@@ -1467,7 +2101,7 @@ fprintf(stderr, "feng_chan    = 0x%016lx\n", feng_spead_info.feng_chan   );
           //     tbin * ntime/block
           //
           // To get an integer number of blocks, simply truncate
-          dwell_blocks = trunc(dwell_seconds / (tbin * mk_ntime(BLOCK_DATA_SIZE, obs_info)));
+          dwell_blocks = trunc(dwell_seconds / (tbin * mk_ntime(block_data_size, sel_info)));
 
           stop_seq_num = start_seq_num + pktidx_per_block * dwell_blocks;
           hputi8(st->buf, "PKTSTOP", stop_seq_num);
@@ -1479,52 +2113,78 @@ fprintf(stderr, "feng_chan    = 0x%016lx\n", feng_spead_info.feng_chan   );
           hgetu8(st->buf, "NLATE", &u64tmp);
           u64tmp += nlate; nlate = 0;
           hputu8(st->buf, "NLATE", u64tmp);
+
+          hpguppi_latehist_str(latehist_str, sizeof(latehist_str), latehist);
+          hputs(st->buf, "LATEHIST", latehist_str);
+          memset(latehist, 0, sizeof(latehist));
         }
         hashpipe_status_unlock_safe(st);
       } // End status buffer block update
 
       // Manage blocks based on pkt_blk_num
-      if(pkt_blk_num == wblk[1].block_num + 1) {
+      if(pkt_blk_num == wblk[wblk_last].block_num + 1) {
         // Time to advance the blocks!!!
 #if 0
-printf("next block (%ld == %ld + 1)\n", pkt_blk_num, wblk[1].block_num);
+printf("next block (%ld == %ld + 1)\n", pkt_blk_num, wblk[wblk_last].block_num);
 #endif
 
-#ifdef USE_WORKER_THREADS
         // Wait for any pending jobs to complete
-        wait_for_job_completion(pjq);
-#endif // USE_WORKER_THREADS
-        // Finalize first working block
+        if(wait_for_job_completion(&pool)) {
+          break;
+        }
+        // Flush any staging tiles of first working block
+        if(tiler.tiles) {
+          flush_heap_tiles(&tiler, wblk[0].block_num);
+        }
+        // Finalize first working block (with compacted layout in header)
+        hpguppi_subset_update_header(block_info_header(wblk), &subset);
         finalize_block(wblk);
         // Update ndrop counter
         ndrop_total += wblk->ndrop;
-        // Shift working blocks
-        wblk[0] = wblk[1];
+        // Count expected packets of selected inputs
+        if(subset.nants && subset.nstrm) {
+          hpguppi_lossstat_expect(lossstat,
+              subset.antmask & (obs_info.nants < 64 ?
+                (1ULL << obs_info.nants) - 1 : ~0ULL),
+              (subset.schan - obs_info.schan) / subset.strm_nchan,
+              subset.nstrm,
+              wblk->pkts_per_block / (subset.nants * subset.nstrm),
+              wblk->block_num * pktidx_per_block);
+        }
+        // Rotate working blocks (the last working block gets wblk[0]'s
+        // bitmap, which gets cleared by increment_block)
+        wblk_tmp = wblk[0];
+        memmove(wblk, wblk+1, wblk_last * sizeof(struct block_info));
+        wblk[wblk_last] = wblk_tmp;
+        wblk[wblk_last].block_idx_out = wblk[wblk_last-1].block_idx_out;
         // Check start/stop using wblk[0]'s first PKTIDX
         check_start_stop(st, wblk[0].block_num * pktidx_per_block);
         // Increment last working block
-        increment_block(&wblk[1], pkt_blk_num);
+        increment_block(&wblk[wblk_last], pkt_blk_num);
         // Wait for new databuf data block to be free
-        wait_for_block_free(&wblk[1], st, status_key);
+        wait_for_block_free(&wblk[wblk_last], st, status_key);
       }
       // Check for PKTIDX discontinuity
-      else if(pkt_blk_num < wblk[0].block_num - 1
-      || pkt_blk_num > wblk[1].block_num + 1) {
+      else if(pkt_blk_num < wblk[0].block_num - nwblk
+      || pkt_blk_num > wblk[wblk_last].block_num + 1) {
 #if 0
-printf("reset blocks (%ld <> [%ld - 1, %ld + 1])\n", pkt_blk_num, wblk[0].block_num, wblk[1].block_num);
+printf("reset blocks (%ld <> [%ld - %d, %ld + 1])\n", pkt_blk_num, wblk[0].block_num, nwblk, wblk[wblk_last].block_num);
 #endif
         // Should only happen when transitioning into LISTEN, so warn about it
         hashpipe_warn(thread_name,
             "working blocks reinit due to packet discontinuity (PKTIDX %lu)",
             pkt_seq_num);
 
-#ifdef USE_WORKER_THREADS
-        wait_for_job_completion(pjq);
-#endif // USE_WORKER_THREADS
+        if(wait_for_job_completion(&pool)) {
+          break;
+        }
+        if(tiler.tiles) {
+          reset_heap_tiles(&tiler);
+        }
 
         // Re-init working blocks for block number *after* current packet's block
         // and clear their data buffers
-        for(wblk_idx=0; wblk_idx<2; wblk_idx++) {
+        for(wblk_idx=0; wblk_idx<nwblk; wblk_idx++) {
           init_block_info(wblk+wblk_idx, NULL, -1, pkt_blk_num+wblk_idx+1,
               eff_block_size / feng_spead_info.payload_size);
 #if 0
@@ -1541,12 +2201,14 @@ printf("reset blocks (%ld <> [%ld - 1, %ld + 1])\n", pkt_blk_num, wblk[0].block_
         check_start_stop(st, wblk[0].block_num * pktidx_per_block);
 // This happens after discontinuities (e.g. on startup), so don't warn about
 // it.
-      } else if(pkt_blk_num == wblk[0].block_num - 1) {
+      } else if(pkt_blk_num < wblk[0].block_num) {
         // Ignore late packet, continue on to next one
         // TODO Move this check above the "once per block" status buffer
         // update (so we don't accidentally update status buffer based on a
         // late packet)?
         nlate++;
+        hpguppi_latehist_add(latehist,
+            wblk[wblk_last].block_num - pkt_blk_num);
 #if 0
         // Should "never" happen, so warn about it
         hashpipe_warn(thread_name,
@@ -1556,7 +2218,7 @@ printf("reset blocks (%ld <> [%ld - 1, %ld + 1])\n", pkt_blk_num, wblk[0].block_
       }
 
 #if 0
-printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].block_num, wblk[1].block_num);
+printf("packet block: %ld   working blocks: %ld - %ld\n", pkt_blk_num, wblk[0].block_num, wblk[wblk_last].block_num);
 #endif
 
       // TODO Check START/STOP status???
@@ -1567,40 +2229,66 @@ printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].blo
       wblk_idx = pkt_blk_num - wblk[0].block_num;
 
       // Only copy packet data and count packet if its wblk_idx is valid
-      if(0 <= wblk_idx && wblk_idx < 2) {
+      if(0 <= wblk_idx && wblk_idx < nwblk) {
+        // Count packet's lag behind the newest working block
+        hpguppi_latehist_add(latehist, wblk_last - wblk_idx);
+
         // Update block's packets per block.  Not needed for each packet, but
         // probably just as fast to do it for each packet rather than
         // check-and-update-only-if-needed for each packet.
         wblk[wblk_idx].pkts_per_block = eff_block_size / feng_spead_info.payload_size;
         wblk[wblk_idx].pktidx_per_block = pktidx_per_block;
 
-#ifdef USE_WORKER_THREADS
-        // Calculate packet_job fields
-        pktjob.src = p_spead_payload;
-        pktjob.row_len = 4 * obs_info.hntime;
-        pktjob.ostride = 4 * mk_ntime(BLOCK_DATA_SIZE, obs_info);
-        pktjob.nbytes = feng_spead_info.payload_size;
-        // Start dst at beginning of data block
-        pktjob.dst = ((uint8_t *)block_info_data(wblk+wblk_idx))
-          // Advance dst to start of slot
-          + ((pkt_seq_num % pktidx_per_block) * pktjob.row_len)
-          // Advance dst to start of heap
-          + (mk_block_chan(obs_info, feng_spead_info) * pktjob.ostride)
-          // Advance dst to heap offset
-          + ((feng_spead_info.heap_offset / pktjob.row_len) * pktjob.ostride)
-        ;
-
-        // Push job onto packet_job_queue
-        if(push_job(pjq, pktjob.dst, pktjob.src,
-            pktjob.row_len, pktjob.ostride, pktjob.nbytes)) {
+        // Mark packet as received, skipping duplicates
+        if(block_info_mark_packet(wblk+wblk_idx,
+              &sel_info, &feng_spead_info)) {
+          continue;
+        }
+
+        // Count packet for its input's loss statistics
+        hpguppi_lossstat_count(lossstat, ls_ant, ls_strm);
+
+        // (Re-)size staging tiles if obs_info has changed
+        if(tiler.tile_slots && !heap_tiler_matches(&tiler, &sel_info)
+        && resize_heap_tiler(&tiler, &sel_info, block_data_size)) {
           hashpipe_warn(thread_name,
-              "error pushing job onto packet job queue");
+              "cannot allocate staging tiles, disabling SPDTILE");
+        }
+
+        if(pool.nworkers > 0) {
+          block_chan = mk_block_chan(sel_info, feng_spead_info);
+          // Calculate packet_job fields
+          pktjob.copy = copy_kernel;
+          pktjob.src = p_spead_payload;
+          pktjob.row_len = kernel_sel.row_len;
+          pktjob.ostride = mk_sample_size(sel_info) *
+            mk_ntime(block_data_size, sel_info);
+          pktjob.nbytes = feng_spead_info.payload_size;
+          // Start dst at beginning of data block
+          pktjob.dst = ((uint8_t *)block_info_data(wblk+wblk_idx))
+            // Advance dst to start of slot
+            + ((pkt_seq_num % pktidx_per_block) * kernel_sel.istride)
+            // Advance dst to start of heap
+            + (block_chan * pktjob.ostride)
+            // Advance dst to heap offset
+            + ((feng_spead_info.heap_offset / kernel_sel.istride) * pktjob.ostride)
+            + (feng_spead_info.heap_offset % kernel_sel.istride)
+          ;
+
+          // Push job onto the ring of the worker for this antenna/stream
+          if(push_job(&pool.rings[(block_chan / sel_info.hnchan) % pool.nworkers],
+                &pktjob)) {
+            break;
+          }
+        } else if(tiler.tile_slots) {
+          // Gather packet data in staging tile
+          copy_packet_data_to_tile(&tiler, wblk+wblk_idx,
+              &feng_spead_info, p_spead_payload, copy_kernel);
+        } else {
+          // Copy packet data to data buffer of working block
+          copy_packet_data_to_databuf(wblk+wblk_idx,
+              &sel_info, &feng_spead_info, p_spead_payload, copy_kernel);
         }
-#else
-        // Copy packet data to data buffer of working block
-        copy_packet_data_to_databuf(wblk+wblk_idx,
-            &obs_info, &feng_spead_info, p_spead_payload);
-#endif
         njobs++;
 
         // Count packet for block and for processing stats
@@ -1609,10 +2297,11 @@ printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].blo
 
     } // end for each packet
 
-#ifdef USE_WORKER_THREADS
-    // Wait for any pending jobs to complete
-    wait_for_job_completion(pjq);
-#endif // USE_WORKER_THREADS
+    // Wait for any pending jobs to complete (the only per-block barrier with
+    // the workers).  This fails only if the pipeline is shutting down.
+    if(wait_for_job_completion(&pool)) {
+      break;
+    }
 
     // Mark input block free
     hpguppi_input_databuf_set_free(dbin, block_idx_in);
@@ -1626,11 +2315,11 @@ printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].blo
     // Store new value
     fill_to_free_block_ns[block_idx_in] = fill_to_free_elapsed_ns;
 
-    if(block_idx_in == N_INPUT_BLOCKS - 1) {
+    if(block_idx_in == dbin->header.n_block - 1) {
       hashpipe_status_lock_safe(st);
       {
         hputr8(st->buf, "NETBLKMS",
-            round((double)fill_to_free_moving_sum_ns / N_INPUT_BLOCKS) / 1e6);
+            round((double)fill_to_free_moving_sum_ns / dbin->header.n_block) / 1e6);
       }
       hashpipe_status_unlock_safe(st);
     }
@@ -1649,6 +2338,14 @@ printf("packet block: %ld   working blocks: %ld %lu\n", pkt_blk_num, wblk[0].blo
     pthread_testcancel();
   } // end main loop
 
+  pthread_cleanup_pop(1); // Stops the workers
+  free(tiler.mem);
+  free(tiler.tiles);
+  for(wblk_idx=0; wblk_idx<nwblk; wblk_idx++) {
+    free(wblk[wblk_idx].rxmap);
+  }
+  hpguppi_lossstat_destroy(lossstat);
+
   hashpipe_info(thread_name, "exiting!");
   pthread_exit(NULL);
 
@@ -38,12 +38,14 @@
 //
 // The value of HNTIME is related to the heap size and HNCHAN:
 //
-//               spead_heap_size
-//     HNTIME = -----------------
-//                 4 * HNCHAN
+//                   spead_heap_size
+//     HNTIME = -------------------------
+//               sample_size * HNCHAN
 //
 // The value for "spead_heap_size" comes from the SPEAD header of each
-// packet.
+// packet.  The sample_size is the number of bytes per complex, dual-pol
+// sample, which is NBITS/2 (i.e. 4 bytes for the usual 8 bit samples, 8 bytes
+// for 16 bit samples).
 //
 // The spead_timestamp value for a given heap is given in the SPEAD header of
 // each packet.  These spead_timestamp values are ADC clock counts since the
@@ -151,6 +153,10 @@
 #define _HPGUPPI_MKFENG_H_
 
 #include <endian.h>
+#include "config.h"
+#if HAVE_AVX2_INSTRUCTIONS
+#include <immintrin.h>
+#endif
 #include "hashpipe_packet.h"
 
 // MeerKAT SPEAD packet with link layer header and internal padding to optimize
@@ -226,6 +232,8 @@ struct mk_obs_info {
   uint64_t hclocks;
   // Starting F Engine channel number to be processed
   int32_t schan;
+  // Number of bits per real/imaginary value (4, 8, or 16)
+  uint32_t nbits;
 };
 
 #define MK_OBS_INFO_INVALID_SCHAN (-1)
@@ -246,6 +254,7 @@ mk_obs_info_init(struct mk_obs_info * poi)
 {
   memset(poi, 0, sizeof(struct mk_obs_info));
   poi->schan = MK_OBS_INFO_INVALID_SCHAN;
+  poi->nbits = 8;
 }
 
 static inline
@@ -259,7 +268,17 @@ mk_obs_info_valid(const struct mk_obs_info oi)
     (oi.hntime  != 0) &&
     (oi.hnchan  != 0) &&
     (oi.hclocks != 0) &&
-    (oi.schan   != MK_OBS_INFO_INVALID_SCHAN);
+    (oi.schan   != MK_OBS_INFO_INVALID_SCHAN) &&
+    (oi.nbits == 4 || oi.nbits == 8 || oi.nbits == 16);
+}
+
+// Returns the number of bytes per complex, dual-pol sample (i.e. 2 pols * 2
+// values * NBITS/8).
+static inline
+uint32_t
+mk_sample_size(const struct mk_obs_info oi)
+{
+  return oi.nbits / 2;
 }
 
 static inline
@@ -337,12 +356,14 @@ mk_block_chan(const struct mk_obs_info oi, const struct mk_feng_spead_info fesi)
 // of two.  HNTIME is set by the upstream F engines, so we have no control of
 // that, but we can and do ensure that PIPERBLK is a power of 2.
 //
-// This function assumes each sample is 4 bytes ([1 real + 1 imag] * 2 pols).
+// Each sample is samp_size bytes ([1 real + 1 imag] * 2 pols, see
+// mk_sample_size()).
 static inline
 uint32_t
-calc_mk_pktidx_per_block(size_t block_size, uint32_t nchan, uint32_t hntime)
+calc_mk_pktidx_per_block(size_t block_size, uint32_t nchan, uint32_t hntime,
+    uint32_t samp_size)
 {
-  uint32_t piperblk = (uint32_t)(block_size / (4 * nchan * hntime));
+  uint32_t piperblk = (uint32_t)(block_size / (samp_size * nchan * hntime));
   return prevpow2(piperblk);
 }
 
@@ -350,45 +371,51 @@ static inline
 uint32_t
 mk_pktidx_per_block(size_t block_size, const struct mk_obs_info oi)
 {
-  return calc_mk_pktidx_per_block(block_size, mk_obsnchan(oi), oi.hntime);
+  return calc_mk_pktidx_per_block(block_size, mk_obsnchan(oi), oi.hntime,
+      mk_sample_size(oi));
 }
 
 // For MeerKAT, the NTIME parameter (not stored in the status buffer or GUPPI
 // RAW files), represents the total number of time samples in a block.  It
-// depends on the block size and NCHAN (and sample size, but that is assumed to
-// be 4 bytes).  This calculation is a bit tricky because the effective block
-// size can be less than the max block size when NCHAN and HNTIME do not evenly
-// divide the max block size.
+// depends on the block size, NCHAN, and the sample size.  This calculation is
+// a bit tricky because the effective block size can be less than the max block
+// size when NCHAN and HNTIME do not evenly divide the max block size.
 static inline
 uint32_t
-calc_mk_ntime(size_t block_size, uint32_t nchan, uint32_t hntime)
+calc_mk_ntime(size_t block_size, uint32_t nchan, uint32_t hntime,
+    uint32_t samp_size)
 {
-  return hntime * calc_mk_pktidx_per_block(block_size, nchan, hntime);
+  return hntime * calc_mk_pktidx_per_block(block_size, nchan, hntime,
+      samp_size);
 }
 
 static inline
 uint32_t
 mk_ntime(size_t block_size, const struct mk_obs_info oi)
 {
-  return calc_mk_ntime(block_size, mk_obsnchan(oi), oi.hntime);
+  return calc_mk_ntime(block_size, mk_obsnchan(oi), oi.hntime,
+      mk_sample_size(oi));
 }
 
 // Calculate the effective block size for the given max block size, nchan, and
 // hntime values.  The effective block size can be less than the max block size
-// if nchan and/or hntime do not evenly divide the max block size.  This
-// assumes 4 bytes per sample.
+// if nchan and/or hntime do not evenly divide the max block size.  Each
+// sample is samp_size bytes.
 static inline
 uint32_t
-calc_mk_block_size(size_t block_size, uint32_t nchan, uint32_t hntime)
+calc_mk_block_size(size_t block_size, uint32_t nchan, uint32_t hntime,
+    uint32_t samp_size)
 {
-  return 4 * nchan * hntime * calc_mk_pktidx_per_block(block_size, nchan, hntime);
+  return samp_size * nchan * hntime *
+    calc_mk_pktidx_per_block(block_size, nchan, hntime, samp_size);
 }
 
 static inline
 uint32_t
 mk_block_size(size_t block_size, const struct mk_obs_info oi)
 {
-  return calc_mk_block_size(block_size, mk_obsnchan(oi), oi.hntime);
+  return calc_mk_block_size(block_size, mk_obsnchan(oi), oi.hntime,
+      mk_sample_size(oi));
 }
 
 // Parses a MeerKAT F Engine packet, stores metadata in fesi, returns pointer
@@ -443,9 +470,96 @@ mk_parse_mkfeng_packet(const struct udppkt *p, struct mk_feng_spead_info * fesi)
   return p_spead_payload;
 }
 
+// The MeerKAT F Engines always send the same SPEAD header items in the same
+// order, so the SPEAD header can be parsed with fixed offsets once the item
+// IDs have been verified.  This is the expected first word of the SPEAD
+// header (magic, version, item pointer width, heap address width, and 11
+// items) as a little endian uint64_t.
+#define MK_SPEAD_HDR_WORD0 (0x0b00000006020453ULL)
+
+// The first 8 items are expected to be HEAP_COUNTER, HEAP_SIZE, HEAP_OFFSET,
+// PAYLOAD_SIZE, TIMESTAMP, FENG_ID, FENG_CHAN, and PAYLOAD_OFFSET.  The
+// remaining 3 items are SPEAD_ID_IMM_IGNORE items.
+
+// Fast path for parsing a MeerKAT F Engine SPEAD header that has the fixed
+// layout described above.  The layout is verified for every packet (with two
+// vector compares when AVX2 is available) so that packets from other sources
+// cannot be misparsed.  Returns 1 and stores metadata in fesi if the layout
+// matched, otherwise returns 0 and leaves fesi unchanged in which case the
+// caller should fall back to walking the items.
+static inline
+int
+mk_parse_mkfeng_spead_fixed(const uint64_t * p_spead,
+    struct mk_feng_spead_info * fesi)
+{
+#if HAVE_AVX2_INSTRUCTIONS
+  // _mm256_set_epi64x takes its arguments in reverse order
+  const __m256i ids_1_4 = _mm256_set_epi64x(SPEAD_ID_IMM_PAYLOAD_SIZE,
+      SPEAD_ID_IMM_HEAP_OFFSET, SPEAD_ID_IMM_HEAP_SIZE,
+      SPEAD_ID_IMM_HEAP_COUNTER);
+  const __m256i ids_5_8 = _mm256_set_epi64x(SPEAD_ID_IMM_PAYLOAD_OFFSET,
+      SPEAD_ID_IMM_FENG_CHAN, SPEAD_ID_IMM_FENG_ID, SPEAD_ID_IMM_TIMESTAMP);
+  const __m256i id_mask = _mm256_set1_epi64x(0xffff);
+  const __m256i imm_mask = _mm256_set1_epi64x(SPEAD_IMM_MASK);
+  // Reverses the bytes of each 64 bit lane (i.e. be64toh for each lane)
+  const __m256i bswap64 = _mm256_set_epi8(
+       8,  9, 10, 11, 12, 13, 14, 15,  0,  1,  2,  3,  4,  5,  6,  7,
+       8,  9, 10, 11, 12, 13, 14, 15,  0,  1,  2,  3,  4,  5,  6,  7);
+  uint64_t v[8] __attribute__((aligned(32)));
+
+  __m256i items_1_4 = _mm256_loadu_si256((const __m256i *)(p_spead+1));
+  __m256i items_5_8 = _mm256_loadu_si256((const __m256i *)(p_spead+5));
+
+  __m256i match = _mm256_and_si256(
+      _mm256_cmpeq_epi64(_mm256_and_si256(items_1_4, id_mask), ids_1_4),
+      _mm256_cmpeq_epi64(_mm256_and_si256(items_5_8, id_mask), ids_5_8));
+
+  if(p_spead[0] != MK_SPEAD_HDR_WORD0 || _mm256_movemask_epi8(match) != -1) {
+    return 0;
+  }
+
+  _mm256_store_si256((__m256i *)v, _mm256_and_si256(
+        _mm256_shuffle_epi8(items_1_4, bswap64), imm_mask));
+  _mm256_store_si256((__m256i *)(v+4), _mm256_and_si256(
+        _mm256_shuffle_epi8(items_5_8, bswap64), imm_mask));
+
+  fesi->heap_offset  = v[2];
+  fesi->payload_size = v[3];
+  fesi->timestamp    = v[4];
+  fesi->feng_id      = v[5];
+  fesi->feng_chan    = v[6];
+#else
+  int i;
+  static const uint16_t ids[8] = {
+    SPEAD_ID_IMM_HEAP_COUNTER, SPEAD_ID_IMM_HEAP_SIZE,
+    SPEAD_ID_IMM_HEAP_OFFSET,  SPEAD_ID_IMM_PAYLOAD_SIZE,
+    SPEAD_ID_IMM_TIMESTAMP,    SPEAD_ID_IMM_FENG_ID,
+    SPEAD_ID_IMM_FENG_CHAN,    SPEAD_ID_IMM_PAYLOAD_OFFSET
+  };
+
+  if(p_spead[0] != MK_SPEAD_HDR_WORD0) {
+    return 0;
+  }
+  for(i=0; i<8; i++) {
+    if(*(uint16_t *)(p_spead+1+i) != ids[i]) {
+      return 0;
+    }
+  }
+
+  fesi->heap_offset  = spead_imm_value(be64toh(p_spead[3]));
+  fesi->payload_size = spead_imm_value(be64toh(p_spead[4]));
+  fesi->timestamp    = spead_imm_value(be64toh(p_spead[5]));
+  fesi->feng_id      = spead_imm_value(be64toh(p_spead[6]));
+  fesi->feng_chan    = spead_imm_value(be64toh(p_spead[7]));
+#endif // HAVE_AVX2_INSTRUCTIONS
+
+  return 1;
+}
+
 // Parses a MeerKAT F Engine packet that is in the format of a "struct
 // mk_ibv_spead_pkt", stores metadata in fesi, returns pointer to packet's
-// spead payload.
+// spead payload.  Packets with the usual fixed SPEAD header layout are parsed
+// by mk_parse_mkfeng_spead_fixed(), others by walking the SPEAD items.
 static inline
 const uint8_t *
 mk_parse_mkfeng_ibv_spead_packet(const struct mk_ibv_spead_pkt *p,
@@ -455,9 +569,15 @@ mk_parse_mkfeng_ibv_spead_packet(const struct mk_ibv_spead_pkt *p,
   uint16_t id;
   const uint8_t * p_spead_payload;
   const uint64_t * p_spead = p->spdhdr;
-  uint16_t nitems = ntohs(((uint16_t *)(p_spead++))[3]);
+  uint16_t nitems;
   //uint64_t offset = 0;
 
+  if(mk_parse_mkfeng_spead_fixed(p_spead, fesi)) {
+    return p->payload;
+  }
+
+  nitems = ntohs(((uint16_t *)(p_spead++))[3]);
+
   for(i=0; i<nitems; i++, p_spead++) {
     id = *(uint16_t *)p_spead;
     switch(id) {
@@ -26,10 +26,9 @@
 #define HPGUPPI_DAQ_CONTROL "/tmp/hpguppi_daq_control"
 #define MAX_CMD_LEN 1024
 
-#define PKTSOCK_BYTES_PER_FRAME (16384)
-#define PKTSOCK_FRAMES_PER_BLOCK (8)
-#define PKTSOCK_NBLOCKS (800)
-#define PKTSOCK_NFRAMES (PKTSOCK_FRAMES_PER_BLOCK * PKTSOCK_NBLOCKS)
+// TPACKET_V3 ring of 50 2 MiB blocks (same 100 MiB as the former TPACKET_V1
+// ring of 6400 16 KiB frames)
+#define PKTSOCK_NBLOCKS (50)
 
 #define ELAPSED_NS(start,stop) \
   (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
@@ -208,7 +207,7 @@ static uint64_t hpguppi_pktsock_seq_num(const unsigned char *p_frame)
 {
     // XXX Temp for new baseband mode, blank out top 8 bits which
     // contain channel info.
-    uint64_t tmp = be64toh(*(uint64_t *)PKT_UDP_DATA(p_frame));
+    uint64_t tmp = be64toh(*(uint64_t *)PKTV3_UDP_DATA(p_frame));
     tmp &= 0x00FFFFFFFFFFFFFF;
     return tmp ;
 }
@@ -239,7 +238,7 @@ static void write_search_packet_to_block_from_pktsock_frame(
     int cur_pos=0;
     if (d->last_pkt > d->packet_idx) cur_pos = d->last_pkt - d->packet_idx + 1;
     char *dataptr = hpguppi_databuf_data(d->db, d->block_idx)
-        + (cur_pos*d->packet_data_size % BLOCK_DATA_SIZE);
+        + (cur_pos*d->packet_data_size % hpguppi_databuf_block_data_size(d->db));
     for (; cur_pos<next_pos; cur_pos++) {
         memset(dataptr, 0, d->packet_data_size);
         dataptr += d->packet_data_size;
@@ -247,7 +246,7 @@ static void write_search_packet_to_block_from_pktsock_frame(
         d->ndropped++;
     }
     hpguppi_udp_packet_data_copy_from_payload(dataptr,
-        (char *)PKT_UDP_DATA(p_frame), (size_t)PKT_UDP_SIZE(p_frame));
+        (char *)PKTV3_UDP_DATA(p_frame), (size_t)PKTV3_UDP_SIZE(p_frame));
     d->last_pkt = seq_num;
     d->npacket++;
 }
@@ -275,8 +274,8 @@ static void write_baseband_packet_to_block_from_pktsock_frame(
     hpguppi_udp_packet_data_copy_transpose_from_payload(
             hpguppi_databuf_data(d->db, d->block_idx),
             nchan, block_pkt_idx, d->packets_per_block,
-            (char *)PKT_UDP_DATA(p_frame),
-            (size_t)PKT_UDP_SIZE(p_frame));
+            (char *)PKTV3_UDP_DATA(p_frame),
+            (size_t)PKTV3_UDP_SIZE(p_frame));
 
     /* Consider any skipped packets to have been dropped,
      * update counters.
@@ -297,7 +296,8 @@ static void write_baseband_packet_to_block_from_pktsock_frame(
 static int init(hashpipe_thread_args_t *args, const int fake)
 {
     /* Non-network essential paramaters */
-    int blocsize=BLOCK_DATA_SIZE;
+    int blocsize=hpguppi_databuf_block_data_size(
+        (hpguppi_input_databuf_t *)args->obuf);
     int directio=1;
     int nbits=8;
     int npol=4;
@@ -373,18 +373,15 @@ static int init(hashpipe_thread_args_t *args, const int fake)
     hputi4(st->buf, "CHANMAJ", 0);
     hashpipe_status_unlock_safe(st);
 
-    // Set up pktsock.  Make frame_size be a divisor of block size so that
-    // frames will be contiguous in mapped mempory.  block_size must also be a
-    // multiple of page_size.  Easiest way is to oversize the frames to be
-    // 16384 bytes, which is bigger than we need, but keeps things easy.
-    p_psp->ps.frame_size = PKTSOCK_BYTES_PER_FRAME;
-    // total number of frames
-    p_psp->ps.nframes = PKTSOCK_NFRAMES;
-    // number of blocks
-    p_psp->ps.nblocks = PKTSOCK_NBLOCKS;
+    // Set up pktsock.  The TPACKET_V3 ring packs variable length frames into
+    // blocks, so frame_size is just an upper bound on the packet size.
+    p_psp->psv3.block_size = HPGUPPI_PKTSOCK_V3_BLOCK_SIZE;
+    p_psp->psv3.frame_size = HPGUPPI_PKTSOCK_V3_FRAME_SIZE;
+    p_psp->psv3.nblocks = PKTSOCK_NBLOCKS;
+    p_psp->psv3.retire_ms = HPGUPPI_PKTSOCK_V3_RETIRE_MS;
 
     if(!fake) {
-        rv = hashpipe_pktsock_open(&p_psp->ps, p_psp->ifname, PACKET_RX_RING);
+        rv = hpguppi_pktsock_v3_open(&p_psp->psv3, p_psp->ifname);
         if (rv!=HASHPIPE_OK) {
             hashpipe_error("hpguppi_net_thread", "Error opening pktsock.");
             pthread_exit(NULL);
@@ -418,6 +415,9 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
     struct hpguppi_pktsock_params *p_ps_params =
         (struct hpguppi_pktsock_params *)args->user_data;
 
+    // Size of data area of the databuf's blocks
+    const int block_data_size = hpguppi_databuf_block_data_size(db);
+
     /* Open command FIFO for read */
     char fifo_name[PATH_MAX];
     char fifo_cmd[MAX_CMD_LEN];
@@ -466,17 +466,17 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
      * per block, etc.  Changing packet size during an obs is not
      * recommended.
      */
-    int block_size = BLOCK_DATA_SIZE;
+    int block_size = block_data_size;
     size_t packet_data_size = hpguppi_udp_packet_datasize(p_ps_params->packet_size);
     if (use_parkes_packets)
         packet_data_size = parkes_udp_packet_datasize(p_ps_params->packet_size);
     if (hgeti4(status_buf, "BLOCSIZE", &block_size)==0) {
-            block_size = BLOCK_DATA_SIZE;
+            block_size = block_data_size;
             hputi4(status_buf, "BLOCSIZE", block_size);
     } else {
-        if (block_size > BLOCK_DATA_SIZE) {
+        if (block_size > block_data_size) {
             hashpipe_error("hpguppi_net_thread", "BLOCSIZE > databuf block_size");
-            block_size = BLOCK_DATA_SIZE;
+            block_size = block_data_size;
             hputi4(status_buf, "BLOCSIZE", block_size);
         }
     }
@@ -553,17 +553,18 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
     // Drop all packets to date
     unsigned char *p_frame;
     if(!fake) {
-        while((p_frame=hashpipe_pktsock_recv_frame_nonblock(&p_ps_params->ps))) {
-            hashpipe_pktsock_release_frame(p_frame);
-        }
+        hpguppi_pktsock_v3_flush(&p_ps_params->psv3);
     } else {
         // Allocate p_frame and ininitialize packet
-        p_frame = malloc(p_ps_params->ps.frame_size);
+        p_frame = calloc(1, p_ps_params->psv3.frame_size);
+        // Set MAC and network header offsets
+        ((struct tpacket3_hdr *)p_frame)->tp_mac = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+        ((struct tpacket3_hdr *)p_frame)->tp_net = TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) + 14;
         // Set packet length
-        PKT_NET(p_frame)[0x18] = ((p_ps_params->packet_size+8) >> 8) & 0xff;
-        PKT_NET(p_frame)[0x19] = ((p_ps_params->packet_size+8)     ) & 0xff;
+        PKTV3_NET(p_frame)[0x18] = ((p_ps_params->packet_size+8) >> 8) & 0xff;
+        PKTV3_NET(p_frame)[0x19] = ((p_ps_params->packet_size+8)     ) & 0xff;
         // Init payload
-        uint64_t *payload = (uint64_t *)PKT_UDP_DATA(p_frame);
+        uint64_t *payload = (uint64_t *)PKTV3_UDP_DATA(p_frame);
         payload[0] = htobe64(fake_pktidx);
         for(i=1; i<1025; i++) {
             payload[i] = htobe64(0xcafefacecafeface);
@@ -579,8 +580,8 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
         /* Wait for data */
         do {
             if(!fake) {
-                p_frame = hashpipe_pktsock_recv_udp_frame(
-                    &p_ps_params->ps, p_ps_params->port, 1000); // 1 second timeout
+                p_frame = hpguppi_pktsock_v3_recv_udp_frame(
+                    &p_ps_params->psv3, p_ps_params->port, 1000); // 1 second timeout
             } else {
                 // Sleep after every burts, if needed, to keep data rate reasonable
                 if(fake_pktidx % fake_packets_per_burst == 0) {
@@ -606,7 +607,7 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
                     fake_pktidx++;
                 }
 
-                *(uint64_t *)PKT_UDP_DATA(p_frame) = htobe64(fake_pktidx & ((1UL<<56)-1));
+                *(uint64_t *)PKTV3_UDP_DATA(p_frame) = htobe64(fake_pktidx & ((1UL<<56)-1));
             }
 
             // Heartbeat update?
@@ -677,24 +678,21 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
 
         if(!run_threads()) {
             // We're outta here!
-            if(!fake) hashpipe_pktsock_release_frame(p_frame);
             break;
         }
 
         /* Check packet size */
         if(p_ps_params->packet_size == 0) {
-            p_ps_params->packet_size = PKT_UDP_SIZE(p_frame) - 8;
-        } else if(p_ps_params->packet_size != PKT_UDP_SIZE(p_frame) - 8) {
+            p_ps_params->packet_size = PKTV3_UDP_SIZE(p_frame) - 8;
+        } else if(p_ps_params->packet_size != PKTV3_UDP_SIZE(p_frame) - 8) {
             /* Unexpected packet size, ignore? */
             nbogus_total++;
             if(nbogus_total % 1000000 == 0) {
                 hashpipe_status_lock_safe(st);
                 hputi4(st->buf, "NBOGUS", nbogus_total);
-                hputi4(st->buf, "PKTSIZE", PKT_UDP_SIZE(p_frame)-8);
+                hputi4(st->buf, "PKTSIZE", PKTV3_UDP_SIZE(p_frame)-8);
                 hashpipe_status_unlock_safe(st);
             }
-            // Release frame!
-            if(!fake) hashpipe_pktsock_release_frame(p_frame);
             continue;
         }
 
@@ -733,17 +731,15 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
             waiting=0;
         }
 
-        // If IDLE, release frame and continue main loop
+        // If IDLE, skip frame and continue main loop
         if(state == IDLE) {
-            // Release frame!
-            if(!fake) hashpipe_pktsock_release_frame(p_frame);
             continue;
         }
 
         /* Convert packet format if needed */
         if (use_parkes_packets) {
             parkes_to_guppi_from_payload(
-                (char *)PKT_UDP_DATA(p_frame), acclen, npol, nchan);
+                (char *)PKTV3_UDP_DATA(p_frame), acclen, npol, nchan);
         }
 
         /* Check seq num diff */
@@ -757,8 +753,6 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
                         seq_num);
             }
             else {
-              // Release frame!
-              if(!fake) hashpipe_pktsock_release_frame(p_frame);
               /* No going backwards */
               continue;
             }
@@ -868,12 +862,12 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
              */
             if (force_new_block) {
                 if (hgeti4(status_buf, "BLOCSIZE", &block_size)==0) {
-                        block_size = BLOCK_DATA_SIZE;
+                        block_size = block_data_size;
                 } else {
-                    if (block_size > BLOCK_DATA_SIZE) {
+                    if (block_size > block_data_size) {
                         hashpipe_error("hpguppi_net_thread",
                                 "BLOCSIZE > databuf block_size");
-                        block_size = BLOCK_DATA_SIZE;
+                        block_size = block_data_size;
                     }
                 }
                 packets_per_block = block_size / packet_data_size;
@@ -931,9 +925,6 @@ static void *run(hashpipe_thread_args_t * args, const int fake)
             }
         }
 
-        // Release frame back to ring buffer
-        if(!fake) hashpipe_pktsock_release_frame(p_frame);
-
         /* Will exit if thread has been cancelled */
         pthread_testcancel();
     }
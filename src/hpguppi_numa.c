@@ -0,0 +1,121 @@
+// hpguppi_numa.c
+//
+// NUMA related utility functions for hpguppi_daq
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "hpguppi_numa.h"
+
+// Max number of nodes supported by the node masks used here
+#define MAX_NUMA_NODES (64)
+
+int
+hpguppi_numa_node_of_interface(const char * ifname)
+{
+  int node = -1;
+  char path[256];
+  FILE * f;
+
+  if(!ifname || !*ifname || strchr(ifname, '/')) {
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+  if(!(f = fopen(path, "r"))) {
+    errno = 0;
+    return -1;
+  }
+  if(fscanf(f, "%d", &node) != 1) {
+    node = -1;
+  }
+  fclose(f);
+
+  // Non-NUMA systems report -1
+  return node < 0 ? -1 : node;
+}
+
+int
+hpguppi_numa_bind(void * addr, size_t len, int node)
+{
+  unsigned long nodemask;
+
+  if(node < 0 || node >= MAX_NUMA_NODES) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  nodemask = 1UL << node;
+
+  return syscall(SYS_mbind, addr, len, MPOL_BIND,
+      &nodemask, MAX_NUMA_NODES+1, MPOL_MF_MOVE);
+}
+
+int
+hpguppi_numa_node_of_addr(const void * addr)
+{
+  int node = -1;
+
+  if(syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+        MPOL_F_NODE | MPOL_F_ADDR)) {
+    errno = 0;
+    return -1;
+  }
+
+  return node;
+}
+
+int
+hpguppi_numa_bound_node_of_addr(const void * addr)
+{
+  int mode;
+  unsigned long nodemask = 0;
+
+  if(syscall(SYS_get_mempolicy, &mode, &nodemask, MAX_NUMA_NODES+1,
+        addr, MPOL_F_ADDR)) {
+    errno = 0;
+    return -1;
+  }
+
+  // Must be bound to exactly one node
+  if(mode != MPOL_BIND || !nodemask || (nodemask & (nodemask-1))) {
+    return -1;
+  }
+
+  return __builtin_ctzl(nodemask);
+}
+
+int
+hpguppi_numa_node_of_thread()
+{
+  unsigned int cpu;
+  unsigned int node;
+
+  if(syscall(SYS_getcpu, &cpu, &node, NULL)) {
+    errno = 0;
+    return -1;
+  }
+
+  return node;
+}
+
+void
+hpguppi_numa_report_thread(hashpipe_thread_args_t * args)
+{
+  int node = hpguppi_numa_node_of_thread();
+  char key[9];
+
+  snprintf(key, sizeof(key), "THNUMA%d", args->input_buffer);
+
+  hashpipe_status_lock_safe(&args->st);
+  {
+    hputi4(args->st.buf, key, node);
+  }
+  hashpipe_status_unlock_safe(&args->st);
+}
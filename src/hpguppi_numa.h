@@ -0,0 +1,45 @@
+// hpguppi_numa.h
+//
+// NUMA related utility functions for hpguppi_daq.  These use the Linux system
+// calls directly so that no additional library is required.
+
+#ifndef _HPGUPPI_NUMA_H_
+#define _HPGUPPI_NUMA_H_
+
+#include <stddef.h>
+
+#include "hashpipe.h"
+
+// Returns the NUMA node of the network interface named ifname (e.g. "eth4")
+// as reported by sysfs, or -1 if it cannot be determined (e.g. ifname is not
+// an interface name or the system is not NUMA).
+int hpguppi_numa_node_of_interface(const char * ifname);
+
+// Binds the memory region starting at addr and spanning len bytes to NUMA
+// node `node` using mbind().  Any pages of the region that are already
+// resident are migrated to node.  addr must be page aligned.  Returns 0 on
+// success, -1 on error (with errno set).
+int hpguppi_numa_bind(void * addr, size_t len, int node);
+
+// Returns the NUMA node of the page containing addr, or -1 on error (e.g. if
+// the page is not yet resident).
+int hpguppi_numa_node_of_addr(const void * addr);
+
+// Returns the NUMA node that the memory containing addr is bound to (i.e. that
+// has an MPOL_BIND policy for a single node, as set by hpguppi_numa_bind()),
+// or -1 if it is not bound to a single node or on error.
+int hpguppi_numa_bound_node_of_addr(const void * addr);
+
+// Returns the NUMA node of the CPU on which the calling thread is currently
+// running, or -1 on error.
+int hpguppi_numa_node_of_thread();
+
+// Stores the NUMA node of the calling thread in the status buffer using
+// keyword THNUMA<N>, where <N> is the thread's input databuf ID (i.e. its
+// position in the pipeline), so that each thread of an instance gets its own
+// keyword even when several threads share a databuf (see FANOUTDB).  This
+// should be called from a thread's run() function after hashpipe has set the
+// thread's CPU affinity.
+void hpguppi_numa_report_thread(hashpipe_thread_args_t * args);
+
+#endif // _HPGUPPI_NUMA_H_
@@ -10,6 +10,7 @@
 #include <hashpipe.h>
 
 #include "psrfits.h"
+#include "hpguppi_pktsock_v3.h"
 
 struct hpguppi_params {
     /* Packet information for the current block */
@@ -59,6 +60,8 @@ struct hpguppi_pktsock_params {
 
     // Holds packet socket details
     struct hashpipe_pktsock ps;
+    // Holds packet socket details for threads using TPACKET_V3 rings
+    struct hpguppi_pktsock_v3 psv3;
 };
 
 // Read networking parameters for packet sockets.  Same as for UDP sockets,
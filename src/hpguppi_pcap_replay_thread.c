@@ -0,0 +1,513 @@
+// hpguppi_pcap_replay_thread.c
+//
+// A Hashpipe thread that replays packets from a pcap file into the blocks of
+// an hpguppi_input_databuf.  This is a stand-in for hpguppi_ibvpkt_thread
+// that does not need a NIC.  Packets are stored using the exact same slot and
+// chunk layout that hpguppi_ibvpkt_thread uses (as specified by IBVPKTSZ), so
+// downstream threads (e.g. hpguppi_meerkat_spead_thread,
+// hpguppi_atasnap_voltage_thread, hpguppi_pksuwl_vdif_thread) cannot tell the
+// difference.  This allows those threads to be profiled and regression tested
+// on any Linux system.
+//
+// The pcap file is memory mapped and must use Ethernet link type.  Both
+// microsecond and nanosecond timestamp formats are supported in either byte
+// order.  Packets longer than the slot's packet size are skipped (and counted)
+// just as the NIC would not deliver them.  Because there is no NIC, all
+// packets in the file are delivered regardless of any flows requested by
+// downstream threads.
+//
+// Status buffer keywords:
+//
+//   PCAPFILE  Name of pcap file to replay (required)
+//   PCAPRATE  Replay rate: "max" (default) to replay as fast as possible,
+//             "line" to replay at the line rate given by PCAPGBPS, or
+//             "captured" to replay with the captured inter-packet timing.
+//   PCAPGBPS  Line rate in Gbps for "line" rate (default 100).  This includes
+//             the Ethernet preamble, FCS, and inter-frame gap overheads.
+//   PCAPLOOP  Number of times to replay the file (default 1, 0 for forever)
+//   PCAPNPKT  Number of packets replayed so far
+//   PCAPSKIP  Number of packets skipped because they were too large
+//   IBVPKTSZ  Slot layout (see hpguppi_ibverbs_pkt_thread.c)
+//   IBVSKIP   Number of leading IBVPKTSZ chunks to skip (default 0)
+//   IBVSTAT   Thread status ("init", "running", "blocked", "done")
+//   IBVBUFST  Databuf fill level as "filled/n_block"
+//   IBVGBPS   Replayed data rate (Gbps)
+//   IBVPPS    Replayed packet rate (packets per second)
+//
+// IBVSTAT, IBVBUFST, IBVGBPS, and IBVPPS are the same as for
+// hpguppi_ibvpkt_thread so that downstream threads and monitoring tools work
+// unchanged.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashpipe.h"
+#include "hpguppi_databuf.h"
+#include "hpguppi_ibverbs_pkt_thread.h"
+
+// Milliseconds between periodic status buffer updates
+#define PERIODIC_STATUS_BUFFER_UPDATE_MS (200)
+
+// Default max flows stored in status buffer for downstream threads
+#define DEFAULT_MAX_FLOWS (16)
+
+// Ethernet overhead bytes not included in pcap captures: 8 bytes of preamble
+// and start frame delimiter, 4 bytes of FCS, and 12 bytes of inter-frame gap.
+#define ETH_WIRE_OVERHEAD (24)
+
+// Sleep rather than spin when more than this far ahead of schedule
+#define PACING_SLEEP_THRESHOLD_NS (1000*1000)
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)(stop).tv_sec-(start).tv_sec)*1000*1000*1000 + \
+   ((stop).tv_nsec-(start).tv_nsec))
+
+// pcap file format magic numbers and link type
+#define PCAP_MAGIC_US (0xa1b2c3d4)
+#define PCAP_MAGIC_NS (0xa1b23c4d)
+#define PCAP_LINKTYPE_ETHERNET (1)
+
+struct pcap_file_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t  thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcap_rec_header {
+  uint32_t ts_sec;
+  uint32_t ts_frac;
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+enum replay_rate {
+  RATE_MAX,
+  RATE_LINE,
+  RATE_CAPTURED
+};
+
+// Memory mapped pcap file
+struct pcap_map {
+  const uint8_t * base;
+  size_t size;
+  int swapped;
+  uint32_t frac_per_sec;
+};
+
+static inline uint32_t pcap_u32(const struct pcap_map * pm, uint32_t v)
+{
+  return pm->swapped ? __builtin_bswap32(v) : v;
+}
+
+// Maps pcap file fname and validates its header.  Returns 0 on success or -1
+// on error.
+static int pcap_map_open(const char * thread_name, const char * fname,
+    struct pcap_map * pm)
+{
+  int fd;
+  struct stat sb;
+  const struct pcap_file_header * fh;
+
+  if((fd = open(fname, O_RDONLY)) == -1) {
+    hashpipe_error(thread_name, "cannot open pcap file %s", fname);
+    return -1;
+  }
+  if(fstat(fd, &sb) || sb.st_size < sizeof(struct pcap_file_header)) {
+    hashpipe_error(thread_name, "cannot stat pcap file %s", fname);
+    close(fd);
+    return -1;
+  }
+  pm->size = sb.st_size;
+  pm->base = mmap(NULL, pm->size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+  close(fd);
+  if(pm->base == MAP_FAILED) {
+    hashpipe_error(thread_name, "cannot mmap pcap file %s", fname);
+    return -1;
+  }
+  madvise((void *)pm->base, pm->size, MADV_SEQUENTIAL);
+
+  fh = (const struct pcap_file_header *)pm->base;
+  switch(fh->magic) {
+    case PCAP_MAGIC_US:
+      pm->swapped = 0; pm->frac_per_sec = 1000000; break;
+    case PCAP_MAGIC_NS:
+      pm->swapped = 0; pm->frac_per_sec = 1000000000; break;
+    default:
+      if(__builtin_bswap32(fh->magic) == PCAP_MAGIC_US) {
+        pm->swapped = 1; pm->frac_per_sec = 1000000;
+      } else if(__builtin_bswap32(fh->magic) == PCAP_MAGIC_NS) {
+        pm->swapped = 1; pm->frac_per_sec = 1000000000;
+      } else {
+        hashpipe_error(thread_name, "%s is not a pcap file", fname);
+        munmap((void *)pm->base, pm->size);
+        return -1;
+      }
+  }
+
+  if(pcap_u32(pm, fh->linktype) != PCAP_LINKTYPE_ETHERNET) {
+    hashpipe_error(thread_name, "%s link type is %u, not Ethernet",
+        fname, pcap_u32(pm, fh->linktype));
+    munmap((void *)pm->base, pm->size);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Copies packet pkt of length len into slot, scattering it across the slot's
+// chunks the same way the NIC would.
+static inline void copy_pkt_to_slot(uint8_t * slot, const uint8_t * pkt,
+    size_t len, const struct hpguppi_pktbuf_info * pktbuf_info)
+{
+  int i;
+  size_t n;
+
+  for(i=0; i<pktbuf_info->num_chunks && len > 0; i++) {
+    n = len < pktbuf_info->chunks[i].chunk_size ?
+      len : pktbuf_info->chunks[i].chunk_size;
+    // Skipped chunks are not stored
+    if(i >= pktbuf_info->num_skip_chunks) {
+      memcpy(slot + pktbuf_info->chunks[i].chunk_offset, pkt, n);
+    }
+    pkt += n;
+    len -= n;
+  }
+}
+
+// Waits for block block_idx to be free, updating status buffer while blocked.
+// Exits thread on error.
+static void wait_for_block_free(hpguppi_input_databuf_t *db, int block_idx,
+    hashpipe_status_t * st, const char * status_key)
+{
+  int rv;
+  char ibvbuf_status[80];
+
+  while ((rv=hpguppi_input_databuf_wait_free(db, block_idx))
+      != HASHPIPE_OK) {
+    if (rv==HASHPIPE_TIMEOUT) {
+      sprintf(ibvbuf_status, "%d/%d",
+          hpguppi_input_databuf_total_status(db), db->header.n_block);
+      hashpipe_status_lock_safe(st);
+      {
+        hputs(st->buf, status_key, "blocked");
+        hputs(st->buf, "IBVBUFST", ibvbuf_status);
+      }
+      hashpipe_status_unlock_safe(st);
+    } else {
+      hashpipe_error(__FUNCTION__,
+          "error waiting for free databuf (%s)", __FILE__);
+      pthread_exit(NULL);
+    }
+  }
+}
+
+// Waits until now is at least target_ns after start.
+static inline void pace(const struct timespec * start, int64_t target_ns)
+{
+  struct timespec now;
+  struct timespec ts_sleep;
+  int64_t ahead_ns;
+
+  for(;;) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ahead_ns = target_ns - ELAPSED_NS(*start, now);
+    if(ahead_ns <= 0) {
+      break;
+    }
+    if(ahead_ns > PACING_SLEEP_THRESHOLD_NS) {
+      ahead_ns -= PACING_SLEEP_THRESHOLD_NS / 2;
+      ts_sleep.tv_sec = ahead_ns / 1000000000;
+      ts_sleep.tv_nsec = ahead_ns % 1000000000;
+      nanosleep(&ts_sleep, NULL);
+    }
+  }
+}
+
+static int init(hashpipe_thread_args_t *args)
+{
+  // Local aliases to shorten access to args fields
+  // Our output buffer happens to be a hpguppi_input_databuf
+  hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->obuf;
+  hashpipe_status_t * st = &args->st;
+  const char * thread_name = args->thread_desc->name;
+  const char * status_key = args->thread_desc->skey;
+
+  // Get pointer to hpguppi_pktbuf_info
+  struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
+
+  uint32_t max_flows = DEFAULT_MAX_FLOWS;
+  uint32_t num_skip_chunks = 0;
+  char pcapfile[80] = {0};
+  char ibvpktsz[80];
+  strcpy(ibvpktsz, "9216"); // 9216 == 9*1024
+
+  hashpipe_status_lock_safe(st);
+  {
+    hgets(st->buf,  "PCAPFILE", sizeof(pcapfile), pcapfile);
+    hgets(st->buf,  "IBVPKTSZ", sizeof(ibvpktsz), ibvpktsz);
+    hgetu4(st->buf, "IBVSKIP", &num_skip_chunks);
+    hgetu4(st->buf, "MAXFLOWS", &max_flows);
+
+    // Store ibvpktsz, num_skip_chunks, and max_flows in status buffer for
+    // downstream threads
+    hputs(st->buf, "IBVPKTSZ", ibvpktsz);
+    hputu4(st->buf, "IBVSKIP", num_skip_chunks);
+    hputu4(st->buf, "MAXFLOWS", max_flows);
+
+    // Set status_key to init
+    hputs(st->buf, status_key, "init");
+  }
+  hashpipe_status_unlock_safe(st);
+
+  if(pcapfile[0] == '\0') {
+    hashpipe_error(thread_name, "PCAPFILE not given");
+    return HASHPIPE_ERR_PARAM;
+  }
+
+  // Parse ibvpktsz exactly as hpguppi_ibvpkt_thread does
+  if(hpguppi_parse_ibvpktsz(pktbuf_info, ibvpktsz, num_skip_chunks,
+        hpguppi_databuf_block_data_size(db))) {
+    return HASHPIPE_ERR_PARAM;
+  }
+
+  // There are no NIC flows to manage
+  hpguppi_ibvpkt_disable_flows();
+
+  return HASHPIPE_OK;
+}
+
+static void * run(hashpipe_thread_args_t * args)
+{
+  // Local aliases to shorten access to args fields
+  // Our output buffer happens to be a hpguppi_input_databuf
+  hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->obuf;
+  hashpipe_status_t * st = &args->st;
+  const char * thread_name = args->thread_desc->name;
+  const char * status_key = args->thread_desc->skey;
+
+  // pktbuf_info related variables
+  struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
+  const size_t pkt_size = pktbuf_info->pkt_size;
+  const size_t slots_per_block = pktbuf_info->slots_per_block;
+
+  // Replay parameters
+  char pcapfile[80] = {0};
+  char pcaprate[80];
+  double gbps = 100.0;
+  uint32_t nloops = 1;
+  enum replay_rate rate = RATE_MAX;
+  strcpy(pcaprate, "max");
+
+  hashpipe_status_lock_safe(st);
+  {
+    hgets(st->buf,  "PCAPFILE", sizeof(pcapfile), pcapfile);
+    hgets(st->buf,  "PCAPRATE", sizeof(pcaprate), pcaprate);
+    hgetr8(st->buf, "PCAPGBPS", &gbps);
+    hgetu4(st->buf, "PCAPLOOP", &nloops);
+  }
+  hashpipe_status_unlock_safe(st);
+
+  if(!strcasecmp(pcaprate, "line")) {
+    rate = RATE_LINE;
+    if(gbps <= 0.0) {
+      hashpipe_error(thread_name, "PCAPGBPS must be positive");
+      return NULL;
+    }
+  } else if(!strcasecmp(pcaprate, "captured")) {
+    rate = RATE_CAPTURED;
+  } else if(strcasecmp(pcaprate, "max")) {
+    hashpipe_error(thread_name,
+        "invalid PCAPRATE \"%s\" (must be max, line, or captured)", pcaprate);
+    return NULL;
+  }
+
+  struct pcap_map pm;
+  if(pcap_map_open(thread_name, pcapfile, &pm)) {
+    return NULL;
+  }
+
+  hashpipe_info(thread_name, "replaying %s at %s rate (%u loops)",
+      pcapfile, pcaprate, nloops);
+
+  // Block/slot tracking
+  uint64_t curblk = 0;
+  uint32_t next_slot = 0;
+
+  // Pacing
+  struct timespec ts_pace_start;
+  // Wire bits sent so far this loop.  The target time is computed from the
+  // total so that per-packet rounding does not accumulate.
+  uint64_t target_bits = 0;
+  uint64_t first_ts_ns = 0;
+  uint64_t ts_ns;
+  int have_first_ts;
+
+  // Counters
+  uint64_t bytes_received = 0;
+  uint64_t pkts_received = 0;
+  uint64_t npkts = 0;
+  uint64_t nskip = 0;
+  uint32_t loop;
+  struct timespec ts_start;
+  struct timespec ts_now;
+  uint64_t ns_elapsed;
+  char ibvbuf_status[80];
+
+  const uint8_t * p;
+  const uint8_t * end = pm.base + pm.size;
+  const struct pcap_rec_header * rh;
+  uint32_t incl_len;
+
+  wait_for_block_free(db, curblk % db->header.n_block, st, status_key);
+
+  // Update status_key with running state
+  hashpipe_status_lock_safe(st);
+  {
+    hputs(st->buf, status_key, "running");
+    hputu8(st->buf, "PCAPNPKT", 0);
+    hputu8(st->buf, "PCAPSKIP", 0);
+  }
+  hashpipe_status_unlock_safe(st);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+  for(loop=0; run_threads() && (nloops == 0 || loop < nloops); loop++) {
+    p = pm.base + sizeof(struct pcap_file_header);
+    have_first_ts = 0;
+    target_bits = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts_pace_start);
+
+    while(run_threads() && p + sizeof(struct pcap_rec_header) <= end) {
+      rh = (const struct pcap_rec_header *)p;
+      incl_len = pcap_u32(&pm, rh->incl_len);
+      p += sizeof(struct pcap_rec_header);
+      if(p + incl_len > end) {
+        // Truncated file
+        break;
+      }
+
+      // Pace packet
+      if(rate == RATE_CAPTURED) {
+        ts_ns = pcap_u32(&pm, rh->ts_sec) * 1000000000ULL
+              + pcap_u32(&pm, rh->ts_frac)
+              * (1000000000ULL / pm.frac_per_sec);
+        if(!have_first_ts) {
+          first_ts_ns = ts_ns;
+          have_first_ts = 1;
+        }
+        pace(&ts_pace_start, ts_ns - first_ts_ns);
+      } else if(rate == RATE_LINE) {
+        pace(&ts_pace_start, (int64_t)(target_bits / gbps));
+        target_bits += (incl_len + ETH_WIRE_OVERHEAD) * 8;
+      }
+
+      if(incl_len > pkt_size) {
+        nskip++;
+      } else {
+        copy_pkt_to_slot(
+            hpguppi_pktbuf_block_slot_ptr(db, curblk, next_slot),
+            p, incl_len, pktbuf_info);
+        pkts_received++;
+        bytes_received += incl_len;
+        npkts++;
+
+        // Advance slot, handing off block when full
+        if(++next_slot >= slots_per_block) {
+          hpguppi_input_databuf_set_filled(db, curblk % db->header.n_block);
+          curblk++;
+          next_slot = 0;
+          wait_for_block_free(db, curblk % db->header.n_block,
+              st, status_key);
+        }
+      }
+
+      p += incl_len;
+
+      // Check for periodic status buffer update interval (counting skipped
+      // packets so that a run of them does not delay the update)
+      if(((npkts + nskip) & 0x3ff) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ts_now);
+        ns_elapsed = ELAPSED_NS(ts_start, ts_now);
+        if(ns_elapsed >= PERIODIC_STATUS_BUFFER_UPDATE_MS*1000*1000) {
+          ts_start = ts_now;
+          sprintf(ibvbuf_status, "%d/%d",
+              hpguppi_input_databuf_total_status(db), db->header.n_block);
+          hashpipe_status_lock_safe(st);
+          {
+            hputs(st->buf, status_key, "running");
+            hputs(st->buf, "IBVBUFST", ibvbuf_status);
+            hputnr8(st->buf, "IBVGBPS", 6, 8.0 * bytes_received / ns_elapsed);
+            hputnr8(st->buf, "IBVPPS", 3, 1e9 * pkts_received / ns_elapsed);
+            hputu8(st->buf, "PCAPNPKT", npkts);
+            hputu8(st->buf, "PCAPSKIP", nskip);
+          }
+          hashpipe_status_unlock_safe(st);
+          bytes_received = 0;
+          pkts_received = 0;
+        }
+      }
+    } // end for each packet
+
+    // Will exit if thread has been cancelled
+    pthread_testcancel();
+  } // end for each loop
+
+  // Hand off final partial block with unused slots zeroed
+  if(next_slot > 0) {
+    memset(hpguppi_pktbuf_block_slot_ptr(db, curblk, next_slot), 0,
+        (slots_per_block - next_slot) * pktbuf_info->slot_size);
+    hpguppi_input_databuf_set_filled(db, curblk % db->header.n_block);
+  }
+
+  munmap((void *)pm.base, pm.size);
+
+  hashpipe_status_lock_safe(st);
+  {
+    hputs(st->buf, status_key, "done");
+    hputu8(st->buf, "PCAPNPKT", npkts);
+    hputu8(st->buf, "PCAPSKIP", nskip);
+    hputr8(st->buf, "IBVGBPS", 0.0);
+    hputr8(st->buf, "IBVPPS", 0.0);
+  }
+  hashpipe_status_unlock_safe(st);
+
+  hashpipe_info(thread_name, "replayed %lu packets (%lu skipped)",
+      npkts, nskip);
+
+  // Idle until pipeline exits
+  while(run_threads()) {
+    sleep(1);
+    pthread_testcancel();
+  }
+
+  return NULL;
+}
+
+static hashpipe_thread_desc_t thread_desc = {
+    name: "hpguppi_pcap_replay_thread",
+    skey: "IBVSTAT",
+    init: init,
+    run:  run,
+    ibuf_desc: {NULL},
+    obuf_desc: {hpguppi_input_databuf_create}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&thread_desc);
+}
+
+// vi: set ts=2 sw=2 et :
@@ -135,9 +135,14 @@
 #ifndef _HPGUPPI_PKSUWL_H_
 #define _HPGUPPI_PKSUWL_H_
 
+#include "config.h"
 #include "hashpipe_packet.h"
 #include "hpguppi_vdif.h"
 
+#if HAVE_AVX2_INSTRUCTIONS
+#include <immintrin.h>
+#endif
+
 #define PKSUWL_SAMPLES_PER_SEC (128*1000*1000)
 
 // This could be derived from packet data.
@@ -164,7 +169,7 @@
 // If we use a power of two number of channels, the GUPPI RAW block is the same
 // as the shared memory block size and the number of PKTIDX values per block is
 // 8192.
-#define PKSUWL_BLOCK_DATA_SIZE (BLOCK_DATA_SIZE)
+#define PKSUWL_BLOCK_DATA_SIZE (DEFAULT_BLOCK_DATA_SIZE)
 #define PKSUWL_PKTIDX_PER_BLOCK (8192)
 #else
 // For the 2**N * 1e6 channel options, we find that 5**5 * 2 == 6250 packets
@@ -176,6 +181,9 @@
 #define PKSUWL_PKTIDX_PER_BLOCK (6250)
 #endif // USE_POWER_OF_TWO_NCHAN
 
+// Because PKSUWL_BLOCK_DATA_SIZE is fixed, the output databuf's blocks must be
+// at least PKSUWL_BLOCK_DATA_SIZE bytes in size (see DBBLKSZ).
+
 static inline
 uint64_t
 pksuwl_get_pktidx(struct vdifhdr * p)
@@ -193,6 +201,104 @@ pksuwl_pktidx_to_timeval(uint64_t pktidx, struct timeval *tv)
   tv->tv_usec = (pktidx % PKSUWL_PKTIDX_PER_SEC) * PKSUWL_NS_PER_PKT / 1000;
 }
 
+// Copies the PKSUWL_SAMPLES_PER_PKT samples of one polarization's packet data
+// (src) into the block unit starting at unit.  The samples are converted from
+// offset binary to two's complement by inverting the MSb of each 16 bit
+// component and are stored interleaved with the other polarization, whose
+// samples are left untouched.  The 16+16 bit complex samples are treated as
+// uint32_t values.  The SIMD versions rely on PKSUWL_SAMPLES_PER_PKT being a
+// multiple of 16.
+static inline
+void
+pksuwl_copy_pol(uint32_t * unit, const uint32_t * src, int pol)
+{
+  int i = 0;
+  pol &= 1;
+#if HAVE_AVX512F_INSTRUCTIONS
+  const __m512i flip = _mm512_set1_epi32(0x80008000);
+  const __m512i idxlo = _mm512_set_epi32(
+      7,7,6,6,5,5,4,4,3,3,2,2,1,1,0,0);
+  const __m512i idxhi = _mm512_set_epi32(
+      15,15,14,14,13,13,12,12,11,11,10,10,9,9,8,8);
+  // Every other element, starting with element pol
+  const __mmask16 mask = 0x5555 << pol;
+  __m512i x;
+  for(; i+16<=PKSUWL_SAMPLES_PER_PKT; i+=16) {
+    x = _mm512_xor_si512(_mm512_loadu_si512((const void *)(src+i)), flip);
+    _mm512_mask_storeu_epi32(unit+2*i,    mask, _mm512_permutexvar_epi32(idxlo, x));
+    _mm512_mask_storeu_epi32(unit+2*i+16, mask, _mm512_permutexvar_epi32(idxhi, x));
+  }
+#elif HAVE_AVX2_INSTRUCTIONS
+  const __m256i flip = _mm256_set1_epi32(0x80008000);
+  const __m256i idxlo = _mm256_set_epi32(3,3,2,2,1,1,0,0);
+  const __m256i idxhi = _mm256_set_epi32(7,7,6,6,5,5,4,4);
+  __m256i x, lo, hi;
+  __m256i * d;
+  for(; i+8<=PKSUWL_SAMPLES_PER_PKT; i+=8) {
+    x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src+i)), flip);
+    lo = _mm256_permutevar8x32_epi32(x, idxlo);
+    hi = _mm256_permutevar8x32_epi32(x, idxhi);
+    d = (__m256i *)(unit+2*i);
+    // Blend into the other polarization's samples
+    if(pol) {
+      _mm256_storeu_si256(d,   _mm256_blend_epi32(_mm256_loadu_si256(d),   lo, 0xaa));
+      _mm256_storeu_si256(d+1, _mm256_blend_epi32(_mm256_loadu_si256(d+1), hi, 0xaa));
+    } else {
+      _mm256_storeu_si256(d,   _mm256_blend_epi32(_mm256_loadu_si256(d),   lo, 0x55));
+      _mm256_storeu_si256(d+1, _mm256_blend_epi32(_mm256_loadu_si256(d+1), hi, 0x55));
+    }
+  }
+#else
+  for(; i<PKSUWL_SAMPLES_PER_PKT; i++) {
+    unit[2*i+pol] = src[i] ^ 0x80008000;
+  }
+#endif // HAVE_AVX512F || HAVE_AVX2
+}
+
+// Same as pksuwl_copy_pol(), but for the packet data of both polarizations of
+// a block unit (src0 and src1).  These are merged in one pass that writes the
+// whole block unit with full width non-temporal stores, so unit must be
+// aligned to 64 bytes.
+static inline
+void
+pksuwl_copy_pols(uint32_t * unit, const uint32_t * src0, const uint32_t * src1)
+{
+  int i = 0;
+#if HAVE_AVX512F_INSTRUCTIONS
+  const __m512i flip = _mm512_set1_epi32(0x80008000);
+  const __m512i idxlo = _mm512_set_epi32(
+      23,7,22,6,21,5,20,4,19,3,18,2,17,1,16,0);
+  const __m512i idxhi = _mm512_set_epi32(
+      31,15,30,14,29,13,28,12,27,11,26,10,25,9,24,8);
+  __m512i x0, x1;
+  for(; i+16<=PKSUWL_SAMPLES_PER_PKT; i+=16) {
+    x0 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(src0+i)), flip);
+    x1 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(src1+i)), flip);
+    _mm512_stream_si512((void *)(unit+2*i),    _mm512_permutex2var_epi32(x0, idxlo, x1));
+    _mm512_stream_si512((void *)(unit+2*i+16), _mm512_permutex2var_epi32(x0, idxhi, x1));
+  }
+  _mm_sfence();
+#elif HAVE_AVX2_INSTRUCTIONS
+  const __m256i flip = _mm256_set1_epi32(0x80008000);
+  __m256i x0, x1, lo, hi;
+  for(; i+8<=PKSUWL_SAMPLES_PER_PKT; i+=8) {
+    x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src0+i)), flip);
+    x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src1+i)), flip);
+    // Interleaves within 128 bit lanes, then puts the lanes in order
+    lo = _mm256_unpacklo_epi32(x0, x1);
+    hi = _mm256_unpackhi_epi32(x0, x1);
+    _mm256_stream_si256((__m256i *)(unit+2*i),   _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_stream_si256((__m256i *)(unit+2*i+8), _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  _mm_sfence();
+#else
+  for(; i<PKSUWL_SAMPLES_PER_PKT; i++) {
+    unit[2*i  ] = src0[i] ^ 0x80008000;
+    unit[2*i+1] = src1[i] ^ 0x80008000;
+  }
+#endif // HAVE_AVX512F || HAVE_AVX2
+}
+
 #if 0
 // Not used, but here it is if needed someday...
 static inline
@@ -305,7 +305,6 @@ static void wait_for_block_free(const struct block_info * bi,
 static void copy_packet_data_to_databuf(uint64_t packet_idx,
     struct block_info *bi, struct vdifhdr * vdifhdr)
 {
-  int i;
   uint32_t * src = (uint32_t *)(vdifhdr + 1);
   uint32_t * dst = (uint32_t *)block_info_data(bi);
 
@@ -313,17 +312,11 @@ static void copy_packet_data_to_databuf(uint64_t packet_idx,
   off_t offset = (off_t)(packet_idx % PKSUWL_PKTIDX_PER_BLOCK);
   // Convert to sample (i.e. uint32_t) offset
   offset *= 2 /*pols*/ * PKSUWL_SAMPLES_PER_PKT;
-  // Adjust for polarization
-  offset += (vdif_get_thread_id(vdifhdr) & 1);
   // Update destination pointer
   dst += offset;
 
-  // Copy samples
-  for(i=0 ; i<PKSUWL_SAMPLES_PER_PKT; i++) {
-    // Invert the MSb's of each component to convert to two's complement
-    *dst++ = *src++ ^ 0x80008000;
-    dst++; // Extra increment to interleave pols
-  }
+  // Convert and interleave samples
+  pksuwl_copy_pol(dst, src, vdif_get_thread_id(vdifhdr));
 }
 
 // Check the given pktidx value against the status buffer's PKTSTART/PKTSTOP
@@ -451,6 +444,14 @@ static int init(hashpipe_thread_args_t *args)
     errno = 0;
   }
 
+  // Make sure databuf blocks are big enough
+  if(hpguppi_databuf_block_data_size((hpguppi_input_databuf_t *)args->obuf)
+      < PKSUWL_BLOCK_DATA_SIZE) {
+    hashpipe_error("hpguppi_pksuwl_net_thread",
+        "databuf block size must be >= %d", PKSUWL_BLOCK_DATA_SIZE);
+    return HASHPIPE_ERR_PARAM;
+  }
+
   strcpy(obs_mode, "RAW");
   strcpy(dest_ip, "0.0.0.0");
 
@@ -31,6 +31,7 @@
 #include "hpguppi_databuf.h"
 #include "hpguppi_pksuwl.h"
 #include "hpguppi_time.h"
+#include "hpguppi_numa.h"
 #include "hpguppi_util.h"
 
 #include "hpguppi_ibverbs_pkt_thread.h"
@@ -311,25 +312,37 @@ static void wait_for_block_free(const struct block_info * bi,
 static void copy_packet_data_to_databuf(uint64_t packet_idx,
     struct block_info *bi, uint32_t vdif_thread_id, uint8_t * payload)
 {
-  int i;
-  uint32_t * src = (uint32_t *)(payload);
   uint32_t * dst = (uint32_t *)block_info_data(bi);
 
   // Compute starting packet offset into data block
   off_t offset = (off_t)(packet_idx % PKSUWL_PKTIDX_PER_BLOCK);
   // Convert to sample (i.e. uint32_t) offset
   offset *= 2 /*pols*/ * PKSUWL_SAMPLES_PER_PKT;
-  // Adjust for polarization
-  offset += (vdif_thread_id & 1);
   // Update destination pointer
   dst += offset;
 
-  // Copy samples
-  for(i=0 ; i<PKSUWL_SAMPLES_PER_PKT; i++) {
-    // Invert the MSb's of each component to convert to two's complement
-    *dst++ = *src++ ^ 0x80008000;
-    dst++; // Extra increment to interleave pols
-  }
+  // Convert and interleave samples
+  pksuwl_copy_pol(dst, (uint32_t *)payload, vdif_thread_id);
+}
+
+// The copy_packet_pair_to_databuf() function is like
+// copy_packet_data_to_databuf(), but it copies the packet data of both
+// polarizations of a block unit (payload0 and payload1 for polarizations 0 and
+// 1) in one pass.
+static void copy_packet_pair_to_databuf(uint64_t packet_idx,
+    struct block_info *bi, uint8_t * payload0, uint8_t * payload1)
+{
+  uint32_t * dst = (uint32_t *)block_info_data(bi);
+
+  // Compute starting packet offset into data block
+  off_t offset = (off_t)(packet_idx % PKSUWL_PKTIDX_PER_BLOCK);
+  // Convert to sample (i.e. uint32_t) offset
+  offset *= 2 /*pols*/ * PKSUWL_SAMPLES_PER_PKT;
+  // Update destination pointer
+  dst += offset;
+
+  // Convert and interleave samples
+  pksuwl_copy_pols(dst, (uint32_t *)payload0, (uint32_t *)payload1);
 }
 
 // Called periodically to update/query status buffer fields
@@ -340,10 +353,12 @@ update_status_buffer_periodic(hashpipe_status_t *st, int nfull, int nblocks,
 #if 0
     char *dest_ip_str, size_t dest_ip_len, uint32_t *bind_port,
 #endif
-    time_t *last_daq_pulse, uint64_t *ndrop)
+    time_t *last_daq_pulse, uint64_t *ndrop, uint64_t *nlate,
+    uint64_t *latehist)
 {
   char timestr[32] = {0};
   char bufst[80];
+  char latehist_str[80];
   double gbps;
   double pps;
   time_t now;
@@ -356,8 +371,9 @@ update_status_buffer_periodic(hashpipe_status_t *st, int nfull, int nblocks,
     timestr[strlen(timestr)-1] = '\0'; // Chop off trailing newline
   }
 
-  // Make xxxBUFST string
+  // Make xxxBUFST and LATEHIST strings
   sprintf(bufst, "%d/%d", nfull, nblocks);
+  hpguppi_latehist_str(latehist_str, sizeof(latehist_str), latehist);
 
   // Calculate stats
   gbps = 8.0 * nbytes / ns_processed;
@@ -378,6 +394,13 @@ update_status_buffer_periodic(hashpipe_status_t *st, int nfull, int nblocks,
     u64tmp += *ndrop; *ndrop = 0;
     hputu8(st->buf, "NDROP", u64tmp);
 
+    hgetu8(st->buf, "NLATE", &u64tmp);
+    u64tmp += *nlate; *nlate = 0;
+    hputu8(st->buf, "NLATE", u64tmp);
+
+    hputs(st->buf, "LATEHIST", latehist_str);
+    memset(latehist, 0, HPGUPPI_LATEHIST_BINS * sizeof(*latehist));
+
 #if 0
     hgets(st->buf, "DESTIP", dest_ip_len, dest_ip_str);
     hgetu4(st->buf, "BINDPORT", bind_port);
@@ -542,6 +565,14 @@ init(hashpipe_thread_args_t *args)
     return HASHPIPE_ERR_PARAM;
   }
 
+  // Make sure output databuf blocks are big enough
+  if(hpguppi_databuf_block_data_size((hpguppi_input_databuf_t *)args->obuf)
+      < PKSUWL_BLOCK_DATA_SIZE) {
+    hashpipe_error(thread_name, "output databuf block size must be >= %d",
+        PKSUWL_BLOCK_DATA_SIZE);
+    return HASHPIPE_ERR_PARAM;
+  }
+
   // Get DESTIP, OBSFREQ, and OBSBW first since their absence is a fatal error
   hashpipe_status_lock_safe(st);
   {
@@ -618,6 +649,9 @@ run(hashpipe_thread_args_t * args)
   // Current run state
   enum run_states state = IDLE;
   unsigned waiting = 0;
+  // Report NUMA node of this thread
+  hpguppi_numa_report_thread(args);
+
   // Update status_key with idle state
   hashpipe_status_lock_safe(st);
   {
@@ -636,26 +670,29 @@ run(hashpipe_thread_args_t * args)
   uint32_t bind_port = 0;
 
   // The incoming packets are placed in blocks that are eventually passed off
-  // to the downstream thread.  We currently support two active blocks (aka
-  // "working blocks").  Working blocks are associated with absolute block
-  // numbers, which are simply PKTIDX values divided by the number of packets
-  // per block (discarding any remainder).  Let the block numbers for the first
-  // working block (wblk[0]) be W.  The block number for the second working
-  // block (wblk[1]) will be W+1.  Incoming packets corresponding to block W or
-  // W+1 are placed in the corresponding data buffer block.  Incoming packets
-  // for block W+2 cause block W to be "finalized" and handed off to the
-  // downstream thread, working block 1 moves to working block 0 and working
-  // block 1 is incremented to be W+2.  Things get "interesting" when a packet
-  // is recevied for block < W or block > W+2.  Packets for block W-1 are
-  // ignored.  Packets with PKTIDX P corresponding block < W-1 or block > W+2
-  // cause the current working blocks' block numbers to be reset such that W
-  // will refer to the block containing P and W+1 will refer to the block after
-  // that.
+  // to the downstream thread.  We currently support NWBLK (default 2) active
+  // blocks (aka "working blocks").  Working blocks are associated with absolute
+  // block numbers, which are simply PKTIDX values divided by the number of
+  // packets per block (discarding any remainder).  Let the block numbers for
+  // the first working block (wblk[0]) be W.  The block number for the last
+  // working block (wblk[NWBLK-1]) will be L = W+NWBLK-1.  Incoming packets
+  // corresponding to blocks W through L are placed in the corresponding data
+  // buffer block.  Incoming packets for block L+1 cause block W to be
+  // "finalized" and handed off to the downstream thread, the remaining working
+  // blocks move down one position and the last working block is incremented to
+  // be L+1.  Things get "interesting" when a packet is recevied for block < W
+  // or block > L+1.  Packets for blocks W-NWBLK through W-1 are late and are
+  // ignored (but counted in NLATE and LATEHIST, see hpguppi_latehist_add()).
+  // Packets with PKTIDX P corresponding block < W-NWBLK or block > L+1 cause
+  // the current working blocks' block numbers to be reset such that W will
+  // refer to the block after the block containing P.
   //
-  // wblk is a two element array of block_info structures (i.e. the working
-  // blocks)
-  struct block_info wblk[2];
+  // wblk is an array of block_info structures (i.e. the working blocks), nwblk
+  // of which are used.
+  struct block_info wblk[HPGUPPI_MAX_WBLKS];
   int wblk_idx;
+  int nwblk;
+  int wblk_last;
 
   // Packet block variables
   uint64_t pkt_seq_num;
@@ -675,6 +712,7 @@ run(hashpipe_thread_args_t * args)
   // Variables for counting packets and bytes.
   uint64_t ndrop_total = 0;
   uint64_t nlate = 0;
+  uint64_t latehist[HPGUPPI_LATEHIST_BINS] = {0};
   // TODO Move used variabled from above to below, then remove unused
   uint64_t bytes_received = 0;
   uint64_t pkts_received = 0;
@@ -682,6 +720,16 @@ run(hashpipe_thread_args_t * args)
   // Variables for handing received packets
   struct vdifhdr * vdifhdr;
   uint8_t * payload;
+  uint32_t pol;
+
+  // Variables for a packet whose copy is deferred in the hope that the next
+  // packet is the other polarization of the same block unit, in which case
+  // both get copied in one pass.  The pending packet is always copied before
+  // the next packet can change the working blocks.
+  uint8_t * pend_payload = NULL;
+  uint64_t pend_seq_num = 0;
+  uint32_t pend_pol = 0;
+  int pend_wblk_idx = 0;
   off_t vdifhdr_offset = pktbuf_info->chunks[1].chunk_offset;
   off_t payload_offset = pktbuf_info->chunks[2].chunk_offset;
   const size_t bytes_per_packet = pktbuf_info->pkt_size;
@@ -693,7 +741,9 @@ run(hashpipe_thread_args_t * args)
   uint64_t ns_since_last_update = 0;
 
   // Initialize working blocks
-  for(wblk_idx=0; wblk_idx<2; wblk_idx++) {
+  nwblk = hpguppi_status_get_nwblk(st, dbout->header.n_block);
+  wblk_last = nwblk - 1;
+  for(wblk_idx=0; wblk_idx<nwblk; wblk_idx++) {
     init_block_info(wblk+wblk_idx, dbout, wblk_idx, wblk_idx);
     wait_for_block_free(wblk+wblk_idx, st, status_key);
   }
@@ -746,7 +796,7 @@ run(hashpipe_thread_args_t * args)
 #if 0
             dest_ip_str_new, sizeof(dest_ip_str_new), &bind_port,
 #endif
-            &last_daqpulse, &ndrop_total);
+            &last_daqpulse, &ndrop_total, &nlate, latehist);
 
         // If DESTIP changed
         if(strcmp(dest_ip_str_cur, dest_ip_str_new)) {
@@ -859,9 +909,9 @@ run(hashpipe_thread_args_t * args)
 
     // Get pointer to first vdifhdr and payload
     vdifhdr = (struct vdifhdr *)
-              (dbin->block[block_idx_in].data + vdifhdr_offset);
+              (hpguppi_databuf_data(dbin, block_idx_in) + vdifhdr_offset);
     payload = (uint8_t *)
-              (dbin->block[block_idx_in].data + payload_offset);//pbi->chunks[2].chunk_offset);
+              (hpguppi_databuf_data(dbin, block_idx_in) + payload_offset);//pbi->chunks[2].chunk_offset);
 
     // For each packet: process all packets
     for(i=0; i < npkts_per_block_in; i++, payload += slot_size,
@@ -883,9 +933,17 @@ run(hashpipe_thread_args_t * args)
       // Get packet index and absolute block number for packet
       pkt_seq_num = pksuwl_get_pktidx(vdifhdr);
       pkt_blk_num = pkt_seq_num / PKSUWL_PKTIDX_PER_BLOCK;
+      pol = vdif_get_thread_id(vdifhdr) & 1;
+
+      // Copy pending packet now unless this packet is its other polarization
+      if(pend_payload && (pkt_seq_num != pend_seq_num || pol == pend_pol)) {
+        copy_packet_data_to_databuf(pend_seq_num, wblk+pend_wblk_idx,
+            pend_pol, pend_payload);
+        pend_payload = NULL;
+      }
 
       // Manage blocks based on pkt_blk_num
-      if(pkt_blk_num == wblk[1].block_num + 1) {
+      if(pkt_blk_num == wblk[wblk_last].block_num + 1) {
         // Finalize first working block
         finalize_block(wblk);
         // Update ndrop counter
@@ -895,19 +953,19 @@ run(hashpipe_thread_args_t * args)
           ndrop_total -= PKSUWL_PKTIDX_PER_BLOCK;
         }
         // Shift working blocks
-        wblk[0] = wblk[1];
+        memmove(wblk, wblk+1, wblk_last * sizeof(struct block_info));
 
         // Increment last working block
-        increment_block(&wblk[1], pkt_blk_num);
+        increment_block(&wblk[wblk_last], pkt_blk_num);
         // Wait for new databuf data block to be free
-        wait_for_block_free(&wblk[1], st, status_key);
+        wait_for_block_free(&wblk[wblk_last], st, status_key);
 
         // Update status buffer for new wblk[0]
         state = update_status_buffer_new_block(st, wblk[0].block_num);
       }
       // Check for PKTIDX discontinuity
-      else if(pkt_blk_num < wblk[0].block_num - 1
-           || pkt_blk_num > wblk[1].block_num + 1) {
+      else if(pkt_blk_num + nwblk < wblk[0].block_num
+           || pkt_blk_num > wblk[wblk_last].block_num + 1) {
 
         // Should only happen when transitioning into LISTEN, so warn about it
         hashpipe_warn(thread_name,
@@ -916,7 +974,7 @@ run(hashpipe_thread_args_t * args)
 
         // Re-init working blocks for next block number
         // and clear their data buffers
-        for(wblk_idx=0; wblk_idx<2; wblk_idx++) {
+        for(wblk_idx=0; wblk_idx<nwblk; wblk_idx++) {
           init_block_info(wblk+wblk_idx, NULL, -1, pkt_blk_num+wblk_idx+1);
           // Clear data buffer
           bzero_nt(block_info_data(wblk+wblk_idx), PKSUWL_BLOCK_DATA_SIZE);
@@ -928,10 +986,12 @@ run(hashpipe_thread_args_t * args)
         // Continue on to next packet
         continue;
 
-      } else if(pkt_blk_num == wblk[0].block_num - 1) {
+      } else if(pkt_blk_num < wblk[0].block_num) {
         // Ignore late packet, continue on to next one.  This happens after
         // discontinuities (e.g. on startup), so don't warn about it.
         nlate++;
+        hpguppi_latehist_add(latehist,
+            wblk[wblk_last].block_num - pkt_blk_num);
         continue;
       }
 
@@ -941,16 +1001,36 @@ run(hashpipe_thread_args_t * args)
       wblk_idx = pkt_blk_num - wblk[0].block_num;
 
       // Only copy packet data and count packet if its wblk_idx is valid
-      if(0 <= wblk_idx && wblk_idx < 2) {
-        // Copy packet data to data buffer of working block
-        copy_packet_data_to_databuf(pkt_seq_num, wblk+wblk_idx,
-            vdif_get_thread_id(vdifhdr), payload);
+      if(0 <= wblk_idx && wblk_idx < nwblk) {
+        // Count packet's lag behind the newest working block
+        hpguppi_latehist_add(latehist, wblk_last - wblk_idx);
+
+        // Copy packet data to data buffer of working block, along with the
+        // pending packet if it is this packet's other polarization, otherwise
+        // make this packet pending.
+        if(pend_payload) {
+          copy_packet_pair_to_databuf(pkt_seq_num, wblk+wblk_idx,
+              pol ? pend_payload : payload, pol ? payload : pend_payload);
+          pend_payload = NULL;
+        } else {
+          pend_payload = payload;
+          pend_seq_num = pkt_seq_num;
+          pend_pol = pol;
+          pend_wblk_idx = wblk_idx;
+        }
 
         // Count packet for block
         wblk[wblk_idx].npacket++;
       }
     } // end for each packet
 
+    // Copy pending packet, if any, before releasing the input block
+    if(pend_payload) {
+      copy_packet_data_to_databuf(pend_seq_num, wblk+pend_wblk_idx,
+          pend_pol, pend_payload);
+      pend_payload = NULL;
+    }
+
     // Mark input block free
     hpguppi_input_databuf_set_free(dbin, block_idx_in);
 
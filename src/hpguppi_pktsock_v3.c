@@ -0,0 +1,204 @@
+// hpguppi_pktsock_v3.c
+//
+// TPACKET_V3 packet socket receive ring for hpguppi_daq (see
+// hpguppi_pktsock_v3.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+
+#include "hashpipe.h"
+#include "hpguppi_pktsock_v3.h"
+
+// Returns pointer to block descriptor of block idx
+static inline struct tpacket_block_desc *
+block_desc(struct hpguppi_pktsock_v3 * p_ps, unsigned int idx)
+{
+  return (struct tpacket_block_desc *)(p_ps->p_ring + idx * p_ps->block_size);
+}
+
+// Hands the current block (if any) back to the kernel
+static inline void
+release_block(struct hpguppi_pktsock_v3 * p_ps)
+{
+  if(p_ps->p_bd) {
+    __atomic_store_n(&p_ps->p_bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+        __ATOMIC_RELEASE);
+    p_ps->p_bd = NULL;
+    p_ps->frames_left = 0;
+  }
+}
+
+// Takes ownership of the next block if the kernel has retired it.  Returns 1
+// if a block was taken, 0 otherwise.
+static inline int
+take_block(struct hpguppi_pktsock_v3 * p_ps)
+{
+  struct tpacket_block_desc * p_bd = block_desc(p_ps, p_ps->next_block);
+
+  if(!(__atomic_load_n(&p_bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+        & TP_STATUS_USER)) {
+    return 0;
+  }
+
+  p_ps->p_bd = p_bd;
+  p_ps->frames_left = p_bd->hdr.bh1.num_pkts;
+  p_ps->p_next_frame = (unsigned char *)p_bd + p_bd->hdr.bh1.offset_to_first_pkt;
+  p_ps->next_block = (p_ps->next_block + 1) % p_ps->nblocks;
+
+  return 1;
+}
+
+int
+hpguppi_pktsock_v3_open(struct hpguppi_pktsock_v3 * p_ps, const char * ifname)
+{
+  int version = TPACKET_V3;
+  struct tpacket_req3 req;
+  struct sockaddr_ll addr;
+
+  p_ps->p_ring = NULL;
+  p_ps->p_bd = NULL;
+  p_ps->frames_left = 0;
+  p_ps->next_block = 0;
+
+  p_ps->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if(p_ps->fd == -1) {
+    hashpipe_error(__FUNCTION__, "socket");
+    return HASHPIPE_ERR_SYS;
+  }
+
+  if(setsockopt(p_ps->fd, SOL_PACKET, PACKET_VERSION,
+        &version, sizeof(version))) {
+    hashpipe_error(__FUNCTION__, "setsockopt PACKET_VERSION");
+    goto error;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = p_ps->block_size;
+  req.tp_block_nr = p_ps->nblocks;
+  req.tp_frame_size = p_ps->frame_size;
+  req.tp_frame_nr = (p_ps->block_size / p_ps->frame_size) * p_ps->nblocks;
+  req.tp_retire_blk_tov = p_ps->retire_ms;
+  if(setsockopt(p_ps->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+    hashpipe_error(__FUNCTION__, "setsockopt PACKET_RX_RING "
+        "(block_size %u nblocks %u frame_size %u)",
+        p_ps->block_size, p_ps->nblocks, p_ps->frame_size);
+    goto error;
+  }
+
+  p_ps->ring_size = (size_t)p_ps->block_size * p_ps->nblocks;
+  p_ps->p_ring = mmap(NULL, p_ps->ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, p_ps->fd, 0);
+  if(p_ps->p_ring == MAP_FAILED) {
+    p_ps->p_ring = NULL;
+    hashpipe_error(__FUNCTION__, "mmap");
+    goto error;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_IP);
+  addr.sll_ifindex = if_nametoindex(ifname);
+  if(addr.sll_ifindex == 0) {
+    hashpipe_error(__FUNCTION__, "if_nametoindex %s", ifname);
+    goto error;
+  }
+  if(bind(p_ps->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    hashpipe_error(__FUNCTION__, "bind %s", ifname);
+    goto error;
+  }
+
+  return HASHPIPE_OK;
+
+error:
+  hpguppi_pktsock_v3_close(p_ps);
+  return HASHPIPE_ERR_SYS;
+}
+
+unsigned char *
+hpguppi_pktsock_v3_recv_udp_frame(struct hpguppi_pktsock_v3 * p_ps,
+    int dst_port, int timeout_ms)
+{
+  struct pollfd pfd;
+  unsigned char * p_frame;
+
+  for(;;) {
+    // Return next matching frame of current block
+    while(p_ps->frames_left > 0) {
+      p_frame = p_ps->p_next_frame;
+      p_ps->p_next_frame += ((struct tpacket3_hdr *)p_frame)->tp_next_offset;
+      p_ps->frames_left--;
+
+      if(PKTV3_IS_UDP(p_frame)
+      && (dst_port == 0 || PKTV3_UDP_DST(p_frame) == dst_port)) {
+        return p_frame;
+      }
+    }
+
+    // Current block is done, give it back and get the next one
+    release_block(p_ps);
+    if(take_block(p_ps)) {
+      continue;
+    }
+
+    pfd.fd = p_ps->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, timeout_ms) <= 0 || !take_block(p_ps)) {
+      return NULL;
+    }
+  }
+}
+
+void
+hpguppi_pktsock_v3_flush(struct hpguppi_pktsock_v3 * p_ps)
+{
+  release_block(p_ps);
+  while(take_block(p_ps)) {
+    release_block(p_ps);
+  }
+}
+
+int
+hpguppi_pktsock_v3_stats(struct hpguppi_pktsock_v3 * p_ps,
+    unsigned int * p_pkts, unsigned int * p_drops)
+{
+  struct tpacket_stats_v3 stats;
+  socklen_t len = sizeof(stats);
+
+  if(getsockopt(p_ps->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len)) {
+    return -1;
+  }
+
+  if(p_pkts) {
+    *p_pkts = stats.tp_packets;
+  }
+  if(p_drops) {
+    *p_drops = stats.tp_drops;
+  }
+
+  return 0;
+}
+
+void
+hpguppi_pktsock_v3_close(struct hpguppi_pktsock_v3 * p_ps)
+{
+  if(p_ps->p_ring) {
+    munmap(p_ps->p_ring, p_ps->ring_size);
+    p_ps->p_ring = NULL;
+  }
+  if(p_ps->fd != -1) {
+    close(p_ps->fd);
+    p_ps->fd = -1;
+  }
+  p_ps->p_bd = NULL;
+  p_ps->frames_left = 0;
+}
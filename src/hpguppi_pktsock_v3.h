@@ -0,0 +1,86 @@
+// hpguppi_pktsock_v3.h
+//
+// TPACKET_V3 packet socket receive ring for hpguppi_daq.  Unlike the
+// TPACKET_V1 rings used by hashpipe_pktsock, a TPACKET_V3 ring is divided into
+// blocks that the kernel fills with variable length frames and hands to user
+// space as a whole, either when full or when the block's retire timeout
+// expires.  This module walks the frames of each block in order and hands the
+// whole block back to the kernel with a single status write once all of its
+// frames have been consumed, so there is no per-frame status handshake and
+// small packets do not waste a fixed size frame each.
+//
+// Frames returned by hpguppi_pktsock_v3_recv_udp_frame() remain valid until
+// the next call to hpguppi_pktsock_v3_recv_udp_frame() or
+// hpguppi_pktsock_v3_flush().  They do not need to be released individually.
+
+#ifndef _HPGUPPI_PKTSOCK_V3_H_
+#define _HPGUPPI_PKTSOCK_V3_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/if_packet.h>
+
+// Default ring geometry.  Blocks are 2 MiB (i.e. one x86_64 huge page) so
+// that each block is one high order kernel allocation rather than many
+// scattered pages.  frame_size is only a hint to the kernel for V3 rings;
+// frames are packed into blocks according to their actual length.
+#define HPGUPPI_PKTSOCK_V3_BLOCK_SIZE (2*1024*1024)
+#define HPGUPPI_PKTSOCK_V3_FRAME_SIZE (16384)
+#define HPGUPPI_PKTSOCK_V3_RETIRE_MS  (8)
+
+// Macros to get various parts of a TPACKET_V3 frame.  These mirror the
+// PKT_XXX macros of hashpipe_pktsock.h, which assume TPACKET_V1 frames.  As
+// with those, the UDP macros assume an IPv4 header without options.
+#define PKTV3_MAC(p) ((p)+((struct tpacket3_hdr *)(p))->tp_mac)
+#define PKTV3_NET(p) ((p)+((struct tpacket3_hdr *)(p))->tp_net)
+#define PKTV3_IS_UDP(p) ((PKTV3_NET(p)[0x09]) == 0x11)
+#define PKTV3_UDP_DST(p) (((PKTV3_NET(p)[0x16]) << 8) | ((PKTV3_NET(p)[0x17])))
+#define PKTV3_UDP_SIZE(p) (((PKTV3_NET(p)[0x18]) << 8) | ((PKTV3_NET(p)[0x19])))
+#define PKTV3_UDP_DATA(p) (PKTV3_NET(p) + 0x1c)
+
+struct hpguppi_pktsock_v3 {
+  // These fields must be set before calling hpguppi_pktsock_v3_open()
+  unsigned int block_size; // Multiple of page size, and of frame_size
+  unsigned int frame_size; // Multiple of TPACKET_ALIGNMENT
+  unsigned int nblocks;
+  unsigned int retire_ms;  // Block retire timeout, 0 means kernel default
+
+  // These fields are managed by the hpguppi_pktsock_v3_xxx functions
+  int fd;
+  unsigned char * p_ring;
+  size_t ring_size;
+  unsigned int next_block;         // Index of next block to get from kernel
+  struct tpacket_block_desc * p_bd; // Block currently owned by us, or NULL
+  uint32_t frames_left;            // Frames of p_bd not yet returned
+  unsigned char * p_next_frame;    // Next frame of p_bd to return
+};
+
+// Creates a TPACKET_V3 packet socket bound to interface ifname (e.g. "eth4")
+// and maps its receive ring according to the geometry fields of p_ps.
+// Returns HASHPIPE_OK on success or HASHPIPE_ERR_SYS on error (with errno
+// set).
+int hpguppi_pktsock_v3_open(struct hpguppi_pktsock_v3 * p_ps,
+    const char * ifname);
+
+// Returns a pointer to the next frame containing a UDP packet destined for
+// port dst_port (or any UDP packet if dst_port is 0).  Other frames are
+// skipped.  When all frames of the current block have been consumed, the
+// block is released to the kernel and the next block is waited for for up to
+// timeout_ms milliseconds.  Returns NULL on timeout or error.
+unsigned char * hpguppi_pktsock_v3_recv_udp_frame(
+    struct hpguppi_pktsock_v3 * p_ps, int dst_port, int timeout_ms);
+
+// Releases all blocks currently owned by user space, dropping any frames not
+// yet returned.
+void hpguppi_pktsock_v3_flush(struct hpguppi_pktsock_v3 * p_ps);
+
+// Gets the number of packets received and dropped by the kernel since the
+// previous call (the kernel resets the counters on each read), like
+// hashpipe_pktsock_stats().  Returns 0 on success, -1 on error.
+int hpguppi_pktsock_v3_stats(struct hpguppi_pktsock_v3 * p_ps,
+    unsigned int * p_pkts, unsigned int * p_drops);
+
+// Unmaps the receive ring and closes the socket.
+void hpguppi_pktsock_v3_close(struct hpguppi_pktsock_v3 * p_ps);
+
+#endif // _HPGUPPI_PKTSOCK_V3_H_
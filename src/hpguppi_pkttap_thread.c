@@ -0,0 +1,415 @@
+// hpguppi_pkttap_thread.c
+//
+// A Hashpipe thread that writes a sampled subset of the packets captured into
+// an hpguppi_input_databuf (e.g. by hpguppi_ibvpkt_thread, possibly with its
+// IBVSNIFF sniffer flow enabled) to a set of rotating pcap files.  This allows
+// F engine packets to be inspected with the usual tools while observing.
+//
+// This thread does NOT register as a reader of the databuf so it can never
+// hold up the release of a block.  Instead, it peeks at filled blocks and
+// discards whatever it read from a block if the block was freed while it was
+// being read (see hpguppi_input_databuf_fill_seq()).  It is expected to share
+// the databuf with the thread that consumes it via FANOUTDB and FANOUTN (see
+// hpguppi_databuf.c).  For example, with FANOUTDB=1 and FANOUTN=1, the
+// pipeline
+//
+//   hpguppi_ibvpkt_thread -> hpguppi_pkttap_thread
+//     -> hpguppi_meerkat_spead_thread -> hpguppi_rawdisk_thread
+//
+// has this thread and hpguppi_meerkat_spead_thread both reading databuf 1,
+// while hpguppi_meerkat_spead_thread still writes its own output databuf (3)
+// for hpguppi_rawdisk_thread.  The same works with the other packet
+// assemblers (e.g. hpguppi_atasnap_voltage_thread).  Blocks that get filled
+// and freed before this thread gets to them are simply missed.
+//
+// Packets are sampled either 1-in-N (TAPEVERY) or as the first K per second
+// (TAPPERS), or both, and at most MAX_TAP_PKTS_PER_BLOCK packets are taken from
+// any one block.  The slots do not record when packets arrived, so all packets
+// taken from a block get the time at which this thread saw the block as their
+// timestamp.  The packet length is taken from the IPv4 header when present,
+// otherwise the full slot packet size is used.  If IBVSKIP is non-zero, the
+// skipped chunks are not in the databuf so the remaining chunks are written
+// with link type USER0 rather than Ethernet.
+//
+// Status buffer keywords:
+//
+//   TAPSTAT   Thread status
+//   TAPFILE   Base name of pcap files (tapping is disabled if empty).  Files
+//             are named TAPFILE.0.pcap, TAPFILE.1.pcap, etc.
+//   TAPEVERY  Take every Nth packet (default 0, disabled)
+//   TAPPERS   Take the first K packets each second (default 0, disabled)
+//   TAPFSIZE  Switch to next file after this many MiB (default 100)
+//   TAPNFILE  Number of files to rotate through (default 2)
+//   TAPNPKT   Number of packets written
+//   TAPMISS   Number of blocks missed
+//   TAPDISC   Number of blocks whose packets were discarded
+//
+// TAPFILE, TAPEVERY, and TAPPERS can be changed while running.  If a pcap
+// file cannot be opened or written, tapping stops and is retried with a new
+// set of files on the next once per second status update.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "hashpipe.h"
+#include "hpguppi_databuf.h"
+#include "hpguppi_ibverbs_pkt_thread.h"
+
+// Max number of packets to take from a single block
+#define MAX_TAP_PKTS_PER_BLOCK (256)
+
+// Nanoseconds to sleep when no new block is ready
+#define TAP_POLL_NS (1000*1000)
+
+#define DEFAULT_TAP_FILE_MIB (100)
+#define DEFAULT_TAP_NFILE (2)
+
+// pcap file format magic number and link types
+#define PCAP_MAGIC_NS (0xa1b23c4d)
+#define PCAP_LINKTYPE_ETHERNET (1)
+#define PCAP_LINKTYPE_USER0 (147)
+
+struct pcap_file_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t  thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcap_rec_header {
+  uint32_t ts_sec;
+  uint32_t ts_frac;
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+// Rotating pcap output files
+struct tap_files {
+  FILE * fp;
+  char base[80];
+  uint32_t idx;
+  uint32_t nfile;
+  size_t bytes;
+  size_t max_bytes;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+// Closes the current file (if any) and opens the next one.  Returns 0 on
+// success or -1 on error.
+static int tap_files_next(struct tap_files * tf, const char * thread_name)
+{
+  char fname[128];
+  struct pcap_file_header fh = {
+    .magic         = PCAP_MAGIC_NS,
+    .version_major = 2,
+    .version_minor = 4,
+    .thiszone      = 0,
+    .sigfigs       = 0,
+    .snaplen       = tf->snaplen,
+    .linktype      = tf->linktype
+  };
+
+  if(tf->fp) {
+    fclose(tf->fp);
+    tf->fp = NULL;
+    tf->idx = (tf->idx + 1) % tf->nfile;
+  }
+
+  snprintf(fname, sizeof(fname), "%s.%u.pcap", tf->base, tf->idx);
+  if(!(tf->fp = fopen(fname, "w"))) {
+    hashpipe_error(thread_name, "error opening %s", fname);
+    return -1;
+  }
+  if(fwrite(&fh, sizeof(fh), 1, tf->fp) != 1) {
+    hashpipe_error(thread_name, "error writing %s", fname);
+    fclose(tf->fp);
+    tf->fp = NULL;
+    return -1;
+  }
+  tf->bytes = sizeof(fh);
+
+  return 0;
+}
+
+// Writes a record header and packet to the current file.  Returns 0 on
+// success or -1 on error (e.g. a short write due to a full disk).
+static int tap_files_write(struct tap_files * tf,
+    const struct pcap_rec_header * rh, const uint8_t * pkt,
+    const char * thread_name)
+{
+  if(fwrite(rh, sizeof(*rh), 1, tf->fp) != 1
+  || fwrite(pkt, rh->incl_len, 1, tf->fp) != 1) {
+    hashpipe_error(thread_name, "error writing %s.%u.pcap",
+        tf->base, tf->idx);
+    return -1;
+  }
+  tf->bytes += sizeof(*rh) + rh->incl_len;
+
+  return 0;
+}
+
+static void tap_files_close(struct tap_files * tf)
+{
+  if(tf->fp) {
+    fclose(tf->fp);
+    tf->fp = NULL;
+  }
+  tf->idx = 0;
+}
+
+// Gathers the stored (i.e. non-skipped) chunks of the packet in slot into pkt.
+// Returns the length of the packet.
+static size_t gather_slot(uint8_t * pkt, const uint8_t * slot,
+    const struct hpguppi_pktbuf_info * pktbuf_info)
+{
+  int i;
+  size_t len = 0;
+  size_t ip_len;
+
+  for(i=pktbuf_info->num_skip_chunks; i<pktbuf_info->num_chunks; i++) {
+    memcpy(pkt + len, slot + pktbuf_info->chunks[i].chunk_offset,
+        pktbuf_info->chunks[i].chunk_size);
+    len += pktbuf_info->chunks[i].chunk_size;
+  }
+
+  // Use the IPv4 total length (plus Ethernet header) if we have an Ethernet
+  // header, optionally with an 802.1Q tag.
+  if(pktbuf_info->num_skip_chunks == 0 && len >= 22) {
+    if(pkt[12] == 0x08 && pkt[13] == 0x00) {
+      ip_len = 14 + ntohs(*(uint16_t *)(pkt + 16));
+    } else if(pkt[12] == 0x81 && pkt[13] == 0x00
+           && pkt[16] == 0x08 && pkt[17] == 0x00 && len >= 24) {
+      ip_len = 18 + ntohs(*(uint16_t *)(pkt + 20));
+    } else {
+      ip_len = len;
+    }
+    if(ip_len < len) {
+      len = ip_len;
+    }
+  }
+
+  return len;
+}
+
+static void * run(hashpipe_thread_args_t * args)
+{
+  // Local aliases to shorten access to args fields
+  hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->ibuf;
+  hashpipe_status_t *st = &args->st;
+  const char * thread_name = args->thread_desc->name;
+  const char * status_key = args->thread_desc->skey;
+
+  struct hpguppi_pktbuf_info * pktbuf_info = hpguppi_pktbuf_info_ptr(db);
+  const int n_block = db->header.n_block;
+
+  int i;
+  int curblock = 0;
+  uint64_t * last_seq = NULL;
+  uint64_t seq;
+  uint8_t * slot;
+
+  // Sampled packets of current block
+  uint8_t * pkts = NULL;
+  size_t pkt_len[MAX_TAP_PKTS_PER_BLOCK];
+  int npkts;
+
+  // Sampling parameters and state
+  uint32_t tap_every = 0;
+  uint32_t tap_per_sec = 0;
+  uint64_t slot_count = 0;
+  uint32_t sec_count = 0;
+  time_t cur_sec = 0;
+
+  // Output files
+  struct tap_files tf;
+  char tapfile[80] = {0};
+  uint32_t file_mib = DEFAULT_TAP_FILE_MIB;
+  struct pcap_rec_header rh;
+
+  // Counters
+  uint64_t tap_npkt = 0;
+  uint64_t tap_miss = 0;
+  uint64_t tap_disc = 0;
+
+  struct timespec ts_block;
+  struct timespec ts_poll = {
+    .tv_sec  = 0,
+    .tv_nsec = TAP_POLL_NS
+  };
+  time_t last_status = 0;
+
+  memset(&tf, 0, sizeof(tf));
+  tf.nfile = DEFAULT_TAP_NFILE;
+  tf.snaplen = pktbuf_info->pkt_size;
+  tf.linktype = pktbuf_info->num_skip_chunks ?
+    PCAP_LINKTYPE_USER0 : PCAP_LINKTYPE_ETHERNET;
+
+  if(!(last_seq = (uint64_t *)calloc(n_block, sizeof(uint64_t)))
+  || !(pkts = (uint8_t *)malloc(MAX_TAP_PKTS_PER_BLOCK * pktbuf_info->pkt_size))) {
+    hashpipe_error(thread_name, "out of memory");
+    free(last_seq);
+    return NULL;
+  }
+
+  hashpipe_status_lock_safe(st);
+  {
+    // Get info from status buffer if present (no change if not present)
+    hgets(st->buf,  "TAPFILE", sizeof(tapfile), tapfile);
+    hgetu4(st->buf, "TAPEVERY", &tap_every);
+    hgetu4(st->buf, "TAPPERS", &tap_per_sec);
+    hgetu4(st->buf, "TAPFSIZE", &file_mib);
+    hgetu4(st->buf, "TAPNFILE", &tf.nfile);
+    if(tf.nfile == 0) {
+      tf.nfile = 1;
+    }
+    hputs(st->buf, "TAPFILE", tapfile);
+    hputu4(st->buf, "TAPEVERY", tap_every);
+    hputu4(st->buf, "TAPPERS", tap_per_sec);
+    hputu4(st->buf, "TAPFSIZE", file_mib);
+    hputu4(st->buf, "TAPNFILE", tf.nfile);
+    hputu8(st->buf, "TAPNPKT", 0);
+    hputu8(st->buf, "TAPMISS", 0);
+    hputu8(st->buf, "TAPDISC", 0);
+    hputs(st->buf, status_key, "running");
+  }
+  hashpipe_status_unlock_safe(st);
+  tf.max_bytes = (size_t)file_mib << 20;
+
+  while(run_threads()) {
+    clock_gettime(CLOCK_REALTIME, &ts_block);
+
+    // Once per second, update status buffer and get (possibly new) settings
+    if(ts_block.tv_sec != last_status) {
+      last_status = ts_block.tv_sec;
+      hashpipe_status_lock_safe(st);
+      {
+        hputu8(st->buf, "TAPNPKT", tap_npkt);
+        hputu8(st->buf, "TAPMISS", tap_miss);
+        hputu8(st->buf, "TAPDISC", tap_disc);
+        hgets(st->buf, "TAPFILE", sizeof(tapfile), tapfile);
+        hgetu4(st->buf, "TAPEVERY", &tap_every);
+        hgetu4(st->buf, "TAPPERS", &tap_per_sec);
+      }
+      hashpipe_status_unlock_safe(st);
+
+      // Start over with new files if TAPFILE changed
+      if(strcmp(tapfile, tf.base)) {
+        tap_files_close(&tf);
+        strcpy(tf.base, tapfile);
+      }
+    }
+
+    // Wait for block to be filled with data that we have not yet seen.  The
+    // block state must be checked before fill_seq.
+    if(hpguppi_input_databuf_block_status(db, curblock) == 0
+    || (seq = hpguppi_input_databuf_fill_seq(db, curblock))
+        == last_seq[curblock]) {
+      nanosleep(&ts_poll, NULL);
+      continue;
+    }
+
+    // Count blocks that got filled more than once since we last saw them
+    if(last_seq[curblock] != 0 && seq > last_seq[curblock] + 1) {
+      tap_miss += seq - last_seq[curblock] - 1;
+    }
+    last_seq[curblock] = seq;
+
+    // Take sampled packets
+    npkts = 0;
+    if(tf.base[0] && (tap_every || tap_per_sec)) {
+      slot = (uint8_t *)hpguppi_databuf_data(db, curblock);
+      for(i=0; i<pktbuf_info->slots_per_block
+          && npkts < MAX_TAP_PKTS_PER_BLOCK; i++, slot += pktbuf_info->slot_size) {
+        if(ts_block.tv_sec != cur_sec) {
+          cur_sec = ts_block.tv_sec;
+          sec_count = 0;
+        }
+        if((tap_every && slot_count++ % tap_every == 0)
+        || (tap_per_sec && sec_count < tap_per_sec)) {
+          pkt_len[npkts] = gather_slot(
+              pkts + npkts * pktbuf_info->pkt_size, slot, pktbuf_info);
+          npkts++;
+          sec_count++;
+        }
+      }
+    }
+
+    // Discard packets if the block was freed while we were reading it
+    if(npkts > 0
+    && (hpguppi_input_databuf_block_status(db, curblock) == 0
+        || hpguppi_input_databuf_fill_seq(db, curblock) != seq)) {
+      tap_disc++;
+      npkts = 0;
+    }
+
+    // Write packets
+    for(i=0; i<npkts; i++) {
+      // Skip empty (all zero MAC/ethertype) slots, e.g. from padded blocks
+      if(tf.linktype == PCAP_LINKTYPE_ETHERNET) {
+        slot = pkts + i * pktbuf_info->pkt_size;
+        if(!memcmp(slot, slot+1, 13) && slot[0] == 0) {
+          continue;
+        }
+      }
+
+      if((!tf.fp || tf.bytes >= tf.max_bytes)
+      && tap_files_next(&tf, thread_name)) {
+        // Disable tapping until next status update
+        tf.base[0] = '\0';
+        break;
+      }
+
+      rh.ts_sec = ts_block.tv_sec;
+      rh.ts_frac = ts_block.tv_nsec;
+      rh.incl_len = pkt_len[i];
+      rh.orig_len = pkt_len[i];
+      if(tap_files_write(&tf, &rh, pkts + i * pktbuf_info->pkt_size,
+            thread_name)) {
+        // Close (possibly truncated) file and disable tapping until next
+        // status update
+        tap_files_close(&tf);
+        tf.base[0] = '\0';
+        break;
+      }
+      tap_npkt++;
+    }
+
+    curblock = (curblock + 1) % n_block;
+
+    // Will exit if thread has been cancelled
+    pthread_testcancel();
+  }
+
+  tap_files_close(&tf);
+  free(pkts);
+  free(last_seq);
+
+  hashpipe_info(thread_name, "exiting!");
+
+  return NULL;
+}
+
+static hashpipe_thread_desc_t thread_desc = {
+    name: "hpguppi_pkttap_thread",
+    skey: "TAPSTAT",
+    init: NULL,
+    run:  run,
+    ibuf_desc: {hpguppi_input_databuf_create},
+    obuf_desc: {NULL}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&thread_desc);
+}
+
+// vi: set ts=2 sw=2 et :
@@ -19,6 +19,7 @@
 #include "hashpipe.h"
 
 #include "hpguppi_databuf.h"
+#include "hpguppi_numa.h"
 #include "hpguppi_params.h"
 //#include "hpguppi_pksuwl.h"
 #include "hpguppi_util.h"
@@ -84,6 +85,28 @@ static int init(hashpipe_thread_args_t * args)
 }
 #endif // 0
 
+// Our reader ID for the input databuf
+static int reader_id = -1;
+
+// Buffer for the header of the block being written.  Other readers may be
+// reading the same block, so its header cannot be modified in place.
+static char hdrbuf[HPGUPPI_RAW_HDR_BUF_SIZE] __attribute__((aligned(4096)));
+
+static int init(hashpipe_thread_args_t * args)
+{
+    hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->ibuf;
+
+    // Register as a reader of the input databuf
+    if((reader_id = hpguppi_input_databuf_add_reader_spin(db,
+        &args->st, "DISKSPIN")) < 0) {
+      hashpipe_error(args->thread_desc->name,
+	  "unable to register as databuf reader");
+      return HASHPIPE_ERR_SYS;
+    }
+
+    return HASHPIPE_OK;
+}
+
 static void *run(hashpipe_thread_args_t * args)
 {
     // Local aliases to shorten access to args fields
@@ -111,27 +134,30 @@ static void *run(hashpipe_thread_args_t * args)
       hashpipe_error(thread_name, "ioprio_set IOPRIO_CLASS_RT");
     }
 
+    /* Report NUMA node of this thread */
+    hpguppi_numa_report_thread(args);
+
     /* Loop */
     int64_t pktidx=0, pktstart=0, pktstop=0;
     int blocksize=0, len=0;
     int curblock=0;
     int block_count=0, blocks_per_file=128, filenum=0;
     int got_packet_0=0, first=1;
-    char *ptr, *hend;
+    char *ptr;
     int open_flags = 0;
     int directio = 0;
     int rv = 0;
+    const char * disk_state = NULL;
 
     while (run_threads()) {
 
-        /* Note waiting status */
-        hashpipe_status_lock_safe(st);
-        hputs(st->buf, status_key, "waiting");
-        hashpipe_status_unlock_safe(st);
-
         /* Wait for buf to have data */
-        rv = hpguppi_input_databuf_wait_filled(db, curblock);
-        if (rv!=0) continue;
+        rv = hpguppi_input_databuf_reader_wait_filled(db, curblock, reader_id);
+        if (rv!=0) {
+            /* Note waiting status */
+            hpguppi_status_update_state(st, status_key, &disk_state, "waiting");
+            continue;
+        }
 
         /* Read param struct for this block */
         ptr = hpguppi_databuf_header(db, curblock);
@@ -165,7 +191,10 @@ static void *run(hashpipe_thread_args_t * args)
 		    pktstart, pktstop, pktidx);
 	    }
 	    /* Mark as free */
-	    hpguppi_input_databuf_set_free(db, curblock);
+	    hpguppi_input_databuf_reader_set_free(db, curblock, reader_id);
+
+	    /* Note waiting status */
+	    hpguppi_status_update_state(st, status_key, &disk_state, "waiting");
 
 	    /* Go to next block */
 	    curblock = (curblock + 1) % db->header.n_block;
@@ -241,33 +270,18 @@ static void *run(hashpipe_thread_args_t * args)
         if (got_packet_0) {
 
             /* Note writing status */
-            hashpipe_status_lock_safe(st);
-            hputs(st->buf, status_key, "writing");
-            hashpipe_status_unlock_safe(st);
-
-            /* Write header to file */
-            hend = ksearch(ptr, "END");
-            len = (hend-ptr)+80;
-
-            // If BACKEND record is not present, insert it as first record.
-            // TODO: Verify that we have room to insert the record.
-            if(!ksearch(ptr, "BACKEND")) {
-                // Move exsiting records to make room for new first record
-                memmove(ptr+80, ptr, len);
-                // Copy in BACKEND_RECORD string
-                strncpy(ptr, BACKEND_RECORD, 80);
-                // Increase len by 80 to account for the added record
-                len += 80;
-            }
-
-            // Adjust length for any padding required for DirectIO
-            if(directio) {
-                // Round up to next multiple of 512
-                len = (len+511) & ~511;
+            hpguppi_status_update_state(st, status_key, &disk_state, "writing");
+
+            /* Copy header (and padding, if any) to hdrbuf, leaving the
+             * block itself unmodified for any other readers */
+            len = hpguppi_raw_header_copy(hdrbuf, ptr, BACKEND_RECORD, directio);
+            if (len == -1) {
+                hashpipe_error(thread_name, "no END record in block header");
+                len = 0;
             }
 
             /* Write header (and padding, if any) */
-            rv = write_all(fdraw, ptr, len);
+            rv = write_all(fdraw, hdrbuf, len);
             if (rv != len) {
                 char msg[100];
                 perror(thread_name);
@@ -300,7 +314,7 @@ static void *run(hashpipe_thread_args_t * args)
         }
 
         /* Mark as free */
-        hpguppi_input_databuf_set_free(db, curblock);
+        hpguppi_input_databuf_reader_set_free(db, curblock, reader_id);
 
         /* Go to next block */
         curblock = (curblock + 1) % db->header.n_block;
@@ -321,7 +335,7 @@ static void *run(hashpipe_thread_args_t * args)
 static hashpipe_thread_desc_t rawdisk_thread = {
     name: "hpguppi_rawdisk_only_thread",
     skey: "DISKSTAT",
-    init: NULL,
+    init: init,
     run:  run,
     ibuf_desc: {hpguppi_input_databuf_create},
     obuf_desc: {NULL}
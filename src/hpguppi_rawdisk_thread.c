@@ -18,6 +18,7 @@
 #include "hashpipe.h"
 
 #include "hpguppi_databuf.h"
+#include "hpguppi_numa.h"
 #include "hpguppi_params.h"
 #include "hpguppi_pksuwl.h"
 #include "hpguppi_rawspec.h"
@@ -53,6 +54,13 @@ static int safe_close(int *pfd) {
     return close(*pfd);
 }
 
+// Our reader ID for the input databuf
+static int reader_id = -1;
+
+// Buffer for the header of the block being written.  Other readers may be
+// reading the same block, so its header cannot be modified in place.
+static char hdrbuf[HPGUPPI_RAW_HDR_BUF_SIZE] __attribute__((aligned(4096)));
+
 static int init(hashpipe_thread_args_t * args)
 {
     int i;
@@ -99,7 +107,7 @@ static int init(hashpipe_thread_args_t * args)
 
     if(Nbps == 8) {
       // Assume pre-PKSUWL (multibeam, other single pixel) data parameters.
-      ctx->Ntpb = calc_ntime_per_block(BLOCK_DATA_SIZE, Nc);
+      ctx->Ntpb = calc_ntime_per_block(hpguppi_databuf_block_data_size(db), Nc);
       // Number of fine channels per coarse channel (i.e. FFT size).
       ctx->Nts[0] = (1<<20);
       ctx->Nts[1] = (1<<3);
@@ -157,7 +165,7 @@ static int init(hashpipe_thread_args_t * args)
       return HASHPIPE_ERR_SYS;
     }
     for(i=0; i < ctx->Nb_host; i++) {
-      ctx->h_blkbufs[i] = (char *)&db->block[i].data;
+      ctx->h_blkbufs[i] = hpguppi_databuf_data(db, i);
     }
 
     // Initialize rawspec
@@ -176,6 +184,14 @@ static int init(hashpipe_thread_args_t * args)
       }
     }
 
+    // Register as a reader of the input databuf
+    if((reader_id = hpguppi_input_databuf_add_reader_spin(db,
+        &args->st, "DISKSPIN")) < 0) {
+      hashpipe_error(thread_name,
+	  "unable to register as databuf reader");
+      return HASHPIPE_ERR_SYS;
+    }
+
     // Save context
     args->user_data = ctx;
 
@@ -214,6 +230,9 @@ static void *run(hashpipe_thread_args_t * args)
       hashpipe_error(thread_name, "ioprio_set IOPRIO_CLASS_RT");
     }
 
+    /* Report NUMA node of this thread */
+    hpguppi_numa_report_thread(args);
+
     /* Loop */
     int64_t pktidx=0, pktstart=0, pktstop=0;
     int64_t piperblk=0, last_pktidx=0;
@@ -221,24 +240,22 @@ static void *run(hashpipe_thread_args_t * args)
     int curblock=0;
     int block_count=0, blocks_per_file=128, filenum=0;
     int got_packet_0=0, first=1;
-    char *ptr, *hend;
+    char *ptr;
     int open_flags = 0;
     int directio = 0;
     int rv = 0;
+    const char * disk_state = NULL;
     int i;
 
     while (run_threads()) {
 
-        /* Note waiting status */
-        hashpipe_status_lock_safe(st);
-	{
-	  hputs(st->buf, status_key, "waiting");
-	}
-        hashpipe_status_unlock_safe(st);
-
         /* Wait for buf to have data */
-        rv = hpguppi_input_databuf_wait_filled(db, curblock);
-        if (rv!=0) continue;
+        rv = hpguppi_input_databuf_reader_wait_filled(db, curblock, reader_id);
+        if (rv!=0) {
+            /* Note waiting status */
+            hpguppi_status_update_state(st, status_key, &disk_state, "waiting");
+            continue;
+        }
 
         /* Read param struct for this block */
         ptr = hpguppi_databuf_header(db, curblock);
@@ -283,7 +300,10 @@ static void *run(hashpipe_thread_args_t * args)
 		piperblk = 0;
 	    }
 	    /* Mark as free */
-	    hpguppi_input_databuf_set_free(db, curblock);
+	    hpguppi_input_databuf_reader_set_free(db, curblock, reader_id);
+
+	    /* Note waiting status */
+	    hpguppi_status_update_state(st, status_key, &disk_state, "waiting");
 
 	    /* Go to next block */
 	    curblock = (curblock + 1) % db->header.n_block;
@@ -408,36 +428,19 @@ static void *run(hashpipe_thread_args_t * args)
         /* If we got packet 0, write data to disk */
         if (got_packet_0) {
 
-            /* Note waiting status */
-            hashpipe_status_lock_safe(st);
-	    {
-	      hputs(st->buf, status_key, "writing");
-	    }
-            hashpipe_status_unlock_safe(st);
-
-            /* Write header to file */
-            hend = ksearch(ptr, "END");
-            len = (hend-ptr)+80;
-
-            // If BACKEND record is not present, insert it as first record.
-            // TODO: Verify that we have room to insert the record.
-            if(!ksearch(ptr, "BACKEND")) {
-                // Move exsiting records to make room for new first record
-                memmove(ptr+80, ptr, len);
-                // Copy in BACKEND_RECORD string
-                strncpy(ptr, BACKEND_RECORD, 80);
-                // Increase len by 80 to account for the added record
-                len += 80;
-            }
+            /* Note writing status */
+            hpguppi_status_update_state(st, status_key, &disk_state, "writing");
 
-            // Adjust length for any padding required for DirectIO
-            if(directio) {
-                // Round up to next multiple of 512
-                len = (len+511) & ~511;
+            /* Copy header (and padding, if any) to hdrbuf, leaving the
+             * block itself unmodified for any other readers */
+            len = hpguppi_raw_header_copy(hdrbuf, ptr, BACKEND_RECORD, directio);
+            if (len == -1) {
+                hashpipe_error(thread_name, "no END record in block header");
+                len = 0;
             }
 
             /* Write header (and padding, if any) */
-            rv = write_all(fdraw, ptr, len);
+            rv = write_all(fdraw, hdrbuf, len);
             if (rv != len) {
                 hashpipe_error(thread_name,
 		    "write_all header (ptr=%p, len=%d) = %d)", ptr, len, rv);
@@ -526,7 +529,7 @@ static void *run(hashpipe_thread_args_t * args)
         }
 
         /* Mark as free */
-        hpguppi_input_databuf_set_free(db, curblock);
+        hpguppi_input_databuf_reader_set_free(db, curblock, reader_id);
 
         /* Go to next block */
         curblock = (curblock + 1) % db->header.n_block;
@@ -0,0 +1,460 @@
+/* hpguppi_rawtrig_thread.c
+ *
+ * Keep the most recent databuf blocks in memory and write them out to disk
+ * when triggered.
+ *
+ * This thread holds on to (i.e. does not release) the most recent blocks of
+ * its input databuf rather than writing them to disk.  When a trigger arrives
+ * it writes all held blocks that overlap the trigger's PKTIDX range to disk
+ * and continues writing incoming blocks until the end of the range is
+ * reached.  Blocks that are no longer needed, including each block as soon as
+ * it has been written, are released back to the databuf, so the databuf
+ * itself serves as the ring buffer and no data are copied.  If a write fails,
+ * the trigger is aborted (leaving a truncated dump) and the error is logged.
+ * Use DBNBLKS (and DBBLKSZ) to size the databuf for the desired amount of
+ * look-back time.
+ *
+ * Status buffer keywords:
+ *
+ *   TRIGSECS  Seconds of data to hold (optional).  Converted to blocks using
+ *             BLOCSIZE, OBSNCHAN, NBITS, and TBIN from the first block.
+ *   TRIGHOLD  Number of blocks to hold (used if TRIGSECS is not given).  At
+ *             most DBNBLKS-MIN_N_INPUT_BLOCKS blocks can be held so that the
+ *             upstream thread always has free blocks to work with.
+ *   TRIGSTRT  PKTIDX of start of trigger range (inclusive)
+ *   TRIGSTOP  PKTIDX of end of trigger range (exclusive).  A new trigger is
+ *             recognized when TRIGSTOP > TRIGSTRT and the (TRIGSTRT,TRIGSTOP)
+ *             pair differs from the previous trigger.
+ *   TRIGSTAT  Thread status, "armed" or "dumping"
+ *   TRIGPKT0  PKTIDX of oldest held block
+ *   TRIGPKT1  PKTIDX of newest held block
+ *   TRIGNUM   Number of triggers handled so far
+ *
+ * The output files of trigger N are named BASEFILE_trigNNNN.MMMM.raw.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "ioprio.h"
+
+#include "hashpipe.h"
+
+#include "hpguppi_databuf.h"
+#include "hpguppi_params.h"
+#include "hpguppi_util.h"
+
+// 80 character string for the BACKEND header record.
+static const char BACKEND_RECORD[] =
+// 0000000000111111111122222222223333333333
+// 0123456789012345678901234567890123456789
+  "BACKEND = 'GUPPI   '                    " \
+  "                                        ";
+
+// Number of blocks per output file
+#define BLOCKS_PER_FILE (128)
+
+static ssize_t write_all(int fd, const void *buf, size_t bytes_to_write)
+{
+  size_t bytes_remaining = bytes_to_write;
+  ssize_t bytes_written = 0;
+  while(bytes_remaining != 0) {
+    bytes_written = write(fd, buf, bytes_remaining);
+    if(bytes_written == -1) {
+      // Error!
+      return -1;
+    }
+    bytes_remaining -= bytes_written;
+    buf += bytes_written;
+  }
+  // All done!
+  return bytes_to_write;
+}
+
+static int safe_close(int *pfd) {
+    if (pfd==NULL || *pfd==-1) return 0;
+    fsync(*pfd);
+    return close(*pfd);
+}
+
+// Our reader ID for the input databuf
+static int reader_id = -1;
+
+static int init(hashpipe_thread_args_t * args)
+{
+    hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->ibuf;
+
+    // Register as a reader of the input databuf
+    if((reader_id = hpguppi_input_databuf_add_reader_spin(db,
+        &args->st, "TRIGSPIN")) < 0) {
+      hashpipe_error(args->thread_desc->name,
+          "unable to register as databuf reader");
+      return HASHPIPE_ERR_SYS;
+    }
+
+    return HASHPIPE_OK;
+}
+
+// Returns the duration, in seconds, of the block whose header is hdr or 0 if
+// it cannot be determined.
+static double block_duration(char *hdr)
+{
+    int blocsize = 0;
+    int obsnchan = 0;
+    int nbits = 8;
+    double tbin = 0.0;
+
+    hgeti4(hdr, "BLOCSIZE", &blocsize);
+    hgeti4(hdr, "OBSNCHAN", &obsnchan);
+    hgeti4(hdr, "NBITS", &nbits);
+    hgetr8(hdr, "TBIN", &tbin);
+
+    if(obsnchan <= 0 || nbits <= 0) {
+        return 0.0;
+    }
+
+    // Each time sample of each channel has two complex polarizations
+    return (double)blocsize * 8 / (obsnchan * 2 * 2 * nbits) * tbin;
+}
+
+// Opens output file filenum of trigger trignum.  Returns the file descriptor
+// or -1 on error.
+static int open_trigger_file(const char *thread_name, struct psrfits *pf,
+    int trignum, int filenum, int directio)
+{
+    int fd;
+    char fname[256];
+    int open_flags = O_CREAT|O_RDWR|O_SYNC;
+
+    if(directio) {
+        open_flags |= O_DIRECT;
+    }
+
+    snprintf(fname, sizeof(fname), "%s_trig%04d.%04d.raw",
+        pf->basefilename, trignum, filenum);
+    hashpipe_info(thread_name, "opening raw file '%s' (directio=%d)",
+        fname, directio);
+
+    fd = open(fname, open_flags, 0644);
+    if(fd == -1) {
+        hashpipe_error(thread_name, "error opening file '%s'", fname);
+    }
+
+    return fd;
+}
+
+// Buffer for the header of the block being written.  Other readers may be
+// reading the same block, so its header cannot be modified in place.
+static char hdrbuf[HPGUPPI_RAW_HDR_BUF_SIZE] __attribute__((aligned(4096)));
+
+// Writes header and data of block block_id to fd.  Returns 0 on success or
+// -1 on error.
+static int write_block(const char *thread_name, hpguppi_input_databuf_t *db,
+    int block_id, int fd, int directio)
+{
+    char *ptr = hpguppi_databuf_header(db, block_id);
+    int blocksize = 0;
+    int len;
+
+    /* Copy header (and padding, if any) to hdrbuf */
+    len = hpguppi_raw_header_copy(hdrbuf, ptr, BACKEND_RECORD, directio);
+    if(len == -1) {
+        hashpipe_error(thread_name, "no END record in block header");
+        return -1;
+    }
+
+    if(write_all(fd, hdrbuf, len) != len) {
+        hashpipe_error(thread_name, "error writing header");
+        return -1;
+    }
+
+    /* Write data */
+    hgeti4(ptr, "BLOCSIZE", &blocksize);
+    ptr = hpguppi_databuf_data(db, block_id);
+    len = blocksize;
+    if(directio) {
+        // Round up to next multiple of 512
+        len = (len+511) & ~511;
+    }
+    if(write_all(fd, ptr, len) != len) {
+        hashpipe_error(thread_name, "error writing data");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    // Local aliases to shorten access to args fields
+    hpguppi_input_databuf_t *db = (hpguppi_input_databuf_t *)args->ibuf;
+    hashpipe_status_t *st = &args->st;
+    const char * thread_name = args->thread_desc->name;
+    const char * status_key = args->thread_desc->skey;
+    const int n_block = db->header.n_block;
+    const int max_hold = n_block - MIN_N_INPUT_BLOCKS;
+
+    /* Read in general parameters */
+    struct hpguppi_params gp;
+    struct psrfits pf;
+    pf.sub.dat_freqs = NULL;
+    pf.sub.dat_weights = NULL;
+    pf.sub.dat_offsets = NULL;
+    pf.sub.dat_scales = NULL;
+    pthread_cleanup_push((void *)hpguppi_free_psrfits, &pf);
+
+    /* Init output file descriptor (-1 means no file open) */
+    static int fdraw = -1;
+    pthread_cleanup_push((void *)safe_close, &fdraw);
+
+    /* Set I/O priority class for this thread to "real time" */
+    if(ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, 7))) {
+      hashpipe_error(thread_name, "ioprio_set IOPRIO_CLASS_RT");
+    }
+
+    /* Held blocks, oldest first, stored as a FIFO of block IDs */
+    int held[n_block];
+    int64_t held_pktidx[n_block];
+    int held_head = 0, held_count = 0;
+    int hold = -1;
+
+    /* Trigger state */
+    int64_t trigstrt = 0, trigstop = 0;
+    int64_t last_trigstrt = 0, last_trigstop = 0;
+    int64_t piperblk = 0, last_pktidx = -1;
+    double trigsecs = 0.0;
+    uint32_t hold_blocks = max_hold;
+    int triggered = 0, trignum = 0;
+    int dump_error = 0;
+    int filenum = 0, block_count = 0;
+    int directio = 0;
+
+    int64_t pktidx = 0;
+    int curblock = 0;
+    int first = 1;
+    int rv = 0;
+    int b;
+    char *ptr;
+    const char * trig_state = NULL;
+
+    hashpipe_status_lock_safe(st);
+    {
+        hgetr8(st->buf, "TRIGSECS", &trigsecs);
+        hgetu4(st->buf, "TRIGHOLD", &hold_blocks);
+        // Consider any trigger already present as handled
+        hgeti8(st->buf, "TRIGSTRT", &last_trigstrt);
+        hgeti8(st->buf, "TRIGSTOP", &last_trigstop);
+        hputi4(st->buf, "TRIGNUM", trignum);
+    }
+    hashpipe_status_unlock_safe(st);
+
+    hpguppi_status_update_state(st, status_key, &trig_state, "armed");
+
+    while (run_threads()) {
+
+        /* Wait for buf to have data */
+        rv = hpguppi_input_databuf_reader_wait_filled(db, curblock, reader_id);
+        if (rv!=0) continue;
+
+        ptr = hpguppi_databuf_header(db, curblock);
+        if (first) {
+            hpguppi_read_obs_params(ptr, &gp, &pf);
+            first = 0;
+
+            /* Determine number of blocks to hold */
+            if(trigsecs > 0.0 && block_duration(ptr) > 0.0) {
+                hold_blocks = ceil(trigsecs / block_duration(ptr));
+            }
+            hold = hold_blocks;
+            if(hold > max_hold) {
+                hashpipe_warn(thread_name,
+                    "can only hold %d of %d requested blocks "
+                    "(increase DBNBLKS)", max_hold, hold);
+                hold = max_hold;
+            }
+            hashpipe_status_lock_safe(st);
+            {
+                hputi4(st->buf, "TRIGHOLD", hold);
+                hputr8(st->buf, "TRIGSECS", hold * block_duration(ptr));
+            }
+            hashpipe_status_unlock_safe(st);
+        } else {
+            hpguppi_read_subint_params(ptr, &gp, &pf);
+        }
+
+        hgeti8(ptr, "PKTIDX", &pktidx);
+        // piperblk will be 0 if PIPERBLK is not present (or it's 0)
+        piperblk = hpguppi_read_piperblk(ptr);
+        if(!piperblk) {
+            // Infer from change in PKTIDX (assume 1 for first block)
+            piperblk = last_pktidx >= 0 ? pktidx - last_pktidx : 1;
+        }
+        last_pktidx = pktidx;
+
+        /* Add block to held FIFO */
+        b = (held_head + held_count) % n_block;
+        held[b] = curblock;
+        held_pktidx[b] = pktidx;
+        held_count++;
+
+        /* Check for new trigger */
+        hashpipe_status_lock_safe(st);
+        {
+            hgeti8(st->buf, "TRIGSTRT", &trigstrt);
+            hgeti8(st->buf, "TRIGSTOP", &trigstop);
+            hputi8(st->buf, "TRIGPKT0", held_pktidx[held_head]);
+            hputi8(st->buf, "TRIGPKT1", pktidx);
+        }
+        hashpipe_status_unlock_safe(st);
+
+        if(!triggered && trigstop > trigstrt
+        && (trigstrt != last_trigstrt || trigstop != last_trigstop)) {
+            last_trigstrt = trigstrt;
+            last_trigstop = trigstop;
+            triggered = 1;
+            filenum = 0;
+            block_count = 0;
+            directio = hpguppi_read_directio_mode(ptr);
+
+            hashpipe_info(thread_name,
+                "trigger %d: pktidx %ld to %ld (holding %ld to %ld)",
+                trignum, trigstrt, trigstop,
+                held_pktidx[held_head], pktidx);
+            if(trigstrt < held_pktidx[held_head]) {
+                hashpipe_warn(thread_name,
+                    "trigger %d starts %ld packets before oldest held block",
+                    trignum, held_pktidx[held_head] - trigstrt);
+            }
+
+            // Create the output directory if needed
+            char datadir[1024];
+            strncpy(datadir, pf.basefilename, 1023);
+            datadir[1023] = '\0';
+            char *last_slash = strrchr(datadir, '/');
+            if (last_slash!=NULL && last_slash!=datadir) {
+                *last_slash = '\0';
+                if(mkdir_p(datadir, 0755) == -1) {
+                    hashpipe_error(thread_name, "mkdir_p(%s)", datadir);
+                    break;
+                }
+            }
+
+            hpguppi_status_update_state(st, status_key, &trig_state, "dumping");
+        }
+
+        /* Write held blocks (oldest first) that overlap trigger range.
+         * Each block is released as soon as it has been written, and blocks
+         * that precede the trigger range are released unwritten, so the
+         * upstream thread gets free blocks back while the dump proceeds. */
+        if(triggered) {
+            while(held_count > 0) {
+                b = held[held_head];
+                if(held_pktidx[held_head] >= last_trigstop) {
+                    // This block and all newer blocks follow the range
+                    break;
+                }
+
+                if(held_pktidx[held_head] + piperblk > last_trigstrt) {
+                    /* See if we need to open next file */
+                    if (fdraw == -1 || block_count >= BLOCKS_PER_FILE) {
+                        if(fdraw != -1) {
+                            close(fdraw);
+                            filenum++;
+                        }
+                        fdraw = open_trigger_file(thread_name, &pf,
+                            trignum, filenum, directio);
+                        if(fdraw == -1) {
+                            pthread_exit(NULL);
+                        }
+                        block_count = 0;
+                    }
+
+                    if(write_block(thread_name, db, b, fdraw, directio)) {
+                        hashpipe_error(thread_name,
+                            "trigger %d: write failed at pktidx %ld "
+                            "(block %d of file %d)", trignum,
+                            held_pktidx[held_head], block_count, filenum);
+                        dump_error = 1;
+                        break;
+                    }
+                    block_count++;
+                }
+
+                hpguppi_input_databuf_reader_set_free(db, b, reader_id);
+                held_head = (held_head + 1) % n_block;
+                held_count--;
+            }
+
+            /* See if trigger range is complete (or the dump failed) */
+            if(dump_error || pktidx + piperblk >= last_trigstop) {
+                if(fdraw != -1) {
+                    if(!directio) {
+                        fsync(fdraw);
+                    }
+                    close(fdraw);
+                    fdraw = -1;
+                }
+                if(dump_error) {
+                    hashpipe_error(thread_name,
+                        "trigger %d aborted, dump is incomplete", trignum);
+                } else {
+                    hashpipe_info(thread_name, "trigger %d done", trignum);
+                }
+                triggered = 0;
+                dump_error = 0;
+                trignum++;
+
+                hashpipe_status_lock_safe(st);
+                {
+                    hputi4(st->buf, "TRIGNUM", trignum);
+                }
+                hashpipe_status_unlock_safe(st);
+                hpguppi_status_update_state(st, status_key, &trig_state, "armed");
+            }
+        }
+
+        /* Release oldest blocks beyond the hold depth */
+        while(held_count > hold) {
+            b = held[held_head];
+            hpguppi_input_databuf_reader_set_free(db, b, reader_id);
+            held_head = (held_head + 1) % n_block;
+            held_count--;
+        }
+
+        /* Go to next block */
+        curblock = (curblock + 1) % n_block;
+
+        /* Check for cancel */
+        pthread_testcancel();
+    }
+
+    hashpipe_info(thread_name, "exiting!");
+    pthread_exit(NULL);
+
+    pthread_cleanup_pop(0); /* Closes safe_close */
+    pthread_cleanup_pop(0); /* Closes hpguppi_free_psrfits */
+}
+
+static hashpipe_thread_desc_t rawtrig_thread = {
+    name: "hpguppi_rawtrig_thread",
+    skey: "TRIGSTAT",
+    init: init,
+    run:  run,
+    ibuf_desc: {hpguppi_input_databuf_create},
+    obuf_desc: {NULL}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&rawtrig_thread);
+}
+
+// vi: set ts=8 sw=4 et :
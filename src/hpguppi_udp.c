@@ -2,6 +2,7 @@
  *
  * GUPPI UDP packet implementations.
  */
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,14 +10,21 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <netdb.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 
 #include <hashpipe.h>
 
+#include "config.h"
 #include "hpguppi_databuf.h"
 #include "hpguppi_udp.h"
+
+#if HAVE_AVX2_INSTRUCTIONS
+#include <immintrin.h>
+#endif
 //#ifdef USE_SSE_TRANSPOSE
 //#include "sse_transpose.h"
 //#endif
@@ -111,6 +119,113 @@ int hpguppi_udp_recv(struct hpguppi_udp_params *p, struct hpguppi_udp_packet *b)
     }
 }
 
+#define GRO_CMSG_SIZE CMSG_SPACE(sizeof(int))
+
+int hpguppi_udp_batch_init(struct hpguppi_udp_batch *b, unsigned int nmsgs) {
+    memset(b, 0, sizeof(struct hpguppi_udp_batch));
+    b->nmsgs = nmsgs;
+    b->msgs = calloc(nmsgs, sizeof(struct mmsghdr));
+    b->iovs = calloc(nmsgs, sizeof(struct iovec));
+    b->cmsgs = calloc(nmsgs, GRO_CMSG_SIZE);
+    b->pkt_data = calloc(nmsgs * HPGUPPI_UDP_GRO_MAX_SEGS, sizeof(char *));
+    b->pkt_size = calloc(nmsgs * HPGUPPI_UDP_GRO_MAX_SEGS, sizeof(size_t));
+    if (!b->msgs || !b->iovs || !b->cmsgs || !b->pkt_data || !b->pkt_size) {
+        hashpipe_error(__FUNCTION__, "calloc");
+        hpguppi_udp_batch_free(b);
+        return(HASHPIPE_ERR_SYS);
+    }
+    return(HASHPIPE_OK);
+}
+
+void hpguppi_udp_batch_free(struct hpguppi_udp_batch *b) {
+    free(b->msgs);
+    free(b->iovs);
+    free(b->cmsgs);
+    free(b->pkt_data);
+    free(b->pkt_size);
+    memset(b, 0, sizeof(struct hpguppi_udp_batch));
+}
+
+int hpguppi_udp_enable_gro(struct hpguppi_udp_params *p) {
+#ifdef UDP_GRO
+    int on = 1;
+    if (setsockopt(p->sock, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+        hashpipe_error(__FUNCTION__, "setsockopt UDP_GRO");
+        return(HASHPIPE_ERR_SYS);
+    }
+    return(HASHPIPE_OK);
+#else
+    errno = ENOPROTOOPT;
+    hashpipe_error(__FUNCTION__, "UDP_GRO not supported");
+    return(HASHPIPE_ERR_SYS);
+#endif
+}
+
+int hpguppi_udp_recv_batch(struct hpguppi_udp_params *p,
+        struct hpguppi_udp_batch *b, char * const *slots, size_t slot_size,
+        unsigned int nslots) {
+    unsigned int i, nmsgs = nslots < b->nmsgs ? nslots : b->nmsgs;
+    int rv;
+
+    b->npkts = 0;
+    b->ntrunc = 0;
+
+    for (i=0; i<nmsgs; i++) {
+        b->iovs[i].iov_base = slots[i];
+        b->iovs[i].iov_len = slot_size;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_control = b->cmsgs + i*GRO_CMSG_SIZE;
+        b->msgs[i].msg_hdr.msg_controllen = GRO_CMSG_SIZE;
+    }
+
+    rv = recvmmsg(p->sock, b->msgs, nmsgs, MSG_DONTWAIT, NULL);
+    if (rv==-1) {
+        if (errno==EAGAIN || errno==EWOULDBLOCK) {
+            errno = 0;
+            return(0);
+        }
+        return(HASHPIPE_ERR_SYS);
+    }
+
+    /* Split datagrams into packets */
+    for (i=0; i<(unsigned int)rv; i++) {
+        char *data = slots[i];
+        size_t len = b->msgs[i].msg_len;
+        size_t seg_size = len;
+        if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            b->ntrunc++;
+            continue;
+        }
+#ifdef UDP_GRO
+        struct cmsghdr *cmsg;
+        for (cmsg=CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cmsg!=NULL;
+                cmsg=CMSG_NXTHDR(&b->msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level==SOL_UDP && cmsg->cmsg_type==UDP_GRO) {
+                seg_size = *(int *)CMSG_DATA(cmsg);
+                break;
+            }
+        }
+#endif
+        while (len > 0 && seg_size > 0
+                && b->npkts < b->nmsgs*HPGUPPI_UDP_GRO_MAX_SEGS) {
+            size_t n = len < seg_size ? len : seg_size;
+            b->pkt_data[b->npkts] = data;
+            b->pkt_size[b->npkts] = n;
+            b->npkts++;
+            data += n;
+            len -= n;
+        }
+    }
+
+    if (b->npkts && p->packet_size==0) {
+        p->packet_size = b->pkt_size[0];
+    }
+
+    return(b->npkts);
+}
+
 unsigned long long change_endian64(const unsigned long long *d) {
     unsigned long long tmp;
     char *in=(char *)d, *out=(char *)&tmp;
@@ -225,6 +340,172 @@ void hpguppi_udp_packet_data_copy_from_payload(char *out, const char *payload, s
     }
 }
 
+#if HAVE_AVX2_INSTRUCTIONS
+/* Byte shuffles (per 128 bit lane) for S6 packets, whose 8 byte channel pairs
+ * are in X0r|X0i|X1r|X1i|Y0r|Y0i|Y1r|Y1i order.  S6_UNPACK_SHUF128 puts each
+ * pair in X0 Y0 X1 Y1 order.  S6_TRANSPOSE_SHUF128 gives the 32 bit samples
+ * that hpguppi_s6_packet_data_copy_transpose_from_payload() stores for the
+ * even and odd channels of each pair, i.e. X1 Y1 then X0 Y0.
+ */
+#define S6_UNPACK_SHUF128 \
+    _mm_set_epi64x(0x0f0e0b0a0d0c0908, 0x0706030205040100)
+#define S6_TRANSPOSE_SHUF128 \
+    _mm_set_epi64x(0x0d0c09080f0e0b0a, 0x0504010007060302)
+
+/* Transposes the 8x8 matrix of 32 bit elements in r[0] to r[7] in place */
+static inline void transpose_8x8_epi32(__m256i r[8])
+{
+    __m256i t[8], u[8];
+    unsigned i;
+
+    for (i=0; i<8; i+=2) {
+        t[i]   = _mm256_unpacklo_epi32(r[i], r[i+1]);
+        t[i+1] = _mm256_unpackhi_epi32(r[i], r[i+1]);
+    }
+    for (i=0; i<8; i+=4) {
+        u[i]   = _mm256_unpacklo_epi64(t[i],   t[i+2]);
+        u[i+1] = _mm256_unpackhi_epi64(t[i],   t[i+2]);
+        u[i+2] = _mm256_unpacklo_epi64(t[i+1], t[i+3]);
+        u[i+3] = _mm256_unpackhi_epi64(t[i+1], t[i+3]);
+    }
+    for (i=0; i<4; i++) {
+        r[i]   = _mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+        r[i+4] = _mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+    }
+}
+#endif // HAVE_AVX2_INSTRUCTIONS
+
+#ifndef TRANSPOSE_NETBLKS_ON_GPU
+/* Transpose kernels for baseband data with 4 byte samples.  These copy a
+ * packet of nsamp rows of nchan samples from iptr into nchan rows of nsamp
+ * samples at optr, with consecutive output rows being ostride bytes apart.
+ */
+typedef void transpose4_fn(char *optr, const char *iptr,
+        unsigned nchan, unsigned nsamp, size_t ostride);
+
+static void transpose4_scalar(char *optr, const char *iptr,
+        unsigned nchan, unsigned nsamp, size_t ostride)
+{
+    const uint32_t *in = (const uint32_t *)iptr;
+    uint32_t *out;
+    unsigned isamp,ichan;
+
+    for (ichan=0; ichan<nchan; ++ichan)
+    {
+        out = (uint32_t *)(optr + ichan*ostride);
+        for (isamp=0; isamp<nsamp; ++isamp)
+        {
+            out[isamp] = in[isamp*nchan + ichan];
+        }
+    }
+}
+
+#if HAVE_AVX2_INSTRUCTIONS
+/* Transposes 8x8 tiles (8 samples by 8 channels) in AVX2 registers and
+ * writes each output row of the tile with one non-temporal 32 byte store.
+ * Requires nchan and nsamp to be multiples of 8, and optr and ostride to be
+ * multiples of 32.
+ */
+static void transpose4_avx2(char *optr, const char *iptr,
+        unsigned nchan, unsigned nsamp, size_t ostride)
+{
+    __m256i r[8];
+    unsigned isamp,ichan,i;
+
+    for (isamp=0; isamp<nsamp; isamp+=8) {
+        for (ichan=0; ichan<nchan; ichan+=8) {
+            const char *in = iptr + 4*(isamp*nchan + ichan);
+            char *out = optr + ichan*ostride + 4*isamp;
+
+            for (i=0; i<8; i++) {
+                r[i] = _mm256_loadu_si256((const __m256i *)(in + 4*i*nchan));
+            }
+            transpose_8x8_epi32(r);
+            for (i=0; i<8; i++) {
+                _mm256_stream_si256((__m256i *)(out + i*ostride), r[i]);
+            }
+        }
+    }
+    _mm_sfence();
+}
+#endif // HAVE_AVX2_INSTRUCTIONS
+
+#if HAVE_AVX512F_INSTRUCTIONS
+/* Transposes 16x16 tiles (16 samples by 16 channels) in AVX-512 registers and
+ * writes each output row of the tile with one non-temporal 64 byte store.
+ * Requires nchan and nsamp to be multiples of 16, and optr and ostride to be
+ * multiples of 64.
+ */
+static void transpose4_avx512(char *optr, const char *iptr,
+        unsigned nchan, unsigned nsamp, size_t ostride)
+{
+    __m512i r[16], t[16], u[16], x0, x1, y0, y1;
+    unsigned isamp,ichan,i;
+
+    for (isamp=0; isamp<nsamp; isamp+=16) {
+        for (ichan=0; ichan<nchan; ichan+=16) {
+            const char *in = iptr + 4*(isamp*nchan + ichan);
+            char *out = optr + ichan*ostride + 4*isamp;
+
+            for (i=0; i<16; i++) {
+                r[i] = _mm512_loadu_si512((const void *)(in + 4*i*nchan));
+            }
+            for (i=0; i<16; i+=2) {
+                t[i]   = _mm512_unpacklo_epi32(r[i], r[i+1]);
+                t[i+1] = _mm512_unpackhi_epi32(r[i], r[i+1]);
+            }
+            // Lane L of u[4*j+k] holds samples 4*j to 4*j+3 of channel 4*L+k
+            for (i=0; i<16; i+=4) {
+                u[i]   = _mm512_unpacklo_epi64(t[i],   t[i+2]);
+                u[i+1] = _mm512_unpackhi_epi64(t[i],   t[i+2]);
+                u[i+2] = _mm512_unpacklo_epi64(t[i+1], t[i+3]);
+                u[i+3] = _mm512_unpackhi_epi64(t[i+1], t[i+3]);
+            }
+            for (i=0; i<4; i++) {
+                x0 = _mm512_shuffle_i32x4(u[i],   u[i+4],  0x88);
+                x1 = _mm512_shuffle_i32x4(u[i],   u[i+4],  0xdd);
+                y0 = _mm512_shuffle_i32x4(u[i+8], u[i+12], 0x88);
+                y1 = _mm512_shuffle_i32x4(u[i+8], u[i+12], 0xdd);
+                _mm512_stream_si512((void *)(out + i*ostride),
+                        _mm512_shuffle_i32x4(x0, y0, 0x88));
+                _mm512_stream_si512((void *)(out + (i+4)*ostride),
+                        _mm512_shuffle_i32x4(x1, y1, 0x88));
+                _mm512_stream_si512((void *)(out + (i+8)*ostride),
+                        _mm512_shuffle_i32x4(x0, y0, 0xdd));
+                _mm512_stream_si512((void *)(out + (i+12)*ostride),
+                        _mm512_shuffle_i32x4(x1, y1, 0xdd));
+            }
+        }
+    }
+    _mm_sfence();
+}
+#endif // HAVE_AVX512F_INSTRUCTIONS
+
+/* Returns the widest transpose kernel that was compiled in and whose size and
+ * alignment requirements are met.  As elsewhere in this file, kernels are
+ * selected at compile time from the configure probes (the whole file is built
+ * with X86_FEATURE_CFLAGS), so the build host's instruction set is assumed.
+ */
+static transpose4_fn * select_transpose4(const char *optr,
+        unsigned nchan, unsigned nsamp, size_t ostride)
+{
+    const uintptr_t align = (uintptr_t)optr | ostride;
+
+#if HAVE_AVX512F_INSTRUCTIONS
+    if (nchan%16 == 0 && nsamp%16 == 0 && align%64 == 0) {
+        return transpose4_avx512;
+    }
+#endif
+#if HAVE_AVX2_INSTRUCTIONS
+    if (nchan%8 == 0 && nsamp%8 == 0 && align%32 == 0) {
+        return transpose4_avx2;
+    }
+#endif
+    (void)align;
+    return transpose4_scalar;
+}
+#endif // TRANSPOSE_NETBLKS_ON_GPU
+
 /* Copy function for baseband data that does a partial
  * corner turn (or transpose) based on nchan.  In this case
  * out should point to the beginning of the data buffer.
@@ -261,8 +542,6 @@ void hpguppi_udp_packet_data_copy_transpose_from_payload(char *databuf, int ncha
 #else
     // transpose on CPU before loading into buffer
     const unsigned samp_per_block = packets_per_block * samp_per_packet;
-    const char *iptr;
-    unsigned isamp,ichan;
 
     // Arrange data from network packet format e.g:
     // S0C0P0123, S0C1P0123, S0C2P0123, ... S0CnP0123,
@@ -281,6 +560,8 @@ void hpguppi_udp_packet_data_copy_transpose_from_payload(char *databuf, int ncha
 
     #if 0
     /* Previous CPU based routine, cache unfriendly */
+    const char *iptr;
+    unsigned isamp,ichan;
     iptr = hpguppi_udp_packet_data_from_payload(payload, payload_size);
     for (isamp=0; isamp<samp_per_packet; isamp++) {
         optr = databuf + bytes_per_sample * (block_pkt_idx*samp_per_packet
@@ -292,18 +573,10 @@ void hpguppi_udp_packet_data_copy_transpose_from_payload(char *databuf, int ncha
         }
     }
     #else
-    /* New improved more cache friendly version on CPU */
-    for (ichan=0; ichan<chan_per_packet; ++ichan)
-    {
-        iptr = in + (ichan*bytes_per_sample);
-        for (isamp=0; isamp<samp_per_packet; ++isamp)
-        {
-            memcpy(optr, iptr, bytes_per_sample);
-            optr += bytes_per_sample;
-            iptr += chan_per_packet*bytes_per_sample;
-        }
-        optr += bytes_per_sample*(samp_per_block-samp_per_packet);
-    }
+    /* Tiled SIMD version, or cache friendly scalar version, on CPU */
+    const size_t ostride = bytes_per_sample*samp_per_block;
+    select_transpose4(optr, chan_per_packet, samp_per_packet, ostride)(
+            optr, in, chan_per_packet, samp_per_packet, ostride);
     #endif
 #endif
 }
@@ -351,7 +624,31 @@ void hpguppi_s6_packet_data_copy_from_payload(char *databuf, int block_chan,
     // Unpack the unusual X0 X1 Y0 Y1 order into the normal X0 Y0 X1 Y1 order.
     // This code is specific to little endian systems.  To make it more general,
     // should use be64toh and htobe64.
-    for (ichan=0; ichan<chan_per_packet/2; ++ichan)
+    ichan = 0;
+#if HAVE_AVX512BW_INSTRUCTIONS && HAVE_AVX2_INSTRUCTIONS
+    // 8 channel pairs at a time with one 64 byte byte shuffle (needs
+    // S6_UNPACK_SHUF128 and <immintrin.h>, which are only pulled in for AVX2)
+    const __m512i shuf512 = _mm512_broadcast_i32x4(S6_UNPACK_SHUF128);
+    for (; ichan+8<=chan_per_packet/2; ichan+=8)
+    {
+        _mm512_storeu_si512((void *)optr,
+            _mm512_shuffle_epi8(_mm512_loadu_si512((const void *)iptr), shuf512));
+        iptr += 8;
+        optr += 8;
+    }
+#endif // HAVE_AVX512BW_INSTRUCTIONS && HAVE_AVX2_INSTRUCTIONS
+#if HAVE_AVX2_INSTRUCTIONS
+    // 4 channel pairs at a time with one 32 byte byte shuffle
+    const __m256i shuf256 = _mm256_broadcastsi128_si256(S6_UNPACK_SHUF128);
+    for (; ichan+4<=chan_per_packet/2; ichan+=4)
+    {
+        _mm256_storeu_si256((__m256i *)optr,
+            _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)iptr), shuf256));
+        iptr += 4;
+        optr += 4;
+    }
+#endif // HAVE_AVX2_INSTRUCTIONS
+    for (; ichan<chan_per_packet/2; ++ichan)
     {
         // In mem: 00 11 22 33 44 55 66 77
         // In reg: 77 66 55 44 33 22 11 00
@@ -366,26 +663,19 @@ void hpguppi_s6_packet_data_copy_from_payload(char *databuf, int block_chan,
 #endif
 }
 
-void hpguppi_s6_packet_data_copy_transpose_from_payload(char *databuf, int block_chan,
+/* Scalar S6 transpose of channel pairs ipair0 to npairs-1 of one packet */
+static void s6_packet_data_copy_transpose_pairs(char *databuf, int block_chan,
         unsigned block_time, unsigned ntime_per_block,
-        const char *payload, size_t payload_size)
+        const char *payload, unsigned ipair0, unsigned npairs)
 {
     const size_t bytes_per_sample = 4; // Xr,Xi,Yr,Yi
-    // -16 for S6 header and footer bytes
-    const unsigned chan_per_packet = (payload_size - 16) / bytes_per_sample;
-
-#if 0
-    hashpipe_warn("hpguppi_s6_packet_data_copy_from_payload",
-            "databuf %lp block_chan %d block_time %d ntime_per_block %d payload_size %d",
-            databuf, block_chan, block_time, ntime_per_block, payload_size);
-#endif // 0
 
 #ifndef DEBUG_S6_COPY
-    const uint64_t *iptr = (const uint64_t *)(payload + 8);
+    const uint64_t *iptr = (const uint64_t *)(payload + 8) + ipair0;
 #endif // DEBUG_S6_COPY
 
     uint32_t *optr = (uint32_t *)(databuf
-                   + block_chan * ntime_per_block * bytes_per_sample
+                   + (block_chan + 2*ipair0) * ntime_per_block * bytes_per_sample
                    + block_time * bytes_per_sample);
 
     unsigned ichan;
@@ -402,7 +692,7 @@ void hpguppi_s6_packet_data_copy_transpose_from_payload(char *databuf, int block
     // S0C3P01, S1C3P01, S2C3P01, ... SmC1P01
     /// ...
 
-    for (ichan=0; ichan<chan_per_packet/2; ++ichan)
+    for (ichan=ipair0; ichan<npairs; ++ichan)
     {
 #ifndef DEBUG_S6_COPY
         uint64_t d = *iptr++;
@@ -432,6 +722,77 @@ void hpguppi_s6_packet_data_copy_transpose_from_payload(char *databuf, int block
     }
 }
 
+void hpguppi_s6_packet_data_copy_transpose_from_payload(char *databuf, int block_chan,
+        unsigned block_time, unsigned ntime_per_block,
+        const char *payload, size_t payload_size)
+{
+    hpguppi_s6_packets_data_copy_transpose_from_payloads(databuf, block_chan,
+            block_time, ntime_per_block, &payload, 1, payload_size);
+}
+
+void hpguppi_s6_packets_data_copy_transpose_from_payloads(char *databuf,
+        int block_chan, unsigned block_time, unsigned ntime_per_block,
+        const char * const *payloads, unsigned npkts, size_t payload_size)
+{
+    const size_t bytes_per_sample = 4; // Xr,Xi,Yr,Yi
+    // -16 for S6 header and footer bytes
+    const unsigned chan_per_packet = (payload_size - 16) / bytes_per_sample;
+    unsigned ipkt = 0;
+
+#if 0
+    hashpipe_warn("hpguppi_s6_packet_data_copy_from_payload",
+            "databuf %lp block_chan %d block_time %d ntime_per_block %d payload_size %d",
+            databuf, block_chan, block_time, ntime_per_block, payload_size);
+#endif // 0
+
+#if HAVE_AVX2_INSTRUCTIONS && !defined(DEBUG_S6_COPY)
+    // Tiles of 8 packets (i.e. time samples) by 8 channels.  Each packet's 32
+    // bytes of the tile get shuffled into channel order, then the tile gets
+    // transposed so that each channel's 8 time samples are stored at once.
+    const __m256i shuf256 =
+        _mm256_broadcastsi128_si256(S6_TRANSPOSE_SHUF128);
+    const size_t ostride = ntime_per_block * bytes_per_sample;
+    const unsigned nchan_vec = chan_per_packet & ~7;
+    __m256i r[8];
+    unsigned ichan, i;
+
+    for (; ipkt+8<=npkts; ipkt+=8)
+    {
+        char *optr = databuf
+                   + block_chan * ostride
+                   + (block_time + ipkt) * bytes_per_sample;
+
+        for (ichan=0; ichan<nchan_vec; ichan+=8)
+        {
+            for (i=0; i<8; i++) {
+                r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)
+                        (payloads[ipkt+i] + 8 + ichan*bytes_per_sample)),
+                        shuf256);
+            }
+            transpose_8x8_epi32(r);
+            for (i=0; i<8; i++) {
+                _mm256_storeu_si256((__m256i *)(optr + (ichan+i)*ostride), r[i]);
+            }
+        }
+
+        // Remaining channel pairs (if any) of these packets
+        for (i=0; i<8; i++) {
+            s6_packet_data_copy_transpose_pairs(databuf, block_chan,
+                    block_time+ipkt+i, ntime_per_block, payloads[ipkt+i],
+                    nchan_vec/2, chan_per_packet/2);
+        }
+    }
+#endif // HAVE_AVX2_INSTRUCTIONS && !DEBUG_S6_COPY
+
+    // Remaining packets
+    for (; ipkt<npkts; ipkt++)
+    {
+        s6_packet_data_copy_transpose_pairs(databuf, block_chan,
+                block_time+ipkt, ntime_per_block, payloads[ipkt],
+                0, chan_per_packet/2);
+    }
+}
+
 void hpguppi_s6mb_packet_data_copy_from_payload(char *databuf, int block_chan,
         unsigned block_time, unsigned ntime_per_block,
         const char *payload, size_t payload_size)
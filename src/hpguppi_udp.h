@@ -6,6 +6,7 @@
 #define _GUPPI_UDP_H
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <netdb.h>
 #include <poll.h>
 
@@ -63,6 +64,59 @@ int hpguppi_udp_wait(struct hpguppi_udp_params *p);
 /* Read a packet */
 int hpguppi_udp_recv(struct hpguppi_udp_params *p, struct hpguppi_udp_packet *b);
 
+/* Maximum number of packets a single UDP GRO datagram can hold */
+#define HPGUPPI_UDP_GRO_MAX_SEGS 64
+
+/* Holds the state for batched receives using recvmmsg().  The caller
+ * provides the receive buffers ("slots", e.g. packet slots in a data block)
+ * for each call.  After each call, npkts, pkt_data and pkt_size describe the
+ * packets that were received.  Without GRO, each packet is at the start of
+ * its datagram's slot.  With GRO, a slot may hold several consecutive packets
+ * of a coalesced datagram, which are split into separate pkt_data/pkt_size
+ * entries.  Datagrams that did not fit in their slot are dropped and counted
+ * in ntrunc.
+ */
+struct hpguppi_udp_batch {
+    unsigned int nmsgs;   /* Max datagrams per call */
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *cmsgs;          /* Per message control buffers (for UDP_GRO) */
+
+    /* Results of most recent hpguppi_udp_recv_batch() call */
+    unsigned int npkts;
+    char **pkt_data;
+    size_t *pkt_size;
+    unsigned int ntrunc;  /* Datagrams dropped due to truncation */
+};
+
+/* Allocate batch state for receiving up to nmsgs datagrams per call */
+int hpguppi_udp_batch_init(struct hpguppi_udp_batch *b, unsigned int nmsgs);
+
+/* Free batch state */
+void hpguppi_udp_batch_free(struct hpguppi_udp_batch *b);
+
+/* Enable UDP GRO on the socket so that the kernel may coalesce consecutive
+ * equal sized packets from the sender into one datagram.  Slots passed to
+ * hpguppi_udp_recv_batch() should then be big enough for a coalesced
+ * datagram (up to 64 KiB), otherwise packets will be truncated.  Returns
+ * HASHPIPE_ERR_SYS if the kernel (or C library) does not support UDP GRO.
+ */
+int hpguppi_udp_enable_gro(struct hpguppi_udp_params *p);
+
+/* Receive up to nslots datagrams (and at most b->nmsgs) with one recvmmsg()
+ * call, datagram i being written to slots[i] which is slot_size bytes.  Does
+ * not block, so it should be preceded by hpguppi_udp_wait().  Returns the
+ * number of packets received (i.e. b->npkts, which can exceed the number of
+ * datagrams when using GRO), 0 if no data are available, or
+ * HASHPIPE_ERR_SYS on error.  Truncated datagrams (i.e. larger than
+ * slot_size) are dropped and counted in b->ntrunc.  Other packets of
+ * unexpected size are not filtered out, but as with hpguppi_udp_recv() the
+ * expected packet_size is taken from the first packet if it is 0.
+ */
+int hpguppi_udp_recv_batch(struct hpguppi_udp_params *p,
+        struct hpguppi_udp_batch *b, char * const *slots, size_t slot_size,
+        unsigned int nslots);
+
 /* Convert a Parkes-style packet to a GUPPI-style packet */
 void parkes_to_guppi(struct hpguppi_udp_packet *b, const int acc_len, 
         const int npol, const int nchan);
@@ -88,6 +142,12 @@ void hpguppi_s6_packet_data_copy_from_payload(char *databuf, int block_chan,
 void hpguppi_s6_packet_data_copy_transpose_from_payload(char *databuf, int block_chan,
         unsigned block_time, unsigned ntime_per_block,
         const char *payload, size_t payload_size);
+/* Same as hpguppi_s6_packet_data_copy_transpose_from_payload, but for npkts
+ * packets of consecutive time samples starting at block_time.  Batching the
+ * time samples lets each channel's samples be stored several at a time. */
+void hpguppi_s6_packets_data_copy_transpose_from_payloads(char *databuf,
+        int block_chan, unsigned block_time, unsigned ntime_per_block,
+        const char * const *payloads, unsigned npkts, size_t payload_size);
 void hpguppi_s6mb_packet_data_copy_from_payload(char *databuf, int block_chan,
         unsigned block_time, unsigned ntime_per_block,
         const char *payload, size_t payload_size);
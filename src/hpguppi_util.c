@@ -3,6 +3,8 @@
 // Utility functions for hpguppi_daq
 
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -53,6 +55,169 @@ mkdir_p(char *pathname, mode_t mode)
   return 0;
 }
 
+void
+hpguppi_status_update_state(hashpipe_status_t *st, const char *key,
+    const char **last, const char *value)
+{
+  if(*last && !strcmp(*last, value)) {
+    return;
+  }
+
+  hashpipe_status_lock_safe(st);
+  {
+    hputs(st->buf, key, value);
+  }
+  hashpipe_status_unlock_safe(st);
+
+  *last = value;
+}
+
+int
+hpguppi_status_get_nwblk(hashpipe_status_t *st, int n_block)
+{
+  int nwblk = 2;
+
+  hashpipe_status_lock_safe(st);
+  {
+    hgeti4(st->buf, "NWBLK", &nwblk);
+    if(nwblk > HPGUPPI_MAX_WBLKS) {
+      nwblk = HPGUPPI_MAX_WBLKS;
+    }
+    if(nwblk > n_block - 1) {
+      nwblk = n_block - 1;
+    }
+    if(nwblk < 2) {
+      nwblk = 2;
+    }
+    hputi4(st->buf, "NWBLK", nwblk);
+  }
+  hashpipe_status_unlock_safe(st);
+
+  return nwblk;
+}
+
+void
+hpguppi_latehist_str(char *buf, size_t len, const uint64_t *latehist)
+{
+  int i, nbins = HPGUPPI_LATEHIST_BINS;
+  size_t n = 0;
+
+  // Omit trailing zero bins (but keep at least one bin)
+  while(nbins > 1 && latehist[nbins-1] == 0) {
+    nbins--;
+  }
+
+  buf[0] = '\0';
+  for(i=0; i<nbins && n<len; i++) {
+    uint64_t v = latehist[i];
+    int e = 0;
+    if(v < 1000) {
+      n += snprintf(buf+n, len-n, "%s%lu", i ? "," : "", v);
+    } else {
+      while(v >= 10 && e < 9) {
+        v /= 10;
+        e++;
+      }
+      n += snprintf(buf+n, len-n, "%s%lue%d", i ? "," : "", v < 10 ? v : 9, e);
+    }
+  }
+}
+
+void
+hpguppi_subset_read(char *buf, struct hpguppi_subset *sub)
+{
+  char str[80] = {0};
+  char *p;
+
+  sub->antmask = ~0ULL;
+  if(hgets(buf, "ANTMASK", sizeof(str), str) && *str) {
+    sub->antmask = strtoull(str, NULL, 0);
+  }
+
+  sub->chan_lo = 0;
+  sub->chan_hi = INT64_MAX;
+  if(hgets(buf, "CHANRANGE", sizeof(str), str) && *str) {
+    sub->chan_lo = strtoll(str, &p, 0);
+    if(*p == ':') {
+      sub->chan_hi = strtoll(p+1, NULL, 0);
+    }
+  }
+}
+
+void
+hpguppi_subset_compact(struct hpguppi_subset *sub, uint32_t nants,
+    uint32_t nstrm, uint32_t strm_nchan, int32_t schan)
+{
+  int64_t first, last;
+  uint64_t mask = nants < 64 ? (1ULL << nants) - 1 : ~0ULL;
+
+  sub->antmask &= mask;
+  sub->nants = __builtin_popcountll(sub->antmask);
+  sub->strm_nchan = strm_nchan;
+  if(strm_nchan == 0) {
+    sub->nants = 0;
+    sub->nstrm = 0;
+    sub->schan = schan;
+    return;
+  }
+
+  // First and last streams that overlap [chan_lo, chan_hi]
+  first = sub->chan_lo > schan ? (sub->chan_lo - schan) / strm_nchan : 0;
+  last  = sub->chan_hi < schan ? -1 : (sub->chan_hi - schan) / strm_nchan;
+  if(last >= nstrm) {
+    last = nstrm - 1;
+  }
+
+  if(last < first) {
+    sub->nants = 0;
+    sub->nstrm = 0;
+    sub->schan = schan;
+  } else {
+    sub->nstrm = last - first + 1;
+    sub->schan = schan + first * strm_nchan;
+  }
+}
+
+void
+hpguppi_subset_update_header(char *header, const struct hpguppi_subset *sub)
+{
+  if(sub->nants == 0) {
+    return;
+  }
+  hputu4(header, "NANTS", sub->nants);
+  hputu4(header, "NSTRM", sub->nstrm);
+  hputi4(header, "SCHAN", sub->schan);
+}
+
+int
+hpguppi_raw_header_copy(char *buf, const char *hdr,
+    const char *backend_record, int directio)
+{
+  const char *hend = ksearch(hdr, "END");
+  int len = 0;
+
+  if(!hend) {
+    return -1;
+  }
+
+  // If BACKEND record is not present, insert it as first record
+  if(!ksearch(hdr, "BACKEND")) {
+    memcpy(buf, backend_record, 80);
+    len = 80;
+  }
+
+  memcpy(buf+len, hdr, (hend-hdr)+80);
+  len += (hend-hdr)+80;
+
+  // Pad to next multiple of 512 for DirectIO
+  if(directio) {
+    memset(buf+len, ' ', (-len) & 511);
+    len = (len+511) & ~511;
+  }
+
+  return len;
+}
+
 // Implementations of functions requiring AVX512F or AVX2
 
 #if HAVE_AVX512F_INSTRUCTIONS || HAVE_AVX2_INSTRUCTIONS
@@ -6,11 +6,129 @@
 #define _HPGUPPI_UTIL_H_
 
 #include "config.h"
+#include "hashpipe.h"
+#include "hpguppi_databuf.h"
 
 // Makes directory given in pathname.  Makes any intervening directories as
 // needed.  Newly created directories will get permissions specified by mode.
 int mkdir_p(char *pathname, mode_t mode);
 
+// Stores value in status buffer keyword key unless it is the same as *last,
+// then sets *last to value.  value must remain valid (e.g. a string literal).
+// This lets threads that update a state keyword for every block avoid locking
+// the status buffer when the state has not changed.  *last should be
+// initialized to NULL.
+void hpguppi_status_update_state(hashpipe_status_t *st, const char *key,
+    const char **last, const char *value);
+
+// Maximum number of working blocks that the packet-to-RAW assemblers (e.g.
+// hpguppi_meerkat_spead_thread) can use to reorder packets.
+#define HPGUPPI_MAX_WBLKS (8)
+
+// Number of bins in the assemblers' late packet histogram (LATEHIST).  Bin N
+// counts packets that arrived for the block N blocks before the newest working
+// block.  The last bin also counts packets that arrived even later.  Like
+// NLATE, the bins count packets since the previous status buffer update and
+// are cleared once they have been stored in LATEHIST.
+#define HPGUPPI_LATEHIST_BINS (2 * HPGUPPI_MAX_WBLKS)
+
+// Returns the number of working blocks that an assembler should use, as given
+// by the NWBLK status buffer keyword (default 2), limited to the range 2 to
+// HPGUPPI_MAX_WBLKS and to one less than n_block (the number of blocks in the
+// assembler's output databuf).  The value used is stored back in NWBLK.
+int hpguppi_status_get_nwblk(hashpipe_status_t *st, int n_block);
+
+// Adds the late packet lag of a packet, i.e. the number of blocks between the
+// newest working block and the packet's block, to the latehist array of
+// HPGUPPI_LATEHIST_BINS counters.
+static inline void hpguppi_latehist_add(uint64_t *latehist, int64_t lag)
+{
+  if(lag < 0) {
+    lag = 0;
+  } else if(lag >= HPGUPPI_LATEHIST_BINS) {
+    lag = HPGUPPI_LATEHIST_BINS - 1;
+  }
+  latehist[lag]++;
+}
+
+// Formats the latehist array of HPGUPPI_LATEHIST_BINS counters as a comma
+// separated list in buf (of size len), omitting trailing zero bins.  Counts
+// less than 1000 are given exactly and larger counts are given as a single
+// digit and a power of ten, e.g. "4e5" for 400000 to 499999 (saturating at
+// "9e9").  Each bin therefore takes at most 3 characters, so the result always
+// fits in a status buffer string value and is suitable for storing in the
+// LATEHIST status buffer keyword.
+void hpguppi_latehist_str(char *buf, size_t len, const uint64_t *latehist);
+
+// Antenna/channel subset selection for the packet-to-RAW assemblers.  The
+// ANTMASK status buffer keyword is a bit mask (e.g. "0xff0f") of F engine IDs
+// to record (default all).  The CHANRANGE keyword is "LO:HI", the inclusive
+// range of absolute F engine channels to record (default all).  Channels are
+// selected in units of streams (i.e. the channels of one packet/heap), so all
+// streams that overlap CHANRANGE are recorded.  Packets that are not selected
+// are skipped before any copying and the RAW block layout only contains the
+// selected antennas and streams, with the selected antennas renumbered
+// consecutively.
+struct hpguppi_subset {
+  uint64_t antmask;  // Bit N selects F engine ID N
+  int64_t chan_lo;   // First selected channel
+  int64_t chan_hi;   // Last selected channel
+  // Fields below are set by hpguppi_subset_compact()
+  uint32_t nants;    // Number of selected antennas
+  uint32_t nstrm;    // Number of selected streams per antenna
+  int32_t schan;     // First channel of first selected stream
+  uint32_t strm_nchan; // Number of channels per stream
+};
+
+// Reads ANTMASK and CHANRANGE from status buffer contents buf into sub.  The
+// caller must hold the status buffer lock.
+void hpguppi_subset_read(char *buf, struct hpguppi_subset *sub);
+
+// Computes sub's compacted layout for an observation with nants antennas,
+// each with nstrm streams of strm_nchan channels starting at channel schan.
+// If nothing is selected, the compacted nants will be 0.
+void hpguppi_subset_compact(struct hpguppi_subset *sub, uint32_t nants,
+    uint32_t nstrm, uint32_t strm_nchan, int32_t schan);
+
+// Stores the compacted NANTS, NSTRM, and SCHAN values of sub in a block's
+// header.  This should be called just before the block is finalized.
+void hpguppi_subset_update_header(char *header,
+    const struct hpguppi_subset *sub);
+
+// Size of a buffer that can hold any header produced by
+// hpguppi_raw_header_copy(), i.e. a full block header plus an inserted
+// BACKEND record, rounded up to a multiple of 512 bytes.
+#define HPGUPPI_RAW_HDR_BUF_SIZE (BLOCK_HDR_SIZE + 512)
+
+// Copies the GUPPI RAW header hdr, up to and including its END record, to buf
+// for writing to a RAW file.  If hdr has no BACKEND record, backend_record (an
+// 80 character record) is inserted as the first record.  If directio is
+// non-zero, the copy is padded with spaces to a multiple of 512 bytes.  buf
+// must have room for HPGUPPI_RAW_HDR_BUF_SIZE bytes (and be suitably aligned
+// for direct I/O).  Returns the length of the copy or -1 if hdr has no END
+// record.  Threads that write databuf blocks to disk use this rather than
+// editing the block's header in place because other threads may be reading
+// the same block (see FANOUTDB), so filled blocks must be treated as read
+// only.
+int hpguppi_raw_header_copy(char *buf, const char *hdr,
+    const char *backend_record, int directio);
+
+// Returns 1 if the packet from F engine *feng_id whose first channel is
+// feng_chan is selected by sub, in which case *feng_id is replaced by the
+// antenna's index in the compacted layout.  Returns 0 if the packet is not
+// selected.
+static inline int hpguppi_subset_select(const struct hpguppi_subset *sub,
+    uint64_t *feng_id, uint64_t feng_chan)
+{
+  if(*feng_id >= 64 || !(sub->antmask & (1ULL << *feng_id))
+  || (int64_t)feng_chan < sub->schan
+  || (int64_t)feng_chan >= sub->schan + sub->nstrm * sub->strm_nchan) {
+    return 0;
+  }
+  *feng_id = __builtin_popcountll(sub->antmask & ((1ULL << *feng_id) - 1));
+  return 1;
+}
+
 #if HAVE_AVX512F_INSTRUCTIONS || HAVE_AVX2_INSTRUCTIONS
 
 // Cache bypass (non-temporal) version of memset(dst, 0,len)
@@ -10,7 +10,8 @@
 #
 #   Checks if the host cpu supports various x86 instruction set, the
 #   instructions that will get tested are "mmx, popcnt, sse, sse2, sse3,
-#   sse4.1, sse4.2, sse4a, avx, avx2, avx512f, fma, fma4, bmi, bmi2". If the
+#   sse4.1, sse4.2, sse4a, avx, avx2, avx512f, avx512bw, fma, fma4, bmi,
+#   bmi2". If the
 #   instruction set is supported by the host cpu, the C preprocessor macro
 #   HAVE_XXX_INSTRUCTIONS is set to 1. The XXX is up-cased instruction case
 #   with dot replaced by underscore. For example, the test for "sse4.2"
@@ -65,7 +66,7 @@
 AC_DEFUN([AX_CHECK_X86_FEATURES],
  [m4_foreach_w(
    [ax_x86_feature],
-   [mmx popcnt sse sse2 sse3 sse4.1 sse4.2 sse4a avx avx2 avx512f fma fma4 bmi bmi2],
+   [mmx popcnt sse sse2 sse3 sse4.1 sse4.2 sse4a avx avx2 avx512f avx512bw fma fma4 bmi bmi2],
    [AX_GCC_X86_CPU_SUPPORTS(ax_x86_feature,
      [X86_FEATURE_CFLAGS="$X86_FEATURE_CFLAGS -m[]ax_x86_feature"],
      [])